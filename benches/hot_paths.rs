@@ -0,0 +1,256 @@
+//! Benchmarks for the paths a control loop sits on: packet conversions, the rx and tx rings,
+//! the C API read/write calls under contention, and write-to-read latency over a virtual device.
+//!
+//! Run with `cargo bench`, or `cargo bench -- <filter>` to only run benchmarks whose name contains the filter.
+//! Every benchmark prints its throughput and p50/p99/p999 latency. Operations timed one by one report per-call
+//! latency; those too fast for that are timed in batches, and report percentiles of the batch means instead,
+//! marked "mean". Those smooth over per-call outliers, so read them as jitter between batches, not tail latency.
+
+use std::{hint::black_box, sync::{Arc, Barrier}, time::{Duration, Instant}};
+
+use async_ringbuf::{traits::{Consumer, Producer, Split}, AsyncHeapRb};
+use bytemuck::Zeroable;
+use rdxusb::{c_api, compact::CompactWriter, event_loop, ring::packet_ring, virtual_device::{VirtualDeviceConfig, VIRTUAL_VID}, RdxUsbPacket};
+use rdxusb_protocol::RdxUsbFsPacket;
+
+#[allow(dead_code)]
+#[path = "../src/test_util.rs"]
+mod test_util;
+
+/// Operations timed together per sample, for operations too fast to time one by one.
+const BATCH: usize = 1024;
+const SAMPLES: usize = 4096;
+const THREAD_COUNTS: [usize; 4] = [1, 2, 4, 8];
+
+/// Latency samples for one benchmark, in nanoseconds per operation.
+struct Report {
+    name: String,
+    ops: u64,
+    elapsed: Duration,
+    latency_ns: Vec<u64>,
+    /// Whether each sample is the mean of a [`BATCH`] rather than one call.
+    batch_means: bool,
+}
+
+impl Report {
+    fn percentile(&self, p: f64) -> u64 {
+        if self.latency_ns.is_empty() { return 0; }
+        let idx = ((self.latency_ns.len() - 1) as f64 * p).round() as usize;
+        self.latency_ns[idx]
+    }
+
+    fn print(mut self) {
+        self.latency_ns.sort_unstable();
+        let throughput = self.ops as f64 / self.elapsed.as_secs_f64();
+        let kind = if self.batch_means { "mean" } else { "call" };
+        println!(
+            "{:<36} {:>14.0} ops/s   {kind} p50 {:>8} ns   p99 {:>8} ns   p999 {:>8} ns",
+            self.name, throughput, self.percentile(0.50), self.percentile(0.99), self.percentile(0.999),
+        );
+    }
+}
+
+struct Bench {
+    filter: Option<String>,
+}
+
+impl Bench {
+    fn from_args() -> Self {
+        // cargo passes --bench; anything else that isn't a flag is a name filter
+        Self { filter: std::env::args().skip(1).find(|a| !a.starts_with('-')) }
+    }
+
+    fn enabled(&self, name: &str) -> bool {
+        self.filter.as_ref().is_none_or(|f| name.contains(f.as_str()))
+    }
+
+    /// Times `f` in batches of [`BATCH`] calls. The latency samples are each batch's mean per call.
+    fn batched(&self, name: &str, mut f: impl FnMut()) {
+        if !self.enabled(name) { return; }
+        for _ in 0..BATCH { f(); }
+        let mut latency_ns = Vec::with_capacity(SAMPLES);
+        let start = Instant::now();
+        for _ in 0..SAMPLES {
+            let sample = Instant::now();
+            for _ in 0..BATCH { f(); }
+            latency_ns.push(sample.elapsed().as_nanos() as u64 / BATCH as u64);
+        }
+        Report { name: name.to_string(), ops: (SAMPLES * BATCH) as u64, elapsed: start.elapsed(), latency_ns, batch_means: true }.print();
+    }
+
+    /// Runs `f` on `n_threads` threads at once. Each thread returns its operation count and per-call latencies.
+    fn contended<F>(&self, name: &str, n_threads: usize, f: F)
+    where F: Fn() -> (u64, Vec<u64>) + Send + Sync + 'static {
+        if !self.enabled(name) { return; }
+        let f = Arc::new(f);
+        let barrier = Arc::new(Barrier::new(n_threads + 1));
+        let threads: Vec<_> = (0..n_threads).map(|_| {
+            let (f, barrier) = (f.clone(), barrier.clone());
+            std::thread::spawn(move || {
+                barrier.wait();
+                f()
+            })
+        }).collect();
+        barrier.wait();
+        let start = Instant::now();
+        let mut report = Report { name: name.to_string(), ops: 0, elapsed: Duration::ZERO, latency_ns: Vec::new(), batch_means: false };
+        for thread in threads {
+            let (ops, latency_ns) = thread.join().unwrap();
+            report.ops += ops;
+            report.latency_ns.extend(latency_ns);
+        }
+        report.elapsed = start.elapsed();
+        report.print();
+    }
+}
+
+fn bench_conversions(bench: &Bench) {
+    let fs = RdxUsbFsPacket::zeroed();
+    bench.batched("convert/fs_to_hs", || {
+        black_box(RdxUsbPacket::from(black_box(fs)));
+    });
+    let hs = test_util::packet(0x123, 0, 8);
+    bench.batched("convert/hs_to_fs", || {
+        let _ = black_box(RdxUsbFsPacket::try_from(black_box(hs)));
+    });
+}
+
+fn bench_rings(bench: &Bench) {
+    // rx queues, as created by the host for every channel
+    let (mut prod, mut cons) = packet_ring::<RdxUsbPacket>(event_loop::DEFAULT_QUEUE_CAPACITY);
+    let p = test_util::packet(0x123, 0, 8);
+    bench.batched("ring/rx_push_pop", || {
+        prod.try_push_with(|slot| *slot = p);
+        black_box(cons.try_pop());
+    });
+
+    let mut out = [RdxUsbPacket::zeroed(); 64];
+    bench.batched("ring/rx_push_64_pop_slice", || {
+        for _ in 0..64 { prod.try_push_with(|slot| *slot = p); }
+        black_box(cons.pop_slice(&mut out));
+    });
+
+    let mut compact = [0u8; 64 * 24];
+    bench.batched("ring/rx_push_64_pop_compact", || {
+        for _ in 0..64 { prod.try_push_with(|slot| *slot = p); }
+        let mut writer = CompactWriter::new(&mut compact);
+        black_box(cons.pop_each(64, |i, packet| {
+            if i == 0 { writer.clear(); }
+            writer.push(packet)
+        }));
+    });
+
+    // the tx queue, as created by the write poller
+    let (mut tx_prod, mut tx_cons) = AsyncHeapRb::<RdxUsbPacket>::new(event_loop::DEFAULT_QUEUE_CAPACITY).split();
+    bench.batched("ring/tx_push_pop", || {
+        let _ = tx_prod.try_push(p);
+        black_box(tx_cons.try_pop());
+    });
+
+    if bench.enabled("ring/rx_cross_thread") {
+        // one producer thread, one consumer thread; latency is push to pop
+        let n = (SAMPLES * BATCH) as u64;
+        let (mut prod, mut cons) = packet_ring::<RdxUsbPacket>(event_loop::DEFAULT_QUEUE_CAPACITY);
+        let start = Instant::now();
+        let producer = std::thread::spawn(move || {
+            for seq in 0..n {
+                let packet = RdxUsbPacket { timestamp_ns: rdxusb::clock::monotonic_ns(), arb_id: seq as u32, ..p };
+                while !prod.try_push_with(|slot| *slot = packet) { std::hint::spin_loop(); }
+            }
+        });
+        let mut latency_ns = Vec::with_capacity(n as usize);
+        while (latency_ns.len() as u64) < n {
+            match cons.try_pop() {
+                Some(packet) => latency_ns.push(rdxusb::clock::monotonic_ns().saturating_sub(packet.timestamp_ns)),
+                None => std::hint::spin_loop(),
+            }
+        }
+        producer.join().unwrap();
+        Report { name: "ring/rx_cross_thread".to_string(), ops: n, elapsed: start.elapsed(), latency_ns, batch_means: false }.print();
+    }
+}
+
+/// Opens a virtual device, waiting until it is attached.
+fn open_virtual(pid: u16, config: VirtualDeviceConfig) -> i32 {
+    event_loop::configure_virtual_device(pid, config).expect("could not configure virtual device");
+    let handle = c_api::rdxusb_open_device(VIRTUAL_VID, pid, core::ptr::null(), false, 4096);
+    assert!(handle >= 0, "could not open virtual device: {handle}");
+    let mut generation = 0u32;
+    while c_api::rdxusb_get_connection_generation(handle, &mut generation) != 0 || generation & 1 == 0 {
+        std::thread::sleep(Duration::from_millis(1));
+    }
+    handle
+}
+
+fn bench_c_api(bench: &Bench) {
+    const CALLS_PER_THREAD: usize = 200_000;
+
+    let writer = open_virtual(0xbe01, VirtualDeviceConfig { rate: 0, echo: false, ..Default::default() });
+    for n_threads in THREAD_COUNTS {
+        bench.contended(&format!("c_api/write_packets/{n_threads}t"), n_threads, move || {
+            let p = test_util::packet(0x123, 0, 8);
+            let mut latency_ns = Vec::with_capacity(CALLS_PER_THREAD);
+            let mut written_total = 0;
+            for _ in 0..CALLS_PER_THREAD {
+                let mut written = 0u64;
+                let start = Instant::now();
+                c_api::rdxusb_write_packets(writer, &p, 1, &mut written);
+                latency_ns.push(start.elapsed().as_nanos() as u64);
+                written_total += written;
+            }
+            (written_total, latency_ns)
+        });
+    }
+    c_api::rdxusb_close_device(writer);
+
+    let reader = open_virtual(0xbe02, VirtualDeviceConfig { rate: 2_000_000, burst: 64, echo: false, ..Default::default() });
+    for n_threads in THREAD_COUNTS {
+        bench.contended(&format!("c_api/read_packets/{n_threads}t"), n_threads, move || {
+            let mut packets = [RdxUsbPacket::zeroed(); 64];
+            let mut latency_ns = Vec::with_capacity(CALLS_PER_THREAD);
+            let mut read_total = 0;
+            for _ in 0..CALLS_PER_THREAD {
+                let mut read = 0u64;
+                let start = Instant::now();
+                c_api::rdxusb_read_packets(reader, 0, packets.as_mut_ptr(), packets.len() as u64, &mut read);
+                latency_ns.push(start.elapsed().as_nanos() as u64);
+                read_total += read;
+            }
+            (read_total, latency_ns)
+        });
+    }
+    c_api::rdxusb_close_device(reader);
+}
+
+fn bench_loopback(bench: &Bench) {
+    const ROUND_TRIPS: usize = 20_000;
+    if !bench.enabled("loopback/write_to_read") { return; }
+
+    let handle = open_virtual(0xbe03, VirtualDeviceConfig { rate: 0, echo: true, ..Default::default() });
+    let mut packets = [RdxUsbPacket::zeroed(); 8];
+    let mut latency_ns = Vec::with_capacity(ROUND_TRIPS);
+    let start = Instant::now();
+    for seq in 0..ROUND_TRIPS as u32 {
+        let p = test_util::packet(seq, 0, 8);
+        let mut written = 0u64;
+        let sent = Instant::now();
+        c_api::rdxusb_write_packets(handle, &p, 1, &mut written);
+        'wait: loop {
+            let mut read = 0u64;
+            c_api::rdxusb_read_packets(handle, 0, packets.as_mut_ptr(), packets.len() as u64, &mut read);
+            if packets[..read as usize].iter().any(|p| p.arb_id == seq) { break 'wait; }
+            std::hint::spin_loop();
+        }
+        latency_ns.push(sent.elapsed().as_nanos() as u64);
+    }
+    Report { name: "loopback/write_to_read".to_string(), ops: ROUND_TRIPS as u64, elapsed: start.elapsed(), latency_ns, batch_means: false }.print();
+    c_api::rdxusb_close_device(handle);
+}
+
+fn main() {
+    let bench = Bench::from_args();
+    bench_conversions(&bench);
+    bench_rings(&bench);
+    bench_c_api(&bench);
+    bench_loopback(&bench);
+}
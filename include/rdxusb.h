@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -28,12 +30,42 @@
 #define ERR_DEVICE_ITER_IDX_OUT_OF_RANGE -103
 /** A passed argument was null that should not be null. */
 #define RDXUSB_ERR_NULL_PTR -104
+/** The maximum number of simultaneously open device handles has been reached. */
+#define RDXUSB_ERR_TOO_MANY_DEVICES -105
+/** The OS event handle for the device could not be created. */
+#define RDXUSB_ERR_EVENT_HANDLE_UNAVAILABLE -106
+/** A passed argument was out of range or otherwise invalid. */
+#define RDXUSB_ERR_INVALID_ARGUMENT -107
+/** The specified periodic job does not exist or was cancelled. */
+#define RDXUSB_ERR_PERIODIC_JOB_NOT_FOUND -108
+/** The event loop was already started, so its runtime can no longer be configured. */
+#define RDXUSB_ERR_EVENT_LOOP_ALREADY_STARTED -109
+/** A capture or trace file could not be created, written or read. */
+#define RDXUSB_ERR_CAPTURE_IO -110
+/** rdxusb was built without the latency-trace feature. */
+#define RDXUSB_ERR_TRACING_DISABLED -111
+/** The specified control request does not exist, was cancelled, or was already collected. */
+#define RDXUSB_ERR_CONTROL_REQUEST_NOT_FOUND -112
+/** The specified control request has not finished yet. */
+#define RDXUSB_ERR_CONTROL_PENDING -113
+/** The maximum number of uncollected control requests has been reached. */
+#define RDXUSB_ERR_TOO_MANY_CONTROL_REQUESTS -114
+/** The device could not be published to other processes, or another process already publishes it. */
+#define RDXUSB_ERR_BROKER_UNAVAILABLE -115
 /** The specified device handle is invalid. */
 #define RDXUSB_ERR_DEVICE_NOT_OPENED -200
 /** The specified device is not currently connected right now. */
 #define RDXUSB_ERR_DEVICE_NOT_CONNECTED -201
 /** The specified device channel is not valid for this device. */
 #define RDXUSB_ERR_CHANNEL_OUT_OF_RANGE -202
+/** The specified channel does not have a mailbox enabled. */
+#define RDXUSB_ERR_MAILBOX_DISABLED -203
+/** No packet with the requested arbitration id has been received into the mailbox. */
+#define RDXUSB_ERR_MAILBOX_EMPTY -204
+/** Not enough packets have been received from the device to correlate its clock with the host's. */
+#define RDXUSB_ERR_NO_CLOCK_ESTIMATE -205
+/** The device rejected or failed a control request. */
+#define RDXUSB_ERR_CONTROL_TRANSFER_FAILED -206
 
 #ifdef _MSC_VER
 #pragma pack(push, 4)
@@ -56,6 +88,7 @@ struct __attribute__((packed, aligned(4))) rdxusb_packet {
     /** 
      * data (max size: 64 bytes) 
      * USB-FS devices (e.g. original canandgyro/canandcolor) only support data up to the first 48 bytes.
+     * USB-HS devices support the full 64 bytes.
      */
     uint8_t data[64];
 };
@@ -63,6 +96,89 @@ struct __attribute__((packed, aligned(4))) rdxusb_packet {
 #pragma pack(pop)
 #endif
 
+/** Header of each record written by rdxusb_read_packets_compact. These are the first 16 bytes of struct rdxusb_packet. */
+struct rdxusb_compact_header {
+    /** Timestamp since device power-on (nanoseconds) */
+    uint64_t timestamp_ns;
+    /** CAN-associated arbitration id, including flag bits. */
+    uint32_t arb_id;
+    /** Number of data bytes following the header, at most 64. */
+    uint8_t dlc;
+    /** Channel associated with the packet. */
+    uint8_t channel;
+    /** Misc flags (unused for now) */
+    uint16_t flags;
+};
+
+/** Compact records start at multiples of this many bytes from the start of the buffer. */
+#define RDXUSB_COMPACT_ALIGN 8
+
+/** Size in bytes of the compact record of a packet with dlc data bytes, including padding. */
+static inline uint64_t rdxusb_compact_record_size(uint8_t dlc) {
+    uint64_t len = dlc > 64 ? 64 : dlc;
+    return (sizeof(struct rdxusb_compact_header) + len + RDXUSB_COMPACT_ALIGN - 1) & ~(uint64_t)(RDXUSB_COMPACT_ALIGN - 1);
+}
+
+/**
+ * Cursor over the records written by rdxusb_read_packets_compact:
+ * 
+ *     struct rdxusb_compact_cursor cursor;
+ *     rdxusb_compact_cursor_init(&cursor, buf, bytes_written);
+ *     const uint8_t* data;
+ *     const struct rdxusb_compact_header* header;
+ *     while ((header = rdxusb_compact_next(&cursor, &data)) != NULL) { ... }
+ */
+struct rdxusb_compact_cursor {
+    const uint8_t* pos;
+    const uint8_t* end;
+};
+
+static inline void rdxusb_compact_cursor_init(struct rdxusb_compact_cursor* cursor, const uint8_t* buf, uint64_t len) {
+    cursor->pos = buf;
+    cursor->end = buf + len;
+}
+
+/**
+ * Advances a cursor to the next record.
+ * 
+ * @param cursor the cursor, initialized with rdxusb_compact_cursor_init
+ * @param data pointer updated with the record's header->dlc data bytes. Can be NULL.
+ * @return the record's header, or NULL after the last record
+ */
+static inline const struct rdxusb_compact_header* rdxusb_compact_next(struct rdxusb_compact_cursor* cursor, const uint8_t** data) {
+    const struct rdxusb_compact_header* header;
+    uint64_t size;
+    if ((uint64_t)(cursor->end - cursor->pos) < sizeof(struct rdxusb_compact_header)) return NULL;
+    header = (const struct rdxusb_compact_header*)cursor->pos;
+    size = rdxusb_compact_record_size(header->dlc);
+    if ((uint64_t)(cursor->end - cursor->pos) < size) return NULL;
+    if (data != NULL) *data = cursor->pos + sizeof(struct rdxusb_compact_header);
+    cursor->pos += size;
+    return header;
+}
+
+/**
+ * Destination arrays for rdxusb_read_packets_columnar. Packet i goes in entry i of every column.
+ * 
+ * Any column can be NULL to skip it, so a reader only pays for the fields it uses; e.g. scan arb_ids for matches,
+ * then look up the timestamps and payloads of only the matching packets.
+ */
+struct rdxusb_columns {
+    /** Packet timestamps, or NULL. */
+    uint64_t* timestamps_ns;
+    /** Arbitration ids including flag bits, or NULL. */
+    uint32_t* arb_ids;
+    /** Data length codes, or NULL. */
+    uint8_t* dlcs;
+    /**
+     * payload_stride bytes per packet, or NULL. Each holds the packet's data cut off at payload_stride bytes,
+     * and is zero-filled past its dlc. A stride of 8 holds all of a classic CAN frame.
+     */
+    uint8_t* payloads;
+    /** Bytes per packet in payloads. */
+    uint64_t payload_stride;
+};
+
 /** Represents a device visible to rdxusb. */
 struct rdxusb_device_entry {
     /** Null-terminated serial number string. */
@@ -83,10 +199,320 @@ struct rdxusb_device_entry {
 
 typedef uint64_t rdxusb_iter_id;
 
+/** 
+ * Event loop runtime configuration for rdxusb_init_ex.
+ * 
+ * Always set struct_size and initialize this with rdxusb_runtime_config_init before changing fields,
+ * so that fields added by newer versions of rdxusb get sensible defaults.
+ */
+struct rdxusb_runtime_config {
+    /** sizeof(struct rdxusb_runtime_config). The caller sets this before calling rdxusb_runtime_config_init. */
+    uint32_t struct_size;
+    /** Number of event loop worker threads. 0 means one per core. */
+    uint32_t worker_threads;
+    /** If 1, all devices are polled from a single dedicated thread and worker_threads is ignored. */
+    uint32_t single_thread;
+    /**
+     * Real-time priority for the event loop threads, 1-99, or 0 to leave the scheduling policy alone.
+     * This is SCHED_FIFO on Linux, which usually needs CAP_SYS_NICE, and time-critical priority on Windows.
+     */
+    uint32_t rt_priority;
+    /** CPUs the event loop threads may run on, one bit per CPU, or 0 to leave affinity alone. */
+    uint64_t cpu_affinity;
+    /** Name given to the event loop threads, or NULL for the default. This MUST be utf-8. */
+    const char* thread_name;
+};
+
+/** Discard packets that arrive on a full rx queue. */
+#define RDXUSB_OVERFLOW_DROP_NEWEST 0
+/** Evict the oldest queued packet to make room for new ones. */
+#define RDXUSB_OVERFLOW_DROP_OLDEST 1
+/** Stop reading from the device until the rx queue has room. */
+#define RDXUSB_OVERFLOW_BACKPRESSURE 2
+
+/** Packet timestamps are left as device timestamps (nanoseconds since device power-on). */
+#define RDXUSB_TIMESTAMP_DEVICE 0
+/** Packet timestamps are converted to the host monotonic clock (see rdxusb_host_time_ns) before they are queued. */
+#define RDXUSB_TIMESTAMP_HOST 1
+
+/**
+ * Tx lane for control frames such as setpoints. Frames here are sent first, and never wait behind
+ * more than one transfer of the other lanes.
+ */
+#define RDXUSB_TX_LANE_URGENT 0
+/** Tx lane frames go in by default. */
+#define RDXUSB_TX_LANE_NORMAL 1
+/**
+ * Tx lane for configuration and other bulk traffic, sent after the other lanes.
+ * A sustained load on the normal lane holds it back for at most 8 transfers at a time.
+ */
+#define RDXUSB_TX_LANE_BULK 2
+
+/** Direction of a control request that sends data to the device. */
+#define RDXUSB_CONTROL_OUT 0
+/** Direction of a control request that reads data from the device. */
+#define RDXUSB_CONTROL_IN 1
+
+/** 
+ * Transport options for rdxusb_open_device_ex. 
+ * 
+ * Always set struct_size and initialize this with rdxusb_open_options_init before changing fields,
+ * so that fields added by newer versions of rdxusb get sensible defaults.
+ */
+struct rdxusb_open_options {
+    /** sizeof(struct rdxusb_open_options). The caller sets this before calling rdxusb_open_options_init. */
+    uint32_t struct_size;
+    /** What to do with packets that arrive on a full rx queue. One of the RDXUSB_OVERFLOW_* defines. */
+    uint32_t overflow_policy;
+    /** Capacity of each channel's rx queue, in packets. Rounded up to a power of two. */
+    uint64_t rx_capacity;
+    /** Capacity of the normal tx lane, in packets. */
+    uint64_t tx_capacity;
+    /** Number of bulk IN transfers kept in flight. */
+    uint32_t in_transfers;
+    /** Number of bulk OUT transfers kept in flight. */
+    uint32_t out_transfers;
+    /** Which clock received packet timestamps are on. One of the RDXUSB_TIMESTAMP_* defines. */
+    uint32_t timestamp_mode;
+    /**
+     * While the device is disconnected, rescan for it after this many milliseconds, doubling the interval
+     * after each miss up to 2 seconds. 0 relies on hotplug events alone. Set this where hotplug is unreliable.
+     */
+    uint32_t reconnect_probe_ms;
+    /**
+     * Capacity of the urgent tx lane, in packets. 0, the default, disables it.
+     * While it is enabled, the other lanes keep at most one transfer in flight.
+     */
+    uint64_t tx_urgent_capacity;
+    /** Capacity of the bulk tx lane, in packets. 0 disables it. */
+    uint64_t tx_bulk_capacity;
+    /**
+     * Packets written with rdxusb_write_packets whose CAN id, without flag bits, is below this
+     * go in the urgent lane. Lower ids win arbitration on the bus. Defaults to 0.
+     */
+    uint32_t tx_urgent_below;
+    /** Packets written with rdxusb_write_packets whose id is at or above this go in the bulk lane. Defaults to 0xFFFFFFFF. */
+    uint32_t tx_bulk_from;
+    /**
+     * 1 to send packets still queued when the device disconnected once it reconnects, 0 (the default) to drop them.
+     * Unread rx packets are always kept, as the rings are reused across reconnects.
+     */
+    uint32_t keep_pending_tx;
+};
+
+/** One device of an rdxusb_open_devices call. */
+struct rdxusb_open_spec {
+    /** USB vendor ID to match */
+    uint16_t vid;
+    /** USB product ID to match */
+    uint16_t pid;
+    /** If true, closes the device handle on device disconnect */
+    bool close_on_dc;
+    /** An optional serial number string. This MUST be utf-8 or NULL. */
+    const char* serial_number;
+    /** Transport options initialized with rdxusb_open_options_init, or NULL for the defaults. */
+    const struct rdxusb_open_options* options;
+};
+
+/** Vendor id that opens an in-process virtual device instead of a USB device. See rdxusb_configure_virtual_device. */
+#define RDXUSB_VIRTUAL_VID 0xFFFF
+
+/**
+ * What a virtual device generates.
+ * 
+ * Always set struct_size and initialize this with rdxusb_virtual_device_config_init before changing fields,
+ * so that fields added by newer versions of rdxusb get sensible defaults.
+ */
+struct rdxusb_virtual_device_config {
+    /** sizeof(struct rdxusb_virtual_device_config). The caller sets this before calling rdxusb_virtual_device_config_init. */
+    uint32_t struct_size;
+    /** Number of channels the device reports, 1 to 255. */
+    uint32_t n_channels;
+    /** Generated frames per second, spread randomly over the channels. 0 only echoes. */
+    uint32_t rate;
+    /** Generated frames are sent in bursts of this many back to back, at rate / burst bursts per second. */
+    uint32_t burst;
+    /** Generated arbitration ids are drawn uniformly from id_base to id_base + id_count - 1. */
+    uint32_t id_base;
+    /** Number of distinct generated arbitration ids. Must not be 0. */
+    uint32_t id_count;
+    /** Data length of generated frames, up to 64. The first 8 bytes carry a little-endian sequence number. */
+    uint32_t dlc;
+    /** Nonzero to send written frames back on the channel they were written to. */
+    uint32_t echo;
+};
+
+/** Number of channels that get their own entry in struct rdxusb_stats. */
+#define RDXUSB_STATS_MAX_CHANNELS 8
+
+/** Per-channel receive counters. */
+struct rdxusb_channel_stats {
+    /** Packets queued for reading. */
+    uint64_t rx_packets;
+    /** Payload bytes queued for reading. */
+    uint64_t rx_bytes;
+    /** Packets dropped because the rx queue was full, or in RDXUSB_MAILBOX_ONLY mode because the mailbox was. */
+    uint64_t rx_dropped_full;
+    /** Queued packets evicted to make room (RDXUSB_OVERFLOW_DROP_OLDEST only). */
+    uint64_t rx_evicted;
+    /** Highest rx queue occupancy seen. */
+    uint64_t rx_high_water;
+};
+
+/**
+ * Transport statistics for a device handle, filled in by rdxusb_get_stats.
+ * 
+ * Counters are cumulative since the handle was opened and persist across reconnects.
+ */
+struct rdxusb_stats {
+    /** Must be set to sizeof(struct rdxusb_stats) by the caller. */
+    uint32_t struct_size;
+    /** Number of channels the device has. Only the first RDXUSB_STATS_MAX_CHANNELS have entries in channels. */
+    uint32_t n_channels;
+    /** Receive counters summed over all channels. rx_high_water is the maximum over all channels. */
+    struct rdxusb_channel_stats total;
+    /** Transfers dropped because they could not be decoded as a packet. */
+    uint64_t rx_dropped_decode_error;
+    /** Packets dropped because they were addressed to a channel the device does not have. */
+    uint64_t rx_dropped_invalid_channel;
+    /** Packets accepted by rdxusb_write_packets. */
+    uint64_t tx_accepted;
+    /** Packets not accepted by rdxusb_write_packets, because the tx queue was full or the packet was too large. */
+    uint64_t tx_rejected;
+    /** Highest tx queue occupancy seen, over all lanes. */
+    uint64_t tx_high_water;
+    /** USB transfers that were cancelled. */
+    uint64_t usb_errors_cancelled;
+    /** USB transfers that failed with an endpoint stall. */
+    uint64_t usb_errors_stall;
+    /** USB transfers that failed because the device disconnected. */
+    uint64_t usb_errors_disconnected;
+    /** USB transfers that failed with a USB fault. */
+    uint64_t usb_errors_fault;
+    /** USB transfers that failed with an unknown error. */
+    uint64_t usb_errors_unknown;
+    /** Number of times the device reconnected after the first connection. */
+    uint64_t reconnects;
+    /** Per-channel receive counters. */
+    struct rdxusb_channel_stats channels[RDXUSB_STATS_MAX_CHANNELS];
+    /** Packets dropped by acceptance filters, summed over all channels. */
+    uint64_t rx_filtered;
+    /** The part of tx_rejected bound for the urgent, normal and bulk tx lanes. */
+    uint64_t tx_rejected_urgent;
+    uint64_t tx_rejected_normal;
+    uint64_t tx_rejected_bulk;
+    /** Packets accepted by write calls that overwrote a pending packet instead of being queued. See rdxusb_set_tx_coalescing. */
+    uint64_t tx_coalesced;
+};
+
+/**
+ * An arbitration id acceptance filter for rdxusb_set_filters.
+ * 
+ * A packet matches if (arb_id & mask) == (id & mask). The RDXUSB_ARB_ID_FLAG_* bits are part of
+ * the arbitration id, so include them in the mask to match only extended, RTR, or device frames.
+ */
+struct rdxusb_filter {
+    /** Arbitration id to match, including flag bits. */
+    uint32_t id;
+    /** Bits of the arbitration id that have to match. */
+    uint32_t mask;
+};
+
+/**
+ * A mapped receive ring, filled in by rdxusb_map_rx_channel.
+ * 
+ * This is a single-producer/single-consumer ring of packets: rdxusb's receive poller is the producer,
+ * and the caller is the consumer. Indices increase forever and wrap around at UINTPTR_MAX,
+ * and an index i refers to slots[i & (capacity - 1)]. The slots array is aligned to a 64-byte cache line,
+ * and head and tail are on cache lines of their own.
+ * 
+ * head, tail, and closed must only be accessed atomically, e.g. with C11 atomic_load_explicit on a
+ * (_Atomic uintptr_t*) cast, or C++20 std::atomic_ref<uintptr_t>. To consume packets:
+ * 
+ *  1. Load tail with acquire ordering, then load head with acquire ordering.
+ *     Packets [tail, head) are readable. If head - tail exceeds capacity, start over.
+ *  2. Read or copy the packets in place.
+ *  3. Commit with a compare-exchange of tail from the old value to tail + n, with acq_rel ordering.
+ *     If this fails, the producer evicted packets under RDXUSB_OVERFLOW_DROP_OLDEST, and the packets read in
+ *     step 2 may have been overwritten; discard them and start over. With other overflow policies the producer
+ *     never touches tail, so the compare-exchange only fails if the ring is consumed from two places.
+ * 
+ * Do not mix this with rdxusb_read_packets/rdxusb_wait_packets on the same channel.
+ * The OS event from rdxusb_get_event_handle still works: call rdxusb_reset_event_handle before checking the ring.
+ * 
+ * The ring belongs to the handle, not to one connection. While the device is disconnected the view stays valid
+ * and packets still in the ring remain readable, and once it reconnects new packets arrive in the same ring,
+ * so there is no need to remap. A device that reconnects with fewer channels just stops filling the rings of
+ * the channels it no longer has. Use rdxusb_get_connection_generation to notice disconnects.
+ * 
+ * closed becomes nonzero once nothing will write to the ring again, which happens at the end of a replayed capture.
+ * Packets still in the ring remain readable until rdxusb_unmap_rx_channel or the handle is closed.
+ */
+struct rdxusb_ring_view {
+    /** Must be set to sizeof(struct rdxusb_ring_view) by the caller. */
+    uint32_t struct_size;
+    /** Reserved, always 0. */
+    uint32_t reserved;
+    /** The ring's packet slots. */
+    struct rdxusb_packet* slots;
+    /** Number of slots. Always a power of two. */
+    uint64_t capacity;
+    /** Index of the next packet the producer writes. Written by rdxusb, read by the caller. */
+    uintptr_t* head;
+    /** Index of the next packet to read. Advanced by the caller (and by rdxusb when evicting). */
+    uintptr_t* tail;
+    /** Becomes nonzero once nothing will write to the ring again, e.g. at the end of a replay. Read-only. */
+    const uint8_t* closed;
+};
+
+/**
+ * Receive callback for rdxusb_set_rx_callback.
+ * 
+ * @param user_data the user_data pointer passed to rdxusb_set_rx_callback
+ * @param handle_id the device handle the packets came from
+ * @param channel the channel the packets came from
+ * @param packets a contiguous batch of packets, only valid for the duration of the call
+ * @param n_packets the number of packets in the batch, at least 1
+ */
+typedef void (*rdxusb_rx_callback)(void* user_data, int32_t handle_id, uint8_t channel, 
+                                   const struct rdxusb_packet* packets, uint64_t n_packets);
+
+/** Packets only go to the rx queue. */
+#define RDXUSB_MAILBOX_DISABLED 0
+/** Packets update the channel's mailbox and are also queued. */
+#define RDXUSB_MAILBOX_QUEUED 1
+/** Packets only update the channel's mailbox and are never queued. */
+#define RDXUSB_MAILBOX_ONLY 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif 
 
+/**
+ * Fills a runtime config struct with the defaults the event loop normally starts with.
+ * 
+ * Only the fields the caller's version of the struct has are written.
+ * 
+ * @param config the config struct to initialize. Must not be NULL.
+ *               The caller must set config->struct_size to sizeof(struct rdxusb_runtime_config) first.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_runtime_config_init(struct rdxusb_runtime_config* config);
+
+/**
+ * Starts the rdxusb event loop with a custom runtime configuration.
+ * 
+ * Without this, the event loop starts on first use with one worker thread per core.
+ * This must be called before any other function that starts the event loop, like rdxusb_open_device,
+ * or it fails with RDXUSB_ERR_EVENT_LOOP_ALREADY_STARTED.
+ * Affinity and priority are applied to every thread of the event loop. If the OS refuses them,
+ * the event loop still starts, and a warning is logged.
+ * 
+ * @param config runtime configuration, initialized with rdxusb_runtime_config_init. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_init_ex(const struct rdxusb_runtime_config* config);
+
 /**
  * Directs rdxusb to open a device with the associated vid/pid/serial number tuple.
  * 
@@ -94,6 +520,9 @@ extern "C" {
  * send/receive messages from it. If connection with the matching device is lost, reconnection is 
  * continually attempted.
  * 
+ * If another process has published a device with this vid/pid/serial number tuple through
+ * rdxusb_publish_device, the handle attaches to that process instead and shares its device.
+ * 
  * @param vid USB vendor ID to match
  * @param pid USB product ID to match
  * @param serial_number an optional serial number string. This MUST be utf-8 or NULL.
@@ -103,6 +532,82 @@ extern "C" {
  */
 int32_t rdxusb_open_device(uint16_t vid, uint16_t pid, const char* serial_number, bool close_on_dc, uint64_t buf_size);
 
+/**
+ * Fills an options struct with the defaults used by rdxusb_open_device_ex.
+ * 
+ * Only the fields the caller's version of the struct has are written, so callers built against an older header are safe.
+ * 
+ * @param options the options struct to initialize. Must not be NULL.
+ *                The caller must set options->struct_size to sizeof(struct rdxusb_open_options) first.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_open_options_init(struct rdxusb_open_options* options);
+
+/**
+ * Like rdxusb_open_device, but with per-device transport tuning.
+ * 
+ * @param vid USB vendor ID to match
+ * @param pid USB product ID to match
+ * @param serial_number an optional serial number string. This MUST be utf-8 or NULL.
+ * @param close_on_dc if true, closes the device handle on device disconnect
+ * @param options transport options, initialized with rdxusb_open_options_init. Must not be NULL.
+ *                These are ignored if the device is already open.
+ * @return a non-negative device handle on success, negative on error
+ */
+int32_t rdxusb_open_device_ex(uint16_t vid, uint16_t pid, const char* serial_number, bool close_on_dc,
+                              const struct rdxusb_open_options* options);
+
+/**
+ * Opens several devices at once, then waits for all of them to connect.
+ * 
+ * The devices are matched against one scan of the bus, and each is opened concurrently on the event loop,
+ * so this takes about as long as the slowest device rather than the sum of all of them.
+ * 
+ * @param specs the devices to open. Must not be NULL.
+ * @param n_specs the number of devices to open.
+ * @param handles array of n_specs entries updated with each device's handle, or the negative error that
+ *                opening it failed with. Must not be NULL.
+ * @param timeout_ns the maximum time to wait for every device to connect, in nanoseconds. 0 doesn't wait.
+ * @return 0 if every device opened and connected, otherwise the first error, RDXUSB_ERR_DEVICE_NOT_CONNECTED
+ *         if a device opened but didn't connect in time. Handles that opened stay open either way.
+ */
+int32_t rdxusb_open_devices(const struct rdxusb_open_spec* specs, uint64_t n_specs, int32_t* handles, uint64_t timeout_ns);
+
+/**
+ * Blocks until a device is connected and its handle is usable, returning right away if it already is.
+ * 
+ * Opening a device is asynchronous, so call this instead of sleeping after rdxusb_open_device.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param timeout_ns the maximum time to block for, in nanoseconds.
+ * @return 0 once connected, RDXUSB_ERR_DEVICE_NOT_CONNECTED on timeout, other negative values on error
+ */
+int32_t rdxusb_wait_connected(int32_t handle_id, uint64_t timeout_ns);
+
+/**
+ * Fills a virtual device config with the defaults: one channel, 1000 frames per second of id 0, echo on.
+ * 
+ * Only the fields the caller's version of the struct has are written.
+ * 
+ * @param config the config struct to initialize. Must not be NULL.
+ *               The caller must set config->struct_size to sizeof(struct rdxusb_virtual_device_config) first.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_virtual_device_config_init(struct rdxusb_virtual_device_config* config);
+
+/**
+ * Sets what virtual devices opened on a pid generate.
+ * 
+ * Virtual devices are opened with rdxusb_open_device using the vid RDXUSB_VIRTUAL_VID.
+ * They never disconnect, and run the same rx and tx paths as USB devices, so they can load test
+ * everything above the USB transfers. Already open virtual devices keep the config they were opened with.
+ * 
+ * @param pid the product id the config applies to
+ * @param config the config, initialized with rdxusb_virtual_device_config_init. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_configure_virtual_device(uint16_t pid, const struct rdxusb_virtual_device_config* config);
+
 /**
  * Forces the RdxUsb event loop to rescan USB devices.
  * 
@@ -129,7 +634,356 @@ int32_t rdxusb_read_packets(int32_t handle_id, uint8_t channel,
                             uint64_t max_packets, uint64_t* packets_read);
 
 /**
- * Writes packets from the specified buffer.
+ * Reads packets into a byte buffer as variable-length compact records, which copies far less than
+ * rdxusb_read_packets for short frames.
+ * 
+ * Each record is a struct rdxusb_compact_header, then header->dlc data bytes, then zero padding up to
+ * RDXUSB_COMPACT_ALIGN bytes; see rdxusb_compact_record_size. Walk the records with struct rdxusb_compact_cursor.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the USB channel to read from.
+ * @param buf the buffer to read into. Must not be NULL. Should be 8-byte aligned so headers can be read in place.
+ * @param buf_len the size of the buffer in bytes. Packets are read until the next record would not fit.
+ * @param bytes_written pointer updated with how many bytes of records were written. Must not be NULL.
+ * @param packets_read pointer updated with how many packets were read. Can be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_read_packets_compact(int32_t handle_id, uint8_t channel, uint8_t* buf, uint64_t buf_len,
+                                    uint64_t* bytes_written, uint64_t* packets_read);
+
+/**
+ * Reads packets into separate arrays of timestamps, arbitration ids, dlcs and payloads (struct of arrays).
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the USB channel to read from.
+ * @param columns the columns to read into. Must not be NULL. Every non-NULL column must hold max_packets entries,
+ *                and payloads max_packets * payload_stride bytes. Packets are consumed even if every column is NULL.
+ * @param max_packets the maximum number of packets to read.
+ * @param packets_read pointer updated with how many packets were actually read. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_read_packets_columnar(int32_t handle_id, uint8_t channel, const struct rdxusb_columns* columns,
+                                     uint64_t max_packets, uint64_t* packets_read);
+
+/** One read of a rdxusb_read_packets_multi call. */
+struct rdxusb_read_request {
+    /** A handle id returned from rdxusb_open_device. */
+    int32_t handle_id;
+    /** The USB channel to read from. */
+    uint8_t channel;
+    uint8_t reserved[3];
+    /** The packet buffer to read into. */
+    struct rdxusb_packet* packets;
+    /** The maximum number of packets to read into the packet buffer. */
+    uint64_t max_packets;
+    /** Set to how many packets were actually read. */
+    uint64_t packets_read;
+    /** Set to 0 on success, negative on error. */
+    int32_t status;
+    uint32_t reserved2;
+};
+
+/**
+ * Reads packets from several handles and channels in one call.
+ * 
+ * Consecutive requests for the same handle share one lock of that handle, so keep them together.
+ * 
+ * @param requests the reads to do. Each gets its packets_read and status filled in. Must not be NULL.
+ * @param n_requests the number of requests
+ * @param ready_mask pointer updated with a mask that has bit i set if request i read any packets.
+ *                   Only the first 64 requests are covered. Can be NULL.
+ * @return 0 on success, negative on error. Errors of individual requests are reported in their status.
+ */
+int32_t rdxusb_read_packets_multi(struct rdxusb_read_request* requests, uint64_t n_requests, uint64_t* ready_mask);
+
+/**
+ * Reads packets into the specified buffer, blocking until at least one packet arrives or the timeout expires.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the USB channel to read from.
+ * @param timeout_ns the maximum time to block for, in nanoseconds.
+ * @param packets a pointer to the packet buffer to read into. Must not be NULL.
+ * @param max_packets the maximum number of packets to read into the packet buffer.
+ * @param packets_read pointer updated with how many packets were actually read. Must not be NULL.
+ *                     This is 0 if the timeout expired.
+ * @return 0 on success (including timeouts), negative on error
+ */
+int32_t rdxusb_wait_packets(int32_t handle_id, uint8_t channel, uint64_t timeout_ns,
+                            struct rdxusb_packet* packets,
+                            uint64_t max_packets, uint64_t* packets_read);
+
+/**
+ * Gets an OS event handle that is signalled when packets arrive on any of the device's channels.
+ * 
+ * On Linux, this is an eventfd. On other unixes, it is the read end of a pipe.
+ * On Windows, it is a manual-reset event HANDLE. The handle is owned by rdxusb and stays valid until the device is closed.
+ * 
+ * The event is signalled by the first packet that arrives after any read on the handle.
+ * To use it, call rdxusb_reset_event_handle, then read every channel until it is empty, then wait on the handle again.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param event_handle pointer the raw fd/HANDLE gets written to. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_get_event_handle(int32_t handle_id, int64_t* event_handle);
+
+/**
+ * Resets the OS event handle returned by rdxusb_get_event_handle.
+ * 
+ * This also re-arms the event, so the next packet to arrive signals it even if no read call follows.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_reset_event_handle(int32_t handle_id);
+
+/**
+ * Gets a handle's connection generation.
+ * 
+ * This never takes a lock, so it is cheap enough to poll every loop iteration.
+ * The generation is odd while the device is connected and changes on every connect and disconnect,
+ * so a changed value means state tied to the old connection, like the clock estimate, is stale.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param generation pointer the generation gets written to. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_get_connection_generation(int32_t handle_id, uint32_t* generation);
+
+/**
+ * Gets transport statistics for a device handle.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param stats the stats struct to fill in. Must not be NULL.
+ *              The caller must set stats->struct_size to sizeof(struct rdxusb_stats) first.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_get_stats(int32_t handle_id, struct rdxusb_stats* stats);
+
+/**
+ * Installs arbitration id acceptance filters on a channel, replacing any previous ones.
+ * 
+ * Packets that match none of the filters are dropped by the receive poller before they are queued,
+ * so they never take up queue space. Matching costs one table lookup per distinct mask, not one per filter.
+ * Filters persist across reconnects.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the channel to filter
+ * @param filters the filters to install. May be NULL if n_filters is 0.
+ * @param n_filters the number of filters. 0 removes filtering, accepting every packet.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_set_filters(int32_t handle_id, uint8_t channel, const struct rdxusb_filter* filters, uint64_t n_filters);
+
+/**
+ * Makes a handle coalesce the packets it sends whose arbitration id matches any of the filters, replacing any previous ones.
+ * 
+ * While a coalesced packet is waiting to be sent, a newer packet with the same channel and id overwrites it in place
+ * instead of queueing behind it, so after a stall only the newest payload goes on the wire, at the first packet's place
+ * in the queue. Overwrites are counted in tx_coalesced of struct rdxusb_stats. This persists across reconnects.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param filters the id/mask pairs to coalesce. A mask of 0 coalesces everything. May be NULL if n_filters is 0.
+ * @param n_filters the number of filters. 0 turns coalescing off.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_set_tx_coalescing(int32_t handle_id, const struct rdxusb_filter* filters, uint64_t n_filters);
+
+/**
+ * Sets the latest-value mailbox mode of a channel.
+ * 
+ * With a mailbox enabled, the receive poller keeps the newest packet for each arbitration id
+ * (ignoring flag bits) on the channel, which can be looked up with rdxusb_get_latest.
+ * Mailboxes hold up to 1024 distinct ids per channel; packets with ids beyond that are not stored,
+ * and in RDXUSB_MAILBOX_ONLY mode count towards rx_dropped_full.
+ * Disabling the mailbox discards its contents. The mode persists across reconnects.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the channel to configure
+ * @param mode one of the RDXUSB_MAILBOX_* defines
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_set_mailbox_mode(int32_t handle_id, uint8_t channel, uint32_t mode);
+
+/**
+ * Reads the newest packet received on a channel with a given arbitration id.
+ * 
+ * This is a constant-time lookup that never blocks the receive poller, and does not consume the packet.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel a channel with a mailbox enabled through rdxusb_set_mailbox_mode
+ * @param arb_id the arbitration id to look up. Flag bits are ignored.
+ * @param packet pointer the packet gets written to. Must not be NULL.
+ * @param age_ns pointer updated with the nanoseconds since the packet was received by the host. Can be NULL.
+ * @return 0 on success, RDXUSB_ERR_MAILBOX_EMPTY if no such packet was received yet, other negative values on error
+ */
+int32_t rdxusb_get_latest(int32_t handle_id, uint8_t channel, uint32_t arb_id, struct rdxusb_packet* packet, uint64_t* age_ns);
+
+/**
+ * Gets the current time on the host monotonic clock, in nanoseconds.
+ * 
+ * This is CLOCK_MONOTONIC on unix and QueryPerformanceCounter on Windows.
+ * Mailbox ages and converted packet timestamps are on this clock.
+ * 
+ * @return the current host time
+ */
+uint64_t rdxusb_host_time_ns(void);
+
+/**
+ * Converts a device timestamp to the host monotonic clock.
+ * 
+ * rdxusb continually estimates each device's clock offset and drift from the packets it receives,
+ * using the lowest-latency receive times over the last few seconds. The estimate is reset when the device reconnects.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param device_ns a timestamp_ns from a packet received from the device
+ * @param host_ns pointer the converted timestamp gets written to. Must not be NULL.
+ * @return 0 on success, RDXUSB_ERR_NO_CLOCK_ESTIMATE if no packets were received yet, other negative values on error
+ */
+int32_t rdxusb_device_to_host_time(int32_t handle_id, uint64_t device_ns, uint64_t* host_ns);
+
+/**
+ * Maps a channel's receive ring so packets can be read in place, without a copy or a call into rdxusb per batch.
+ * 
+ * See struct rdxusb_ring_view for the consumer protocol.
+ * Mapping a channel again replaces, and invalidates, the previous view of it.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the channel to map
+ * @param view the view struct to fill in. Must not be NULL.
+ *             The caller must set view->struct_size to sizeof(struct rdxusb_ring_view) first.
+ * @return 0 on success, negative on error. Returns RDXUSB_ERR_DEVICE_NOT_CONNECTED if the device is not connected.
+ */
+int32_t rdxusb_map_rx_channel(int32_t handle_id, uint8_t channel, struct rdxusb_ring_view* view);
+
+/**
+ * Releases a ring mapped with rdxusb_map_rx_channel. Its view becomes invalid.
+ * Rings are also released when the device handle is closed.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the mapped channel
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_unmap_rx_channel(int32_t handle_id, uint8_t channel);
+
+/**
+ * Sets or clears a push-style receive callback on a channel.
+ * 
+ * The callback runs on rdxusb's event loop thread as soon as the receive poller has decoded a transfer,
+ * and gets every packet that passes the channel's filters, whether or not it is also queued for rdxusb_read_packets.
+ * Packets from all transfers that have completed by then are coalesced into one call per channel,
+ * split into calls of at most max_batch packets.
+ * 
+ * The callback must not block, as that stalls receiving from the device, and must not open or close devices.
+ * The callback persists across reconnects.
+ * 
+ * Once this returns, the previous callback on the channel isn't running and won't be called again,
+ * so its user_data can be freed. When called from inside that callback, the same holds once the callback returns.
+ * Closing the handle does the same for all of its callbacks.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param channel the channel to receive from
+ * @param callback the callback, or NULL to remove the current callback
+ * @param user_data passed through to the callback unchanged
+ * @param max_batch the maximum number of packets passed to a single call. 0 is treated as 1.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_set_rx_callback(int32_t handle_id, uint8_t channel, rdxusb_rx_callback callback, void* user_data, uint64_t max_batch);
+
+/**
+ * Starts sending a packet periodically from the event loop.
+ * 
+ * Packets are sent by the event loop, so they keep going out while the calling thread is blocked.
+ * Each period sends at most one packet: packets that come due while the device is disconnected or
+ * the tx queue is full are dropped rather than sent late. Timing follows the event loop's timer,
+ * which has about a millisecond of resolution. The job runs until it is cancelled or the handle is closed.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param packet the packet to send. It is copied, so it can be freed right away. Must not be NULL.
+ * @param period_ns the send period in nanoseconds. Must not be 0.
+ * @param phase_ns how long from now the first packet is sent, in nanoseconds
+ * @return a non-negative job id on success, negative on error
+ */
+int32_t rdxusb_schedule_periodic(int32_t handle_id, const struct rdxusb_packet* packet, uint64_t period_ns, uint64_t phase_ns);
+
+/**
+ * Replaces the data of a periodic job's packet.
+ * 
+ * The swap is atomic: the next packet the job sends carries either the old data or the new data, never a mix.
+ * 
+ * @param job_id a job id returned from rdxusb_schedule_periodic
+ * @param data the new data. Can be NULL if dlc is 0.
+ * @param dlc the number of data bytes, at most 64
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_update_periodic(int32_t job_id, const uint8_t* data, uint8_t dlc);
+
+/**
+ * Stops a periodic job.
+ * 
+ * @param job_id a job id returned from rdxusb_schedule_periodic
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_cancel_periodic(int32_t job_id);
+
+/**
+ * Starts a vendor control request to a device's RdxUsb interface.
+ * 
+ * Control requests go over the control pipe instead of the bulk endpoints, so they don't compete with packets.
+ * This returns right away; the transfer runs on the event loop, and its result is collected with
+ * rdxusb_control_poll or rdxusb_control_wait. Any number of requests can be in flight at once, on one device
+ * or across devices, so e.g. reading many parameters from many devices is best done by submitting every
+ * request first and collecting the results after.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param direction RDXUSB_CONTROL_IN or RDXUSB_CONTROL_OUT
+ * @param request the vendor request code
+ * @param value the request's wValue
+ * @param index the request's wIndex
+ * @param data for OUT requests, the data to send. It is copied, so it can be freed right away.
+ *             Can be NULL if length is 0. Ignored for IN requests.
+ * @param length for OUT requests, the number of bytes to send. For IN requests, the most bytes to read.
+ * @return a non-negative request id on success, negative on error
+ */
+int32_t rdxusb_control_submit(int32_t handle_id, uint8_t direction, uint8_t request, uint16_t value, uint16_t index,
+                              const uint8_t* data, uint16_t length);
+
+/**
+ * Collects a finished control request without blocking.
+ * 
+ * Once this returns anything other than RDXUSB_ERR_CONTROL_PENDING, the request id is freed.
+ * 
+ * @param request_id a request id returned from rdxusb_control_submit
+ * @param data buffer updated with the data read, or for OUT requests the data sent. Can be NULL if data_len is 0.
+ * @param data_len the size of the data buffer. Data past it is cut off.
+ * @param transferred pointer updated with the number of bytes transferred, which can exceed data_len. Can be NULL.
+ * @return 0 on success, RDXUSB_ERR_CONTROL_PENDING if the request is still in flight, other negative values on error
+ */
+int32_t rdxusb_control_poll(int32_t request_id, uint8_t* data, uint64_t data_len, uint64_t* transferred);
+
+/**
+ * Collects a control request, blocking until it finishes or the timeout expires.
+ * 
+ * @param request_id a request id returned from rdxusb_control_submit
+ * @param timeout_ns the maximum time to block for, in nanoseconds.
+ * @param data buffer updated with the data read, or for OUT requests the data sent. Can be NULL if data_len is 0.
+ * @param data_len the size of the data buffer. Data past it is cut off.
+ * @param transferred pointer updated with the number of bytes transferred, which can exceed data_len. Can be NULL.
+ * @return 0 on success, RDXUSB_ERR_CONTROL_PENDING on timeout, other negative values on error
+ */
+int32_t rdxusb_control_wait(int32_t request_id, uint64_t timeout_ns, uint8_t* data, uint64_t data_len, uint64_t* transferred);
+
+/**
+ * Abandons a control request and frees its id, cancelling the transfer if it hasn't finished.
+ * 
+ * @param request_id a request id returned from rdxusb_control_submit
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_control_cancel(int32_t request_id);
+
+/**
+ * Writes packets from the specified buffer, each into the tx lane its id maps to.
+ * See tx_urgent_below and tx_bulk_from in struct rdxusb_open_options.
  * 
  * @param handle_id a handle id returned from rdxusb_open_device
  * @param packets a pointer to the packet buffer to write from. Must not be NULL.
@@ -140,6 +994,171 @@ int32_t rdxusb_read_packets(int32_t handle_id, uint8_t channel,
 int32_t rdxusb_write_packets(int32_t handle_id, struct rdxusb_packet* packets, 
                             uint64_t packets_len, uint64_t* packets_written);
 
+/**
+ * Writes packets into one tx lane, regardless of the lanes their ids map to.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param lane one of the RDXUSB_TX_LANE_* defines. Writes to a lane with no capacity write nothing.
+ * @param packets a pointer to the packet buffer to write from. Must not be NULL.
+ * @param packets_len the number of packets to write from the packet buffer.
+ * @param packets_written pointer updated with how many packets were actually written. Can be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_write_packets_lane(int32_t handle_id, uint32_t lane, const struct rdxusb_packet* packets,
+                                  uint64_t packets_len, uint64_t* packets_written);
+
+/** One write of a rdxusb_write_packets_multi call. */
+struct rdxusb_write_request {
+    /** A handle id returned from rdxusb_open_device. */
+    int32_t handle_id;
+    uint32_t reserved;
+    /** The packets to write. */
+    const struct rdxusb_packet* packets;
+    /** The number of packets to write. */
+    uint64_t n_packets;
+    /** Set to how many packets were actually written. */
+    uint64_t packets_written;
+    /** Set to 0 on success, negative on error. */
+    int32_t status;
+    uint32_t reserved2;
+};
+
+/**
+ * Writes packets to several handles in one call.
+ * 
+ * Consecutive requests for the same handle share one lock of that handle, so keep them together.
+ * 
+ * @param requests the writes to do. Each gets its packets_written and status filled in. Must not be NULL.
+ * @param n_requests the number of requests
+ * @return 0 on success, negative on error. Errors of individual requests are reported in their status.
+ */
+int32_t rdxusb_write_packets_multi(struct rdxusb_write_request* requests, uint64_t n_requests);
+
+/** USB transfer completion to the frame being pushed into its rx buffer. */
+#define RDXUSB_TRACE_STAGE_RX_COMPLETE_TO_PUSH 0
+/** Frame pushed into its rx buffer to being read out of it. */
+#define RDXUSB_TRACE_STAGE_RX_PUSH_TO_POP 1
+/** Frames read out of the rx buffer to the read call returning. Recorded once per read call. */
+#define RDXUSB_TRACE_STAGE_RX_POP_TO_RETURN 2
+/** USB transfer completion to the frame being read, i.e. everything rdxusb adds on the rx side. */
+#define RDXUSB_TRACE_STAGE_RX_COMPLETE_TO_POP 3
+/** Write call entry to the frame being pushed into the tx buffer. */
+#define RDXUSB_TRACE_STAGE_TX_ENTRY_TO_PUSH 4
+/** Frame pushed into the tx buffer to its USB transfer being submitted. */
+#define RDXUSB_TRACE_STAGE_TX_PUSH_TO_SUBMIT 5
+/** USB transfer submitted to completed. Recorded once per transfer. */
+#define RDXUSB_TRACE_STAGE_TX_SUBMIT_TO_COMPLETE 6
+
+/** Latency summary of one stage, filled in by rdxusb_get_latency_histogram. All times are in nanoseconds. */
+struct rdxusb_latency_histogram {
+    /** Must be set to sizeof(struct rdxusb_latency_histogram) by the caller. */
+    uint32_t struct_size;
+    /** The RDXUSB_TRACE_STAGE_* this is for. */
+    uint32_t stage;
+    /** Number of recorded samples. */
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    /** Percentiles, accurate to within 25% of their value. */
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+/**
+ * Gets the latency histogram of one hot path stage, recorded since startup or the last reset.
+ * 
+ * This needs rdxusb built with the latency-trace feature, and fails with RDXUSB_ERR_TRACING_DISABLED otherwise.
+ * 
+ * @param stage one of the RDXUSB_TRACE_STAGE_* defines
+ * @param histogram the histogram struct to fill in, with struct_size set. Must not be NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_get_latency_histogram(uint32_t stage, struct rdxusb_latency_histogram* histogram);
+
+/**
+ * Clears every latency histogram and the sampled trace spans.
+ * 
+ * @return 0 on success, negative on error. RDXUSB_ERR_TRACING_DISABLED without the latency-trace feature.
+ */
+int32_t rdxusb_reset_latency_histograms(void);
+
+/**
+ * Keeps every Nth frame's stage timestamps for rdxusb_export_trace.
+ * 
+ * @param interval keep one frame in this many. 0 turns sampling off, which is the default.
+ * @return 0 on success, negative on error. RDXUSB_ERR_TRACING_DISABLED without the latency-trace feature.
+ */
+int32_t rdxusb_set_trace_sample_interval(uint32_t interval);
+
+/**
+ * Writes the sampled frames to a Chrome trace event file, viewable in Perfetto or chrome://tracing, and clears them.
+ * 
+ * @param path path of the trace file, created or truncated. This MUST be UTF-8 and not NULL.
+ * @return 0 on success, negative on error. RDXUSB_ERR_TRACING_DISABLED without the latency-trace feature.
+ */
+int32_t rdxusb_export_trace(const char* path);
+
+/**
+ * Starts capturing every frame a handle sends and receives to a file, replacing any running capture.
+ * 
+ * Frames are buffered and written by a background thread, so capturing does not slow down the device.
+ * If the writer falls behind, frames are dropped from the capture rather than from the device.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param path path of the capture file, created or truncated. This MUST be UTF-8 and not NULL.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_start_capture(int32_t handle_id, const char* path);
+
+/**
+ * Stops a handle's capture and finishes writing the file. Stopping a handle with no capture running does nothing.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_stop_capture(int32_t handle_id);
+
+/**
+ * Publishes a handle's device to other processes through shared memory.
+ * 
+ * Calling rdxusb_open_device with the same vid/pid/serial number in another process then attaches to this
+ * handle instead of claiming the device: it reads every frame this handle receives, and its writes go out
+ * through this handle's tx queues. Control requests can only be made from this process.
+ * Frames are copied through shared memory rather than shared in place, so each attached process keeps its own
+ * filters, mailboxes, callbacks and mapped rings.
+ * Publishing lasts across reconnects, until rdxusb_unpublish_device or until the handle is closed.
+ * Only available on POSIX systems.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @param ring_capacity packets buffered per attached process in each direction. 0 picks the default.
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_publish_device(int32_t handle_id, uint64_t ring_capacity);
+
+/**
+ * Stops publishing a handle's device. Attached processes see the device disconnect.
+ * 
+ * @param handle_id a handle id returned from rdxusb_open_device
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_unpublish_device(int32_t handle_id);
+
+/**
+ * Opens a handle that plays back the received frames of a capture file.
+ * 
+ * The frames are read with rdxusb_read_packets and friends, on the channel they were captured on.
+ * Replay never drops frames: it waits for room in the rx buffers, so every channel in the capture must be read.
+ * Writes to a replay handle fail. Once the capture ends, rdxusb_get_connection_generation reports the handle
+ * as disconnected, but the buffered frames stay readable until the handle is closed with rdxusb_close_device.
+ * 
+ * @param path path of a capture file written by rdxusb_start_capture. This MUST be UTF-8 and not NULL.
+ * @param speed playback speed relative to the original timing, e.g. 1.0 for real time. 0 plays as fast as possible.
+ * @param buf_size the maximum number of packets to buffer per channel
+ * @return a non-negative device handle on success, negative on error
+ */
+int32_t rdxusb_open_replay(const char* path, double speed, uint64_t buf_size);
+
 /**
  * Closes the specified device, and stops reading from it.
  * 
@@ -163,12 +1182,29 @@ int32_t rdxusb_close_all_devices();
 /**
  * Creates a new USB device iterator.
  * 
+ * Once the event loop is running, this snapshots a device list kept current by hotplug instead of
+ * enumerating the bus. Before that, it enumerates the bus.
+ * 
  * @param iter_id pointer where the iterator handle will be written
  * @param n_devices the number of USB devices available to the iterator
  * @return 0 on success, negative on error
  */
 int32_t rdxusb_new_device_iterator(rdxusb_iter_id* iter_id, uint64_t* n_devices);
 
+/**
+ * Creates a new USB device iterator over only the devices with a given vid and pid.
+ * 
+ * Like rdxusb_new_device_iterator, this copies the event loop's device list, which hotplug keeps current,
+ * rather than enumerating the bus, so it is cheap to call periodically.
+ * 
+ * @param vid USB vendor ID to match, or 0 to match any
+ * @param pid USB product ID to match, or 0 to match any
+ * @param iter_id pointer where the iterator handle will be written
+ * @param n_devices the number of USB devices available to the iterator
+ * @return 0 on success, negative on error
+ */
+int32_t rdxusb_new_device_iterator_filtered(uint16_t vid, uint16_t pid, rdxusb_iter_id* iter_id, uint64_t* n_devices);
+
 /**
  * Gets a device by index in an iterator.
  * 
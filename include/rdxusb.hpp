@@ -0,0 +1,756 @@
+#pragma once
+/**
+ * Header-only C++20 wrapper over rdxusb.h.
+ *
+ * - rdxusb::Device is a move-only handle that closes its device when destroyed.
+ * - Calls return rdxusb::Result<T>, which is std::expected<T, rdxusb::Error> where the standard library
+ *   has it, and a look-alike with the same members elsewhere. Nothing here throws or allocates on the
+ *   read and write paths.
+ * - Device::next_batch is a coroutine awaitable that completes once packets arrive, without blocking
+ *   a thread. It waits on the device's event handle (see rdxusb_get_event_handle) through a Reactor.
+ */
+#include "rdxusb.h"
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if __has_include(<expected>)
+#include <expected>
+#endif
+#if !defined(__cpp_lib_expected) || __cpp_lib_expected < 202202L
+#include <variant>
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace rdxusb {
+
+/** The RDXUSB_ERR_* codes. */
+enum class Errc : int32_t {
+    EventLoopCrashed = RDXUSB_ERR_EVENT_LOOP_CRASHED,
+    CannotListDevices = RDXUSB_ERR_CANNOT_LIST_DEVICES,
+    DeviceIterInvalid = RDXUSB_ERR_DEVICE_ITER_INVALID,
+    DeviceIterIdxOutOfRange = ERR_DEVICE_ITER_IDX_OUT_OF_RANGE,
+    NullPtr = RDXUSB_ERR_NULL_PTR,
+    TooManyDevices = RDXUSB_ERR_TOO_MANY_DEVICES,
+    EventHandleUnavailable = RDXUSB_ERR_EVENT_HANDLE_UNAVAILABLE,
+    InvalidArgument = RDXUSB_ERR_INVALID_ARGUMENT,
+    PeriodicJobNotFound = RDXUSB_ERR_PERIODIC_JOB_NOT_FOUND,
+    EventLoopAlreadyStarted = RDXUSB_ERR_EVENT_LOOP_ALREADY_STARTED,
+    CaptureIo = RDXUSB_ERR_CAPTURE_IO,
+    TracingDisabled = RDXUSB_ERR_TRACING_DISABLED,
+    ControlRequestNotFound = RDXUSB_ERR_CONTROL_REQUEST_NOT_FOUND,
+    ControlPending = RDXUSB_ERR_CONTROL_PENDING,
+    TooManyControlRequests = RDXUSB_ERR_TOO_MANY_CONTROL_REQUESTS,
+    BrokerUnavailable = RDXUSB_ERR_BROKER_UNAVAILABLE,
+    DeviceNotOpened = RDXUSB_ERR_DEVICE_NOT_OPENED,
+    DeviceNotConnected = RDXUSB_ERR_DEVICE_NOT_CONNECTED,
+    ChannelOutOfRange = RDXUSB_ERR_CHANNEL_OUT_OF_RANGE,
+    MailboxDisabled = RDXUSB_ERR_MAILBOX_DISABLED,
+    MailboxEmpty = RDXUSB_ERR_MAILBOX_EMPTY,
+    NoClockEstimate = RDXUSB_ERR_NO_CLOCK_ESTIMATE,
+    ControlTransferFailed = RDXUSB_ERR_CONTROL_TRANSFER_FAILED,
+};
+
+/** A negative status returned by an rdxusb call. */
+class Error {
+public:
+    constexpr explicit Error(int32_t code) noexcept : code_(code) {}
+    constexpr Error(Errc errc) noexcept : code_(static_cast<int32_t>(errc)) {}
+
+    /** The raw RDXUSB_ERR_* code. */
+    constexpr int32_t code() const noexcept { return code_; }
+    constexpr Errc errc() const noexcept { return static_cast<Errc>(code_); }
+
+    const char* message() const noexcept {
+        switch (errc()) {
+            case Errc::EventLoopCrashed: return "event loop crashed";
+            case Errc::CannotListDevices: return "cannot list USB devices";
+            case Errc::DeviceIterInvalid: return "invalid device iterator";
+            case Errc::DeviceIterIdxOutOfRange: return "device iterator index out of range";
+            case Errc::NullPtr: return "null pointer";
+            case Errc::TooManyDevices: return "too many open devices";
+            case Errc::EventHandleUnavailable: return "event handle unavailable";
+            case Errc::InvalidArgument: return "invalid argument";
+            case Errc::PeriodicJobNotFound: return "periodic job not found";
+            case Errc::EventLoopAlreadyStarted: return "event loop already started";
+            case Errc::CaptureIo: return "capture or trace file I/O failed";
+            case Errc::TracingDisabled: return "built without latency tracing";
+            case Errc::ControlRequestNotFound: return "control request not found";
+            case Errc::ControlPending: return "control request still pending";
+            case Errc::TooManyControlRequests: return "too many control requests";
+            case Errc::BrokerUnavailable: return "device broker unavailable";
+            case Errc::DeviceNotOpened: return "device not opened";
+            case Errc::DeviceNotConnected: return "device not connected";
+            case Errc::ChannelOutOfRange: return "channel out of range";
+            case Errc::MailboxDisabled: return "mailbox disabled";
+            case Errc::MailboxEmpty: return "mailbox empty";
+            case Errc::NoClockEstimate: return "no clock estimate yet";
+            case Errc::ControlTransferFailed: return "control transfer failed";
+        }
+        return "unknown rdxusb error";
+    }
+
+    friend constexpr bool operator==(Error a, Error b) noexcept { return a.code_ == b.code_; }
+
+private:
+    int32_t code_;
+};
+
+#if defined(__cpp_lib_expected) && __cpp_lib_expected >= 202202L
+
+template <class T>
+using Result = std::expected<T, Error>;
+using Unexpected = std::unexpected<Error>;
+
+#else
+
+/** Stand-in for std::unexpected<Error> before C++23. */
+class Unexpected {
+public:
+    constexpr explicit Unexpected(Error error) noexcept : error_(error) {}
+    constexpr Error error() const noexcept { return error_; }
+
+private:
+    Error error_;
+};
+
+/** Stand-in for std::expected<T, Error> before C++23, with the members this header's users need. */
+template <class T>
+class Result {
+public:
+    Result(T value) : value_(std::in_place_index<0>, std::move(value)) {}
+    Result(Unexpected error) : value_(std::in_place_index<1>, error.error()) {}
+
+    bool has_value() const noexcept { return value_.index() == 0; }
+    explicit operator bool() const noexcept { return has_value(); }
+
+    /** The value. Aborts if there is none, since this header doesn't assume exceptions are enabled. */
+    T& value() & { check(); return *std::get_if<0>(&value_); }
+    const T& value() const& { check(); return *std::get_if<0>(&value_); }
+    T&& value() && { check(); return std::move(*std::get_if<0>(&value_)); }
+    T& operator*() & noexcept { return *std::get_if<0>(&value_); }
+    const T& operator*() const& noexcept { return *std::get_if<0>(&value_); }
+    T&& operator*() && noexcept { return std::move(*std::get_if<0>(&value_)); }
+    T* operator->() noexcept { return std::get_if<0>(&value_); }
+    const T* operator->() const noexcept { return std::get_if<0>(&value_); }
+
+    Error error() const noexcept { return *std::get_if<1>(&value_); }
+    template <class U>
+    T value_or(U&& fallback) const& { return has_value() ? **this : static_cast<T>(std::forward<U>(fallback)); }
+
+private:
+    void check() const { if (!has_value()) std::abort(); }
+
+    std::variant<T, Error> value_;
+};
+
+template <>
+class Result<void> {
+public:
+    Result() noexcept : error_(0) {}
+    Result(Unexpected error) noexcept : error_(error.error()) {}
+
+    bool has_value() const noexcept { return error_.code() == 0; }
+    explicit operator bool() const noexcept { return has_value(); }
+    void value() const { if (!has_value()) std::abort(); }
+    void operator*() const noexcept {}
+    Error error() const noexcept { return error_; }
+
+private:
+    Error error_;
+};
+
+#endif
+
+namespace detail {
+
+inline Result<void> check(int32_t status) noexcept {
+    if (status < 0) return Unexpected(Error(status));
+    return {};
+}
+
+/** Initializes a versioned struct with its rdxusb_*_init function. */
+template <class T>
+inline Result<T> init_versioned(int32_t (*init)(T*)) noexcept {
+    T value{};
+    value.struct_size = sizeof(T);
+    if (int32_t status = init(&value); status < 0) return Unexpected(Error(status));
+    return value;
+}
+
+}  // namespace detail
+
+/** Default transport options for Device::open. */
+inline Result<rdxusb_open_options> default_open_options() noexcept {
+    return detail::init_versioned(rdxusb_open_options_init);
+}
+
+/** Current time on the host monotonic clock, in nanoseconds. */
+inline uint64_t host_time_ns() noexcept { return rdxusb_host_time_ns(); }
+
+/**
+ * Lists visible USB devices, optionally only those with a given vid and pid.
+ *
+ * This allocates, so call it at startup or periodically rather than in a control loop.
+ */
+inline Result<std::vector<rdxusb_device_entry>> list_devices(uint16_t vid = 0, uint16_t pid = 0) {
+    rdxusb_iter_id iter = 0;
+    uint64_t n_devices = 0;
+    if (int32_t status = rdxusb_new_device_iterator_filtered(vid, pid, &iter, &n_devices); status < 0) {
+        return Unexpected(Error(status));
+    }
+    std::vector<rdxusb_device_entry> devices(static_cast<size_t>(n_devices));
+    for (uint64_t i = 0; i < n_devices; i++) {
+        if (int32_t status = rdxusb_get_device_in_iterator(iter, i, &devices[i]); status < 0) {
+            rdxusb_free_device_iterator(iter);
+            return Unexpected(Error(status));
+        }
+    }
+    rdxusb_free_device_iterator(iter);
+    return devices;
+}
+
+class Reactor;
+
+/**
+ * Awaitable returned by Device::next_batch.
+ *
+ * Completes with the number of packets read into the caller's buffer, which is at least 1,
+ * or with an error, e.g. Errc::DeviceNotConnected once the device disconnects.
+ * The buffer and the Reactor must outlive the co_await.
+ * Destroying a coroutine suspended on it cancels the await, up until the reactor hands it to be resumed.
+ */
+class BatchAwaitable {
+public:
+    BatchAwaitable(int32_t handle, uint8_t channel, std::span<rdxusb_packet> packets, Reactor& reactor) noexcept
+        : handle_(handle), channel_(channel), packets_(packets), reactor_(&reactor) {}
+
+    BatchAwaitable(const BatchAwaitable&) = delete;
+    BatchAwaitable& operator=(const BatchAwaitable&) = delete;
+    ~BatchAwaitable();
+
+    bool await_ready() noexcept { return packets_.empty() || try_read(); }
+    bool await_suspend(std::coroutine_handle<> coroutine) noexcept;
+    Result<size_t> await_resume() const noexcept {
+        if (status_ < 0) return Unexpected(Error(status_));
+        return count_;
+    }
+
+private:
+    friend class Reactor;
+
+    /** Reads whatever is ready. Returns true once the await is complete. */
+    bool try_read() noexcept {
+        uint64_t n = 0;
+        status_ = rdxusb_read_packets(handle_, channel_, packets_.data(), packets_.size(), &n);
+        count_ = static_cast<size_t>(n);
+        return status_ < 0 || n > 0;
+    }
+
+    int32_t handle_;
+    uint8_t channel_;
+    std::span<rdxusb_packet> packets_;
+    Reactor* reactor_;
+    std::coroutine_handle<> coroutine_{};
+    int64_t event_ = -1;
+    int32_t status_ = 0;
+    size_t count_ = 0;
+    /** Not checked by the reactor yet. */
+    bool fresh_ = true;
+};
+
+/**
+ * Waits on device event handles on one background thread, and resumes coroutines awaiting
+ * Device::next_batch once their packets arrive.
+ *
+ * By default coroutines are resumed on the reactor thread. Pass an executor to resume them somewhere else,
+ * e.g. by posting them to the robot loop's own queue.
+ * On Windows, one reactor waits on at most 63 devices at once; awaits on more are polled every millisecond.
+ */
+class Reactor {
+public:
+    using Executor = std::function<void(std::coroutine_handle<>)>;
+
+    explicit Reactor(Executor executor = {}) : executor_(std::move(executor)) {
+#ifdef _WIN32
+        wake_ = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+#else
+        if (pipe(wake_) == 0) {
+            fcntl(wake_[0], F_SETFL, fcntl(wake_[0], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_[1], F_SETFL, fcntl(wake_[1], F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        thread_ = std::thread([this] { run(); });
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    /** Stops the reactor thread. Coroutines still waiting on it are never resumed. */
+    ~Reactor() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        wake();
+        thread_.join();
+#ifdef _WIN32
+        CloseHandle(wake_);
+#else
+        close(wake_[0]);
+        close(wake_[1]);
+#endif
+    }
+
+    /** The reactor Device::next_batch uses by default, started on first use. */
+    static Reactor& global() {
+        static Reactor reactor;
+        return reactor;
+    }
+
+private:
+    friend class BatchAwaitable;
+
+    void add(BatchAwaitable* waiter) {
+        {
+            std::lock_guard lock(mutex_);
+            waiters_.push_back(waiter);
+        }
+        wake();
+    }
+
+    /** Forgets a waiter that is going away, if it is still waiting or not resumed yet. */
+    void remove(BatchAwaitable* waiter) {
+        std::lock_guard lock(mutex_);
+        waiters_.erase(std::remove(waiters_.begin(), waiters_.end(), waiter), waiters_.end());
+        ready_.erase(std::remove(ready_.begin(), ready_.end(), waiter), ready_.end());
+    }
+
+    void wake() noexcept {
+#ifdef _WIN32
+        SetEvent(wake_);
+#else
+        char byte = 0;
+        [[maybe_unused]] auto n = write(wake_[1], &byte, 1);
+#endif
+    }
+
+    /**
+     * Checks every waiter on the handles in `signalled`, plus any fresh ones, and moves the completed ones to `ready_`.
+     *
+     * The event is reset once per handle before its waiters read, so a packet arriving afterwards always
+     * signals it again, however many coroutines wait on the same device.
+     */
+    void dispatch(std::vector<int32_t>& signalled) {
+        std::lock_guard lock(mutex_);
+        for (BatchAwaitable* waiter : waiters_) {
+            if (waiter->fresh_ && std::find(signalled.begin(), signalled.end(), waiter->handle_) == signalled.end()) {
+                signalled.push_back(waiter->handle_);
+            }
+        }
+        for (int32_t handle : signalled) {
+            rdxusb_reset_event_handle(handle);
+            for (auto it = waiters_.begin(); it != waiters_.end();) {
+                BatchAwaitable* waiter = *it;
+                if (waiter->handle_ != handle) { ++it; continue; }
+                waiter->fresh_ = false;
+                if (waiter->try_read()) {
+                    ready_.push_back(waiter);
+                    it = waiters_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    void run() {
+        std::vector<int64_t> events;
+        std::vector<int32_t> handles;
+        std::vector<int32_t> signalled;
+        for (;;) {
+            events.clear();
+            handles.clear();
+            bool any_fresh = false;
+            {
+                std::lock_guard lock(mutex_);
+                if (stopping_) return;
+                for (BatchAwaitable* waiter : waiters_) {
+                    any_fresh |= waiter->fresh_;
+                    if (std::find(handles.begin(), handles.end(), waiter->handle_) != handles.end()) continue;
+                    handles.push_back(waiter->handle_);
+                    events.push_back(waiter->event_);
+                }
+            }
+
+            signalled.clear();
+#ifdef _WIN32
+            std::vector<HANDLE> objects{wake_};
+            for (size_t i = 0; i < events.size() && objects.size() < MAXIMUM_WAIT_OBJECTS; i++) {
+                objects.push_back(reinterpret_cast<HANDLE>(static_cast<intptr_t>(events[i])));
+            }
+            DWORD timeout = any_fresh ? 0 : (objects.size() <= events.size() ? 1 : INFINITE);
+            WaitForMultipleObjects(static_cast<DWORD>(objects.size()), objects.data(), FALSE, timeout);
+            for (size_t i = 0; i < events.size(); i++) {
+                HANDLE event = reinterpret_cast<HANDLE>(static_cast<intptr_t>(events[i]));
+                if (WaitForSingleObject(event, 0) != WAIT_TIMEOUT) signalled.push_back(handles[i]);
+            }
+#else
+            std::vector<pollfd> fds{{wake_[0], POLLIN, 0}};
+            for (int64_t event : events) fds.push_back({static_cast<int>(event), POLLIN, 0});
+            poll(fds.data(), static_cast<nfds_t>(fds.size()), any_fresh ? 0 : -1);
+            if (fds[0].revents != 0) {
+                char buf[64];
+                while (read(wake_[0], buf, sizeof(buf)) > 0) {}
+            }
+            for (size_t i = 1; i < fds.size(); i++) {
+                // POLLNVAL once the device is closed, which fails the waiters' reads
+                if (fds[i].revents != 0) signalled.push_back(handles[i - 1]);
+            }
+#endif
+
+            dispatch(signalled);
+            for (;;) {
+                std::coroutine_handle<> coroutine;
+                {
+                    // the waiter stays listed until here, so one whose coroutine is destroyed meanwhile
+                    // takes itself off instead of being resumed
+                    std::lock_guard lock(mutex_);
+                    if (ready_.empty()) break;
+                    coroutine = ready_.front()->coroutine_;
+                    ready_.erase(ready_.begin());
+                }
+                if (executor_) {
+                    executor_(coroutine);
+                } else {
+                    coroutine.resume();
+                }
+            }
+        }
+    }
+
+    Executor executor_;
+    std::mutex mutex_;
+    std::vector<BatchAwaitable*> waiters_;
+    /** Completed waiters not resumed yet. */
+    std::vector<BatchAwaitable*> ready_;
+    bool stopping_ = false;
+#ifdef _WIN32
+    HANDLE wake_ = nullptr;
+#else
+    int wake_[2] = {-1, -1};
+#endif
+    std::thread thread_;
+};
+
+inline bool BatchAwaitable::await_suspend(std::coroutine_handle<> coroutine) noexcept {
+    coroutine_ = coroutine;
+    status_ = rdxusb_get_event_handle(handle_, &event_);
+    if (status_ < 0) return false;
+    // the reactor may resume us on its thread before this returns, so nothing touches *this after add
+    reactor_->add(this);
+    return true;
+}
+
+inline BatchAwaitable::~BatchAwaitable() {
+    // only an await that suspended can still be on the reactor's lists
+    if (coroutine_) reactor_->remove(this);
+}
+
+/** A move-only in-flight control request, cancelled when destroyed unless its result was collected. */
+class ControlRequest {
+public:
+    ControlRequest() noexcept = default;
+    /** Takes ownership of a request id returned from rdxusb_control_submit. */
+    explicit ControlRequest(int32_t id) noexcept : id_(id) {}
+
+    ControlRequest(ControlRequest&& other) noexcept : id_(std::exchange(other.id_, -1)) {}
+    ControlRequest& operator=(ControlRequest&& other) noexcept {
+        if (this != &other) {
+            cancel();
+            id_ = std::exchange(other.id_, -1);
+        }
+        return *this;
+    }
+    ControlRequest(const ControlRequest&) = delete;
+    ControlRequest& operator=(const ControlRequest&) = delete;
+    ~ControlRequest() { cancel(); }
+
+    int32_t id() const noexcept { return id_; }
+    /** Whether the result is still to be collected. */
+    explicit operator bool() const noexcept { return id_ >= 0; }
+
+    /**
+     * See rdxusb_control_poll. Returns the number of bytes transferred, or Errc::ControlPending while in flight.
+     * Any other result collects the request.
+     */
+    Result<size_t> poll(std::span<uint8_t> data = {}) noexcept {
+        uint64_t transferred = 0;
+        return collect(rdxusb_control_poll(id_, data.data(), data.size(), &transferred), transferred);
+    }
+
+    /** Like poll, but blocks the calling thread until the request finishes or the timeout expires. */
+    Result<size_t> wait(std::span<uint8_t> data, std::chrono::nanoseconds timeout) noexcept {
+        uint64_t transferred = 0;
+        uint64_t timeout_ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(timeout.count(), 0));
+        return collect(rdxusb_control_wait(id_, timeout_ns, data.data(), data.size(), &transferred), transferred);
+    }
+
+    /** Abandons the request. Does nothing once it was collected. */
+    void cancel() noexcept {
+        if (id_ >= 0) rdxusb_control_cancel(std::exchange(id_, -1));
+    }
+
+private:
+    Result<size_t> collect(int32_t status, uint64_t transferred) noexcept {
+        if (status == RDXUSB_ERR_CONTROL_PENDING) return Unexpected(Error(status));
+        // anything else frees the id
+        id_ = -1;
+        if (status < 0) return Unexpected(Error(status));
+        return static_cast<size_t>(transferred);
+    }
+
+    int32_t id_ = -1;
+};
+
+/** A move-only device handle, closed when destroyed. */
+class Device {
+public:
+    /** An empty handle that isn't open. */
+    Device() noexcept = default;
+    /** Takes ownership of a handle id returned from rdxusb_open_device. */
+    explicit Device(int32_t handle) noexcept : handle_(handle) {}
+
+    Device(Device&& other) noexcept : handle_(std::exchange(other.handle_, -1)) {}
+    Device& operator=(Device&& other) noexcept {
+        if (this != &other) {
+            close();
+            handle_ = std::exchange(other.handle_, -1);
+        }
+        return *this;
+    }
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+    ~Device() { close(); }
+
+    /** See rdxusb_open_device. */
+    static Result<Device> open(uint16_t vid, uint16_t pid, const char* serial_number = nullptr,
+                               bool close_on_dc = false, uint64_t buf_size = 256) noexcept {
+        return from_status(rdxusb_open_device(vid, pid, serial_number, close_on_dc, buf_size));
+    }
+
+    /** See rdxusb_open_device_ex. Get options to change from default_open_options(). */
+    static Result<Device> open(uint16_t vid, uint16_t pid, const rdxusb_open_options& options,
+                               const char* serial_number = nullptr, bool close_on_dc = false) noexcept {
+        return from_status(rdxusb_open_device_ex(vid, pid, serial_number, close_on_dc, &options));
+    }
+
+    /** See rdxusb_open_replay. */
+    static Result<Device> open_replay(const char* path, double speed = 1.0, uint64_t buf_size = 4096) noexcept {
+        return from_status(rdxusb_open_replay(path, speed, buf_size));
+    }
+
+    int32_t handle() const noexcept { return handle_; }
+    explicit operator bool() const noexcept { return handle_ >= 0; }
+
+    /** Gives up ownership of the handle id without closing it. */
+    int32_t release() noexcept { return std::exchange(handle_, -1); }
+
+    /** Closes the device now. Does nothing on an empty handle. */
+    void close() noexcept {
+        if (handle_ >= 0) rdxusb_close_device(std::exchange(handle_, -1));
+    }
+
+    /** Reads as many queued packets as fit. Returns 0 if none are queued. */
+    Result<size_t> read(std::span<rdxusb_packet> packets, uint8_t channel = 0) const noexcept {
+        uint64_t n = 0;
+        if (int32_t status = rdxusb_read_packets(handle_, channel, packets.data(), packets.size(), &n); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return static_cast<size_t>(n);
+    }
+
+    /** See rdxusb_read_packets_compact. Returns the written records, to walk with rdxusb_compact_cursor. */
+    Result<std::span<const uint8_t>> read_compact(std::span<uint8_t> buf, uint8_t channel = 0) const noexcept {
+        uint64_t len = 0;
+        if (int32_t status = rdxusb_read_packets_compact(handle_, channel, buf.data(), buf.size(), &len, nullptr); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return std::span<const uint8_t>(buf.data(), static_cast<size_t>(len));
+    }
+
+    /** See rdxusb_read_packets_columnar. Returns how many packets were read. */
+    Result<size_t> read_columnar(const rdxusb_columns& columns, size_t max_packets, uint8_t channel = 0) const noexcept {
+        uint64_t n = 0;
+        if (int32_t status = rdxusb_read_packets_columnar(handle_, channel, &columns, max_packets, &n); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return static_cast<size_t>(n);
+    }
+
+    /** Like read, but blocks the calling thread until a packet arrives or the timeout expires. */
+    Result<size_t> wait(std::span<rdxusb_packet> packets, std::chrono::nanoseconds timeout, uint8_t channel = 0) const noexcept {
+        uint64_t n = 0;
+        uint64_t timeout_ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(timeout.count(), 0));
+        if (int32_t status = rdxusb_wait_packets(handle_, channel, timeout_ns, packets.data(), packets.size(), &n); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return static_cast<size_t>(n);
+    }
+
+    /**
+     * Awaits the next batch of packets on a channel: `auto n = co_await dev.next_batch(buf);`
+     *
+     * Completes right away if packets are already queued.
+     */
+    BatchAwaitable next_batch(std::span<rdxusb_packet> packets, uint8_t channel = 0,
+                              Reactor& reactor = Reactor::global()) const noexcept {
+        return BatchAwaitable(handle_, channel, packets, reactor);
+    }
+
+    /** Queues packets, each in the tx lane its id maps to. Returns how many fit. */
+    Result<size_t> write(std::span<const rdxusb_packet> packets) const noexcept {
+        uint64_t n = 0;
+        // rdxusb_write_packets only reads the packets
+        auto* data = const_cast<rdxusb_packet*>(packets.data());
+        if (int32_t status = rdxusb_write_packets(handle_, data, packets.size(), &n); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return static_cast<size_t>(n);
+    }
+
+    /** Queues packets in one of the RDXUSB_TX_LANE_* lanes. Returns how many fit. */
+    Result<size_t> write(std::span<const rdxusb_packet> packets, uint32_t lane) const noexcept {
+        uint64_t n = 0;
+        if (int32_t status = rdxusb_write_packets_lane(handle_, lane, packets.data(), packets.size(), &n); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return static_cast<size_t>(n);
+    }
+
+    /** See rdxusb_get_latest. Returns the packet and its age in nanoseconds. */
+    Result<std::pair<rdxusb_packet, uint64_t>> latest(uint32_t arb_id, uint8_t channel = 0) const noexcept {
+        std::pair<rdxusb_packet, uint64_t> latest{};
+        if (int32_t status = rdxusb_get_latest(handle_, channel, arb_id, &latest.first, &latest.second); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return latest;
+    }
+
+    /** Blocks until the device is connected. Fails with Errc::DeviceNotConnected on timeout. See rdxusb_wait_connected. */
+    Result<void> wait_connected(std::chrono::nanoseconds timeout) const noexcept {
+        uint64_t timeout_ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(timeout.count(), 0));
+        return detail::check(rdxusb_wait_connected(handle_, timeout_ns));
+    }
+
+    /** See rdxusb_get_connection_generation. */
+    Result<uint32_t> connection_generation() const noexcept {
+        uint32_t generation = 0;
+        if (int32_t status = rdxusb_get_connection_generation(handle_, &generation); status < 0) {
+            return Unexpected(Error(status));
+        }
+        return generation;
+    }
+
+    bool connected() const noexcept {
+        auto generation = connection_generation();
+        return generation && (*generation & 1) == 1;
+    }
+
+    Result<rdxusb_stats> stats() const noexcept {
+        rdxusb_stats stats{};
+        stats.struct_size = sizeof(stats);
+        if (int32_t status = rdxusb_get_stats(handle_, &stats); status < 0) return Unexpected(Error(status));
+        return stats;
+    }
+
+    /** See rdxusb_set_filters. An empty span removes filtering. */
+    Result<void> set_filters(std::span<const rdxusb_filter> filters, uint8_t channel = 0) const noexcept {
+        return detail::check(rdxusb_set_filters(handle_, channel, filters.data(), filters.size()));
+    }
+
+    /** See rdxusb_set_tx_coalescing. An empty span turns coalescing off. */
+    Result<void> set_tx_coalescing(std::span<const rdxusb_filter> filters) const noexcept {
+        return detail::check(rdxusb_set_tx_coalescing(handle_, filters.data(), filters.size()));
+    }
+
+    /** See rdxusb_set_mailbox_mode. */
+    Result<void> set_mailbox_mode(uint32_t mode, uint8_t channel = 0) const noexcept {
+        return detail::check(rdxusb_set_mailbox_mode(handle_, channel, mode));
+    }
+
+    /** See rdxusb_start_capture. */
+    Result<void> start_capture(const char* path) const noexcept {
+        return detail::check(rdxusb_start_capture(handle_, path));
+    }
+
+    Result<void> stop_capture() const noexcept {
+        return detail::check(rdxusb_stop_capture(handle_));
+    }
+
+    /** See rdxusb_publish_device. */
+    Result<void> publish(uint64_t ring_capacity = 0) const noexcept {
+        return detail::check(rdxusb_publish_device(handle_, ring_capacity));
+    }
+
+    /** See rdxusb_unpublish_device. */
+    Result<void> unpublish() const noexcept {
+        return detail::check(rdxusb_unpublish_device(handle_));
+    }
+
+    /** Starts a vendor control request reading up to length bytes. See rdxusb_control_submit. */
+    Result<ControlRequest> control_in(uint8_t request, uint16_t value, uint16_t index, uint16_t length) const noexcept {
+        int32_t id = rdxusb_control_submit(handle_, RDXUSB_CONTROL_IN, request, value, index, nullptr, length);
+        if (id < 0) return Unexpected(Error(id));
+        return ControlRequest(id);
+    }
+
+    /** Starts a vendor control request sending data, which is copied. See rdxusb_control_submit. */
+    Result<ControlRequest> control_out(uint8_t request, uint16_t value, uint16_t index, std::span<const uint8_t> data) const noexcept {
+        if (data.size() > UINT16_MAX) return Unexpected(Error(Errc::InvalidArgument));
+        int32_t id = rdxusb_control_submit(handle_, RDXUSB_CONTROL_OUT, request, value, index, data.data(), static_cast<uint16_t>(data.size()));
+        if (id < 0) return Unexpected(Error(id));
+        return ControlRequest(id);
+    }
+
+    /** The raw OS event handle, for integrating with an existing event loop. See rdxusb_get_event_handle. */
+    Result<int64_t> event_handle() const noexcept {
+        int64_t event = -1;
+        if (int32_t status = rdxusb_get_event_handle(handle_, &event); status < 0) return Unexpected(Error(status));
+        return event;
+    }
+
+    Result<void> reset_event_handle() const noexcept {
+        return detail::check(rdxusb_reset_event_handle(handle_));
+    }
+
+private:
+    static Result<Device> from_status(int32_t status) noexcept {
+        if (status < 0) return Unexpected(Error(status));
+        return Device(status);
+    }
+
+    int32_t handle_ = -1;
+};
+
+}  // namespace rdxusb
@@ -1,5 +1,3 @@
-use std::time::Duration;
-
 use rdxusb::{RdxUsbPacket, MESSAGE_ARB_ID_DEVICE, MESSAGE_ARB_ID_EXT};
 
 
@@ -28,8 +26,9 @@ fn main() {
         data: data,
     };
 
-    // opening a handle isn't instantaneous. 
-    std::thread::sleep(Duration::from_millis(100));
+    // opening a handle isn't instantaneous.
+    let result = rdxusb::c_api::rdxusb_wait_connected(handle, 5_000_000_000);
+    println!("wait connected: {result}");
     let mut packets_written = 0u64;
     let result = rdxusb::c_api::rdxusb_write_packets(handle, &packet, 1, &mut packets_written);
     println!("write packet: {result} for {packets_written}");
@@ -39,11 +38,10 @@ fn main() {
         let mut packets: Vec<RdxUsbPacket> = Vec::with_capacity(48);
         let mut packets_read = 0u64;
 
-        let result = rdxusb::c_api::rdxusb_read_packets(handle, 0, packets.as_mut_ptr(), 32, &mut packets_read);
+        let result = rdxusb::c_api::rdxusb_wait_packets(handle, 0, 100_000_000, packets.as_mut_ptr(), 32, &mut packets_read);
 
         println!("i: {i} Status {result} Read {packets_read} packets");
 
         i += 1;
-        std::thread::sleep(Duration::from_millis(100));
     }
 }
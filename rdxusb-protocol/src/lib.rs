@@ -72,6 +72,21 @@ impl From<RdxUsbFsPacket> for RdxUsbPacket {
     }
 }
 
+/// Widens a run of [`RdxUsbFsPacket`]s into the front of `dst`, returning how many were converted.
+///
+/// Both packet types share the same 16-byte header and data offset, so each packet is a 64-byte copy
+/// followed by zeroing the 16 data bytes that full-speed packets can't carry.
+/// This is meant for draining ring buffers in bulk and compiles down to a straight-line copy loop.
+pub fn widen_fs_packets(src: &[RdxUsbFsPacket], dst: &mut [RdxUsbPacket]) -> usize {
+    let n = src.len().min(dst.len());
+    for (d, s) in dst[..n].iter_mut().zip(&src[..n]) {
+        let d = bytemuck::bytes_of_mut(d);
+        d[..RdxUsbFsPacket::SIZE].copy_from_slice(bytemuck::bytes_of(s));
+        d[RdxUsbFsPacket::SIZE..].fill(0);
+    }
+    n
+}
+
 impl TryFrom<RdxUsbPacket> for RdxUsbFsPacket {
     type Error = RdxUsbPacket;
 
@@ -146,7 +161,7 @@ impl RdxUsbPacket {
         self.arb_id & MESSAGE_ARB_ID_DEVICE != 0
     }
 
-    /// Should always be 64.
+    /// Should always be 80.
     pub const SIZE: usize = core::mem::size_of::<Self>();
 
     pub fn into_array(self) -> [u8; Self::SIZE] {
@@ -197,4 +212,16 @@ pub enum RdxUsbCtrl {
 }
 
 /// USB-Full Speed protocol version
-pub const PROTOCOL_VERSION_MAJOR_FS: u16 = 1;
\ No newline at end of file
+pub const PROTOCOL_VERSION_MAJOR_FS: u16 = 1;
+/// USB-High Speed protocol version.
+///
+/// High-speed devices exchange full [`RdxUsbPacket`]s instead of [`RdxUsbFsPacket`]s,
+/// packed back to back into bulk transfers of up to [`HS_PACKETS_PER_TRANSFER`] packets in both directions.
+pub const PROTOCOL_VERSION_MAJOR_HS: u16 = 2;
+/// Max packet size of the high-speed bulk endpoints.
+pub const HS_MAX_PACKET_SIZE: usize = 512;
+/// Number of [`RdxUsbPacket`]s packed into one high-speed bulk transfer.
+///
+/// A full transfer is shorter than [`HS_MAX_PACKET_SIZE`], so it always ends in a short packet
+/// and never needs a zero-length packet to terminate it.
+pub const HS_PACKETS_PER_TRANSFER: usize = HS_MAX_PACKET_SIZE / RdxUsbPacket::SIZE;
\ No newline at end of file
@@ -0,0 +1,77 @@
+//! Bridges the channels of an rdxusb device to SocketCAN interfaces.
+//!
+//! Usage: rdxusb-socketcan VID PID [--serial SERIAL] CHANNEL=INTERFACE...
+//!
+//! e.g. `rdxusb-socketcan 16d0 1279 0=vcan0 1=vcan1`
+
+#[cfg(target_os = "linux")]
+fn main() {
+    use rdxusb::{event_loop::{self, DeviceOptions}, host::OverflowPolicy, socketcan::SocketCanGateway};
+
+    env_logger::init_from_env(env_logger::Env::new().default_filter_or("info"));
+    let usage = "usage: rdxusb-socketcan VID PID [--serial SERIAL] CHANNEL=INTERFACE...";
+
+    let mut args = std::env::args().skip(1);
+    let parse_id = |arg: Option<String>| arg.and_then(|s| u16::from_str_radix(s.trim_start_matches("0x"), 16).ok());
+    let (Some(vid), Some(pid)) = (parse_id(args.next()), parse_id(args.next())) else {
+        eprintln!("{usage}");
+        std::process::exit(2);
+    };
+    let mut serial_number = None;
+    let mut bridges = Vec::new();
+    while let Some(arg) = args.next() {
+        if arg == "--serial" {
+            serial_number = args.next();
+            continue;
+        }
+        match arg.split_once('=').and_then(|(channel, iface)| Some((channel.parse::<u8>().ok()?, iface.to_string()))) {
+            Some(bridge) => bridges.push(bridge),
+            None => {
+                eprintln!("{usage}");
+                std::process::exit(2);
+            }
+        }
+    }
+    if bridges.is_empty() {
+        eprintln!("{usage}");
+        std::process::exit(2);
+    }
+
+    // the gateways read every frame through rx callbacks, so nothing drains the rx queues
+    let options = DeviceOptions { overflow: OverflowPolicy::DropOldest, ..Default::default() };
+    let handle = match event_loop::open_device_ex(vid, pid, serial_number, false, options) {
+        Ok(handle) => handle,
+        Err(e) => {
+            eprintln!("could not open device: {e:?}");
+            std::process::exit(1);
+        }
+    };
+
+    let mut gateways = Vec::new();
+    for (channel, iface) in &bridges {
+        match SocketCanGateway::start(handle, *channel, iface) {
+            Ok(gateway) => gateways.push((*channel, iface, gateway)),
+            Err(e) => {
+                eprintln!("could not bridge channel {channel} to {iface}: {e}");
+                let _ = event_loop::close_device(handle);
+                std::process::exit(1);
+            }
+        }
+        println!("bridging channel {channel} to {iface}");
+    }
+
+    let (stop_tx, stop_rx) = std::sync::mpsc::channel();
+    ctrlc::set_handler(move || { let _ = stop_tx.send(()); }).ok();
+    let _ = stop_rx.recv();
+
+    for (channel, iface, gateway) in gateways {
+        println!("channel {channel} <-> {iface}: {:?}", gateway.stats());
+    }
+    let _ = event_loop::close_device(handle);
+}
+
+#[cfg(not(target_os = "linux"))]
+fn main() {
+    eprintln!("rdxusb-socketcan needs Linux");
+    std::process::exit(1);
+}
@@ -0,0 +1,1016 @@
+//! Sharing one device between processes through shared memory.
+//!
+//! The process that owns a device publishes it with [`crate::event_loop::publish_device`], which creates a
+//! named shared-memory segment for it. Each client process attached to the segment gets a pair of rings there:
+//! an rx ring the owner's rx poller copies every received frame into, and a tx ring the owner drains into its
+//! own tx lanes, so client writes go out through the owner's write poller. Opening the same vid/pid/serial
+//! number in another process finds the segment and attaches to it instead of claiming the interface.
+//!
+//! The rings are single-producer/single-consumer like [`crate::ring`], with their indices and slots in the segment.
+//! Doorbells wake the other side through futexes on Linux; elsewhere waiters poll.
+//!
+//! Sharing is not zero-copy. A received frame is copied into each client's shared rx ring, and the client copies
+//! it out again into a transfer buffer, which its host decodes into the handle's own rx ring like a USB transfer.
+//! That keeps the client's filters, mailboxes, callbacks, stats and mapped rings working as they do for a
+//! device it owns, which reading from the shared ring in place could not.
+
+use std::{collections::VecDeque, ffi::CString, future::Future, io, ptr::NonNull, sync::{atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering}, Arc, Mutex}, time::{Duration, Instant}};
+
+use rdxusb_protocol::{RdxUsbDeviceInfo, RdxUsbPacket, PROTOCOL_VERSION_MAJOR_HS};
+
+#[cfg(feature = "event-loop")]
+use nusb::transfer::{Completion, ControlIn, ControlOut, TransferError};
+#[cfg(feature = "event-loop")]
+use rdxusb_protocol::RdxUsbCtrl;
+#[cfg(feature = "event-loop")]
+use crate::transport::{BulkInQueue, BulkOutQueue, Transport};
+
+/// Most client processes attached to one published device at once.
+pub const MAX_BROKER_CLIENTS: usize = 8;
+/// Largest ring a published device gets per client, in packets.
+pub const MAX_BROKER_RING_CAPACITY: usize = 1 << 16;
+/// Longest either side sleeps before checking that the other is still alive.
+pub const BROKER_WAKE_INTERVAL: Duration = Duration::from_millis(100);
+/// How often a full tx ring is retried.
+pub const BROKER_TX_RETRY: Duration = Duration::from_millis(1);
+
+const MAGIC: u64 = u64::from_le_bytes(*b"RDXBRKR\0");
+const VERSION: u32 = 2;
+
+const SEGMENT_DISCONNECTED: u32 = 0;
+const SEGMENT_CONNECTED: u32 = 1;
+const SEGMENT_CLOSED: u32 = 2;
+
+const CLIENT_FREE: u32 = 0;
+const CLIENT_CLAIMING: u32 = 1;
+const CLIENT_ATTACHED: u32 = 2;
+
+#[repr(C, align(64))]
+struct Padded(AtomicU32);
+
+#[repr(C, align(64))]
+struct SegmentHeader {
+    /// Written last by the owner, so a segment with the magic is fully set up.
+    magic: AtomicU64,
+    version: AtomicU32,
+    owner_pid: AtomicU32,
+    /// Packets per ring. Always a power of two.
+    ring_capacity: AtomicU32,
+    /// One of the `SEGMENT_*` values.
+    state: AtomicU32,
+    /// Channels of the owner's connected device.
+    n_channels: AtomicU32,
+    /// Bumped by clients after queueing tx frames.
+    tx_doorbell: AtomicU32,
+    /// Set while the owner sleeps on the tx doorbell.
+    tx_waiting: AtomicU32,
+}
+
+#[repr(C)]
+struct RingIndices {
+    head: Padded,
+    tail: Padded,
+}
+
+#[repr(C, align(64))]
+struct ClientHeader {
+    /// One of the `CLIENT_*` values.
+    state: AtomicU32,
+    /// The client process. A client claims a free slot by setting this from 0, before touching `state`,
+    /// so a client that dies at any point of claiming leaves its pid behind for [`BrokerServer::reap`].
+    pid: AtomicU32,
+    /// Bumped by the owner after publishing rx frames or changing the device state.
+    rx_doorbell: AtomicU32,
+    /// Set while the client sleeps on the rx doorbell.
+    rx_waiting: AtomicU32,
+    rx: RingIndices,
+    tx: RingIndices,
+}
+
+/// Bytes of the segment per client: its header, then its rx slots, then its tx slots.
+fn client_stride(capacity: usize) -> usize {
+    (core::mem::size_of::<ClientHeader>() + 2 * capacity * core::mem::size_of::<RdxUsbPacket>()).next_multiple_of(64)
+}
+
+fn segment_len(capacity: usize) -> usize {
+    core::mem::size_of::<SegmentHeader>() + MAX_BROKER_CLIENTS * client_stride(capacity)
+}
+
+/// Name of a device's segment. Serial numbers are hashed, since macOS limits names to 31 bytes.
+fn segment_name(vid: u16, pid: u16, serial_number: Option<&str>) -> CString {
+    let name = match serial_number {
+        // FNV-1a
+        Some(serial) => {
+            let hash = serial.bytes().fold(0x811c_9dc5u32, |h, b| (h ^ b as u32).wrapping_mul(0x0100_0193));
+            format!("/rdxusb-{vid:04x}{pid:04x}-{hash:08x}")
+        }
+        None => format!("/rdxusb-{vid:04x}{pid:04x}-any"),
+    };
+    CString::new(name).expect("segment names have no nul bytes")
+}
+
+/// Bumps a doorbell, waking its waiter if it is asleep.
+fn ring(doorbell: &AtomicU32, waiting: &AtomicU32) {
+    doorbell.fetch_add(1, Ordering::SeqCst);
+    if waiting.load(Ordering::SeqCst) != 0 { futex::wake(doorbell); }
+}
+
+/// One side of a ring in the segment.
+struct ShmRing<'a> {
+    indices: &'a RingIndices,
+    slots: *mut RdxUsbPacket,
+    mask: u32,
+}
+
+impl ShmRing<'_> {
+    fn is_empty(&self) -> bool {
+        self.indices.head.0.load(Ordering::Acquire) == self.indices.tail.0.load(Ordering::Acquire)
+    }
+
+    /// Producer side: queues as many packets as fit, returning how many did.
+    fn push_slice(&self, packets: &[RdxUsbPacket]) -> usize {
+        let head = self.indices.head.0.load(Ordering::Relaxed);
+        let tail = self.indices.tail.0.load(Ordering::Acquire);
+        let free = (self.mask + 1 - head.wrapping_sub(tail)) as usize;
+        let n = free.min(packets.len());
+        for (i, packet) in packets[..n].iter().enumerate() {
+            // SAFETY: masked indices are in bounds, and [head, head + n) is outside what the consumer reads
+            unsafe { self.slots.add((head.wrapping_add(i as u32) & self.mask) as usize).write(*packet); }
+        }
+        self.indices.head.0.store(head.wrapping_add(n as u32), Ordering::Release);
+        n
+    }
+
+    /// Consumer side: pops as many packets as fit into `out`.
+    fn pop_into(&self, out: &mut [RdxUsbPacket]) -> usize {
+        let tail = self.indices.tail.0.load(Ordering::Relaxed);
+        let head = self.indices.head.0.load(Ordering::Acquire);
+        let n = (head.wrapping_sub(tail) as usize).min(out.len());
+        for (i, slot) in out[..n].iter_mut().enumerate() {
+            // SAFETY: [tail, head) was published by the producer's release store of head
+            *slot = unsafe { self.slots.add((tail.wrapping_add(i as u32) & self.mask) as usize).read() };
+        }
+        self.indices.tail.0.store(tail.wrapping_add(n as u32), Ordering::Release);
+        n
+    }
+
+    /// Consumer side: hands the queued packets up to the ring's wraparound to `f` in place,
+    /// then pops however many `f` says it took.
+    fn consume(&self, f: &mut impl FnMut(&[RdxUsbPacket]) -> usize) -> usize {
+        let tail = self.indices.tail.0.load(Ordering::Relaxed);
+        let head = self.indices.head.0.load(Ordering::Acquire);
+        let start = (tail & self.mask) as usize;
+        let n = (head.wrapping_sub(tail) as usize).min(self.mask as usize + 1 - start);
+        if n == 0 { return 0; }
+        // SAFETY: as in pop_into, and the producer doesn't touch these slots until tail moves past them
+        let taken = f(unsafe { core::slice::from_raw_parts(self.slots.add(start), n) }).min(n);
+        self.indices.tail.0.store(tail.wrapping_add(taken as u32), Ordering::Release);
+        taken
+    }
+
+    /// Consumer side: drops everything queued.
+    fn clear(&self) {
+        let head = self.indices.head.0.load(Ordering::Acquire);
+        self.indices.tail.0.store(head, Ordering::Release);
+    }
+}
+
+/// A client's header and rings in the segment.
+struct ClientView<'a> {
+    header: &'a ClientHeader,
+    rx: ShmRing<'a>,
+    tx: ShmRing<'a>,
+}
+
+/// A mapped segment.
+struct Segment {
+    base: NonNull<u8>,
+    len: usize,
+    capacity: usize,
+}
+
+// SAFETY: the segment is only accessed through atomics and the ring protocol
+unsafe impl Send for Segment {}
+unsafe impl Sync for Segment {}
+
+impl Segment {
+    /// Maps an existing segment, checking that it is set up and the size it says it is.
+    fn open(name: &CString) -> io::Result<Self> {
+        let (base, len) = shm::open(name)?;
+        let mut segment = Segment { base, len, capacity: 0 };
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not an rdxusb broker segment");
+        if len < core::mem::size_of::<SegmentHeader>() { return Err(invalid()); }
+        let header = segment.header();
+        if header.magic.load(Ordering::Acquire) != MAGIC || header.version.load(Ordering::Relaxed) != VERSION {
+            return Err(invalid());
+        }
+        let capacity = header.ring_capacity.load(Ordering::Relaxed) as usize;
+        if !capacity.is_power_of_two() || capacity > MAX_BROKER_RING_CAPACITY || segment_len(capacity) > len {
+            return Err(invalid());
+        }
+        segment.capacity = capacity;
+        Ok(segment)
+    }
+
+    fn header(&self) -> &SegmentHeader {
+        // SAFETY: every segment is at least a header long, and mappings are page aligned
+        unsafe { &*self.base.as_ptr().cast() }
+    }
+
+    fn client(&self, idx: usize) -> ClientView<'_> {
+        debug_assert!(idx < MAX_BROKER_CLIENTS);
+        // SAFETY: the segment was checked to hold every client's region at this capacity
+        unsafe {
+            let base = self.base.as_ptr().add(core::mem::size_of::<SegmentHeader>() + idx * client_stride(self.capacity));
+            let header = &*base.cast::<ClientHeader>();
+            let slots = base.add(core::mem::size_of::<ClientHeader>()).cast::<RdxUsbPacket>();
+            let mask = self.capacity as u32 - 1;
+            ClientView {
+                header,
+                rx: ShmRing { indices: &header.rx, slots, mask },
+                tx: ShmRing { indices: &header.tx, slots: slots.add(self.capacity), mask },
+            }
+        }
+    }
+
+    fn owner_pid(&self) -> u32 {
+        self.header().owner_pid.load(Ordering::Relaxed)
+    }
+
+    /// Whether the owner is still running and hasn't closed the segment.
+    fn owner_alive(&self) -> bool {
+        self.header().state.load(Ordering::Acquire) != SEGMENT_CLOSED && shm::process_alive(self.owner_pid())
+    }
+
+    /// Opens a device's segment if another process that is still running published it.
+    ///
+    /// Segments this process owns are served in-process, and ones whose owner died are stale.
+    fn open_live(vid: u16, pid: u16, serial_number: Option<&str>) -> io::Result<Option<Self>> {
+        let segment = match Segment::open(&segment_name(vid, pid, serial_number)) {
+            Ok(segment) => segment,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => { return Ok(None); }
+            Err(e) => { return Err(e); }
+        };
+        if segment.owner_pid() == std::process::id() || !segment.owner_alive() { return Ok(None); }
+        Ok(Some(segment))
+    }
+}
+
+impl Drop for Segment {
+    fn drop(&mut self) {
+        // SAFETY: nothing borrows from the segment past its own lifetime
+        unsafe { shm::unmap(self.base, self.len); }
+    }
+}
+
+/// The owner's side of a published device.
+pub struct BrokerServer {
+    segment: Segment,
+    name: CString,
+    /// Set when frames were published since the last [`flush`](Self::flush).
+    dirty: AtomicBool,
+}
+
+impl BrokerServer {
+    /// Creates a device's segment with rings of `ring_capacity` packets, rounded up to a power of two.
+    ///
+    /// A segment left behind by an owner that died is replaced. Fails with [`io::ErrorKind::AlreadyExists`]
+    /// if a running process has the device published.
+    pub fn create(vid: u16, pid: u16, serial_number: Option<&str>, ring_capacity: usize) -> io::Result<Self> {
+        let capacity = ring_capacity.clamp(1, MAX_BROKER_RING_CAPACITY).next_power_of_two();
+        let name = segment_name(vid, pid, serial_number);
+        let len = segment_len(capacity);
+        let base = match shm::create(&name, len) {
+            Err(e) if e.kind() == io::ErrorKind::AlreadyExists => {
+                if Segment::open(&name).is_ok_and(|segment| segment.owner_alive()) { return Err(e); }
+                shm::unlink(&name);
+                shm::create(&name, len)?
+            }
+            base => base?,
+        };
+        let segment = Segment { base, len, capacity };
+        // the segment starts zeroed, so every client slot is free and every ring empty
+        let header = segment.header();
+        header.version.store(VERSION, Ordering::Relaxed);
+        header.owner_pid.store(std::process::id(), Ordering::Relaxed);
+        header.ring_capacity.store(capacity as u32, Ordering::Relaxed);
+        header.magic.store(MAGIC, Ordering::Release);
+        Ok(Self { segment, name, dirty: AtomicBool::new(false) })
+    }
+
+    /// Tells clients whether the owner's device is connected, and its highest channel index (as in the device info).
+    pub fn set_connected(&self, n_channels: Option<u8>) {
+        let header = self.segment.header();
+        let state = match n_channels {
+            Some(n) => {
+                header.n_channels.store(n as u32, Ordering::Relaxed);
+                SEGMENT_CONNECTED
+            }
+            None => SEGMENT_DISCONNECTED,
+        };
+        let _ = header.state.fetch_update(Ordering::AcqRel, Ordering::Acquire, |s| (s != SEGMENT_CLOSED).then_some(state));
+        self.ring_clients();
+    }
+
+    /// Unpublishes the device. Clients see it disconnect, and new ones can't find it.
+    pub fn close(&self) {
+        if self.segment.header().state.swap(SEGMENT_CLOSED, Ordering::AcqRel) == SEGMENT_CLOSED { return; }
+        shm::unlink(&self.name);
+        self.ring_clients();
+    }
+
+    pub fn is_closed(&self) -> bool {
+        self.segment.header().state.load(Ordering::Acquire) == SEGMENT_CLOSED
+    }
+
+    /// Copies a received frame into every attached client's rx ring.
+    ///
+    /// A client whose ring is full misses the frame; the owner never waits on clients.
+    pub fn publish(&self, packet: &RdxUsbPacket) {
+        for idx in 0..MAX_BROKER_CLIENTS {
+            let client = self.segment.client(idx);
+            if client.header.state.load(Ordering::Acquire) != CLIENT_ATTACHED { continue; }
+            client.rx.push_slice(core::slice::from_ref(packet));
+        }
+        self.dirty.store(true, Ordering::Relaxed);
+    }
+
+    /// Wakes clients for the frames published since the last flush. The rx poller calls this once per transfer batch.
+    pub fn flush(&self) {
+        if self.dirty.swap(false, Ordering::Relaxed) { self.ring_clients(); }
+    }
+
+    fn ring_clients(&self) {
+        for idx in 0..MAX_BROKER_CLIENTS {
+            let client = self.segment.client(idx);
+            if client.header.state.load(Ordering::Acquire) != CLIENT_ATTACHED { continue; }
+            ring(&client.header.rx_doorbell, &client.header.rx_waiting);
+        }
+    }
+
+    /// Hands the frames clients wrote to `f` in place, client by client, popping however many `f` says it took.
+    ///
+    /// Returns true if frames were left behind.
+    pub fn drain_tx(&self, mut f: impl FnMut(&[RdxUsbPacket]) -> usize) -> bool {
+        let mut backlog = false;
+        for idx in 0..MAX_BROKER_CLIENTS {
+            let tx = self.segment.client(idx).tx;
+            // frames of a client that detached are still sent, like frames queued before closing a handle
+            while tx.consume(&mut f) > 0 {}
+            backlog |= !tx.is_empty();
+        }
+        backlog
+    }
+
+    /// Sleeps until a client rings the tx doorbell or `timeout` passes, unless frames are already waiting.
+    pub fn wait_tx(&self, timeout: Duration) {
+        let header = self.segment.header();
+        let seen = header.tx_doorbell.load(Ordering::SeqCst);
+        header.tx_waiting.store(1, Ordering::SeqCst);
+        if (0..MAX_BROKER_CLIENTS).all(|idx| self.segment.client(idx).tx.is_empty()) {
+            futex::wait(&header.tx_doorbell, seen, timeout);
+        }
+        header.tx_waiting.store(0, Ordering::Relaxed);
+    }
+
+    /// Frees the slots of clients whose process exited without detaching, dropping what they wrote.
+    ///
+    /// This includes clients that died partway through claiming their slot.
+    pub fn reap(&self) {
+        for idx in 0..MAX_BROKER_CLIENTS {
+            let client = self.segment.client(idx);
+            let pid = client.header.pid.load(Ordering::Acquire);
+            if pid == 0 || shm::process_alive(pid) { continue; }
+            client.tx.clear();
+            client.header.state.store(CLIENT_FREE, Ordering::Release);
+            // only now can another client claim the slot
+            let _ = client.header.pid.compare_exchange(pid, 0, Ordering::AcqRel, Ordering::Relaxed);
+        }
+    }
+}
+
+impl Drop for BrokerServer {
+    fn drop(&mut self) {
+        self.close();
+    }
+}
+
+/// A client process's attachment to a published device.
+pub struct BrokerClient {
+    segment: Segment,
+    idx: usize,
+}
+
+impl BrokerClient {
+    /// Whether another running process has the device published.
+    pub fn published(vid: u16, pid: u16, serial_number: Option<&str>) -> bool {
+        matches!(Segment::open_live(vid, pid, serial_number), Ok(Some(_)))
+    }
+
+    /// Attaches to the device's segment, if another running process has it published.
+    pub fn attach(vid: u16, pid: u16, serial_number: Option<&str>) -> io::Result<Option<Self>> {
+        match Segment::open_live(vid, pid, serial_number)? {
+            Some(segment) => Self::claim(segment).map(Some),
+            None => Ok(None),
+        }
+    }
+
+    fn claim(segment: Segment) -> io::Result<Self> {
+        for idx in 0..MAX_BROKER_CLIENTS {
+            let client = segment.client(idx);
+            if client.header.pid.compare_exchange(0, std::process::id(), Ordering::AcqRel, Ordering::Relaxed).is_err() {
+                continue;
+            }
+            client.header.state.store(CLIENT_CLAIMING, Ordering::Release);
+            // skip whatever the owner published to the slot's last client
+            client.rx.clear();
+            client.header.state.store(CLIENT_ATTACHED, Ordering::Release);
+            return Ok(Self { segment, idx });
+        }
+        Err(io::Error::other("every broker client slot is taken"))
+    }
+
+    fn view(&self) -> ClientView<'_> {
+        self.segment.client(self.idx)
+    }
+
+    pub fn owner_alive(&self) -> bool {
+        self.segment.owner_alive()
+    }
+
+    /// The info of the owner's device while it is connected. The client always speaks the high-speed protocol.
+    pub fn device_info(&self) -> Option<RdxUsbDeviceInfo> {
+        let header = self.segment.header();
+        if header.state.load(Ordering::Acquire) != SEGMENT_CONNECTED { return None; }
+        Some(RdxUsbDeviceInfo {
+            sku: 0,
+            interface_idx: 0,
+            n_channels: header.n_channels.load(Ordering::Relaxed) as u8,
+            protocol_version_major: PROTOCOL_VERSION_MAJOR_HS,
+            protocol_version_minor: 0,
+            reserved: [0; 24],
+        })
+    }
+
+    /// Pops received frames into `out`, returning how many.
+    pub fn read(&self, out: &mut [RdxUsbPacket]) -> usize {
+        self.view().rx.pop_into(out)
+    }
+
+    /// Queues frames for the owner to send, returning how many fit.
+    pub fn write(&self, packets: &[RdxUsbPacket]) -> usize {
+        let n = self.view().tx.push_slice(packets);
+        if n > 0 {
+            let header = self.segment.header();
+            ring(&header.tx_doorbell, &header.tx_waiting);
+        }
+        n
+    }
+
+    /// The rx doorbell's current value, to pass to [`wait_rx`](Self::wait_rx).
+    pub fn rx_doorbell(&self) -> u32 {
+        self.view().header.rx_doorbell.load(Ordering::SeqCst)
+    }
+
+    /// Sleeps until the rx doorbell moves on from `seen` or `timeout` passes.
+    pub fn wait_rx(&self, seen: u32, timeout: Duration) {
+        let header = self.view().header;
+        header.rx_waiting.store(1, Ordering::SeqCst);
+        futex::wait(&header.rx_doorbell, seen, timeout);
+        header.rx_waiting.store(0, Ordering::Relaxed);
+    }
+
+    /// Rings this client's own rx doorbell, waking anything in [`wait_rx`](Self::wait_rx).
+    pub fn ring_rx(&self) {
+        let header = self.view().header;
+        ring(&header.rx_doorbell, &header.rx_waiting);
+    }
+}
+
+impl Drop for BrokerClient {
+    fn drop(&mut self) {
+        let header = self.view().header;
+        header.state.store(CLIENT_FREE, Ordering::Release);
+        // frees the slot for the next claim
+        header.pid.store(0, Ordering::Release);
+    }
+}
+
+/// A handle's publishing state, kept across reconnects like [`crate::capture::CaptureSlot`].
+#[derive(Default)]
+pub struct BrokerSlot {
+    generation: AtomicU64,
+    state: Mutex<BrokerState>,
+}
+
+#[derive(Default)]
+struct BrokerState {
+    server: Option<Arc<BrokerServer>>,
+    /// Channels of the handle's connected device, if any.
+    n_channels: Option<u8>,
+}
+
+impl BrokerSlot {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn is_published(&self) -> bool {
+        self.state.lock().is_ok_and(|state| state.server.is_some())
+    }
+
+    /// Starts publishing through the server `create` makes, unless the handle is published already.
+    ///
+    /// The slot stays locked meanwhile, so concurrent publishes make one server between them.
+    pub fn publish_with<E>(&self, create: impl FnOnce() -> Result<Arc<BrokerServer>, E>) -> Result<(), E> {
+        let Ok(mut state) = self.state.lock() else { return Ok(()); };
+        if state.server.is_some() { return Ok(()); }
+        let server = create()?;
+        server.set_connected(state.n_channels);
+        state.server = Some(server);
+        self.generation.fetch_add(1, Ordering::Release);
+        Ok(())
+    }
+
+    /// Stops publishing. Returns false if the handle wasn't published.
+    pub fn unpublish(&self) -> bool {
+        let Ok(mut state) = self.state.lock() else { return false; };
+        let Some(server) = state.server.take() else { return false; };
+        server.close();
+        self.generation.fetch_add(1, Ordering::Release);
+        true
+    }
+
+    /// Records whether the handle's device is connected, passing it on to clients.
+    pub fn set_connected(&self, n_channels: Option<u8>) {
+        let Ok(mut state) = self.state.lock() else { return; };
+        state.n_channels = n_channels;
+        if let Some(server) = &state.server { server.set_connected(n_channels); }
+    }
+}
+
+/// A poller's cached view of a [`BrokerSlot`], refreshed only when publishing starts or stops.
+#[derive(Default)]
+pub struct BrokerCache {
+    generation: u64,
+    server: Option<Arc<BrokerServer>>,
+}
+
+impl BrokerCache {
+    #[inline]
+    pub fn get(&mut self, slot: &BrokerSlot) -> Option<&Arc<BrokerServer>> {
+        let generation = slot.generation.load(Ordering::Acquire);
+        if generation != self.generation {
+            if let Ok(state) = slot.state.lock() { self.server.clone_from(&state.server); }
+            self.generation = generation;
+        }
+        self.server.as_ref()
+    }
+
+    /// The server as of the last [`get`](Self::get).
+    pub fn server(&self) -> Option<&Arc<BrokerServer>> {
+        self.server.as_ref()
+    }
+}
+
+/// Client state shared by a [`BrokerTransport`]'s clones and its waiter thread.
+#[cfg(feature = "event-loop")]
+struct TransportShared {
+    client: BrokerClient,
+    /// Signalled by the waiter thread whenever the owner rings, and at least every [`BROKER_WAKE_INTERVAL`].
+    rx_ready: tokio::sync::Notify,
+    /// Set by the waiter thread once the owner is gone.
+    owner_gone: AtomicBool,
+    stop: AtomicBool,
+}
+
+#[cfg(feature = "event-loop")]
+impl TransportShared {
+    fn connected(&self) -> bool {
+        !self.owner_gone.load(Ordering::Acquire) && self.client.device_info().is_some()
+    }
+
+    /// Turns rx doorbell rings into `rx_ready` wakeups until the transport is dropped.
+    fn wait_loop(&self) {
+        let mut last_check = Instant::now();
+        while !self.stop.load(Ordering::Acquire) {
+            // read the doorbell before waking the reader, so a ring after it checks the rings isn't slept through
+            let seen = self.client.rx_doorbell();
+            if last_check.elapsed() >= BROKER_WAKE_INTERVAL {
+                if !self.client.owner_alive() { self.owner_gone.store(true, Ordering::Release); }
+                last_check = Instant::now();
+            }
+            self.rx_ready.notify_one();
+            self.client.wait_rx(seen, BROKER_WAKE_INTERVAL);
+        }
+    }
+}
+
+/// Stops the waiter thread once the last transport clone is dropped.
+#[cfg(feature = "event-loop")]
+struct TransportHandle(Arc<TransportShared>);
+
+#[cfg(feature = "event-loop")]
+impl Drop for TransportHandle {
+    fn drop(&mut self) {
+        self.0.stop.store(true, Ordering::Release);
+        self.0.client.ring_rx();
+    }
+}
+
+/// A [`Transport`] over a [`BrokerClient`], so a client handle runs the same host a USB device does.
+///
+/// Control requests other than the device info request stall, since only the owner can make them.
+#[cfg(feature = "event-loop")]
+#[derive(Clone)]
+pub struct BrokerTransport(Arc<TransportHandle>);
+
+#[cfg(feature = "event-loop")]
+impl BrokerTransport {
+    /// Attaches to a device published by another process. See [`BrokerClient::attach`].
+    pub fn attach(vid: u16, pid: u16, serial_number: Option<&str>) -> io::Result<Option<Self>> {
+        let Some(client) = BrokerClient::attach(vid, pid, serial_number)? else { return Ok(None); };
+        let shared = Arc::new(TransportShared {
+            client,
+            rx_ready: tokio::sync::Notify::new(),
+            owner_gone: AtomicBool::new(false),
+            stop: AtomicBool::new(false),
+        });
+        std::thread::Builder::new().name("rdxusb-broker-client".into()).spawn({
+            let shared = shared.clone();
+            move || shared.wait_loop()
+        })?;
+        Ok(Some(Self(Arc::new(TransportHandle(shared)))))
+    }
+
+    fn shared(&self) -> &TransportShared {
+        &self.0.0
+    }
+
+    /// Waits for the owner's device to connect, returning its info, or None once the owner is gone.
+    pub async fn device_info(&self) -> Option<RdxUsbDeviceInfo> {
+        loop {
+            if self.shared().owner_gone.load(Ordering::Acquire) { return None; }
+            if let Some(info) = self.shared().client.device_info() { return Some(info); }
+            self.shared().rx_ready.notified().await;
+        }
+    }
+
+    /// Queues whole frames from the front of `buf`, returning the bytes queued.
+    fn write_bytes(&self, buf: &[u8]) -> usize {
+        let whole = buf.len() / RdxUsbPacket::SIZE * RdxUsbPacket::SIZE;
+        self.shared().client.write(bytemuck::cast_slice(&buf[..whole])) * RdxUsbPacket::SIZE
+    }
+}
+
+#[cfg(feature = "event-loop")]
+impl Transport for BrokerTransport {
+    type BulkIn = BrokerBulkIn;
+    type BulkOut = BrokerBulkOut;
+
+    fn bulk_in_queue(&self, _endpoint: u8) -> Self::BulkIn {
+        BrokerBulkIn { transport: self.clone(), buffers: VecDeque::new() }
+    }
+
+    fn bulk_out_queue(&self, _endpoint: u8) -> Self::BulkOut {
+        BrokerBulkOut { transport: self.clone(), buffers: VecDeque::new() }
+    }
+
+    fn bulk_out(&self, endpoint: u8, buf: Vec<u8>) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        let mut queue = self.bulk_out_queue(endpoint);
+        async move {
+            queue.submit(buf);
+            queue.next_complete().await
+        }
+    }
+
+    fn control_in(&self, data: ControlIn) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        let info = if data.request == RdxUsbCtrl::DeviceInfo as u8 { self.shared().client.device_info() } else { None };
+        let completion = match info {
+            Some(info) => {
+                let mut info = info.encode().to_vec();
+                info.truncate(data.length as usize);
+                Completion { data: info, status: Ok(()) }
+            }
+            None => Completion { data: Vec::new(), status: Err(TransferError::Stall) },
+        };
+        std::future::ready(completion)
+    }
+
+    fn control_out(&self, _data: ControlOut<'_>) -> impl Future<Output = Completion<()>> + Send {
+        std::future::ready(Completion { data: (), status: Err(TransferError::Stall) })
+    }
+}
+
+/// Bulk IN queue of a broker client. Transfers complete as soon as the owner has published frames for them.
+///
+/// Frames are copied out of the shared rx ring into the transfer buffer. See the [module docs](self) for why.
+#[cfg(feature = "event-loop")]
+pub struct BrokerBulkIn {
+    transport: BrokerTransport,
+    buffers: VecDeque<(Vec<u8>, usize)>,
+}
+
+#[cfg(feature = "event-loop")]
+impl BulkInQueue for BrokerBulkIn {
+    fn submit(&mut self, buf: Vec<u8>, len: usize) {
+        self.buffers.push_back((buf, len));
+    }
+
+    fn pending(&self) -> usize {
+        self.buffers.len()
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        // nothing is taken off the queue until it completes, so dropping this future loses nothing
+        async move {
+            loop {
+                let shared = self.transport.shared();
+                let Some((buf, len)) = self.buffers.front_mut() else { return std::future::pending().await; };
+                if !shared.connected() {
+                    let (data, _) = self.buffers.pop_front().expect("front exists");
+                    return Completion { data, status: Err(TransferError::Disconnected) };
+                }
+                buf.resize(*len / RdxUsbPacket::SIZE * RdxUsbPacket::SIZE, 0);
+                let n = shared.client.read(bytemuck::cast_slice_mut(buf));
+                if n > 0 {
+                    buf.truncate(n * RdxUsbPacket::SIZE);
+                    let (data, _) = self.buffers.pop_front().expect("front exists");
+                    return Completion { data, status: Ok(()) };
+                }
+                shared.rx_ready.notified().await;
+            }
+        }
+    }
+}
+
+/// Bulk OUT queue of a broker client. Transfers complete once all their frames are in the tx ring.
+#[cfg(feature = "event-loop")]
+pub struct BrokerBulkOut {
+    transport: BrokerTransport,
+    /// Submitted transfers, with the bytes of each already queued.
+    buffers: VecDeque<(Vec<u8>, usize)>,
+}
+
+#[cfg(feature = "event-loop")]
+impl BrokerBulkOut {
+    /// Queues as much of the submitted transfers as fits, in order.
+    fn fill(&mut self) {
+        for (buf, sent) in self.buffers.iter_mut() {
+            let whole = buf.len() / RdxUsbPacket::SIZE * RdxUsbPacket::SIZE;
+            if *sent < whole { *sent += self.transport.write_bytes(&buf[*sent..whole]); }
+            if *sent < whole { break; }
+        }
+    }
+
+    fn front_done(&self) -> bool {
+        self.buffers.front().is_some_and(|(buf, sent)| *sent >= buf.len() / RdxUsbPacket::SIZE * RdxUsbPacket::SIZE)
+    }
+}
+
+#[cfg(feature = "event-loop")]
+impl BulkOutQueue for BrokerBulkOut {
+    fn submit(&mut self, buf: Vec<u8>) {
+        self.buffers.push_back((buf, 0));
+        self.fill();
+    }
+
+    fn pending(&self) -> usize {
+        self.buffers.len()
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        async move {
+            loop {
+                if self.buffers.is_empty() { return std::future::pending().await; }
+                self.fill();
+                if self.front_done() {
+                    let (mut data, _) = self.buffers.pop_front().expect("front exists");
+                    data.clear();
+                    return Completion { data, status: Ok(()) };
+                }
+                if !self.transport.shared().connected() {
+                    let (data, _) = self.buffers.pop_front().expect("front exists");
+                    return Completion { data, status: Err(TransferError::Disconnected) };
+                }
+                tokio::time::sleep(BROKER_TX_RETRY).await;
+            }
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod futex {
+    use std::{sync::atomic::AtomicU32, time::Duration};
+
+    /// Sleeps while `word` holds `expected`, for at most `timeout`. The futex is shared, so this works across processes.
+    pub fn wait(word: &AtomicU32, expected: u32, timeout: Duration) {
+        let ts = libc::timespec { tv_sec: timeout.as_secs() as libc::time_t, tv_nsec: timeout.subsec_nanos() as libc::c_long };
+        unsafe {
+            libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAIT, expected, &ts as *const libc::timespec);
+        }
+    }
+
+    pub fn wake(word: &AtomicU32) {
+        unsafe {
+            libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAKE, i32::MAX);
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+mod futex {
+    use std::{sync::atomic::{AtomicU32, Ordering}, time::{Duration, Instant}};
+
+    /// Without futexes, waiters check the word at this interval.
+    const POLL_INTERVAL: Duration = Duration::from_millis(1);
+
+    pub fn wait(word: &AtomicU32, expected: u32, timeout: Duration) {
+        let start = Instant::now();
+        while word.load(Ordering::SeqCst) == expected && start.elapsed() < timeout {
+            std::thread::sleep(POLL_INTERVAL);
+        }
+    }
+
+    pub fn wake(_word: &AtomicU32) {}
+}
+
+#[cfg(unix)]
+mod shm {
+    use std::{ffi::CStr, io, ptr::NonNull};
+
+    const MODE: u32 = 0o660;
+
+    fn open_fd(name: &CStr, flags: libc::c_int) -> io::Result<libc::c_int> {
+        #[cfg(target_vendor = "apple")]
+        let fd = unsafe { libc::shm_open(name.as_ptr(), flags, MODE as libc::c_uint) };
+        #[cfg(not(target_vendor = "apple"))]
+        let fd = unsafe { libc::shm_open(name.as_ptr(), flags, MODE as libc::mode_t) };
+        if fd < 0 { return Err(io::Error::last_os_error()); }
+        Ok(fd)
+    }
+
+    fn map(fd: libc::c_int, len: usize) -> io::Result<NonNull<u8>> {
+        if len == 0 { return Err(io::Error::new(io::ErrorKind::InvalidData, "empty segment")); }
+        let ptr = unsafe { libc::mmap(core::ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0) };
+        if ptr == libc::MAP_FAILED { return Err(io::Error::last_os_error()); }
+        NonNull::new(ptr.cast()).ok_or_else(|| io::Error::other("mmap returned null"))
+    }
+
+    /// Creates and maps a zero-filled segment. Fails with `AlreadyExists` if one has the name already.
+    pub fn create(name: &CStr, len: usize) -> io::Result<NonNull<u8>> {
+        let fd = open_fd(name, libc::O_CREAT | libc::O_EXCL | libc::O_RDWR)?;
+        let mapped = if unsafe { libc::ftruncate(fd, len as libc::off_t) } == 0 {
+            map(fd, len)
+        } else {
+            Err(io::Error::last_os_error())
+        };
+        unsafe { libc::close(fd); }
+        if mapped.is_err() { unlink(name); }
+        mapped
+    }
+
+    /// Maps an existing segment, returning it with its length.
+    pub fn open(name: &CStr) -> io::Result<(NonNull<u8>, usize)> {
+        let fd = open_fd(name, libc::O_RDWR)?;
+        let mut stat: libc::stat = unsafe { core::mem::zeroed() };
+        let mapped = if unsafe { libc::fstat(fd, &mut stat) } == 0 {
+            let len = stat.st_size as usize;
+            map(fd, len).map(|base| (base, len))
+        } else {
+            Err(io::Error::last_os_error())
+        };
+        unsafe { libc::close(fd); }
+        mapped
+    }
+
+    pub unsafe fn unmap(base: NonNull<u8>, len: usize) {
+        unsafe { libc::munmap(base.as_ptr().cast(), len); }
+    }
+
+    pub fn unlink(name: &CStr) {
+        unsafe { libc::shm_unlink(name.as_ptr()); }
+    }
+
+    pub fn process_alive(pid: u32) -> bool {
+        if pid == 0 { return false; }
+        unsafe { libc::kill(pid as libc::pid_t, 0) == 0 } || io::Error::last_os_error().raw_os_error() == Some(libc::EPERM)
+    }
+}
+
+#[cfg(not(unix))]
+mod shm {
+    use std::{ffi::CStr, io, ptr::NonNull};
+
+    fn unsupported() -> io::Error {
+        io::Error::new(io::ErrorKind::Unsupported, "broker mode needs POSIX shared memory")
+    }
+
+    pub fn create(_name: &CStr, _len: usize) -> io::Result<NonNull<u8>> {
+        Err(unsupported())
+    }
+
+    pub fn open(_name: &CStr) -> io::Result<(NonNull<u8>, usize)> {
+        Err(unsupported())
+    }
+
+    pub unsafe fn unmap(_base: NonNull<u8>, _len: usize) {}
+
+    pub fn unlink(_name: &CStr) {}
+
+    pub fn process_alive(_pid: u32) -> bool {
+        false
+    }
+}
+
+#[cfg(all(test, unix))]
+mod tests {
+    use bytemuck::Zeroable;
+
+    use super::*;
+
+    #[test]
+    fn frames_round_trip_through_segment() {
+        let serial = format!("broker-test-{}", std::process::id());
+        let server = BrokerServer::create(0xfffe, 0x0001, Some(&serial), 16).unwrap();
+        // attach skips segments owned by this process, so claim a slot directly
+        let client = BrokerClient::claim(Segment::open(&segment_name(0xfffe, 0x0001, Some(&serial))).unwrap()).unwrap();
+
+        assert!(client.device_info().is_none());
+        server.set_connected(Some(2));
+        assert_eq!(client.device_info().unwrap().n_channels, 2);
+
+        let mut packet = RdxUsbPacket::zeroed();
+        packet.arb_id = 0x123;
+        packet.channel = 1;
+        server.publish(&packet);
+        server.flush();
+        let mut out = [RdxUsbPacket::zeroed(); 4];
+        assert_eq!(client.read(&mut out), 1);
+        assert_eq!({ out[0].arb_id }, 0x123);
+        assert_eq!(client.read(&mut out), 0);
+
+        assert_eq!(client.write(&[packet; 3]), 3);
+        let mut sent = 0;
+        assert!(!server.drain_tx(|packets| { sent += packets.len(); packets.len() }));
+        assert_eq!(sent, 3);
+
+        // a full tx ring keeps what the owner couldn't take
+        assert_eq!(client.write(&[packet; 20]), 16);
+        let mut budget = 4;
+        assert!(server.drain_tx(|packets| {
+            let n = packets.len().min(budget);
+            budget -= n;
+            n
+        }));
+
+        drop(client);
+        server.close();
+        assert!(Segment::open(&segment_name(0xfffe, 0x0001, Some(&serial))).is_err());
+    }
+
+    #[test]
+    fn reap_frees_slots_of_dead_clients() {
+        let serial = format!("broker-reap-test-{}", std::process::id());
+        let server = BrokerServer::create(0xfffe, 0x0002, Some(&serial), 16).unwrap();
+        let mut child = std::process::Command::new("true").spawn().unwrap();
+        let dead_pid = child.id();
+        child.wait().unwrap();
+
+        // one client died while claiming its slot, and one after attaching
+        for (idx, state) in [(0, CLIENT_CLAIMING), (1, CLIENT_ATTACHED)] {
+            let header = server.segment.client(idx).header;
+            header.pid.store(dead_pid, Ordering::Relaxed);
+            header.state.store(state, Ordering::Relaxed);
+        }
+        let open = || Segment::open(&segment_name(0xfffe, 0x0002, Some(&serial))).unwrap();
+        assert_eq!(BrokerClient::claim(open()).unwrap().idx, 2);
+
+        server.reap();
+        for idx in 0..2 {
+            let header = server.segment.client(idx).header;
+            assert_eq!((header.pid.load(Ordering::Relaxed), header.state.load(Ordering::Relaxed)), (0, CLIENT_FREE));
+        }
+        assert_eq!(BrokerClient::claim(open()).unwrap().idx, 0);
+    }
+
+    #[test]
+    fn concurrent_publishes_make_one_server() {
+        let serial = format!("broker-publish-test-{}", std::process::id());
+        let slot = BrokerSlot::new();
+        let created = std::sync::atomic::AtomicUsize::new(0);
+        std::thread::scope(|s| {
+            for _ in 0..4 {
+                s.spawn(|| {
+                    slot.publish_with(|| {
+                        created.fetch_add(1, Ordering::Relaxed);
+                        BrokerServer::create(0xfffe, 0x0002, Some(&serial), 16).map(Arc::new)
+                    }).unwrap();
+                });
+            }
+        });
+        assert_eq!(created.load(Ordering::Relaxed), 1);
+        assert!(slot.is_published());
+        assert!(slot.unpublish());
+    }
+}
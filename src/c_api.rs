@@ -1,8 +1,8 @@
-use std::{collections::HashMap, ffi::{c_char, CStr, CString}, sync::{Mutex, OnceLock}};
+use std::{collections::HashMap, ffi::{c_char, c_void, CStr}, sync::{atomic::{AtomicBool, AtomicUsize}, Arc, Mutex, OnceLock}, time::Duration};
 
 use rdxusb_protocol::RdxUsbPacket;
 
-use crate::event_loop::{self, EventLoopError};
+use crate::{callback::RxCallback, compact::Columns, control::{ControlDirection, ControlSetup}, event_loop::{self, DeviceOptions, EventLoopError}, filter::RdxUsbFilter, host::{OverflowPolicy, TxLane}, mailbox::MailboxMode, registry::DEVICE_REGISTRY, ring::RingView, trace, runtime::RuntimeConfig, stats::{ChannelStatsSnapshot, DeviceStatsSnapshot, TransferErrorKind, MAX_STATS_CHANNELS}, virtual_device::VirtualDeviceConfig};
 
 fn to_optional_string(cs: *const c_char) -> Option<String> {
     if cs == core::ptr::null() {
@@ -12,6 +12,85 @@ fn to_optional_string(cs: *const c_char) -> Option<String> {
     }
 }
  
+/// Versioned event loop runtime configuration for rdxusb_init_ex. Like [`RdxUsbOpenOptions`], fields are only ever appended.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbRuntimeConfig {
+    struct_size: u32,
+    worker_threads: u32,
+    single_thread: u32,
+    rt_priority: u32,
+    cpu_affinity: u64,
+    thread_name: *const c_char,
+}
+
+impl RdxUsbRuntimeConfig {
+    fn defaults() -> Self {
+        let config = RuntimeConfig::default();
+        Self {
+            struct_size: core::mem::size_of::<Self>() as u32,
+            worker_threads: config.worker_threads as u32,
+            single_thread: config.single_thread as u32,
+            rt_priority: config.rt_priority,
+            cpu_affinity: config.cpu_affinity,
+            thread_name: core::ptr::null(),
+        }
+    }
+
+    /// Reads a caller-provided config, filling in defaults for fields past `struct_size`.
+    unsafe fn read_from(config: *const RdxUsbRuntimeConfig) -> Result<RuntimeConfig, EventLoopError> {
+        let mut cfg = Self::defaults();
+        let caller_size = unsafe { (*config).struct_size } as usize;
+        let n = caller_size.min(core::mem::size_of::<Self>());
+        if n < core::mem::size_of::<u32>() { return Err(EventLoopError::InvalidArgument); }
+        unsafe { core::ptr::copy_nonoverlapping(config as *const u8, (&mut cfg as *mut Self).cast::<u8>(), n); }
+
+        let defaults = RuntimeConfig::default();
+        Ok(RuntimeConfig {
+            worker_threads: cfg.worker_threads as usize,
+            single_thread: match cfg.single_thread {
+                0 => false,
+                1 => true,
+                _ => { return Err(EventLoopError::InvalidArgument); }
+            },
+            thread_name: to_optional_string(cfg.thread_name).unwrap_or(defaults.thread_name),
+            cpu_affinity: cfg.cpu_affinity,
+            rt_priority: cfg.rt_priority,
+        })
+    }
+}
+
+/// Fills a runtime config struct with the defaults the event loop normally starts with.
+///
+/// Only the fields the caller's version of the struct has are written.
+///
+/// * **config** - the config struct to initialize. Must not be NULL.
+///                The caller must set config->struct_size to sizeof(struct rdxusb_runtime_config) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_runtime_config_init(config: *mut RdxUsbRuntimeConfig) -> i32 {
+    if config.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    unsafe { write_versioned(&RdxUsbRuntimeConfig::defaults(), config) }.map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Starts the rdxusb event loop with a custom runtime configuration.
+///
+/// This must be called before any other rdxusb function that starts the event loop, like rdxusb_open_device.
+///
+/// * **config** - runtime configuration, initialized with rdxusb_runtime_config_init. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_init_ex(config: *const RdxUsbRuntimeConfig) -> i32 {
+    if config.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let config = match unsafe { RdxUsbRuntimeConfig::read_from(config) } {
+        Ok(c) => c,
+        Err(e) => { return e as i32; }
+    };
+    event_loop::init_event_loop(&config).map_or_else(|e| e as i32, |_| 0)
+}
+
 /// Directs rdxusb to open an RdxUsb-compatible device with the associated vid/pid/serial number tuple.
 ///
 /// rdxusb will spawn an event loop that will continually attempt to open a matching device and
@@ -31,6 +110,289 @@ pub extern "C" fn rdxusb_open_device(vid: u16, pid: u16, serial_number: *const c
     event_loop::open_device(vid, pid, serial_number, close_on_dc, buf_size as usize).unwrap_or_else(|e| e as i32)
 }
 
+/// Versioned transport options for rdxusb_open_device_ex.
+///
+/// New fields are only ever appended, and `struct_size` tells rdxusb how many of them the caller knows about.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbOpenOptions {
+    struct_size: u32,
+    overflow_policy: u32,
+    rx_capacity: u64,
+    tx_capacity: u64,
+    in_transfers: u32,
+    out_transfers: u32,
+    timestamp_mode: u32,
+    reconnect_probe_ms: u32,
+    tx_urgent_capacity: u64,
+    tx_bulk_capacity: u64,
+    tx_urgent_below: u32,
+    tx_bulk_from: u32,
+    keep_pending_tx: u32,
+}
+
+impl From<DeviceOptions> for RdxUsbOpenOptions {
+    fn from(value: DeviceOptions) -> Self {
+        Self {
+            struct_size: core::mem::size_of::<Self>() as u32,
+            overflow_policy: value.overflow as u32,
+            rx_capacity: value.rx_capacity as u64,
+            tx_capacity: value.tx_capacity as u64,
+            in_transfers: value.in_transfers as u32,
+            out_transfers: value.out_transfers as u32,
+            timestamp_mode: value.host_timestamps as u32,
+            reconnect_probe_ms: value.reconnect_probe.map_or(0, |d| d.as_millis().clamp(1, u32::MAX as u128) as u32),
+            tx_urgent_capacity: value.tx_urgent_capacity as u64,
+            tx_bulk_capacity: value.tx_bulk_capacity as u64,
+            tx_urgent_below: value.tx_urgent_below,
+            tx_bulk_from: value.tx_bulk_from,
+            keep_pending_tx: value.keep_pending_tx as u32,
+        }
+    }
+}
+
+impl RdxUsbOpenOptions {
+    /// Reads caller-provided options, filling in defaults for fields past `struct_size`.
+    unsafe fn read_from(options: *const RdxUsbOpenOptions) -> Result<DeviceOptions, EventLoopError> {
+        let mut opts = RdxUsbOpenOptions::from(DeviceOptions::default());
+        let caller_size = unsafe { (*options).struct_size } as usize;
+        let n = caller_size.min(core::mem::size_of::<Self>());
+        if n < core::mem::size_of::<u32>() { return Err(EventLoopError::InvalidArgument); }
+        unsafe { core::ptr::copy_nonoverlapping(options as *const u8, (&mut opts as *mut Self).cast::<u8>(), n); }
+
+        Ok(DeviceOptions {
+            rx_capacity: (opts.rx_capacity as usize).max(1),
+            tx_capacity: (opts.tx_capacity as usize).max(1),
+            tx_urgent_capacity: opts.tx_urgent_capacity as usize,
+            tx_bulk_capacity: opts.tx_bulk_capacity as usize,
+            tx_urgent_below: opts.tx_urgent_below,
+            tx_bulk_from: opts.tx_bulk_from,
+            in_transfers: (opts.in_transfers as usize).max(1),
+            out_transfers: (opts.out_transfers as usize).max(1),
+            overflow: OverflowPolicy::try_from(opts.overflow_policy).map_err(|_| EventLoopError::InvalidArgument)?,
+            host_timestamps: match opts.timestamp_mode {
+                0 => false,
+                1 => true,
+                _ => { return Err(EventLoopError::InvalidArgument); }
+            },
+            reconnect_probe: match opts.reconnect_probe_ms {
+                0 => None,
+                ms => Some(Duration::from_millis(ms as u64)),
+            },
+            keep_pending_tx: match opts.keep_pending_tx {
+                0 => false,
+                1 => true,
+                _ => { return Err(EventLoopError::InvalidArgument); }
+            },
+        })
+    }
+}
+
+/// Fills an options struct with the defaults used by rdxusb_open_device_ex.
+///
+/// Only the fields the caller's version of the struct has are written, so callers built against an older header are safe.
+///
+/// * **options** - the options struct to initialize. Must not be NULL.
+///                 The caller must set options->struct_size to sizeof(struct rdxusb_open_options) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_open_options_init(options: *mut RdxUsbOpenOptions) -> i32 {
+    if options.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    unsafe { write_versioned(&RdxUsbOpenOptions::from(DeviceOptions::default()), options) }.map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Like rdxusb_open_device, but with per-device transport tuning.
+///
+/// * **vid** - USB vendor ID to match
+/// * **pid** - USB product ID to match
+/// * **serial_number** - an optional serial number string. This MUST be UTF-8 or NULL.
+/// * **close_on_dc** - if true, closes the device handle on device disconnect
+/// * **options** - transport options, initialized with rdxusb_open_options_init. Must not be NULL.
+///                 These are ignored if the device is already open.
+/// 
+/// Returns a non-negative device handle on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_open_device_ex(vid: u16, pid: u16, serial_number: *const c_char, close_on_dc: bool, options: *const RdxUsbOpenOptions) -> i32 {
+    if options.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let options = match unsafe { RdxUsbOpenOptions::read_from(options) } {
+        Ok(o) => o,
+        Err(e) => { return e as i32; }
+    };
+    let serial_number = to_optional_string(serial_number);
+    event_loop::open_device_ex(vid, pid, serial_number, close_on_dc, options).unwrap_or_else(|e| e as i32)
+}
+
+/// One device of an rdxusb_open_devices call.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbOpenSpec {
+    vid: u16,
+    pid: u16,
+    close_on_dc: bool,
+    serial_number: *const c_char,
+    options: *const RdxUsbOpenOptions,
+}
+
+/// Opens several devices at once, then waits for all of them to connect.
+///
+/// The devices are matched against one scan of the bus, and each is opened concurrently on the event loop,
+/// so this takes about as long as the slowest device rather than the sum of all of them.
+///
+/// * **specs** - the devices to open. Must not be NULL.
+/// * **n_specs** - the number of devices to open.
+/// * **handles** - array of n_specs entries updated with each device's handle, or the negative error
+///                 that opening it failed with. Must not be NULL.
+/// * **timeout_ns** - the maximum time to wait for every device to connect, in nanoseconds. 0 doesn't wait.
+///
+/// Return 0 if every device opened and connected, otherwise the first error, RDXUSB_ERR_DEVICE_NOT_CONNECTED
+/// if a device opened but didn't connect in time. Handles that opened stay open either way.
+#[no_mangle]
+pub extern "C" fn rdxusb_open_devices(specs: *const RdxUsbOpenSpec, n_specs: u64, handles: *mut i32, timeout_ns: u64) -> i32 {
+    if specs.is_null() || handles.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let specs = unsafe { core::slice::from_raw_parts(specs, n_specs as usize) };
+    let handles = unsafe { core::slice::from_raw_parts_mut(handles, n_specs as usize) };
+
+    let mut open_specs = Vec::with_capacity(specs.len());
+    for spec in specs {
+        let options = match unsafe { spec.options.as_ref() } {
+            None => DeviceOptions::default(),
+            Some(options) => match unsafe { RdxUsbOpenOptions::read_from(options) } {
+                Ok(o) => o,
+                Err(e) => { return e as i32; }
+            },
+        };
+        open_specs.push(event_loop::OpenSpec {
+            vid: spec.vid,
+            pid: spec.pid,
+            serial_number: to_optional_string(spec.serial_number),
+            close_on_dc: spec.close_on_dc,
+            options,
+        });
+    }
+    let opened = match event_loop::open_devices(&open_specs) {
+        Ok(h) => h,
+        Err(e) => { return e as i32; }
+    };
+
+    // the devices connect concurrently, so waiting on them in turn only waits for the slowest one
+    let deadline = std::time::Instant::now().checked_add(Duration::from_nanos(timeout_ns));
+    let mut status = 0;
+    for (handle, opened) in handles.iter_mut().zip(opened) {
+        let res = match opened {
+            Ok(h) => {
+                *handle = h;
+                if timeout_ns == 0 { continue; }
+                let remaining = deadline.map_or(Duration::MAX, |d| d.saturating_duration_since(std::time::Instant::now()));
+                event_loop::wait_connected(h, remaining)
+            }
+            Err(e) => {
+                *handle = e as i32;
+                Err(e)
+            }
+        };
+        if let (Err(e), 0) = (res, status) { status = e as i32; }
+    }
+    status
+}
+
+/// Blocks until a device is connected and its handle is usable, returning right away if it already is.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **timeout_ns** - the maximum time to block for, in nanoseconds.
+///
+/// Return 0 once connected, RDXUSB_ERR_DEVICE_NOT_CONNECTED on timeout, other negative values on error
+#[no_mangle]
+pub extern "C" fn rdxusb_wait_connected(handle_id: i32, timeout_ns: u64) -> i32 {
+    event_loop::wait_connected(handle_id, Duration::from_nanos(timeout_ns)).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Versioned virtual device config for rdxusb_configure_virtual_device. Like [`RdxUsbOpenOptions`], fields are only ever appended.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbVirtualDeviceConfig {
+    struct_size: u32,
+    n_channels: u32,
+    rate: u32,
+    burst: u32,
+    id_base: u32,
+    id_count: u32,
+    dlc: u32,
+    echo: u32,
+}
+
+impl From<VirtualDeviceConfig> for RdxUsbVirtualDeviceConfig {
+    fn from(value: VirtualDeviceConfig) -> Self {
+        Self {
+            struct_size: core::mem::size_of::<Self>() as u32,
+            n_channels: value.n_channels as u32,
+            rate: value.rate,
+            burst: value.burst,
+            id_base: value.id_base,
+            id_count: value.id_count,
+            dlc: value.dlc as u32,
+            echo: value.echo as u32,
+        }
+    }
+}
+
+impl RdxUsbVirtualDeviceConfig {
+    /// Reads a caller-provided config, filling in defaults for fields past `struct_size`.
+    unsafe fn read_from(config: *const RdxUsbVirtualDeviceConfig) -> Result<VirtualDeviceConfig, EventLoopError> {
+        let mut cfg = RdxUsbVirtualDeviceConfig::from(VirtualDeviceConfig::default());
+        let caller_size = unsafe { (*config).struct_size } as usize;
+        let n = caller_size.min(core::mem::size_of::<Self>());
+        if n < core::mem::size_of::<u32>() { return Err(EventLoopError::InvalidArgument); }
+        unsafe { core::ptr::copy_nonoverlapping(config as *const u8, (&mut cfg as *mut Self).cast::<u8>(), n); }
+
+        Ok(VirtualDeviceConfig {
+            n_channels: u8::try_from(cfg.n_channels).map_err(|_| EventLoopError::InvalidArgument)?,
+            rate: cfg.rate,
+            burst: cfg.burst,
+            id_base: cfg.id_base,
+            id_count: cfg.id_count,
+            dlc: u8::try_from(cfg.dlc).map_err(|_| EventLoopError::InvalidArgument)?,
+            echo: cfg.echo != 0,
+        })
+    }
+}
+
+/// Fills a virtual device config with the defaults.
+///
+/// Only the fields the caller's version of the struct has are written.
+///
+/// * **config** - the config struct to initialize. Must not be NULL.
+///                The caller must set config->struct_size to sizeof(struct rdxusb_virtual_device_config) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_virtual_device_config_init(config: *mut RdxUsbVirtualDeviceConfig) -> i32 {
+    if config.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    unsafe { write_versioned(&RdxUsbVirtualDeviceConfig::from(VirtualDeviceConfig::default()), config) }.map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Sets what virtual devices opened on a pid generate.
+///
+/// Virtual devices are opened with rdxusb_open_device using the vid RDXUSB_VIRTUAL_VID.
+/// Already open virtual devices keep the config they were opened with.
+///
+/// * **pid** - the product id the config applies to
+/// * **config** - the config, initialized with rdxusb_virtual_device_config_init. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_configure_virtual_device(pid: u16, config: *const RdxUsbVirtualDeviceConfig) -> i32 {
+    if config.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let config = match unsafe { RdxUsbVirtualDeviceConfig::read_from(config) } {
+        Ok(c) => c,
+        Err(e) => { return e as i32; }
+    };
+    match event_loop::configure_virtual_device(pid, config) {
+        Ok(_) => 0,
+        Err(e) => e as i32,
+    }
+}
+
 /// Forces the RdxUsb event loop to rescan USB devices.
 /// 
 /// By default, the RdxUsb event loop will automatically reconnect devices via hotplug, 
@@ -40,7 +402,7 @@ pub extern "C" fn rdxusb_open_device(vid: u16, pid: u16, serial_number: *const c
 #[no_mangle]
 pub extern "C" fn rdxusb_force_scan_devices() -> i32 {
     let Ok(event_loop) = event_loop::try_acquire_event_loop() else { return EventLoopError::ERR_EVENT_LOOP_CRASHED; };
-    match event_loop::force_scan_devices(event_loop) {
+    match event_loop::rescan_devices(event_loop) {
         Ok(_) => 0,
         Err(e) => e as i32,
     }
@@ -60,7 +422,9 @@ pub extern "C" fn rdxusb_force_scan_devices() -> i32 {
 pub extern "C" fn rdxusb_read_packets(handle_id: i32, channel: u8, packets: *mut RdxUsbPacket, max_packets: u64, packets_read: *mut u64) -> i32 {
     if packets.is_null() || packets_read.is_null() { return EventLoopError::ERR_NULL_PTR; }
     let packets = unsafe { core::slice::from_raw_parts_mut(packets, max_packets as usize) };
-    match event_loop::read_packets(handle_id, channel, packets) {
+    let res = event_loop::read_packets(handle_id, channel, packets);
+    trace::rx_returned();
+    match res {
         Ok(w) => {
             unsafe { *packets_read = w as u64; }
             0
@@ -69,7 +433,644 @@ pub extern "C" fn rdxusb_read_packets(handle_id: i32, channel: u8, packets: *mut
     }
 }
 
-/// Writes packets from the specified buffer.
+/// Reads packets into a byte buffer as variable-length compact records: each packet's 16-byte header,
+/// then its dlc data bytes, padded to a multiple of 8 bytes.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the USB channel to read from.
+/// * **buf** - the buffer to read into. Must not be NULL. Should be 8-byte aligned.
+/// * **buf_len** - the size of the buffer in bytes. Packets are read until the next record doesn't fit.
+/// * **bytes_written** - pointer updated with how many bytes of records were written. Must not be NULL.
+/// * **packets_read** - pointer updated with how many packets were read. Can be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_read_packets_compact(handle_id: i32, channel: u8, buf: *mut u8, buf_len: u64, bytes_written: *mut u64, packets_read: *mut u64) -> i32 {
+    if buf.is_null() || bytes_written.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let buf = unsafe { core::slice::from_raw_parts_mut(buf, buf_len as usize) };
+    let res = event_loop::read_packets_compact(handle_id, channel, buf);
+    trace::rx_returned();
+    match res {
+        Ok((bytes, n)) => {
+            unsafe { *bytes_written = bytes as u64; }
+            if let Some(p) = unsafe { packets_read.as_mut() } { *p = n as u64; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// Destination columns for rdxusb_read_packets_columnar. Any column can be NULL to skip it.
+/// Packets are still consumed if every column is NULL.
+#[repr(C)]
+pub struct RdxUsbColumns {
+    timestamps_ns: *mut u64,
+    arb_ids: *mut u32,
+    dlcs: *mut u8,
+    payloads: *mut u8,
+    payload_stride: u64,
+}
+
+/// Reads packets into separate arrays of timestamps, arbitration ids, dlcs and payloads.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the USB channel to read from.
+/// * **columns** - the columns to read into. Must not be NULL. Every non-NULL column must hold max_packets entries,
+///                 and payloads max_packets * payload_stride bytes.
+/// * **max_packets** - the maximum number of packets to read.
+/// * **packets_read** - pointer updated with how many packets were actually read. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_read_packets_columnar(handle_id: i32, channel: u8, columns: *const RdxUsbColumns, max_packets: u64, packets_read: *mut u64) -> i32 {
+    let (Some(c), false) = (unsafe { columns.as_ref() }, packets_read.is_null()) else { return EventLoopError::ERR_NULL_PTR; };
+    let n = max_packets as usize;
+    let stride = c.payload_stride as usize;
+    let Some(payload_len) = n.checked_mul(stride) else { return EventLoopError::ERR_INVALID_ARGUMENT; };
+    let mut columns = unsafe {
+        Columns {
+            timestamps_ns: (!c.timestamps_ns.is_null()).then(|| core::slice::from_raw_parts_mut(c.timestamps_ns, n)),
+            arb_ids: (!c.arb_ids.is_null()).then(|| core::slice::from_raw_parts_mut(c.arb_ids, n)),
+            dlcs: (!c.dlcs.is_null()).then(|| core::slice::from_raw_parts_mut(c.dlcs, n)),
+            payloads: (!c.payloads.is_null()).then(|| core::slice::from_raw_parts_mut(c.payloads, payload_len)),
+            payload_stride: stride,
+        }
+    };
+    let res = event_loop::read_packets_columnar(handle_id, channel, &mut columns, n);
+    trace::rx_returned();
+    match res {
+        Ok(w) => {
+            unsafe { *packets_read = w as u64; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// One read of a rdxusb_read_packets_multi call.
+#[repr(C)]
+pub struct RdxUsbReadRequest {
+    handle_id: i32,
+    channel: u8,
+    reserved: [u8; 3],
+    packets: *mut RdxUsbPacket,
+    max_packets: u64,
+    packets_read: u64,
+    status: i32,
+    reserved2: u32,
+}
+
+/// Reads packets from several handles and channels in one call.
+///
+/// * **requests** - the reads to do. Each gets its packets_read and status filled in. Must not be NULL.
+/// * **n_requests** - the number of requests
+/// * **ready_mask** - pointer updated with a mask that has bit i set if request i read any packets.
+///                    Only the first 64 requests are covered. Can be NULL.
+///
+/// Return 0 on success, negative on error. Errors of individual requests are reported in their status.
+#[no_mangle]
+pub extern "C" fn rdxusb_read_packets_multi(requests: *mut RdxUsbReadRequest, n_requests: u64, ready_mask: *mut u64) -> i32 {
+    if requests.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let requests = unsafe { core::slice::from_raw_parts_mut(requests, n_requests as usize) };
+    let mut reads: Vec<event_loop::ReadRequest> = requests.iter().map(|r| event_loop::ReadRequest {
+        handle_id: r.handle_id,
+        channel: r.channel,
+        packets: if r.packets.is_null() { &mut [] } else { unsafe { core::slice::from_raw_parts_mut(r.packets, r.max_packets as usize) } },
+        result: Err(EventLoopError::None),
+    }).collect();
+    let mask = event_loop::read_packets_multi(&mut reads);
+    trace::rx_returned();
+    for (request, read) in requests.iter_mut().zip(reads) {
+        (request.packets_read, request.status) = match (request.packets.is_null(), read.result) {
+            (true, _) => (0, EventLoopError::ERR_NULL_PTR),
+            (false, Ok(n)) => (n as u64, 0),
+            (false, Err(e)) => (0, e as i32),
+        };
+    }
+    if let Some(ready_mask) = unsafe { ready_mask.as_mut() } { *ready_mask = mask; }
+    0
+}
+
+/// Reads packets into the specified buffer, blocking until at least one packet arrives or the timeout expires.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the USB channel to read from.
+/// * **timeout_ns** - the maximum time to block for, in nanoseconds.
+/// * **packets** - a pointer to the packet buffer to read into. Must not be NULL.
+/// * **max_packets** - the maximum number of packets to read into the packet buffer.
+/// * **packets_read** - pointer updated with how many packets were actually read. Must not be NULL.
+///                      This is 0 if the timeout expired.
+/// 
+/// Return 0 on success (including timeouts), negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_wait_packets(handle_id: i32, channel: u8, timeout_ns: u64, packets: *mut RdxUsbPacket, max_packets: u64, packets_read: *mut u64) -> i32 {
+    if packets.is_null() || packets_read.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let packets = unsafe { core::slice::from_raw_parts_mut(packets, max_packets as usize) };
+    let res = event_loop::wait_packets(handle_id, channel, packets, Duration::from_nanos(timeout_ns));
+    trace::rx_returned();
+    match res {
+        Ok(w) => {
+            unsafe { *packets_read = w as u64; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// Gets an OS event handle that is signalled when packets arrive on any of the device's channels.
+///
+/// On Linux, this is an eventfd. On other unixes, it is the read end of a pipe. 
+/// On Windows, it is a manual-reset event HANDLE. The handle is owned by rdxusb and stays valid until the device is closed.
+///
+/// The event is signalled by the first packet that arrives after any read on the handle.
+/// To use it, call rdxusb_reset_event_handle, then read every channel until it is empty, then wait on the handle again.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **event_handle** - pointer the raw fd/HANDLE gets written to. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_get_event_handle(handle_id: i32, event_handle: *mut i64) -> i32 {
+    if event_handle.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    match event_loop::event_handle(handle_id) {
+        Ok(h) => {
+            unsafe { *event_handle = h; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// Resets the OS event handle returned by rdxusb_get_event_handle.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_reset_event_handle(handle_id: i32) -> i32 {
+    event_loop::reset_event_handle(handle_id).map_or_else(|e| e as i32, |_| 0)
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RdxUsbChannelStats {
+    rx_packets: u64,
+    rx_bytes: u64,
+    rx_dropped_full: u64,
+    rx_evicted: u64,
+    rx_high_water: u64,
+}
+
+impl From<ChannelStatsSnapshot> for RdxUsbChannelStats {
+    fn from(value: ChannelStatsSnapshot) -> Self {
+        Self {
+            rx_packets: value.rx_packets,
+            rx_bytes: value.rx_bytes,
+            rx_dropped_full: value.rx_dropped_full,
+            rx_evicted: value.rx_evicted,
+            rx_high_water: value.rx_high_water,
+        }
+    }
+}
+
+/// Versioned stats struct for rdxusb_get_stats. Like [`RdxUsbOpenOptions`], fields are only ever appended.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbStats {
+    struct_size: u32,
+    n_channels: u32,
+    total: RdxUsbChannelStats,
+    rx_dropped_decode_error: u64,
+    rx_dropped_invalid_channel: u64,
+    tx_accepted: u64,
+    tx_rejected: u64,
+    tx_high_water: u64,
+    usb_errors_cancelled: u64,
+    usb_errors_stall: u64,
+    usb_errors_disconnected: u64,
+    usb_errors_fault: u64,
+    usb_errors_unknown: u64,
+    reconnects: u64,
+    channels: [RdxUsbChannelStats; MAX_STATS_CHANNELS],
+    rx_filtered: u64,
+    tx_rejected_urgent: u64,
+    tx_rejected_normal: u64,
+    tx_rejected_bulk: u64,
+    tx_coalesced: u64,
+}
+
+impl From<DeviceStatsSnapshot> for RdxUsbStats {
+    fn from(value: DeviceStatsSnapshot) -> Self {
+        Self {
+            struct_size: core::mem::size_of::<Self>() as u32,
+            n_channels: value.n_channels,
+            total: value.totals.into(),
+            rx_dropped_decode_error: value.rx_dropped_decode_error,
+            rx_dropped_invalid_channel: value.rx_dropped_invalid_channel,
+            tx_accepted: value.tx_accepted,
+            tx_rejected: value.tx_rejected,
+            tx_high_water: value.tx_high_water,
+            usb_errors_cancelled: value.usb_errors[TransferErrorKind::Cancelled as usize],
+            usb_errors_stall: value.usb_errors[TransferErrorKind::Stall as usize],
+            usb_errors_disconnected: value.usb_errors[TransferErrorKind::Disconnected as usize],
+            usb_errors_fault: value.usb_errors[TransferErrorKind::Fault as usize],
+            usb_errors_unknown: value.usb_errors[TransferErrorKind::Unknown as usize],
+            reconnects: value.reconnects,
+            channels: value.channels.map(RdxUsbChannelStats::from),
+            rx_filtered: value.totals.rx_filtered,
+            tx_rejected_urgent: value.tx_lane_rejected[TxLane::Urgent as usize],
+            tx_rejected_normal: value.tx_lane_rejected[TxLane::Normal as usize],
+            tx_rejected_bulk: value.tx_lane_rejected[TxLane::Bulk as usize],
+            tx_coalesced: value.tx_coalesced,
+        }
+    }
+}
+
+/// Gets a handle's connection generation. This never takes a lock, so it is cheap to poll.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **generation** - pointer the generation gets written to. It is odd while the device is connected
+///                    and changes on every connect and disconnect. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_get_connection_generation(handle_id: i32, generation: *mut u32) -> i32 {
+    if generation.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    match event_loop::connection_generation(handle_id) {
+        Ok(g) => {
+            unsafe { *generation = g; }
+            0
+        }
+        Err(e) => e as i32,
+    }
+}
+
+/// Gets transport statistics for a device handle.
+///
+/// Counters are cumulative since the handle was opened and persist across reconnects.
+/// 
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **stats** - the stats struct to fill in. Must not be NULL. 
+///               The caller must set stats->struct_size to sizeof(struct rdxusb_stats) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_get_stats(handle_id: i32, stats: *mut RdxUsbStats) -> i32 {
+    if stats.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let snapshot = match event_loop::stats(handle_id) {
+        Ok(s) => RdxUsbStats::from(s),
+        Err(e) => { return e as i32; }
+    };
+    unsafe { write_versioned(&snapshot, stats) }.map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Copies a versioned struct (one that starts with a `u32` struct_size) out to the caller.
+///
+/// Only as much as the caller's version of the struct has room for is written, and their struct_size is kept.
+unsafe fn write_versioned<T>(value: &T, out: *mut T) -> Result<(), EventLoopError> {
+    let caller_size = unsafe { *out.cast::<u32>() } as usize;
+    let n = caller_size.min(core::mem::size_of::<T>());
+    if n < core::mem::size_of::<u32>() { return Err(EventLoopError::InvalidArgument); }
+    unsafe {
+        core::ptr::copy_nonoverlapping((value as *const T).cast::<u8>().add(4), out.cast::<u8>().add(4), n - 4);
+    }
+    Ok(())
+}
+
+/// Ring view struct for rdxusb_map_rx_channel. Fields are only ever appended.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct RdxUsbRingView {
+    struct_size: u32,
+    reserved: u32,
+    slots: *mut RdxUsbPacket,
+    capacity: u64,
+    head: *const AtomicUsize,
+    tail: *const AtomicUsize,
+    closed: *const AtomicBool,
+}
+
+impl From<RingView<RdxUsbPacket>> for RdxUsbRingView {
+    fn from(value: RingView<RdxUsbPacket>) -> Self {
+        Self {
+            struct_size: core::mem::size_of::<Self>() as u32,
+            reserved: 0,
+            slots: value.slots,
+            capacity: value.capacity as u64,
+            head: value.head,
+            tail: value.tail,
+            closed: value.closed,
+        }
+    }
+}
+
+/// Maps a channel's rx ring so the caller can read packets in place.
+///
+/// The caller becomes the ring's consumer; see include/rdxusb.h for the exact protocol.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the channel to map
+/// * **view** - the view struct to fill in. Must not be NULL.
+///              The caller must set view->struct_size to sizeof(struct rdxusb_ring_view) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_map_rx_channel(handle_id: i32, channel: u8, view: *mut RdxUsbRingView) -> i32 {
+    if view.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let mapped = match event_loop::map_rx_channel(handle_id, channel) {
+        Ok(v) => RdxUsbRingView::from(v),
+        Err(e) => { return e as i32; }
+    };
+    unsafe { write_versioned(&mapped, view) }.map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Releases a ring mapped with rdxusb_map_rx_channel. Views of it become invalid.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the mapped channel
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_unmap_rx_channel(handle_id: i32, channel: u8) -> i32 {
+    event_loop::unmap_rx_channel(handle_id, channel).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Installs arbitration id acceptance filters on a channel, replacing any previous ones.
+///
+/// A packet is kept if `(arb_id & mask) == (id & mask)` for any filter; everything else is dropped
+/// by the rx poller before it is queued. Filters persist across reconnects.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the channel to filter
+/// * **filters** - the filters to install. May be NULL if n_filters is 0.
+/// * **n_filters** - the number of filters. 0 removes filtering from the channel.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_set_filters(handle_id: i32, channel: u8, filters: *const RdxUsbFilter, n_filters: u64) -> i32 {
+    let filters = if n_filters == 0 {
+        &[][..]
+    } else {
+        if filters.is_null() { return EventLoopError::ERR_NULL_PTR; }
+        unsafe { core::slice::from_raw_parts(filters, n_filters as usize) }
+    };
+    event_loop::set_filters(handle_id, channel, filters).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Makes a handle coalesce the frames it sends whose arbitration id matches any of the filters.
+///
+/// While a coalesced frame is waiting to be sent, a newer frame with the same channel and id overwrites it
+/// instead of queueing behind it, so only the newest payload goes on the wire.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **filters** - the id/mask pairs to coalesce. A mask of 0 coalesces everything. Can be NULL if n_filters is 0.
+/// * **n_filters** - the number of filters. 0 turns coalescing off.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_set_tx_coalescing(handle_id: i32, filters: *const RdxUsbFilter, n_filters: u64) -> i32 {
+    let filters = if n_filters == 0 {
+        &[][..]
+    } else {
+        if filters.is_null() { return EventLoopError::ERR_NULL_PTR; }
+        unsafe { core::slice::from_raw_parts(filters, n_filters as usize) }
+    };
+    event_loop::set_tx_coalescing(handle_id, filters).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Sets the latest-value mailbox mode of a channel.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the channel to configure
+/// * **mode** - one of the RDXUSB_MAILBOX_* defines
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_set_mailbox_mode(handle_id: i32, channel: u8, mode: u32) -> i32 {
+    let Ok(mode) = MailboxMode::try_from(mode) else { return EventLoopError::ERR_INVALID_ARGUMENT; };
+    event_loop::set_mailbox_mode(handle_id, channel, mode).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Reads the newest packet received on a channel with a given arbitration id.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - a channel with a mailbox enabled
+/// * **arb_id** - the arbitration id to look up. Flag bits are ignored.
+/// * **packet** - pointer the packet gets written to. Must not be NULL.
+/// * **age_ns** - pointer updated with the nanoseconds since the packet was received. Can be NULL.
+///
+/// Return 0 on success, RDXUSB_ERR_MAILBOX_EMPTY if nothing was received yet, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_get_latest(handle_id: i32, channel: u8, arb_id: u32, packet: *mut RdxUsbPacket, age_ns: *mut u64) -> i32 {
+    if packet.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    match event_loop::get_latest(handle_id, channel, arb_id) {
+        Ok(Some((latest, age))) => {
+            unsafe {
+                packet.write_unaligned(latest);
+                if !age_ns.is_null() { *age_ns = age.as_nanos() as u64; }
+            }
+            0
+        }
+        Ok(None) => EventLoopError::ERR_MAILBOX_EMPTY,
+        Err(e) => e as i32,
+    }
+}
+
+/// Gets the current time on the host monotonic clock, in nanoseconds.
+#[no_mangle]
+pub extern "C" fn rdxusb_host_time_ns() -> u64 {
+    crate::clock::monotonic_ns()
+}
+
+/// Converts a device timestamp to the host monotonic clock.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **device_ns** - a timestamp_ns from a packet received from the device
+/// * **host_ns** - pointer the converted timestamp gets written to. Must not be NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_device_to_host_time(handle_id: i32, device_ns: u64, host_ns: *mut u64) -> i32 {
+    if host_ns.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    match event_loop::device_to_host_time(handle_id, device_ns) {
+        Ok(t) => {
+            unsafe { *host_ns = t; }
+            0
+        }
+        Err(e) => e as i32,
+    }
+}
+
+/// C rx callback, see rdxusb_set_rx_callback.
+pub type RdxUsbRxCallback = extern "C" fn(user_data: *mut c_void, handle_id: i32, channel: u8, packets: *const RdxUsbPacket, n_packets: u64);
+
+/// Opaque caller data handed back to an rx callback.
+struct UserData(*mut c_void);
+// the caller promises their callback and user data are safe to use from the event loop thread
+unsafe impl Send for UserData {}
+unsafe impl Sync for UserData {}
+
+impl UserData {
+    // a method rather than a field access, so closures capture the whole Send wrapper
+    fn get(&self) -> *mut c_void {
+        self.0
+    }
+}
+
+/// Sets or clears a push-style rx callback on a channel.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **channel** - the channel to receive from
+/// * **callback** - the callback, or NULL to remove the current one
+/// * **user_data** - passed through to the callback unchanged
+/// * **max_batch** - the most packets passed to a single call. 0 is treated as 1.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_set_rx_callback(handle_id: i32, channel: u8, callback: Option<RdxUsbRxCallback>, user_data: *mut c_void, max_batch: u64) -> i32 {
+    let callback = callback.map(|callback| {
+        let user_data = UserData(user_data);
+        RxCallback::new(Box::new(move |channel, packets: &[RdxUsbPacket]| {
+            callback(user_data.get(), handle_id, channel, packets.as_ptr(), packets.len() as u64);
+        }), max_batch as usize)
+    });
+    event_loop::set_rx_callback(handle_id, channel, callback).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Starts sending a packet periodically from the event loop.
+///
+/// Frames that come due while the device is disconnected or the tx queue is full are dropped rather than
+/// sent late. The job runs until it is cancelled or the handle is closed.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **packet** - the packet to send. It is copied, so it can be freed right away. Must not be NULL.
+/// * **period_ns** - the send period in nanoseconds. Must not be 0.
+/// * **phase_ns** - how long from now the first packet is sent, in nanoseconds
+///
+/// Return a non-negative job id on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_schedule_periodic(handle_id: i32, packet: *const RdxUsbPacket, period_ns: u64, phase_ns: u64) -> i32 {
+    let Some(packet) = (unsafe { packet.as_ref() }) else { return EventLoopError::ERR_NULL_PTR; };
+    event_loop::schedule_periodic(handle_id, *packet, Duration::from_nanos(period_ns), Duration::from_nanos(phase_ns)).unwrap_or_else(|e| e as i32)
+}
+
+/// Replaces the data of a periodic job's packet. The next packet the job sends carries the new data.
+///
+/// * **job_id** - a job id returned from rdxusb_schedule_periodic
+/// * **data** - the new data. Can be NULL if dlc is 0.
+/// * **dlc** - the number of data bytes, at most 64
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_update_periodic(job_id: i32, data: *const u8, dlc: u8) -> i32 {
+    let data = match (data.is_null(), dlc) {
+        (_, 0) => &[][..],
+        (true, _) => { return EventLoopError::ERR_NULL_PTR; }
+        (false, dlc) => unsafe { core::slice::from_raw_parts(data, dlc as usize) },
+    };
+    event_loop::update_periodic(job_id, data).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Stops a periodic job.
+///
+/// * **job_id** - a job id returned from rdxusb_schedule_periodic
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_cancel_periodic(job_id: i32) -> i32 {
+    event_loop::cancel_periodic(job_id).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Starts a vendor control request to a device's RdxUsb interface.
+///
+/// Control requests go over the control pipe instead of the bulk endpoints, so they don't compete with packets.
+/// This returns right away; the transfer runs on the event loop, and its result is collected with
+/// rdxusb_control_poll or rdxusb_control_wait. Any number of requests can be in flight at once,
+/// on one device or across devices.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **direction** - RDXUSB_CONTROL_IN or RDXUSB_CONTROL_OUT
+/// * **request** - the vendor request code
+/// * **value** - the request's wValue
+/// * **index** - the request's wIndex
+/// * **data** - for OUT requests, the data to send. It is copied, so it can be freed right away.
+///              Can be NULL if length is 0. Ignored for IN requests.
+/// * **length** - for OUT requests, the number of bytes to send. For IN requests, the most bytes to read.
+///
+/// Return a non-negative request id on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_control_submit(handle_id: i32, direction: u8, request: u8, value: u16, index: u16, data: *const u8, length: u16) -> i32 {
+    let Ok(direction) = ControlDirection::try_from(direction) else { return EventLoopError::ERR_INVALID_ARGUMENT; };
+    let data = match (direction, data.is_null(), length) {
+        (ControlDirection::In, _, _) | (_, _, 0) => &[][..],
+        (_, true, _) => { return EventLoopError::ERR_NULL_PTR; }
+        (_, false, length) => unsafe { core::slice::from_raw_parts(data, length as usize) },
+    };
+    let setup = ControlSetup { direction, request, value, index, length };
+    event_loop::submit_control(handle_id, setup, data).unwrap_or_else(|e| e as i32)
+}
+
+/// Writes a collected control request's result to the caller.
+fn control_result(res: Result<usize, EventLoopError>, transferred: *mut u64) -> i32 {
+    match res {
+        Ok(n) => {
+            if let Some(t) = unsafe { transferred.as_mut() } { *t = n as u64; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// Collects a finished control request without blocking.
+///
+/// Once this returns anything other than RDXUSB_ERR_CONTROL_PENDING, the request id is freed.
+///
+/// * **request_id** - a request id returned from rdxusb_control_submit
+/// * **data** - buffer updated with the data read, or for OUT requests the data sent. Can be NULL if data_len is 0.
+/// * **data_len** - the size of the data buffer. Data past it is cut off.
+/// * **transferred** - pointer updated with the number of bytes transferred, which can exceed data_len. Can be NULL.
+///
+/// Return 0 on success, RDXUSB_ERR_CONTROL_PENDING if the request is still in flight, other negative values on error
+#[no_mangle]
+pub extern "C" fn rdxusb_control_poll(request_id: i32, data: *mut u8, data_len: u64, transferred: *mut u64) -> i32 {
+    let data = match (data.is_null(), data_len) {
+        (_, 0) => &mut [][..],
+        (true, _) => { return EventLoopError::ERR_NULL_PTR; }
+        (false, len) => unsafe { core::slice::from_raw_parts_mut(data, len as usize) },
+    };
+    control_result(event_loop::poll_control(request_id, data), transferred)
+}
+
+/// Collects a control request, blocking until it finishes or the timeout expires.
+///
+/// * **request_id** - a request id returned from rdxusb_control_submit
+/// * **timeout_ns** - the maximum time to block for, in nanoseconds.
+/// * **data** - buffer updated with the data read, or for OUT requests the data sent. Can be NULL if data_len is 0.
+/// * **data_len** - the size of the data buffer. Data past it is cut off.
+/// * **transferred** - pointer updated with the number of bytes transferred, which can exceed data_len. Can be NULL.
+///
+/// Return 0 on success, RDXUSB_ERR_CONTROL_PENDING on timeout, other negative values on error
+#[no_mangle]
+pub extern "C" fn rdxusb_control_wait(request_id: i32, timeout_ns: u64, data: *mut u8, data_len: u64, transferred: *mut u64) -> i32 {
+    let data = match (data.is_null(), data_len) {
+        (_, 0) => &mut [][..],
+        (true, _) => { return EventLoopError::ERR_NULL_PTR; }
+        (false, len) => unsafe { core::slice::from_raw_parts_mut(data, len as usize) },
+    };
+    control_result(event_loop::wait_control(request_id, Duration::from_nanos(timeout_ns), data), transferred)
+}
+
+/// Abandons a control request and frees its id, cancelling the transfer if it hasn't finished.
+///
+/// * **request_id** - a request id returned from rdxusb_control_submit
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_control_cancel(request_id: i32) -> i32 {
+    event_loop::cancel_control(request_id).map_or_else(|e| e as i32, |_| 0)
+}
+
+/// Writes packets from the specified buffer, each into the tx lane its id maps to.
 ///
 /// * **handle_id** - a handle id returned from rdxusb_open_device
 /// * **packets** - a pointer to the packet buffer to write from. Must not be NULL.
@@ -82,7 +1083,10 @@ pub extern "C" fn rdxusb_write_packets(handle_id: i32, packets: *const RdxUsbPac
     if packets.is_null() { return EventLoopError::ERR_NULL_PTR; }
 
     let packets = unsafe { core::slice::from_raw_parts(packets, packets_len as usize) };
-    match event_loop::write_packets(handle_id, packets) {
+    trace::tx_entry();
+    let res = event_loop::write_packets(handle_id, packets);
+    trace::tx_returned();
+    match res {
         Ok(w) => {
             unsafe { 
                 match packets_written.as_mut() {
@@ -96,6 +1100,271 @@ pub extern "C" fn rdxusb_write_packets(handle_id: i32, packets: *const RdxUsbPac
     }
 }
 
+/// Writes packets into one tx priority lane, regardless of the lanes their ids map to.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **lane** - one of the RDXUSB_TX_LANE_* defines. Writes to a lane with no capacity write nothing.
+/// * **packets** - a pointer to the packet buffer to write from. Must not be NULL.
+/// * **packets_len** - the number of packets to write from the packet buffer.
+/// * **packets_written** - pointer updated with how many packets were actually written. Can be NULL.
+/// 
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_write_packets_lane(handle_id: i32, lane: u32, packets: *const RdxUsbPacket, packets_len: u64, packets_written: *mut u64) -> i32 {
+    if packets.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let Ok(lane) = TxLane::try_from(lane) else { return EventLoopError::ERR_INVALID_ARGUMENT; };
+
+    let packets = unsafe { core::slice::from_raw_parts(packets, packets_len as usize) };
+    trace::tx_entry();
+    let res = event_loop::write_packets_lane(handle_id, Some(lane), packets);
+    trace::tx_returned();
+    match res {
+        Ok(w) => {
+            if let Some(p) = unsafe { packets_written.as_mut() } { *p = w as u64; }
+            0
+        }
+        Err(e) => { e as i32 }
+    }
+}
+
+/// One write of a rdxusb_write_packets_multi call.
+#[repr(C)]
+pub struct RdxUsbWriteRequest {
+    handle_id: i32,
+    reserved: u32,
+    packets: *const RdxUsbPacket,
+    n_packets: u64,
+    packets_written: u64,
+    status: i32,
+    reserved2: u32,
+}
+
+/// Writes packets to several handles in one call.
+///
+/// * **requests** - the writes to do. Each gets its packets_written and status filled in. Must not be NULL.
+/// * **n_requests** - the number of requests
+///
+/// Return 0 on success, negative on error. Errors of individual requests are reported in their status.
+#[no_mangle]
+pub extern "C" fn rdxusb_write_packets_multi(requests: *mut RdxUsbWriteRequest, n_requests: u64) -> i32 {
+    if requests.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    trace::tx_entry();
+    let requests = unsafe { core::slice::from_raw_parts_mut(requests, n_requests as usize) };
+    let mut writes: Vec<event_loop::WriteRequest> = requests.iter().map(|r| event_loop::WriteRequest {
+        handle_id: r.handle_id,
+        packets: if r.packets.is_null() { &[] } else { unsafe { core::slice::from_raw_parts(r.packets, r.n_packets as usize) } },
+        result: Err(EventLoopError::None),
+    }).collect();
+    event_loop::write_packets_multi(&mut writes);
+    trace::tx_returned();
+    for (request, write) in requests.iter_mut().zip(writes) {
+        (request.packets_written, request.status) = match (request.packets.is_null(), write.result) {
+            (true, _) => (0, EventLoopError::ERR_NULL_PTR),
+            (false, Ok(n)) => (n as u64, 0),
+            (false, Err(e)) => (0, e as i32),
+        };
+    }
+    0
+}
+
+/// Stage latency summary for rdxusb_get_latency_histogram. Like [`RdxUsbOpenOptions`], fields are only ever appended.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RdxUsbLatencyHistogram {
+    struct_size: u32,
+    stage: u32,
+    count: u64,
+    sum_ns: u64,
+    max_ns: u64,
+    p50_ns: u64,
+    p99_ns: u64,
+    p999_ns: u64,
+}
+
+/// Gets the latency histogram of one hot path stage.
+///
+/// This needs rdxusb built with the `latency-trace` feature, and fails with ERR_TRACING_DISABLED otherwise.
+///
+/// * **stage** - one of the RDXUSB_TRACE_STAGE_* defines
+/// * **histogram** - the histogram struct to fill in. Must not be NULL.
+///                   The caller must set histogram->struct_size to sizeof(struct rdxusb_latency_histogram) first.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_get_latency_histogram(stage: u32, histogram: *mut RdxUsbLatencyHistogram) -> i32 {
+    if histogram.is_null() { return EventLoopError::ERR_NULL_PTR; }
+    let Ok(_stage) = trace::Stage::try_from(stage) else { return EventLoopError::ERR_INVALID_ARGUMENT; };
+    #[cfg(feature = "latency-trace")]
+    {
+        let snapshot = trace::histogram(_stage);
+        let summary = RdxUsbLatencyHistogram {
+            struct_size: core::mem::size_of::<RdxUsbLatencyHistogram>() as u32,
+            stage,
+            count: snapshot.count,
+            sum_ns: snapshot.sum_ns,
+            max_ns: snapshot.max_ns,
+            p50_ns: snapshot.percentile(0.50),
+            p99_ns: snapshot.percentile(0.99),
+            p999_ns: snapshot.percentile(0.999),
+        };
+        unsafe { write_versioned(&summary, histogram) }.map_or_else(|e| e as i32, |_| 0)
+    }
+    #[cfg(not(feature = "latency-trace"))]
+    EventLoopError::ERR_TRACING_DISABLED
+}
+
+/// Clears every latency histogram and the sampled trace spans.
+///
+/// Return 0 on success, negative on error. Fails with ERR_TRACING_DISABLED without the `latency-trace` feature.
+#[no_mangle]
+pub extern "C" fn rdxusb_reset_latency_histograms() -> i32 {
+    #[cfg(feature = "latency-trace")]
+    {
+        trace::reset();
+        0
+    }
+    #[cfg(not(feature = "latency-trace"))]
+    EventLoopError::ERR_TRACING_DISABLED
+}
+
+/// Keeps every Nth frame's stage timestamps for rdxusb_export_trace.
+///
+/// * **interval** - keep one frame in this many. 0 turns sampling off, which is the default.
+///
+/// Return 0 on success, negative on error. Fails with ERR_TRACING_DISABLED without the `latency-trace` feature.
+#[no_mangle]
+pub extern "C" fn rdxusb_set_trace_sample_interval(interval: u32) -> i32 {
+    #[cfg(feature = "latency-trace")]
+    {
+        trace::set_sample_interval(interval);
+        0
+    }
+    #[cfg(not(feature = "latency-trace"))]
+    {
+        let _ = interval;
+        EventLoopError::ERR_TRACING_DISABLED
+    }
+}
+
+/// Writes the sampled frames to a Chrome trace event file, viewable in Perfetto or chrome://tracing, and clears them.
+///
+/// * **path** - path of the trace file, created or truncated. This MUST be UTF-8 and not NULL.
+///
+/// Return 0 on success, negative on error. Fails with ERR_TRACING_DISABLED without the `latency-trace` feature.
+#[no_mangle]
+pub extern "C" fn rdxusb_export_trace(path: *const c_char) -> i32 {
+    let _path = match to_path(path) {
+        Ok(p) => p,
+        Err(e) => { return e; }
+    };
+    #[cfg(feature = "latency-trace")]
+    {
+        match trace::export_chrome_trace(&_path) {
+            Ok(_) => 0,
+            Err(e) => {
+                log::trace!(target: "rdxusb", "Could not export trace to {_path:?}: {e}");
+                EventLoopError::ERR_CAPTURE_IO
+            }
+        }
+    }
+    #[cfg(not(feature = "latency-trace"))]
+    EventLoopError::ERR_TRACING_DISABLED
+}
+
+fn to_path(path: *const c_char) -> Result<std::path::PathBuf, i32> {
+    if path.is_null() { return Err(EventLoopError::ERR_NULL_PTR); }
+    let path = unsafe { CStr::from_ptr(path) }.to_str().map_err(|_e| EventLoopError::ERR_INVALID_ARGUMENT)?;
+    Ok(path.into())
+}
+
+/// Starts capturing every frame a handle sends and receives to a file, replacing any running capture.
+///
+/// Frames are buffered and written by a background thread, so capturing does not slow down the device.
+/// If the writer falls behind, frames are dropped from the capture rather than from the device.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **path** - path of the capture file, created or truncated. This MUST be UTF-8 and not NULL.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_start_capture(handle_id: i32, path: *const c_char) -> i32 {
+    let path = match to_path(path) {
+        Ok(p) => p,
+        Err(e) => { return e; }
+    };
+    match event_loop::start_capture(handle_id, &path) {
+        Ok(_) => 0,
+        Err(e) => e as i32,
+    }
+}
+
+/// Stops a handle's capture and finishes writing the file. Stopping a handle with no capture running does nothing.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_stop_capture(handle_id: i32) -> i32 {
+    match event_loop::stop_capture(handle_id) {
+        Ok(_) => 0,
+        Err(e) => e as i32,
+    }
+}
+
+/// Publishes a handle's device to other processes through shared memory.
+///
+/// Calling rdxusb_open_device with the same vid/pid/serial number in another process then attaches to this
+/// handle instead of claiming the device: it reads every frame this handle receives, and its writes go out
+/// through this handle's tx queues. Control requests can only be made from this process.
+/// Publishing lasts across reconnects, until rdxusb_unpublish_device or until the handle is closed.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+/// * **ring_capacity** - packets buffered per attached process in each direction. 0 picks the default.
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_publish_device(handle_id: i32, ring_capacity: u64) -> i32 {
+    let ring_capacity = if ring_capacity == 0 { event_loop::DEFAULT_QUEUE_CAPACITY } else { ring_capacity as usize };
+    match event_loop::publish_device(handle_id, ring_capacity) {
+        Ok(_) => 0,
+        Err(e) => e as i32,
+    }
+}
+
+/// Stops publishing a handle's device. Attached processes see the device disconnect.
+///
+/// * **handle_id** - a handle id returned from rdxusb_open_device
+///
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_unpublish_device(handle_id: i32) -> i32 {
+    match event_loop::unpublish_device(handle_id) {
+        Ok(_) => 0,
+        Err(e) => e as i32,
+    }
+}
+
+/// Opens a handle that plays back the received frames of a capture file.
+///
+/// The frames are read with rdxusb_read_packets and friends, on the channel they were captured on.
+/// Replay never drops frames: it waits for room in the rx buffers, so every channel in the capture must be read.
+/// Writes to a replay handle fail. Once the capture ends, rdxusb_get_connection_generation reports the handle
+/// as disconnected, but the buffered frames stay readable until the handle is closed with rdxusb_close_device.
+///
+/// * **path** - path of a capture file written by rdxusb_start_capture. This MUST be UTF-8 and not NULL.
+/// * **speed** - playback speed relative to the original timing, e.g. 1.0 for real time. 0 plays as fast as possible.
+/// * **buf_size** - the maximum number of packets to buffer per channel
+///
+/// Returns a non-negative device handle on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_open_replay(path: *const c_char, speed: f64, buf_size: u64) -> i32 {
+    let path = match to_path(path) {
+        Ok(p) => p,
+        Err(e) => { return e; }
+    };
+    event_loop::open_replay(&path, speed, buf_size as usize).unwrap_or_else(|e| e as i32)
+}
+
 /// Closes the specified device, and stops reading from it.
 ///
 /// If the handle ID is already closed or invalid, this returns 0.
@@ -121,14 +1390,14 @@ pub extern "C" fn rdxusb_close_all_devices() -> i32 {
 // Device Iterators --------
 
 struct DeviceInfos {
-    info_map: HashMap<u64, Vec<nusb::DeviceInfo>>,
+    info_map: HashMap<u64, Vec<Arc<nusb::DeviceInfo>>>,
     next_idx: u64,
 }
 impl DeviceInfos {
     pub fn new() -> Self {
         Self { info_map: HashMap::new(), next_idx: 0 }
     }
-    pub fn allocate_idx_and_insert(&mut self, devices: Vec<nusb::DeviceInfo>) -> u64 {
+    pub fn allocate_idx_and_insert(&mut self, devices: Vec<Arc<nusb::DeviceInfo>>) -> u64 {
         let idx = self.next_idx;
         self.info_map.insert(idx, devices);
         self.next_idx += 1;
@@ -153,12 +1422,13 @@ pub struct RdxUsbDeviceEntry {
     device_address: u8,
 }
 
-fn strncpy_into_buf(s: &CStr, dest: &mut [u8]) {
+/// Copies a string into a fixed-size, null-terminated buffer, truncating it at any interior null.
+fn strncpy_into_buf(s: &str, dest: &mut [u8]) {
     let max_len = dest.len() - 1;
-    let full_buf = s.to_bytes_with_nul();
-    let copy_buf = &full_buf[..full_buf.len().min(max_len)];
-    dest[..copy_buf.len()].copy_from_slice(copy_buf);
-    dest[max_len] = 0;
+    let bytes = s.as_bytes();
+    let len = bytes.iter().position(|&b| b == 0).unwrap_or(bytes.len()).min(max_len);
+    dest[..len].copy_from_slice(&bytes[..len]);
+    dest[len] = 0;
 }
 
 /// Creates a new USB device iterator.
@@ -169,16 +1439,36 @@ fn strncpy_into_buf(s: &CStr, dest: &mut [u8]) {
 /// Return 0 on success, negative on error
 #[no_mangle]
 pub extern "C" fn rdxusb_new_device_iterator(iter_id: *mut u64, n_devices: *mut u64) -> i32 {
+    rdxusb_new_device_iterator_filtered(0, 0, iter_id, n_devices)
+}
+
+/// Creates a new USB device iterator over only the devices with a given vid and pid.
+/// 
+/// * **vid** - USB vendor ID to match, or 0 to match any
+/// * **pid** - USB product ID to match, or 0 to match any
+/// * **iter_id** - pointer where the iterator handle will be written
+/// * **n_devices** - the number of USB devices available to the iterator
+/// 
+/// Return 0 on success, negative on error
+#[no_mangle]
+pub extern "C" fn rdxusb_new_device_iterator_filtered(vid: u16, pid: u16, iter_id: *mut u64, n_devices: *mut u64) -> i32 {
     if iter_id.is_null() || n_devices.is_null() {
         return EventLoopError::ERR_NULL_PTR;
     }
 
+    let snapshot = match DEVICE_REGISTRY.snapshot() {
+        Ok(s) => s,
+        Err(e) => { return e as i32; }
+    };
+    let devices: Vec<Arc<nusb::DeviceInfo>> = snapshot.iter()
+        .filter(|d| (vid == 0 || d.vendor_id() == vid) && (pid == 0 || d.product_id() == pid))
+        .cloned()
+        .collect();
+    let devices_count = devices.len() as u64;
+
     DEVICE_INFOS.lock().unwrap().get_or_init(DeviceInfos::new);
     let Ok(mut info_lock) = DEVICE_INFOS.lock() else { return EventLoopError::ERR_EVENT_LOOP_CRASHED; };
     let infos = info_lock.get_mut().unwrap();
-    let Ok(device_iter) = nusb::list_devices() else { return EventLoopError::ERR_CANNOT_LIST_DEVICES; };
-    let devices: Vec<nusb::DeviceInfo> = device_iter.collect();
-    let devices_count = devices.len() as u64;
     let idx = infos.allocate_idx_and_insert(devices);
     unsafe {
         *iter_id = idx;
@@ -212,12 +1502,9 @@ pub extern "C" fn rdxusb_get_device_in_iterator(iter_id: u64, device_idx: u64, d
 
     let device_entry = unsafe { &mut *device_entry };
 
-    let serial_str = CString::new(device_ent.serial_number().unwrap_or("")).unwrap_or(c"".into());
-    let mfg_str = CString::new(device_ent.manufacturer_string().unwrap_or("")).unwrap_or(c"".into());
-    let prod_str = CString::new(device_ent.product_string().unwrap_or("")).unwrap_or(c"".into());
-    strncpy_into_buf(serial_str.as_c_str(), &mut device_entry.serial);
-    strncpy_into_buf(mfg_str.as_c_str(), &mut device_entry.manufacturer);
-    strncpy_into_buf(prod_str.as_c_str(), &mut device_entry.product_str);
+    strncpy_into_buf(device_ent.serial_number().unwrap_or(""), &mut device_entry.serial);
+    strncpy_into_buf(device_ent.manufacturer_string().unwrap_or(""), &mut device_entry.manufacturer);
+    strncpy_into_buf(device_ent.product_string().unwrap_or(""), &mut device_entry.product_str);
 
     device_entry.vid = device_ent.vendor_id();
     device_entry.pid = device_ent.product_id();
@@ -238,4 +1525,40 @@ pub extern "C" fn rdxusb_free_device_iterator(iter_id: u64) -> i32 {
     let infos = info_lock.get_mut().unwrap();
     infos.free_idx(iter_id);
     0
-}
\ No newline at end of file
+}
+#[cfg(test)]
+mod tests {
+    use std::{io::Write, path::Path, process::{Command, Stdio}};
+
+    /// Compiles a translation unit that only includes `header`, returning None if there is no such compiler.
+    fn compile_alone(compiler: &str, args: &[&str], header: &str) -> Option<std::process::Output> {
+        let include = Path::new(env!("CARGO_MANIFEST_DIR")).join("include");
+        let mut child = Command::new(compiler)
+            .args(args)
+            .arg("-I").arg(include)
+            .args(["-fsyntax-only", "-Wall", "-Wextra", "-Werror", "-"])
+            .stdin(Stdio::piped())
+            .stderr(Stdio::piped())
+            .spawn()
+            .ok()?;
+        child.stdin.take()?.write_all(format!("#include \"{header}\"\n").as_bytes()).ok()?;
+        child.wait_with_output().ok()
+    }
+
+    #[test]
+    fn headers_compile_on_their_own() {
+        let cc = std::env::var("CC").unwrap_or_else(|_| "cc".into());
+        let cxx = std::env::var("CXX").unwrap_or_else(|_| "c++".into());
+        for (compiler, args, header) in [
+            (cc.as_str(), &["-x", "c", "-std=c99"][..], "rdxusb.h"),
+            (cxx.as_str(), &["-x", "c++", "-std=c++20"][..], "rdxusb.h"),
+            (cxx.as_str(), &["-x", "c++", "-std=c++20"][..], "rdxusb.hpp"),
+        ] {
+            let Some(output) = compile_alone(compiler, args, header) else {
+                eprintln!("skipping {header}: no {compiler}");
+                continue;
+            };
+            assert!(output.status.success(), "{header} does not compile with {compiler}:\n{}", String::from_utf8_lossy(&output.stderr));
+        }
+    }
+}
@@ -0,0 +1,164 @@
+//! Push-style rx callbacks, run by the rx poller in batches.
+
+use std::{cell::Cell, sync::{atomic::{AtomicBool, Ordering}, Arc, Mutex}};
+
+use rdxusb_protocol::RdxUsbPacket;
+
+use crate::channel_table::{ChannelTable, ChannelTableCache};
+
+/// Receives a contiguous batch of packets from one channel.
+pub type RxCallbackFn = dyn Fn(u8, &[RdxUsbPacket]) + Send + Sync;
+
+thread_local! {
+    /// The callback this thread is running, so retiring it from inside itself doesn't wait on itself.
+    static CALLING: Cell<*const RxCallback> = const { Cell::new(std::ptr::null()) };
+}
+
+/// A channel's rx callback.
+pub struct RxCallback {
+    func: Box<RxCallbackFn>,
+    max_batch: usize,
+    /// Held for the duration of each call.
+    running: Mutex<()>,
+    /// Set once the callback has been replaced or removed.
+    retired: AtomicBool,
+}
+
+impl RxCallback {
+    /// `max_batch` bounds how many packets a single call receives.
+    pub fn new(func: Box<RxCallbackFn>, max_batch: usize) -> Self {
+        Self { func, max_batch: max_batch.max(1), running: Mutex::new(()), retired: AtomicBool::new(false) }
+    }
+
+    /// Calls the callback, unless it has been retired.
+    fn call(&self, channel: u8, packets: &[RdxUsbPacket]) {
+        let Ok(_running) = self.running.lock() else { return; };
+        if self.retired.load(Ordering::Acquire) { return; }
+        let outer = CALLING.with(|c| c.replace(self));
+        (self.func)(channel, packets);
+        CALLING.with(|c| c.set(outer));
+    }
+
+    /// Stops the callback from being called again, waiting out a call in progress on another thread.
+    ///
+    /// Retiring a callback from inside itself doesn't wait, but it still isn't called again once it returns.
+    pub fn retire(&self) {
+        self.retired.store(true, Ordering::Release);
+        if CALLING.with(|c| std::ptr::eq(c.get(), self)) { return; }
+        drop(self.running.lock());
+    }
+}
+
+/// Per-channel rx callbacks for a device, shared between the handle and its rx poller.
+pub type RxCallbacks = ChannelTable<RxCallback>;
+
+impl ChannelTable<RxCallback> {
+    /// Sets or clears a channel's callback.
+    ///
+    /// Once this returns, the previous callback isn't running and won't be called again.
+    pub fn set(&self, channel: u8, callback: Option<RxCallback>) {
+        let old = self.update(channel, |entry| std::mem::replace(entry, callback.map(Arc::new))).flatten();
+        if let Some(old) = old { old.retire(); }
+    }
+
+    /// Clears every channel's callback, with the same guarantee as [`Self::set`].
+    pub fn clear(&self) {
+        for old in self.take_all() { old.retire(); }
+    }
+}
+
+/// Collects packets for rx callbacks so each poll iteration delivers one batch per channel.
+#[derive(Default)]
+pub struct CallbackBatcher {
+    callbacks: ChannelTableCache<RxCallback>,
+    batches: Vec<Vec<RdxUsbPacket>>,
+}
+
+impl CallbackBatcher {
+    /// Queues a packet for the channel's callback, if it has one.
+    ///
+    /// The batch is delivered early if it reaches the callback's `max_batch`.
+    #[inline]
+    pub fn push(&mut self, callbacks: &RxCallbacks, channel: u8, packet: impl FnOnce() -> RdxUsbPacket) {
+        let Some(callback) = self.callbacks.get(callbacks, channel) else { return; };
+        let idx = channel as usize;
+        if self.batches.len() <= idx { self.batches.resize_with(idx + 1, Vec::new); }
+        let batch = &mut self.batches[idx];
+        batch.push(packet());
+        if batch.len() >= callback.max_batch {
+            callback.call(channel, batch);
+            batch.clear();
+        }
+    }
+
+    /// Delivers every pending batch.
+    pub fn flush(&mut self, callbacks: &RxCallbacks) {
+        for (idx, batch) in self.batches.iter_mut().enumerate() {
+            if batch.is_empty() { continue; }
+            // a batch whose callback was removed in the meantime is dropped, and one whose callback was
+            // replaced goes to the new callback
+            if let Some(callback) = self.callbacks.get(callbacks, idx as u8) {
+                callback.call(idx as u8, batch);
+            }
+            batch.clear();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicUsize;
+    use crate::test_util::packet;
+
+    fn counter(count: &Arc<AtomicUsize>, max_batch: usize) -> RxCallback {
+        let count = count.clone();
+        RxCallback::new(Box::new(move |_, packets| { count.fetch_add(packets.len(), Ordering::Relaxed); }), max_batch)
+    }
+
+    #[test]
+    fn flush_goes_to_the_current_callback() {
+        let callbacks = RxCallbacks::new();
+        let (old, new) = (Arc::new(AtomicUsize::new(0)), Arc::new(AtomicUsize::new(0)));
+        let mut batcher = CallbackBatcher::default();
+
+        callbacks.set(1, Some(counter(&old, 16)));
+        batcher.push(&callbacks, 1, || packet(0x10, 1, 8));
+        batcher.push(&callbacks, 1, || packet(0x10, 2, 8));
+        callbacks.set(1, Some(counter(&new, 16)));
+        batcher.flush(&callbacks);
+        assert_eq!((old.load(Ordering::Relaxed), new.load(Ordering::Relaxed)), (0, 2));
+
+        batcher.push(&callbacks, 1, || packet(0x10, 3, 8));
+        callbacks.set(1, None);
+        batcher.flush(&callbacks);
+        assert_eq!(new.load(Ordering::Relaxed), 2);
+    }
+
+    #[test]
+    fn retired_callback_is_not_called() {
+        let count = Arc::new(AtomicUsize::new(0));
+        let callback = counter(&count, 1);
+        callback.call(0, &[packet(0x10, 1, 8)]);
+        callback.retire();
+        callback.call(0, &[packet(0x10, 2, 8)]);
+        assert_eq!(count.load(Ordering::Relaxed), 1);
+    }
+
+    #[test]
+    fn callback_can_remove_itself() {
+        let callbacks = Arc::new(RxCallbacks::new());
+        let count = Arc::new(AtomicUsize::new(0));
+        let (table, calls) = (callbacks.clone(), count.clone());
+        callbacks.set(0, Some(RxCallback::new(Box::new(move |channel, _| {
+            calls.fetch_add(1, Ordering::Relaxed);
+            table.set(channel, None);
+        }), 1)));
+
+        let mut batcher = CallbackBatcher::default();
+        batcher.push(&callbacks, 0, || packet(0x10, 1, 8));
+        batcher.push(&callbacks, 0, || packet(0x10, 2, 8));
+        batcher.flush(&callbacks);
+        assert_eq!(count.load(Ordering::Relaxed), 1);
+    }
+}
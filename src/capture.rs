@@ -0,0 +1,513 @@
+//! Streaming binary traffic capture, and reading captures back for replay.
+//!
+//! A capture file is a header followed by self-describing chunks of records, then an index footer that is
+//! written when the capture is finished. Files whose writer never finished (e.g. the process crashed) are
+//! still readable: the reader rebuilds the index by walking the chunk headers. All integers are little-endian.
+//!
+//! ```text
+//! header: magic "RDXCAP\0\0" | version u32 | reserved u32
+//! chunk:  magic "CHNK" | n_records u32 | payload_len u32 | reserved u32 | first_host_ns u64 | last_host_ns u64 | records
+//! record: host_ns u64 | timestamp_ns u64 | arb_id u32 | flags u16 | channel u8 | dlc_dir u8 | data[dlc]
+//! footer: n_entries * (first_host_ns u64 | chunk_offset u64) | magic "RIDX" | reserved u32 | n_entries u64 | index_offset u64
+//! ```
+//!
+//! `dlc_dir` holds the dlc in its low 7 bits, with the top bit set for transmitted frames.
+
+use std::{fs::File, io::{self, BufReader, BufWriter, Read, Seek, SeekFrom, Write}, path::Path, sync::{atomic::{AtomicU64, Ordering}, mpsc::{self, Receiver, RecvTimeoutError, SyncSender, TryRecvError}, Arc, Mutex}, thread::JoinHandle, time::Duration};
+
+use bytemuck::Zeroable;
+use rdxusb_protocol::RdxUsbPacket;
+
+const FILE_MAGIC: [u8; 8] = *b"RDXCAP\0\0";
+const FILE_VERSION: u32 = 1;
+const CHUNK_MAGIC: [u8; 4] = *b"CHNK";
+const INDEX_MAGIC: [u8; 4] = *b"RIDX";
+const HEADER_SIZE: usize = 16;
+const CHUNK_HEADER_SIZE: usize = 32;
+const RECORD_HEADER_SIZE: usize = 24;
+const FOOTER_SIZE: usize = 24;
+const DIR_TX: u8 = 0x80;
+
+/// Size of one chunk buffer, including its header. Each chunk is also one index entry.
+pub const CHUNK_SIZE: usize = 64 * 1024;
+/// Number of preallocated chunk buffers shared between the pollers and the writer thread.
+const N_BUFFERS: usize = 8;
+/// How often a partially filled chunk is handed to the writer anyway, which bounds how much a crash loses.
+const FLUSH_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Which way a captured frame went.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Direction {
+    Rx,
+    Tx,
+}
+
+/// One captured frame.
+#[derive(Debug, Clone, Copy)]
+pub struct CaptureRecord {
+    /// When the frame was received or sent, on the [`crate::clock::monotonic_ns`] clock.
+    pub host_ns: u64,
+    pub direction: Direction,
+    /// The frame as it went over the wire, with its device timestamp.
+    pub packet: RdxUsbPacket,
+}
+
+/// One entry of a capture's seek index.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct IndexEntry {
+    pub first_host_ns: u64,
+    /// File offset of the chunk.
+    pub offset: u64,
+}
+
+struct TapState {
+    chunk: Vec<u8>,
+    n_records: u32,
+    first_ns: u64,
+    last_ns: u64,
+    /// Dropped on close, which lets the writer thread finish once it has drained the queue.
+    full_tx: Option<SyncSender<Vec<u8>>>,
+    free_rx: Receiver<Vec<u8>>,
+}
+
+/// Outcome of [`TapState::seal`].
+#[derive(PartialEq, Eq)]
+enum Seal {
+    Done,
+    /// Every buffer is queued for the writer thread.
+    NoBuffer,
+    /// The writer thread stopped, e.g. because of a write error.
+    WriterGone,
+}
+
+impl TapState {
+    /// Hands the current chunk to the writer thread, if it has any records.
+    fn seal(&mut self) -> Seal {
+        if self.n_records == 0 { return Seal::Done; }
+        let Some(full_tx) = self.full_tx.as_ref() else { return Seal::WriterGone; };
+        let mut next = match self.free_rx.try_recv() {
+            Ok(next) => next,
+            Err(TryRecvError::Empty) => { return Seal::NoBuffer; }
+            Err(TryRecvError::Disconnected) => { return Seal::WriterGone; }
+        };
+        next.clear();
+        next.resize(CHUNK_HEADER_SIZE, 0);
+
+        let payload_len = (self.chunk.len() - CHUNK_HEADER_SIZE) as u32;
+        let header = &mut self.chunk[..CHUNK_HEADER_SIZE];
+        header[0..4].copy_from_slice(&CHUNK_MAGIC);
+        header[4..8].copy_from_slice(&self.n_records.to_le_bytes());
+        header[8..12].copy_from_slice(&payload_len.to_le_bytes());
+        header[16..24].copy_from_slice(&self.first_ns.to_le_bytes());
+        header[24..32].copy_from_slice(&self.last_ns.to_le_bytes());
+        let full = core::mem::replace(&mut self.chunk, next);
+        self.n_records = 0;
+        // there are never more buffers than the queue holds, so this only fails if the writer is gone
+        match full_tx.try_send(full) {
+            Ok(()) => Seal::Done,
+            Err(_) => Seal::WriterGone,
+        }
+    }
+}
+
+/// The recording side of a capture, shared by a device's rx and tx pollers.
+///
+/// Recording copies the frame into a preallocated chunk buffer; full chunks go to the writer thread.
+/// If the writer falls behind and no buffer is free, frames are dropped and counted rather than
+/// blocking the poller.
+pub struct CaptureTap {
+    state: Mutex<TapState>,
+    dropped: AtomicU64,
+}
+
+impl CaptureTap {
+    /// Records a frame.
+    #[inline]
+    pub fn record(&self, direction: Direction, host_ns: u64, packet: &RdxUsbPacket) {
+        let dlc = (packet.dlc as usize).min(packet.data.len());
+        let Ok(mut state) = self.state.lock() else { return; };
+        if state.full_tx.is_none() { return; }
+        if state.chunk.len() + RECORD_HEADER_SIZE + dlc > CHUNK_SIZE && state.seal() != Seal::Done {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        if state.n_records == 0 { state.first_ns = host_ns; }
+        state.last_ns = host_ns;
+        state.n_records += 1;
+        let dlc_dir = dlc as u8 | if direction == Direction::Tx { DIR_TX } else { 0 };
+        let chunk = &mut state.chunk;
+        chunk.extend_from_slice(&host_ns.to_le_bytes());
+        chunk.extend_from_slice(&packet.timestamp_ns.to_le_bytes());
+        chunk.extend_from_slice(&packet.arb_id.to_le_bytes());
+        chunk.extend_from_slice(&packet.flags.to_le_bytes());
+        chunk.extend_from_slice(&[packet.channel, dlc_dir]);
+        chunk.extend_from_slice(&packet.data[..dlc]);
+    }
+
+    /// Number of frames dropped because the writer thread fell behind.
+    pub fn dropped(&self) -> u64 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+
+    fn flush(&self) {
+        if let Ok(mut state) = self.state.lock() { state.seal(); }
+    }
+
+    fn close(&self) {
+        loop {
+            let Ok(mut state) = self.state.lock() else { return; };
+            if state.seal() != Seal::NoBuffer {
+                state.full_tx.take();
+                return;
+            }
+            // the writer thread needs the lock to make progress, so wait for a buffer without it
+            drop(state);
+            std::thread::sleep(Duration::from_millis(1));
+        }
+    }
+}
+
+/// A capture being written to a file by a background thread.
+///
+/// Dropping this finishes the capture, like [`finish`](Self::finish) does.
+pub struct CaptureWriter {
+    tap: Arc<CaptureTap>,
+    thread: Option<JoinHandle<io::Result<()>>>,
+}
+
+impl CaptureWriter {
+    pub fn create(path: impl AsRef<Path>) -> io::Result<Self> {
+        let mut file = BufWriter::new(File::create(path)?);
+        file.write_all(&FILE_MAGIC)?;
+        file.write_all(&FILE_VERSION.to_le_bytes())?;
+        file.write_all(&0u32.to_le_bytes())?;
+
+        let (full_tx, full_rx) = mpsc::sync_channel(N_BUFFERS);
+        let (free_tx, free_rx) = mpsc::sync_channel(N_BUFFERS);
+        for _ in 1..N_BUFFERS {
+            let _ = free_tx.try_send(Vec::with_capacity(CHUNK_SIZE));
+        }
+        let mut chunk = Vec::with_capacity(CHUNK_SIZE);
+        chunk.resize(CHUNK_HEADER_SIZE, 0);
+        let tap = Arc::new(CaptureTap {
+            state: Mutex::new(TapState { chunk, n_records: 0, first_ns: 0, last_ns: 0, full_tx: Some(full_tx), free_rx }),
+            dropped: AtomicU64::new(0),
+        });
+
+        let writer_tap = tap.clone();
+        let thread = std::thread::Builder::new()
+            .name("rdxusb-capture".to_string())
+            .spawn(move || write_chunks(&writer_tap, full_rx, free_tx, file))?;
+        Ok(Self { tap, thread: Some(thread) })
+    }
+
+    pub fn tap(&self) -> &Arc<CaptureTap> {
+        &self.tap
+    }
+
+    /// Writes out everything recorded so far plus the index, and closes the file.
+    pub fn finish(mut self) -> io::Result<()> {
+        self.close()
+    }
+
+    fn close(&mut self) -> io::Result<()> {
+        self.tap.close();
+        match self.thread.take() {
+            Some(thread) => thread.join().unwrap_or_else(|_| Err(io::Error::other("capture writer panicked"))),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for CaptureWriter {
+    fn drop(&mut self) {
+        let _ = self.close();
+    }
+}
+
+fn write_chunks(tap: &CaptureTap, full_rx: Receiver<Vec<u8>>, free_tx: SyncSender<Vec<u8>>, mut file: BufWriter<File>) -> io::Result<()> {
+    let mut offset = HEADER_SIZE as u64;
+    let mut index = Vec::new();
+    loop {
+        match full_rx.recv_timeout(FLUSH_INTERVAL) {
+            Ok(chunk) => {
+                file.write_all(&chunk)?;
+                let first_host_ns = u64::from_le_bytes(chunk[16..24].try_into().unwrap());
+                index.push(IndexEntry { first_host_ns, offset });
+                offset += chunk.len() as u64;
+                let _ = free_tx.try_send(chunk);
+            }
+            Err(RecvTimeoutError::Timeout) => {
+                tap.flush();
+                file.flush()?;
+            }
+            Err(RecvTimeoutError::Disconnected) => { break; }
+        }
+    }
+
+    for entry in &index {
+        file.write_all(&entry.first_host_ns.to_le_bytes())?;
+        file.write_all(&entry.offset.to_le_bytes())?;
+    }
+    file.write_all(&INDEX_MAGIC)?;
+    file.write_all(&0u32.to_le_bytes())?;
+    file.write_all(&(index.len() as u64).to_le_bytes())?;
+    file.write_all(&offset.to_le_bytes())?;
+    file.flush()
+}
+
+/// A device's capture, shared between its handle and its pollers. This is kept across reconnects.
+#[derive(Default)]
+pub struct CaptureSlot {
+    generation: AtomicU64,
+    tap: Mutex<Option<Arc<CaptureTap>>>,
+    writer: Mutex<Option<CaptureWriter>>,
+}
+
+impl CaptureSlot {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Starts capturing to a new file, finishing any capture already running.
+    pub fn start(&self, path: impl AsRef<Path>) -> io::Result<()> {
+        let writer = CaptureWriter::create(path)?;
+        let previous = {
+            let mut current = self.writer.lock().map_err(|_e| io::Error::other("capture lock poisoned"))?;
+            self.set_tap(Some(writer.tap().clone()));
+            current.replace(writer)
+        };
+        previous.map_or(Ok(()), CaptureWriter::finish)
+    }
+
+    /// Stops capturing and finishes the file. This is a no-op if no capture is running.
+    pub fn stop(&self) -> io::Result<()> {
+        let previous = {
+            let mut current = self.writer.lock().map_err(|_e| io::Error::other("capture lock poisoned"))?;
+            self.set_tap(None);
+            current.take()
+        };
+        previous.map_or(Ok(()), CaptureWriter::finish)
+    }
+
+    fn set_tap(&self, tap: Option<Arc<CaptureTap>>) {
+        if let Ok(mut current) = self.tap.lock() { *current = tap; }
+        self.generation.fetch_add(1, Ordering::Release);
+    }
+}
+
+/// A poller's cached view of a [`CaptureSlot`], refreshed only when the capture changes.
+#[derive(Default)]
+pub struct CaptureCache {
+    generation: u64,
+    tap: Option<Arc<CaptureTap>>,
+}
+
+impl CaptureCache {
+    #[inline]
+    pub fn get(&mut self, slot: &CaptureSlot) -> Option<&Arc<CaptureTap>> {
+        let generation = slot.generation.load(Ordering::Acquire);
+        if generation != self.generation {
+            if let Ok(tap) = slot.tap.lock() { self.tap.clone_from(&tap); }
+            self.generation = generation;
+        }
+        self.tap.as_ref()
+    }
+}
+
+fn read_array<const N: usize>(reader: &mut impl Read) -> io::Result<[u8; N]> {
+    let mut buf = [0u8; N];
+    reader.read_exact(&mut buf)?;
+    Ok(buf)
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// Reads a capture file back, record by record.
+pub struct CaptureReader {
+    reader: BufReader<File>,
+    index: Vec<IndexEntry>,
+    /// Where the chunks end: the index footer, or the end of the last whole chunk.
+    end: u64,
+    next_chunk: u64,
+    remaining: u32,
+}
+
+impl CaptureReader {
+    pub fn open(path: impl AsRef<Path>) -> io::Result<Self> {
+        let mut reader = BufReader::new(File::open(path)?);
+        let header: [u8; HEADER_SIZE] = read_array(&mut reader)?;
+        if header[..8] != FILE_MAGIC { return Err(invalid("not an rdxusb capture")); }
+        if u32::from_le_bytes(header[8..12].try_into().unwrap()) != FILE_VERSION { return Err(invalid("unsupported capture version")); }
+
+        let len = reader.seek(SeekFrom::End(0))?;
+        let (index, end) = match Self::read_footer(&mut reader, len)? {
+            Some(found) => found,
+            None => Self::scan_chunks(&mut reader, len)?,
+        };
+        reader.seek(SeekFrom::Start(HEADER_SIZE as u64))?;
+        Ok(Self { reader, index, end, next_chunk: HEADER_SIZE as u64, remaining: 0 })
+    }
+
+    fn read_footer(reader: &mut BufReader<File>, len: u64) -> io::Result<Option<(Vec<IndexEntry>, u64)>> {
+        if len < (HEADER_SIZE + FOOTER_SIZE) as u64 { return Ok(None); }
+        reader.seek(SeekFrom::Start(len - FOOTER_SIZE as u64))?;
+        let footer: [u8; FOOTER_SIZE] = read_array(reader)?;
+        if footer[..4] != INDEX_MAGIC { return Ok(None); }
+        let n_entries = u64::from_le_bytes(footer[8..16].try_into().unwrap());
+        let index_offset = u64::from_le_bytes(footer[16..24].try_into().unwrap());
+        if index_offset.checked_add(n_entries.saturating_mul(16)) != Some(len - FOOTER_SIZE as u64) { return Ok(None); }
+
+        reader.seek(SeekFrom::Start(index_offset))?;
+        let mut index = Vec::with_capacity(n_entries as usize);
+        for _ in 0..n_entries {
+            let entry: [u8; 16] = read_array(reader)?;
+            index.push(IndexEntry {
+                first_host_ns: u64::from_le_bytes(entry[..8].try_into().unwrap()),
+                offset: u64::from_le_bytes(entry[8..].try_into().unwrap()),
+            });
+        }
+        Ok(Some((index, index_offset)))
+    }
+
+    fn scan_chunks(reader: &mut BufReader<File>, len: u64) -> io::Result<(Vec<IndexEntry>, u64)> {
+        let mut index = Vec::new();
+        let mut offset = HEADER_SIZE as u64;
+        while offset + CHUNK_HEADER_SIZE as u64 <= len {
+            reader.seek(SeekFrom::Start(offset))?;
+            let header: [u8; CHUNK_HEADER_SIZE] = read_array(reader)?;
+            if header[..4] != CHUNK_MAGIC { break; }
+            let payload_len = u32::from_le_bytes(header[8..12].try_into().unwrap()) as u64;
+            let chunk_end = offset + CHUNK_HEADER_SIZE as u64 + payload_len;
+            // a chunk cut short by a crash is ignored
+            if chunk_end > len { break; }
+            index.push(IndexEntry { first_host_ns: u64::from_le_bytes(header[16..24].try_into().unwrap()), offset });
+            offset = chunk_end;
+        }
+        Ok((index, offset))
+    }
+
+    /// The capture's seek index, one entry per chunk, in time order.
+    pub fn index(&self) -> &[IndexEntry] {
+        &self.index
+    }
+
+    /// Moves to the start of the chunk containing `host_ns`, so the next record is at most one chunk earlier.
+    pub fn seek(&mut self, host_ns: u64) -> io::Result<()> {
+        let idx = self.index.partition_point(|e| e.first_host_ns <= host_ns).saturating_sub(1);
+        let offset = self.index.get(idx).map_or(HEADER_SIZE as u64, |e| e.offset);
+        self.reader.seek(SeekFrom::Start(offset))?;
+        self.next_chunk = offset;
+        self.remaining = 0;
+        Ok(())
+    }
+
+    /// Reads the next record, or `None` at the end of the capture.
+    pub fn next_record(&mut self) -> io::Result<Option<CaptureRecord>> {
+        while self.remaining == 0 {
+            if self.next_chunk + CHUNK_HEADER_SIZE as u64 > self.end { return Ok(None); }
+            let header: [u8; CHUNK_HEADER_SIZE] = read_array(&mut self.reader)?;
+            if header[..4] != CHUNK_MAGIC { return Err(invalid("corrupt capture chunk")); }
+            self.remaining = u32::from_le_bytes(header[4..8].try_into().unwrap());
+            let payload_len = u32::from_le_bytes(header[8..12].try_into().unwrap()) as u64;
+            self.next_chunk += CHUNK_HEADER_SIZE as u64 + payload_len;
+        }
+        self.remaining -= 1;
+
+        let header: [u8; RECORD_HEADER_SIZE] = read_array(&mut self.reader)?;
+        let dlc_dir = header[23];
+        let mut packet = RdxUsbPacket::zeroed();
+        packet.timestamp_ns = u64::from_le_bytes(header[8..16].try_into().unwrap());
+        packet.arb_id = u32::from_le_bytes(header[16..20].try_into().unwrap());
+        packet.flags = u16::from_le_bytes(header[20..22].try_into().unwrap());
+        packet.channel = header[22];
+        packet.dlc = dlc_dir & !DIR_TX;
+        let dlc = packet.dlc as usize;
+        if dlc > packet.data.len() { return Err(invalid("corrupt capture record")); }
+        self.reader.read_exact(&mut packet.data[..dlc])?;
+        Ok(Some(CaptureRecord {
+            host_ns: u64::from_le_bytes(header[..8].try_into().unwrap()),
+            direction: if dlc_dir & DIR_TX != 0 { Direction::Tx } else { Direction::Rx },
+            packet,
+        }))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::packet;
+
+    /// Enough 64-byte frames to fill a few chunks.
+    const N_RECORDS: u32 = 2000;
+
+    fn temp_path(name: &str) -> std::path::PathBuf {
+        std::env::temp_dir().join(format!("rdxusb-{name}-{}.cap", std::process::id()))
+    }
+
+    fn frame(i: u32) -> RdxUsbPacket {
+        RdxUsbPacket { channel: (i % 2) as u8, ..packet(i, i, if i % 3 == 0 { 8 } else { 64 }) }
+    }
+
+    fn write_capture(path: &Path) {
+        let writer = CaptureWriter::create(path).unwrap();
+        for i in 0..N_RECORDS {
+            let direction = if i % 4 == 0 { Direction::Tx } else { Direction::Rx };
+            writer.tap().record(direction, 1000 + i as u64, &frame(i));
+        }
+        assert_eq!(writer.tap().dropped(), 0);
+        writer.finish().unwrap();
+    }
+
+    fn read_all(reader: &mut CaptureReader) -> Vec<CaptureRecord> {
+        std::iter::from_fn(|| reader.next_record().unwrap()).collect()
+    }
+
+    fn check_record(record: &CaptureRecord, i: u32) {
+        assert_eq!(record.host_ns, 1000 + i as u64);
+        assert_eq!(record.direction, if i % 4 == 0 { Direction::Tx } else { Direction::Rx });
+        assert_eq!(record.packet, frame(i));
+    }
+
+    #[test]
+    fn round_trip() {
+        let path = temp_path("round-trip");
+        write_capture(&path);
+        let mut reader = CaptureReader::open(&path).unwrap();
+        assert!(reader.index().len() > 1);
+        let records = read_all(&mut reader);
+        assert_eq!(records.len(), N_RECORDS as usize);
+        for (i, record) in records.iter().enumerate() { check_record(record, i as u32); }
+
+        let second = reader.index()[1];
+        reader.seek(second.first_host_ns + 1).unwrap();
+        check_record(&reader.next_record().unwrap().unwrap(), (second.first_host_ns - 1000) as u32);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn reads_without_footer() {
+        let path = temp_path("truncated");
+        write_capture(&path);
+        let full = CaptureReader::open(&path).unwrap().index().to_vec();
+        let file = std::fs::OpenOptions::new().write(true).open(&path).unwrap();
+        let len = file.metadata().unwrap().len();
+
+        // a cut into the footer leaves every chunk whole, and the index is rebuilt from the chunk headers
+        file.set_len(len - 4).unwrap();
+        let mut reader = CaptureReader::open(&path).unwrap();
+        assert_eq!(reader.index(), &full[..]);
+        assert_eq!(read_all(&mut reader).len(), N_RECORDS as usize);
+
+        // a cut into the last chunk drops just that chunk
+        file.set_len(full.last().unwrap().offset + CHUNK_HEADER_SIZE as u64 + 10).unwrap();
+        let mut reader = CaptureReader::open(&path).unwrap();
+        assert_eq!(reader.index(), &full[..full.len() - 1]);
+        let records = read_all(&mut reader);
+        assert_eq!(records.len() as u64, full.last().unwrap().first_host_ns - 1000);
+        for (i, record) in records.iter().enumerate() { check_record(record, i as u32); }
+        std::fs::remove_file(path).unwrap();
+    }
+}
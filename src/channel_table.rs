@@ -0,0 +1,84 @@
+//! Per-channel settings shared between a handle and its rx poller.
+
+use std::sync::{atomic::{AtomicU64, Ordering}, Arc, Mutex};
+
+/// A per-channel table of optional entries, like filters or mailboxes.
+///
+/// Handles write to it rarely, and the rx poller reads it for every packet. The poller keeps its own copy
+/// in a [`ChannelTableCache`] and only takes the lock to refresh it when the generation counter changes,
+/// so updating the table never blocks the rx path.
+pub struct ChannelTable<T> {
+    generation: AtomicU64,
+    channels: Mutex<Vec<Option<Arc<T>>>>,
+}
+
+impl<T> ChannelTable<T> {
+    pub fn new() -> Self {
+        Self { generation: AtomicU64::new(0), channels: Mutex::new(Vec::new()) }
+    }
+
+    /// Runs `f` on a channel's entry and publishes the result to the poller.
+    pub fn update<R>(&self, channel: u8, f: impl FnOnce(&mut Option<Arc<T>>) -> R) -> Option<R> {
+        let mut channels = self.channels.lock().ok()?;
+        let channel = channel as usize;
+        if channels.len() <= channel { channels.resize_with(channel + 1, || None); }
+        let res = f(&mut channels[channel]);
+        self.generation.fetch_add(1, Ordering::Release);
+        Some(res)
+    }
+
+    /// Clears every channel's entry, returning the ones that were set.
+    pub fn take_all(&self) -> Vec<Arc<T>> {
+        let Ok(mut channels) = self.channels.lock() else { return Vec::new(); };
+        let taken = channels.iter_mut().filter_map(Option::take).collect();
+        self.generation.fetch_add(1, Ordering::Release);
+        taken
+    }
+
+    /// Gets a channel's entry.
+    pub fn get(&self, channel: u8) -> Option<Arc<T>> {
+        self.channels.lock().ok()?.get(channel as usize)?.clone()
+    }
+}
+
+impl<T> Default for ChannelTable<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// The rx poller's cached view of a [`ChannelTable`].
+pub struct ChannelTableCache<T> {
+    generation: u64,
+    channels: Vec<Option<Arc<T>>>,
+}
+
+impl<T> ChannelTableCache<T> {
+    pub fn new() -> Self {
+        Self { generation: 0, channels: Vec::new() }
+    }
+
+    /// Gets the current entry for a channel, refreshing the cache if the table changed.
+    #[inline]
+    pub fn get(&mut self, table: &ChannelTable<T>, channel: u8) -> Option<&Arc<T>> {
+        let generation = table.generation.load(Ordering::Acquire);
+        if generation != self.generation {
+            if let Ok(channels) = table.channels.lock() {
+                self.channels.clone_from(&channels);
+            }
+            self.generation = generation;
+        }
+        self.channels.get(channel as usize)?.as_ref()
+    }
+
+    /// Gets the cached entry for a channel, without refreshing.
+    pub fn cached(&self, channel: u8) -> Option<&Arc<T>> {
+        self.channels.get(channel as usize)?.as_ref()
+    }
+}
+
+impl<T> Default for ChannelTableCache<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
@@ -0,0 +1,227 @@
+//! Host receive timestamps and device-to-host clock correlation.
+
+use std::{collections::VecDeque, sync::Mutex};
+
+/// Length of a sampling window. The lowest-latency sample in each window becomes one point of the fit.
+const WINDOW_NS: u64 = 100_000_000;
+/// Number of window minima kept for the drift fit, about three seconds' worth.
+const MAX_WINDOWS: usize = 32;
+/// Drift estimates beyond this are treated as noise. Crystal oscillators are well within 1000 ppm.
+const MAX_DRIFT: f64 = 1e-3;
+
+/// Nanoseconds on the host monotonic clock.
+///
+/// This is `CLOCK_MONOTONIC` on unix and `QueryPerformanceCounter` on Windows,
+/// so it can be compared against timestamps taken by other code on the same host.
+#[cfg(unix)]
+pub fn monotonic_ns() -> u64 {
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts); }
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Nanoseconds on the host monotonic clock.
+///
+/// This is `CLOCK_MONOTONIC` on unix and `QueryPerformanceCounter` on Windows,
+/// so it can be compared against timestamps taken by other code on the same host.
+#[cfg(windows)]
+pub fn monotonic_ns() -> u64 {
+    use windows_sys::Win32::System::Performance::{QueryPerformanceCounter, QueryPerformanceFrequency};
+    let (mut ticks, mut freq) = (0i64, 0i64);
+    unsafe {
+        QueryPerformanceCounter(&mut ticks);
+        QueryPerformanceFrequency(&mut freq);
+    }
+    (ticks as u128 * 1_000_000_000 / freq.max(1) as u128) as u64
+}
+
+#[cfg(not(any(unix, windows)))]
+pub fn monotonic_ns() -> u64 {
+    static EPOCH: std::sync::OnceLock<std::time::Instant> = std::sync::OnceLock::new();
+    EPOCH.get_or_init(std::time::Instant::now).elapsed().as_nanos() as u64
+}
+
+/// A linear mapping from device time to host time: `host = device + offset + (device - device_ref) * drift`.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ClockEstimate {
+    pub device_ref_ns: u64,
+    pub offset_ns: i64,
+    /// Host clock rate relative to the device clock, minus one.
+    pub drift: f64,
+}
+
+impl ClockEstimate {
+    pub fn device_to_host(&self, device_ns: u64) -> u64 {
+        let elapsed = device_ns.wrapping_sub(self.device_ref_ns) as i64;
+        let correction = (elapsed as f64 * self.drift) as i64;
+        (device_ns as i64).wrapping_add(self.offset_ns).wrapping_add(correction) as u64
+    }
+}
+
+/// Online offset and drift estimator, fed by the rx poller.
+///
+/// Every sample is `host receive time - device timestamp`, which is the true clock offset plus USB and
+/// scheduling latency. Latency is never negative, so the smallest sample in a window is the one closest
+/// to the true offset. A least-squares line through the recent window minima gives offset and drift.
+#[derive(Debug, Default)]
+pub struct ClockEstimator {
+    window_start_ns: u64,
+    window_min: Option<(u64, i64)>,
+    last_device_ns: u64,
+    minima: VecDeque<(u64, i64)>,
+    estimate: Option<ClockEstimate>,
+}
+
+impl ClockEstimator {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn estimate(&self) -> Option<ClockEstimate> {
+        self.estimate
+    }
+
+    /// Adds a sample. Returns true if the estimate changed.
+    pub fn observe(&mut self, device_ns: u64, host_ns: u64) -> bool {
+        // devices that don't timestamp leave this at zero
+        if device_ns == 0 { return false; }
+        if device_ns < self.last_device_ns {
+            // the device clock went backwards, so it must have reset
+            *self = Self::default();
+        }
+        self.last_device_ns = device_ns;
+
+        let offset = host_ns.wrapping_sub(device_ns) as i64;
+        let mut changed = false;
+        match self.window_min {
+            Some((_, min)) if min <= offset => {}
+            _ => {
+                self.window_min = Some((device_ns, offset));
+                if self.minima.len() < 2 {
+                    // no fit yet, so the best sample so far is the best guess
+                    self.estimate = Some(ClockEstimate { device_ref_ns: device_ns, offset_ns: offset, drift: 0.0 });
+                    changed = true;
+                }
+            }
+        }
+        if self.window_start_ns == 0 { self.window_start_ns = host_ns; }
+
+        if host_ns.wrapping_sub(self.window_start_ns) >= WINDOW_NS {
+            if let Some(min) = self.window_min.take() {
+                if self.minima.len() == MAX_WINDOWS { self.minima.pop_front(); }
+                self.minima.push_back(min);
+                if let Some(estimate) = self.fit() {
+                    self.estimate = Some(estimate);
+                    changed = true;
+                }
+            }
+            self.window_start_ns = host_ns;
+        }
+        changed
+    }
+
+    fn fit(&self) -> Option<ClockEstimate> {
+        let &(x0, y0) = self.minima.front()?;
+        let &(x_last, _) = self.minima.back()?;
+        if self.minima.len() < 2 || x_last == x0 { return None; }
+        // center on the first point so the sums stay well-conditioned in f64
+        let n = self.minima.len() as f64;
+        let (mut sx, mut sy, mut sxx, mut sxy) = (0.0, 0.0, 0.0, 0.0);
+        for &(x, y) in &self.minima {
+            let x = x.wrapping_sub(x0) as f64;
+            let y = y.wrapping_sub(y0) as f64;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        let denom = n * sxx - sx * sx;
+        if denom <= 0.0 { return None; }
+        let drift = ((n * sxy - sx * sy) / denom).clamp(-MAX_DRIFT, MAX_DRIFT);
+        let intercept = (sy - drift * sx) / n;
+        let x_ref = x_last.wrapping_sub(x0) as f64;
+        Some(ClockEstimate {
+            device_ref_ns: x_last,
+            offset_ns: y0.wrapping_add((intercept + drift * x_ref) as i64),
+            drift,
+        })
+    }
+}
+
+/// A device's published clock estimate, shared between the rx poller and readers.
+///
+/// The poller only publishes when a sampling window closes, so the lock is effectively uncontended.
+#[derive(Debug, Default)]
+pub struct ClockSync {
+    estimate: Mutex<Option<ClockEstimate>>,
+}
+
+impl ClockSync {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn publish(&self, estimate: Option<ClockEstimate>) {
+        if let Ok(mut e) = self.estimate.lock() { *e = estimate; }
+    }
+
+    pub fn estimate(&self) -> Option<ClockEstimate> {
+        self.estimate.lock().ok().and_then(|e| *e)
+    }
+
+    /// Converts a device timestamp to the host monotonic clock, if an estimate is available.
+    pub fn device_to_host(&self, device_ns: u64) -> Option<u64> {
+        self.estimate().map(|e| e.device_to_host(device_ns))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const DRIFT: f64 = 50e-6;
+    const OFFSET_NS: u64 = 5_000_000_000;
+    const MIN_LATENCY_NS: u64 = 20_000;
+
+    fn true_host_ns(device_ns: u64) -> u64 {
+        OFFSET_NS + device_ns + (device_ns as f64 * DRIFT) as u64
+    }
+
+    /// Feeds 1 kHz samples for `seconds`, with latency jitter that hits its floor every few samples.
+    fn feed(estimator: &mut ClockEstimator, start_ns: u64, seconds: u64) {
+        let mut rng = 0x2545_f491_4f6c_dd1du64;
+        for i in 0..seconds * 1000 {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            let device_ns = start_ns + i * 1_000_000;
+            let jitter = if i % 5 == 0 { 0 } else { rng % 400_000 };
+            estimator.observe(device_ns, true_host_ns(device_ns) + MIN_LATENCY_NS + jitter);
+        }
+    }
+
+    #[test]
+    fn fits_offset_and_drift() {
+        let mut estimator = ClockEstimator::new();
+        feed(&mut estimator, 1_000_000_000, 4);
+        let estimate = estimator.estimate().unwrap();
+        assert!((estimate.drift - DRIFT).abs() < 2e-6, "drift {}", estimate.drift);
+        for device_ns in [1_000_000_000, 3_000_000_000, 5_000_000_000] {
+            let error = estimate.device_to_host(device_ns) as i64 - true_host_ns(device_ns) as i64;
+            assert!((0..2 * MIN_LATENCY_NS as i64).contains(&error), "error {error} ns at {device_ns}");
+        }
+    }
+
+    #[test]
+    fn ignores_untimestamped_and_resets_on_device_reset() {
+        let mut estimator = ClockEstimator::new();
+        assert!(!estimator.observe(0, 123));
+        assert!(estimator.estimate().is_none());
+
+        feed(&mut estimator, 10_000_000_000, 1);
+        assert!(estimator.observe(1_000_000, true_host_ns(1_000_000) + MIN_LATENCY_NS));
+        let estimate = estimator.estimate().unwrap();
+        assert_eq!(estimate.drift, 0.0);
+        assert_eq!(estimate.device_to_host(1_000_000), true_host_ns(1_000_000) + MIN_LATENCY_NS);
+    }
+}
@@ -0,0 +1,233 @@
+//! Latest-wins tx coalescing: while a frame is waiting to be sent, newer frames with the same channel
+//! and arbitration id overwrite it in place instead of queueing behind it.
+
+use std::{marker::PhantomData, sync::atomic::{self, AtomicBool, AtomicU32, AtomicU64, Ordering}};
+
+use bytemuck::Pod;
+use rdxusb_protocol::RdxUsbPacket;
+
+/// Number of distinct channel and id pairs a writer can have waiting to be sent at once. A slot whose frame
+/// went out is reused for another pair; frames past this are queued as usual.
+pub const COALESCE_SLOTS: usize = 256;
+const SLOT_MASK: usize = COALESCE_SLOTS - 1;
+/// Marks an unused slot. Keys are channel and [`RdxUsbPacket::id`] pairs, which never have these bits set.
+const EMPTY_KEY: u64 = u64::MAX;
+/// Words taken by the largest frame.
+const MAX_WORDS: usize = RdxUsbPacket::SIZE / 8;
+/// `sent_seq` of a slot that never sent anything. Sequence numbers are even once a frame is stored.
+const NEVER_SENT: u32 = u32::MAX;
+
+/// The coalescing key of a frame.
+#[inline]
+pub fn key(channel: u8, arb_id: u32) -> u64 {
+    ((channel as u64) << 32) | (arb_id & 0x1fff_ffff) as u64
+}
+
+#[inline]
+fn slot_index(key: u64) -> usize {
+    (key.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (64 - COALESCE_SLOTS.trailing_zeros())) as usize
+}
+
+/// One key's newest frame, guarded by a seqlock like the rx mailboxes.
+struct Slot {
+    key: AtomicU64,
+    seq: AtomicU32,
+    /// Set while a token for this slot sits in a tx lane. The writer sets it, the poller clears it on pop.
+    queued: AtomicBool,
+    /// Sequence number of the frame the poller sent last. The writer also sets this when it drops a frame
+    /// whose token didn't fit, so that frame isn't sent either.
+    sent_seq: AtomicU32,
+    words: [AtomicU64; MAX_WORDS],
+}
+
+impl Slot {
+    fn new() -> Self {
+        Self {
+            key: AtomicU64::new(EMPTY_KEY),
+            seq: AtomicU32::new(0),
+            queued: AtomicBool::new(false),
+            sent_seq: AtomicU32::new(NEVER_SENT),
+            words: [const { AtomicU64::new(0) }; MAX_WORDS],
+        }
+    }
+
+    fn write<F: Pod>(&self, frame: &F) {
+        let mut words = [0u64; MAX_WORDS];
+        bytemuck::cast_slice_mut::<u64, u8>(&mut words)[..core::mem::size_of::<F>()].copy_from_slice(bytemuck::bytes_of(frame));
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        atomic::fence(Ordering::Release);
+        for (dst, src) in self.words[..core::mem::size_of::<F>() / 8].iter().zip(words) {
+            dst.store(src, Ordering::Relaxed);
+        }
+        self.seq.store(seq.wrapping_add(2), Ordering::Release);
+    }
+
+    /// Whether the slot's newest frame is done with, sent or dropped, so the writer may give the slot another key.
+    fn is_idle(&self) -> bool {
+        !self.queued.load(Ordering::Acquire) && self.sent_seq.load(Ordering::Acquire) == self.seq.load(Ordering::Relaxed)
+    }
+
+    fn read<F: Pod>(&self) -> (u32, F) {
+        loop {
+            let before = self.seq.load(Ordering::Acquire);
+            if before & 1 == 1 {
+                core::hint::spin_loop();
+                continue;
+            }
+            let words: [u64; MAX_WORDS] = core::array::from_fn(|i| self.words[i].load(Ordering::Relaxed));
+            atomic::fence(Ordering::Acquire);
+            if self.seq.load(Ordering::Relaxed) == before {
+                return (before, bytemuck::pod_read_unaligned(&bytemuck::cast_slice::<u64, u8>(&words)[..core::mem::size_of::<F>()]));
+            }
+        }
+    }
+}
+
+/// A fixed-size, open-addressed table of the newest pending frame per channel and id, shared by a writer
+/// and its write poller.
+///
+/// The tx lanes carry tokens pointing at slots rather than the coalesced frames themselves. A slot has
+/// at most one token queued at a time, so however many frames are written for a key while the link is
+/// stalled, it takes one place in its lane and only the newest payload goes on the wire.
+pub struct Coalescer<F> {
+    slots: Box<[Slot]>,
+    _frame: PhantomData<F>,
+}
+
+impl<F: Pod> Coalescer<F> {
+    pub fn new() -> Self {
+        assert!(core::mem::size_of::<F>() % 8 == 0 && core::mem::size_of::<F>() <= RdxUsbPacket::SIZE);
+        Self { slots: (0..COALESCE_SLOTS).map(|_| Slot::new()).collect(), _frame: PhantomData }
+    }
+
+    /// Stores `frame` as the newest for `key`. Only the writer may call this.
+    ///
+    /// Returns the frame's slot and whether a token for it needs to be queued, or `None` if every slot has
+    /// a frame waiting to be sent.
+    pub fn store(&self, key: u64, frame: &F) -> Option<(u32, bool)> {
+        let start = slot_index(key);
+        let mut free = None;
+        // keys are never cleared, so the probe only ends at an empty slot; an idle slot on the way is taken
+        // over only once it is sure the key isn't further along
+        for i in 0..COALESCE_SLOTS {
+            let idx = (start + i) & SLOT_MASK;
+            let slot = &self.slots[idx];
+            match slot.key.load(Ordering::Relaxed) {
+                k if k == key => { return Some(self.write(idx, frame)); }
+                EMPTY_KEY => {
+                    free.get_or_insert(idx);
+                    break;
+                }
+                _ if free.is_none() && slot.is_idle() => { free = Some(idx); }
+                _ => {}
+            }
+        }
+        let idx = free?;
+        self.slots[idx].key.store(key, Ordering::Relaxed);
+        Some(self.write(idx, frame))
+    }
+
+    fn write(&self, idx: usize, frame: &F) -> (u32, bool) {
+        let slot = &self.slots[idx];
+        slot.write(frame);
+        // the poller clears this before reading the frame, so either it sees this frame or we queue a new token
+        (idx as u32, !slot.queued.swap(true, Ordering::AcqRel))
+    }
+
+    /// Drops the newest frame of a slot whose token didn't fit in its lane. Only the writer may call this.
+    pub fn unqueue(&self, slot: u32) {
+        let slot = &self.slots[slot as usize];
+        slot.sent_seq.store(slot.seq.load(Ordering::Relaxed), Ordering::Release);
+        slot.queued.store(false, Ordering::Release);
+    }
+
+    /// Takes the newest frame of a slot whose token was popped. Only the poller may call this.
+    ///
+    /// Returns `None` if that frame already went out with an earlier token.
+    pub fn take(&self, slot: u32) -> Option<F> {
+        let slot = &self.slots[slot as usize];
+        slot.queued.swap(false, Ordering::AcqRel);
+        let (seq, frame) = slot.read();
+        if slot.sent_seq.load(Ordering::Relaxed) == seq { return None; }
+        slot.sent_seq.store(seq, Ordering::Release);
+        Some(frame)
+    }
+}
+
+impl<F: Pod> Default for Coalescer<F> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::{is_whole, packet};
+
+    #[test]
+    fn newer_frames_replace_pending_ones() {
+        let coalescer = Coalescer::<RdxUsbPacket>::new();
+        let (slot, queue) = coalescer.store(key(0, 0x10), &packet(0x10, 1, 64)).unwrap();
+        assert!(queue);
+        assert_eq!(coalescer.store(key(0, 0x10), &packet(0x10, 2, 64)), Some((slot, false)));
+        assert_ne!(coalescer.store(key(1, 0x10), &packet(0x10, 3, 64)).unwrap().0, slot);
+
+        assert_eq!(coalescer.take(slot).unwrap().data[0], 2);
+        // nothing newer was stored, so a stale token sends nothing
+        assert!(coalescer.take(slot).is_none());
+        assert_eq!(coalescer.store(key(0, 0x10), &packet(0x10, 4, 64)), Some((slot, true)));
+        assert_eq!(coalescer.take(slot).unwrap().data[0], 4);
+    }
+
+    #[test]
+    fn unqueued_slots_queue_again() {
+        let coalescer = Coalescer::<RdxUsbPacket>::new();
+        let (slot, _) = coalescer.store(key(0, 1), &packet(1, 1, 64)).unwrap();
+        coalescer.unqueue(slot);
+        assert_eq!(coalescer.store(key(0, 1), &packet(1, 2, 64)), Some((slot, true)));
+    }
+
+    #[test]
+    fn slots_are_reused_once_their_frame_is_done_with() {
+        let coalescer = Coalescer::<RdxUsbPacket>::new();
+        let slots: Vec<u32> = (0..COALESCE_SLOTS as u32).map(|id| coalescer.store(key(0, id), &packet(id, 1, 8)).unwrap().0).collect();
+        // every slot has a frame waiting
+        assert_eq!(coalescer.store(key(1, 0), &packet(0, 1, 8)), None);
+
+        for &slot in &slots[..COALESCE_SLOTS - 1] { assert!(coalescer.take(slot).is_some()); }
+        coalescer.unqueue(slots[COALESCE_SLOTS - 1]);
+        for id in 0..COALESCE_SLOTS as u32 {
+            assert_eq!(coalescer.store(key(1, id), &packet(id, 2, 8)).map(|(_, queue)| queue), Some(true));
+        }
+        assert_eq!(coalescer.store(key(2, 0), &packet(0, 3, 8)), None);
+    }
+
+    #[test]
+    fn a_known_key_keeps_its_slot_past_idle_ones() {
+        let coalescer = Coalescer::<RdxUsbPacket>::new();
+        let slots: Vec<u32> = (0..COALESCE_SLOTS as u32).map(|id| coalescer.store(key(0, id), &packet(id, 1, 8)).unwrap().0).collect();
+        for &slot in &slots { coalescer.take(slot); }
+        // with every slot idle, each key still finds its own slot rather than the first idle one on its probe
+        for (id, &slot) in slots.iter().enumerate() {
+            assert_eq!(coalescer.store(key(0, id as u32), &packet(id as u32, 2, 8)), Some((slot, true)));
+        }
+    }
+
+    #[test]
+    fn reads_are_never_torn() {
+        let coalescer = std::sync::Arc::new(Coalescer::<RdxUsbPacket>::new());
+        let (slot, _) = coalescer.store(key(0, 0x42), &packet(0x42, 0, 64)).unwrap();
+        let writer = {
+            let coalescer = coalescer.clone();
+            std::thread::spawn(move || {
+                for i in 0..100_000u32 { coalescer.store(key(0, 0x42), &packet(0x42, i, 64)); }
+            })
+        };
+        while !writer.is_finished() {
+            if let Some(frame) = coalescer.take(slot) { assert!(is_whole(&frame)); }
+        }
+        writer.join().unwrap();
+    }
+}
@@ -0,0 +1,193 @@
+//! Compact and columnar encodings of received packets, for reads that copy less than a whole [`RdxUsbPacket`] each.
+//!
+//! Most frames carry 8 data bytes or fewer, so copying the full 80-byte packet out of a ring moves about ten
+//! times more memory than the payload. [`CompactWriter`] packs each packet into a variable-length record of
+//! its 16-byte header and `dlc` data bytes. [`Columns`] splits packets into separate arrays (struct of arrays)
+//! so a decoder can scan ids without touching timestamps or payloads.
+
+use rdxusb_protocol::RdxUsbPacket;
+
+/// Size of the header in front of each compact record: the first 16 bytes of an [`RdxUsbPacket`].
+pub const COMPACT_HEADER_SIZE: usize = 16;
+/// Compact records start at multiples of this, so their headers can be read in place from an aligned buffer.
+pub const COMPACT_ALIGN: usize = 8;
+/// Most data bytes a packet carries.
+const MAX_DATA: usize = 64;
+
+/// Size of the compact record of a packet with `dlc` data bytes, including the padding after it.
+pub const fn compact_record_size(dlc: u8) -> usize {
+    let dlc = if dlc as usize > MAX_DATA { MAX_DATA } else { dlc as usize };
+    (COMPACT_HEADER_SIZE + dlc + COMPACT_ALIGN - 1) & !(COMPACT_ALIGN - 1)
+}
+
+/// Packs packets back to back into a byte buffer as compact records.
+///
+/// Each record is the packet's header, then its data bytes, then zero padding up to [`COMPACT_ALIGN`].
+/// A `dlc` above 64 is clamped to 64 in the record, so the record sizes always follow from the headers.
+pub struct CompactWriter<'a> {
+    buf: &'a mut [u8],
+    len: usize,
+}
+
+impl<'a> CompactWriter<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        Self { buf, len: 0 }
+    }
+
+    /// Appends a packet's record. Returns false, writing nothing, if it doesn't fit.
+    pub fn push(&mut self, packet: &RdxUsbPacket) -> bool {
+        let dlc = packet.dlc.min(MAX_DATA as u8);
+        let size = compact_record_size(dlc);
+        let Some(record) = self.buf.get_mut(self.len..self.len + size) else { return false; };
+        let (header, data) = record.split_at_mut(COMPACT_HEADER_SIZE);
+        header.copy_from_slice(&bytemuck::bytes_of(packet)[..COMPACT_HEADER_SIZE]);
+        header[12] = dlc;
+        let (data, padding) = data.split_at_mut(dlc as usize);
+        data.copy_from_slice(&packet.data[..dlc as usize]);
+        padding.fill(0);
+        self.len += size;
+        true
+    }
+
+    /// Number of bytes written so far.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Starts over from the front of the buffer.
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+}
+
+/// Iterates over the records written by a [`CompactWriter`], yielding each packet's header and data bytes.
+pub struct CompactRecords<'a> {
+    buf: &'a [u8],
+}
+
+impl<'a> CompactRecords<'a> {
+    pub fn new(buf: &'a [u8]) -> Self {
+        Self { buf }
+    }
+}
+
+impl<'a> Iterator for CompactRecords<'a> {
+    /// The packet with its data past `dlc` zeroed, and the record's data bytes.
+    type Item = (RdxUsbPacket, &'a [u8]);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let header = self.buf.get(..COMPACT_HEADER_SIZE)?;
+        let dlc = header[12];
+        let record = self.buf.get(..compact_record_size(dlc))?;
+        let data = &record[COMPACT_HEADER_SIZE..COMPACT_HEADER_SIZE + dlc as usize];
+        let mut packet = <RdxUsbPacket as bytemuck::Zeroable>::zeroed();
+        bytemuck::bytes_of_mut(&mut packet)[..COMPACT_HEADER_SIZE].copy_from_slice(header);
+        packet.data[..data.len()].copy_from_slice(data);
+        self.buf = &self.buf[record.len()..];
+        Some((packet, data))
+    }
+}
+
+/// Destination arrays of a columnar read. Packet `i` goes in entry `i` of every column that is present.
+///
+/// Columns left out are skipped entirely, so a reader only pays for the fields it uses.
+/// Every present column must hold as many entries as the read asks for.
+#[derive(Default)]
+pub struct Columns<'a> {
+    pub timestamps_ns: Option<&'a mut [u64]>,
+    pub arb_ids: Option<&'a mut [u32]>,
+    pub dlcs: Option<&'a mut [u8]>,
+    /// `payload_stride` bytes per packet: its data, cut off at the stride and zero-filled past `dlc`.
+    pub payloads: Option<&'a mut [u8]>,
+    pub payload_stride: usize,
+}
+
+impl Columns<'_> {
+    /// Number of packets that fit in every present column.
+    pub fn capacity(&self) -> usize {
+        let payloads = self.payloads.as_ref().map(|p| match self.payload_stride {
+            0 => usize::MAX,
+            stride => p.len() / stride,
+        });
+        [self.timestamps_ns.as_ref().map(|c| c.len()), self.arb_ids.as_ref().map(|c| c.len()), self.dlcs.as_ref().map(|c| c.len()), payloads]
+            .into_iter()
+            .flatten()
+            .min()
+            .unwrap_or(usize::MAX)
+    }
+
+    /// Writes packet `idx`. `idx` must be below [`capacity`](Self::capacity).
+    pub fn write(&mut self, idx: usize, packet: &RdxUsbPacket) {
+        if let Some(c) = self.timestamps_ns.as_deref_mut() { c[idx] = packet.timestamp_ns; }
+        if let Some(c) = self.arb_ids.as_deref_mut() { c[idx] = packet.arb_id; }
+        if let Some(c) = self.dlcs.as_deref_mut() { c[idx] = packet.dlc; }
+        if let Some(c) = self.payloads.as_deref_mut() {
+            let stride = self.payload_stride;
+            let payload = &mut c[idx * stride..(idx + 1) * stride];
+            let n = (packet.dlc as usize).min(stride).min(MAX_DATA);
+            payload[..n].copy_from_slice(&packet.data[..n]);
+            payload[n..].fill(0);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::packet;
+
+    #[test]
+    fn record_sizes_are_aligned() {
+        assert_eq!(compact_record_size(0), 16);
+        assert_eq!(compact_record_size(1), 24);
+        assert_eq!(compact_record_size(8), 24);
+        assert_eq!(compact_record_size(9), 32);
+        assert_eq!(compact_record_size(64), 80);
+        assert_eq!(compact_record_size(255), 80);
+    }
+
+    #[test]
+    fn compact_round_trips() {
+        let packets = [packet(0x123, 1, 8), packet(0x456, 2, 0), packet(0x789, 3, 64), packet(0xabc, 4, 3)];
+        let mut buf = [0xffu8; 512];
+        let mut writer = CompactWriter::new(&mut buf);
+        for p in &packets { assert!(writer.push(p)); }
+        assert_eq!(writer.len(), 24 + 16 + 80 + 24);
+        let len = writer.len();
+
+        let read: Vec<_> = CompactRecords::new(&buf[..len]).collect();
+        assert_eq!(read.len(), packets.len());
+        for ((decoded, data), original) in read.iter().zip(&packets) {
+            assert_eq!(decoded, original);
+            assert_eq!(*data, &original.data[..original.dlc as usize]);
+        }
+        // padding is zeroed, not left over from the buffer
+        assert_eq!(&buf[16 + 3 + 120..144], &[0; 5]);
+    }
+
+    #[test]
+    fn compact_stops_when_full() {
+        let mut buf = [0u8; 40];
+        let mut writer = CompactWriter::new(&mut buf);
+        assert!(writer.push(&packet(1, 1, 8)));
+        assert!(!writer.push(&packet(2, 2, 8)));
+        assert!(writer.push(&packet(3, 3, 0)));
+        assert_eq!(writer.len(), 40);
+    }
+
+    #[test]
+    fn columns_skip_missing_and_truncate_payloads() {
+        let mut ids = [0u32; 4];
+        let mut payloads = [0xffu8; 16];
+        let mut columns = Columns { arb_ids: Some(&mut ids), payloads: Some(&mut payloads), payload_stride: 4, ..Default::default() };
+        assert_eq!(columns.capacity(), 4);
+        columns.write(0, &packet(0x10, 7, 8));
+        columns.write(1, &packet(0x20, 9, 2));
+        assert_eq!(&ids[..2], &[0x10, 0x20]);
+        assert_eq!(&payloads[..8], &[7, 7, 7, 7, 9, 9, 0, 0]);
+    }
+}
@@ -0,0 +1,261 @@
+//! Asynchronous vendor control transfers, run on the event loop.
+//!
+//! Control transfers go over the default control pipe rather than the bulk endpoints, so configuration
+//! traffic doesn't queue behind realtime frames. Each request is its own task on the event loop runtime,
+//! so any number can be in flight on one device or across devices, and callers collect the results later
+//! by polling or waiting.
+
+use std::{collections::HashMap, sync::{atomic::{AtomicI32, Ordering}, Arc, Condvar, Mutex, MutexGuard}, time::Instant};
+
+use nusb::transfer::{ControlIn, ControlOut, ControlType, Recipient, TransferError};
+use tokio::{runtime::Handle, task::JoinHandle};
+
+use crate::{event_loop::EventLoopError, handle_table::HANDLES, transport::Transport, virtual_device::VirtualTransport};
+
+/// Most control requests in flight or waiting to be collected at once, over all handles.
+pub const MAX_CONTROL_REQUESTS: usize = 1024;
+
+/// Direction of a control transfer.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ControlDirection {
+    /// Device to host.
+    In,
+    /// Host to device.
+    Out,
+}
+
+impl TryFrom<u8> for ControlDirection {
+    type Error = u8;
+
+    fn try_from(value: u8) -> Result<Self, Self::Error> {
+        match value {
+            0 => Ok(Self::Out),
+            1 => Ok(Self::In),
+            v => Err(v),
+        }
+    }
+}
+
+/// Setup of a vendor control request to the RdxUsb interface.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ControlSetup {
+    pub direction: ControlDirection,
+    /// The vendor request code, as in [`rdxusb_protocol::RdxUsbCtrl`].
+    pub request: u8,
+    pub value: u16,
+    pub index: u16,
+    /// For IN requests, the most bytes to read. OUT requests send their data instead.
+    pub length: u16,
+}
+
+/// The interface a handle sends control requests to, taken from its connected device.
+#[derive(Clone)]
+pub enum ControlPort {
+    Usb(nusb::Interface),
+    Virtual(VirtualTransport),
+}
+
+impl ControlPort {
+    /// Runs one control transfer. Returns the data read, or for OUT requests the data sent.
+    pub async fn transfer(&self, setup: ControlSetup, data: Vec<u8>) -> Result<Vec<u8>, TransferError> {
+        match self {
+            ControlPort::Usb(iface) => transfer(iface, setup, data).await,
+            ControlPort::Virtual(transport) => transfer(transport, setup, data).await,
+        }
+    }
+}
+
+async fn transfer<T: Transport>(iface: &T, setup: ControlSetup, data: Vec<u8>) -> Result<Vec<u8>, TransferError> {
+    match setup.direction {
+        ControlDirection::In => iface.control_in(ControlIn {
+            control_type: ControlType::Vendor,
+            recipient: Recipient::Interface,
+            request: setup.request,
+            value: setup.value,
+            index: setup.index,
+            length: setup.length,
+        }).await.into_result(),
+        ControlDirection::Out => {
+            iface.control_out(ControlOut {
+                control_type: ControlType::Vendor,
+                recipient: Recipient::Interface,
+                request: setup.request,
+                value: setup.value,
+                index: setup.index,
+                data: &data,
+            }).await.into_result()?;
+            Ok(data)
+        }
+    }
+}
+
+/// Where a request stands, as seen by callers collecting it.
+enum Outcome {
+    Pending,
+    Done(Result<Vec<u8>, EventLoopError>),
+    /// The result was taken by a caller, which removes the request from the table.
+    Collected,
+}
+
+/// Where a request's task leaves its result.
+struct Completion {
+    result: Mutex<Outcome>,
+    done: Condvar,
+}
+
+impl Completion {
+    fn complete(&self, result: Result<Vec<u8>, EventLoopError>) {
+        if let Ok(mut slot) = self.result.lock() {
+            // the first result wins, so a transfer finishing after its handle closed can't overwrite that
+            if matches!(*slot, Outcome::Pending) { *slot = Outcome::Done(result); }
+        }
+        self.done.notify_all();
+    }
+}
+
+/// A submitted control request.
+struct ControlRequest {
+    handle_id: i32,
+    completion: Arc<Completion>,
+    task: JoinHandle<()>,
+}
+
+/// Control requests that are in flight or not collected yet, keyed by request id.
+pub struct ControlRequests {
+    next_id: AtomicI32,
+    requests: Mutex<Option<HashMap<i32, ControlRequest>>>,
+}
+
+impl ControlRequests {
+    const fn new() -> Self {
+        Self { next_id: AtomicI32::new(0), requests: Mutex::new(None) }
+    }
+
+    fn lock(&self) -> Result<MutexGuard<'_, Option<HashMap<i32, ControlRequest>>>, EventLoopError> {
+        self.requests.lock().map_err(|_e| EventLoopError::EventLoopCrashed)
+    }
+
+    /// Starts a control request on a handle's connected device. OUT requests send `data`.
+    ///
+    /// Returns a non-negative request id, to collect the result with [`poll`](Self::poll) or [`wait`](Self::wait).
+    pub fn submit(&self, rt: &Handle, handle_id: i32, setup: ControlSetup, data: &[u8]) -> Result<i32, EventLoopError> {
+        if setup.direction == ControlDirection::Out && data.len() > u16::MAX as usize { return Err(EventLoopError::InvalidArgument); }
+        let port = HANDLES.get(handle_id)?.control_port(handle_id)?;
+
+        let mut requests = self.lock()?;
+        let requests = requests.get_or_insert_with(HashMap::new);
+        if requests.len() >= MAX_CONTROL_REQUESTS { return Err(EventLoopError::TooManyControlRequests); }
+        let request_id = loop {
+            let id = self.next_id.fetch_add(1, Ordering::Relaxed) & i32::MAX;
+            if !requests.contains_key(&id) { break id; }
+        };
+        let completion = Arc::new(Completion { result: Mutex::new(Outcome::Pending), done: Condvar::new() });
+        let data = match setup.direction {
+            ControlDirection::In => Vec::new(),
+            ControlDirection::Out => data.to_vec(),
+        };
+        let task = rt.spawn({
+            let completion = completion.clone();
+            async move {
+                let result = port.transfer(setup, data).await.map_err(|e| match e {
+                    TransferError::Disconnected => EventLoopError::DeviceNotConnected,
+                    _ => EventLoopError::ControlTransferFailed,
+                });
+                completion.complete(result);
+            }
+        });
+        requests.insert(request_id, ControlRequest { handle_id, completion, task });
+        Ok(request_id)
+    }
+
+    /// Collects a finished request, copying the data it read or sent into `data`.
+    ///
+    /// Returns the full transfer length, which can be more than was copied.
+    /// Fails with [`EventLoopError::ControlPending`] while the request is still in flight.
+    pub fn poll(&self, request_id: i32, data: &mut [u8]) -> Result<usize, EventLoopError> {
+        self.wait(request_id, Some(Instant::now()), data)
+    }
+
+    /// Like [`poll`](Self::poll), but first blocks until the request finishes or the deadline passes.
+    /// A `None` deadline waits forever.
+    pub fn wait(&self, request_id: i32, deadline: Option<Instant>, data: &mut [u8]) -> Result<usize, EventLoopError> {
+        let completion = {
+            let requests = self.lock()?;
+            let request = requests.as_ref().and_then(|r| r.get(&request_id)).ok_or(EventLoopError::ControlRequestNotFound)?;
+            request.completion.clone()
+        };
+
+        let result = {
+            let mut result = completion.result.lock().map_err(|_e| EventLoopError::EventLoopCrashed)?;
+            while matches!(*result, Outcome::Pending) {
+                result = match deadline {
+                    Some(deadline) => {
+                        let Some(remaining) = deadline.checked_duration_since(Instant::now()) else { return Err(EventLoopError::ControlPending); };
+                        completion.done.wait_timeout(result, remaining).map_err(|_e| EventLoopError::EventLoopCrashed)?.0
+                    }
+                    None => completion.done.wait(result).map_err(|_e| EventLoopError::EventLoopCrashed)?,
+                };
+            }
+            match std::mem::replace(&mut *result, Outcome::Collected) {
+                Outcome::Done(result) => result,
+                // another caller collecting the same request took the result first
+                _ => { return Err(EventLoopError::ControlRequestNotFound); }
+            }
+        };
+        // the table is only locked after the completion is released, as cancel_handle locks them the other way round
+        if let Ok(mut requests) = self.lock() {
+            if let Some(requests) = requests.as_mut() { requests.remove(&request_id); }
+        }
+
+        let transferred = result?;
+        let n = transferred.len().min(data.len());
+        data[..n].copy_from_slice(&transferred[..n]);
+        Ok(transferred.len())
+    }
+
+    /// Abandons a request. Its transfer is cancelled if it hasn't finished.
+    pub fn cancel(&self, request_id: i32) -> Result<(), EventLoopError> {
+        let request = self.lock()?.as_mut().and_then(|r| r.remove(&request_id)).ok_or(EventLoopError::ControlRequestNotFound)?;
+        request.task.abort();
+        request.completion.complete(Err(EventLoopError::ControlRequestNotFound));
+        Ok(())
+    }
+
+    /// Abandons every request of a handle, failing anyone waiting on them. This is called when the handle is closed.
+    pub fn cancel_handle(&self, handle_id: i32) {
+        let Ok(mut requests) = self.requests.lock() else { return; };
+        let Some(requests) = requests.as_mut() else { return; };
+        requests.retain(|_, request| {
+            if request.handle_id != handle_id { return true; }
+            request.task.abort();
+            request.completion.complete(Err(EventLoopError::DeviceNotOpened));
+            false
+        });
+    }
+}
+
+pub static CONTROL_REQUESTS: ControlRequests = ControlRequests::new();
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn only_one_waiter_collects_a_request() {
+        let rt = tokio::runtime::Builder::new_current_thread().build().unwrap();
+        let requests = ControlRequests::new();
+        let completion = Arc::new(Completion { result: Mutex::new(Outcome::Pending), done: Condvar::new() });
+        let task = rt.spawn(std::future::pending::<()>());
+        requests.lock().unwrap().get_or_insert_with(HashMap::new).insert(7, ControlRequest { handle_id: 0, completion: completion.clone(), task });
+
+        let results = std::thread::scope(|s| {
+            let waiters: Vec<_> = (0..2).map(|_| s.spawn(|| requests.wait(7, None, &mut [0u8; 4]))).collect();
+            std::thread::sleep(std::time::Duration::from_millis(50));
+            completion.complete(Ok(vec![1, 2, 3]));
+            waiters.into_iter().map(|w| w.join().unwrap()).collect::<Vec<_>>()
+        });
+        assert_eq!(results.iter().filter(|r| **r == Ok(3)).count(), 1);
+        assert_eq!(results.iter().filter(|r| **r == Err(EventLoopError::ControlRequestNotFound)).count(), 1);
+        assert_eq!(requests.wait(7, None, &mut []), Err(EventLoopError::ControlRequestNotFound));
+    }
+}
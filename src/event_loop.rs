@@ -1,12 +1,12 @@
 #![allow(unused)]
 
-use std::{cell::OnceCell, collections::HashMap, ops::{Deref, DerefMut}, sync::{Arc, Mutex, MutexGuard}};
+use std::{cell::OnceCell, collections::HashMap, ops::{Deref, DerefMut}, path::Path, sync::{Arc, Mutex, MutexGuard}, time::{Duration, Instant}};
 use futures_util::stream::StreamExt;
 use nusb::{DeviceId, DeviceInfo};
-use rdxusb_protocol::RdxUsbPacket;
-use tokio::runtime::Runtime;
+use rdxusb_protocol::{RdxUsbFsPacket, RdxUsbPacket};
+use tokio::runtime::{Handle, Runtime};
 
-use crate::host::{RdxUsbFsChannel, RdxUsbFsHost, RdxUsbFsWriter, RdxUsbHostError};
+use crate::{broker::{BrokerClient, BrokerServer, BrokerTransport, BROKER_TX_RETRY, BROKER_WAKE_INTERVAL}, callback::RxCallback, capture::{CaptureReader, CaptureRecord, Direction}, compact::{Columns, CompactWriter}, control::{ControlPort, ControlSetup, CONTROL_REQUESTS}, filter::{FilterSet, RdxUsbFilter}, handle_table::{HandleSlot, HANDLES}, clock::monotonic_ns, mailbox::MailboxMode, periodic::PERIODIC_JOBS, registry::DEVICE_REGISTRY, runtime::RuntimeConfig, ring::{packet_ring, RingConsumer, RingMapping, RingProducer, RingView}, host::{self, OverflowPolicy, RdxUsbChannel, RdxUsbFsChannel, RdxUsbFsHost, RdxUsbFsWriter, RdxUsbHost, RdxUsbHostError, RdxUsbHostResult, RdxUsbHsChannel, RdxUsbHsHost, RdxUsbHsWriter, RdxUsbWriter, RxRings, TxLane, TxLaneConfig, TxRings, UsbFrame}, stats::{DeviceStats, DeviceStatsSnapshot, MAX_STATS_CHANNELS}, transport::Transport, virtual_device::{VirtualDeviceConfig, VirtualTransport, VIRTUAL_DEVICES, VIRTUAL_VID}};
 
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -16,9 +16,24 @@ pub enum EventLoopError {
     EventLoopCrashed = -100,
     CannotListDevices = -101,
     DeviceIterInvalid = -102,
+    TooManyDevices = -105,
+    EventHandleUnavailable = -106,
+    InvalidArgument = -107,
+    PeriodicJobNotFound = -108,
+    EventLoopAlreadyStarted = -109,
+    CaptureIo = -110,
+    TracingDisabled = -111,
+    ControlRequestNotFound = -112,
+    ControlPending = -113,
+    TooManyControlRequests = -114,
+    BrokerUnavailable = -115,
     DeviceNotOpened = -200,
     DeviceNotConnected = -201,
     ChannelOutOfRange = -202,
+    MailboxDisabled = -203,
+    MailboxEmpty = -204,
+    NoClockEstimate = -205,
+    ControlTransferFailed = -206,
 }
 
 impl EventLoopError {
@@ -27,9 +42,24 @@ impl EventLoopError {
     pub const ERR_DEVICE_ITER_INVALID: i32 = -102;
     pub const ERR_DEVICE_ITER_IDX_OUT_OF_RANGE: i32 = -103;
     pub const ERR_NULL_PTR: i32 = -104;
+    pub const ERR_TOO_MANY_DEVICES: i32 = -105;
+    pub const ERR_EVENT_HANDLE_UNAVAILABLE: i32 = -106;
+    pub const ERR_INVALID_ARGUMENT: i32 = -107;
+    pub const ERR_PERIODIC_JOB_NOT_FOUND: i32 = -108;
+    pub const ERR_EVENT_LOOP_ALREADY_STARTED: i32 = -109;
+    pub const ERR_CAPTURE_IO: i32 = -110;
+    pub const ERR_TRACING_DISABLED: i32 = -111;
+    pub const ERR_CONTROL_REQUEST_NOT_FOUND: i32 = -112;
+    pub const ERR_CONTROL_PENDING: i32 = -113;
+    pub const ERR_TOO_MANY_CONTROL_REQUESTS: i32 = -114;
+    pub const ERR_BROKER_UNAVAILABLE: i32 = -115;
     pub const ERR_DEVICE_NOT_OPENED: i32 = -200;
     pub const ERR_DEVICE_NOT_CONNECTED: i32 = -201;
     pub const ERR_CHANNEL_OUT_OF_RANGE: i32 = -202;
+    pub const ERR_MAILBOX_DISABLED: i32 = -203;
+    pub const ERR_MAILBOX_EMPTY: i32 = -204;
+    pub const ERR_NO_CLOCK_ESTIMATE: i32 = -205;
+    pub const ERR_CONTROL_TRANSFER_FAILED: i32 = -206;
 
 }
 
@@ -40,69 +70,283 @@ impl From<EventLoopError> for i32 {
 }
 
 
+/// Why a read from a device's rx channels failed. An empty channel isn't a failure; reads return 0 or `None` then.
 pub enum DeviceIOError {
     ChannelOutOfRange,
-    NoData,
+}
+
+impl From<DeviceIOError> for EventLoopError {
+    fn from(value: DeviceIOError) -> Self {
+        match value {
+            DeviceIOError::ChannelOutOfRange => EventLoopError::ChannelOutOfRange,
+        }
+    }
 }
 
 pub enum DeviceChannels {
     FsDevice(Vec<RdxUsbFsChannel>),
+    HsDevice(Vec<RdxUsbHsChannel>),
+    /// Channels of an in-process virtual device. See [`crate::virtual_device`].
+    Virtual(Vec<RdxUsbChannel<RdxUsbPacket, VirtualTransport>>),
+    /// Channels of a device another process published. See [`crate::broker`].
+    Broker(Vec<RdxUsbChannel<RdxUsbPacket, BrokerTransport>>),
+    /// Rx rings fed from a capture file by [`open_replay`].
+    Replay(Vec<RingConsumer<RdxUsbPacket>>),
 }
 
 pub enum Writer {
     FsDevice(RdxUsbFsWriter),
+    HsDevice(RdxUsbHsWriter),
+    /// Replay handles have nothing to send to, so every write is rejected.
+    Replay,
 }
 
-impl DeviceChannels {}
+impl DeviceChannels {
+    /// Reads one packet, or `None` if the channel is empty.
+    pub fn try_read(&mut self, channel_idx: u8) -> Result<Option<RdxUsbPacket>, DeviceIOError> {
+        match self {
+            DeviceChannels::FsDevice(vec) => {
+                if vec.len() <= channel_idx as usize { return Err(DeviceIOError::ChannelOutOfRange); }
+                Ok(vec[channel_idx as usize].try_read())
+            }
+            DeviceChannels::HsDevice(vec) => {
+                if vec.len() <= channel_idx as usize { return Err(DeviceIOError::ChannelOutOfRange); }
+                Ok(vec[channel_idx as usize].try_read())
+            }
+            DeviceChannels::Virtual(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.try_read())
+            }
+            DeviceChannels::Broker(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.try_read())
+            }
+            DeviceChannels::Replay(vec) => {
+                let Some(ring) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(ring.try_pop())
+            }
+        }
+    }
 
-pub struct OpenDevice {
-    pub channels: DeviceChannels,
-    pub writer: Writer,
-    pub device_id: DeviceId,
-    pub protocol: u8,
-}
+    /// Reads as many packets as are available and fit into `packets`.
+    pub fn read_into(&mut self, channel_idx: u8, packets: &mut [RdxUsbPacket]) -> Result<usize, DeviceIOError> {
+        match self {
+            DeviceChannels::FsDevice(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_into(packets))
+            }
+            DeviceChannels::HsDevice(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_into(packets))
+            }
+            DeviceChannels::Virtual(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_into(packets))
+            }
+            DeviceChannels::Broker(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_into(packets))
+            }
+            DeviceChannels::Replay(vec) => {
+                let Some(ring) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(ring.pop_slice(packets))
+            }
+        }
+    }
 
-impl OpenDevice {
-    pub fn try_read(&mut self, channel_idx: u8) -> Result<RdxUsbPacket, DeviceIOError> {
-        match &mut self.channels {
+    /// Pops up to `max` packets in place with `f`. See [`RingConsumer::pop_each`].
+    pub fn read_each(&mut self, channel_idx: u8, max: usize, f: impl FnMut(usize, &RdxUsbPacket) -> bool) -> Result<usize, DeviceIOError> {
+        match self {
             DeviceChannels::FsDevice(vec) => {
-                if vec.len() <= channel_idx as usize { return Err(DeviceIOError::ChannelOutOfRange); }
-                match vec[channel_idx as usize].try_read() {
-                    Some(p) => Ok(p.into()),
-                    None => Err(DeviceIOError::NoData)
-                }
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_each(max, f))
+            }
+            DeviceChannels::HsDevice(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_each(max, f))
+            }
+            DeviceChannels::Virtual(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_each(max, f))
             }
+            DeviceChannels::Broker(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(channel.read_each(max, f))
+            }
+            DeviceChannels::Replay(vec) => {
+                let Some(ring) = vec.get_mut(channel_idx as usize) else { return Err(DeviceIOError::ChannelOutOfRange); };
+                Ok(ring.pop_each(max, f))
+            }
+        }
+    }
+
+    /// Takes the channels apart into their rx rings' consumer ends, in channel order.
+    pub fn into_rx_queues(self) -> Vec<RingConsumer<RdxUsbPacket>> {
+        match self {
+            DeviceChannels::FsDevice(vec) => vec.into_iter().map(RdxUsbChannel::into_rx_queue).collect(),
+            DeviceChannels::HsDevice(vec) => vec.into_iter().map(RdxUsbChannel::into_rx_queue).collect(),
+            DeviceChannels::Virtual(vec) => vec.into_iter().map(RdxUsbChannel::into_rx_queue).collect(),
+            DeviceChannels::Broker(vec) => vec.into_iter().map(RdxUsbChannel::into_rx_queue).collect(),
+            DeviceChannels::Replay(vec) => vec,
+        }
+    }
+
+    /// The interface control requests to the device go to. Replay and broker client handles have none.
+    pub fn control_port(&self) -> Option<ControlPort> {
+        match self {
+            DeviceChannels::FsDevice(vec) => vec.first().map(|c| ControlPort::Usb(c.interface().clone())),
+            DeviceChannels::HsDevice(vec) => vec.first().map(|c| ControlPort::Usb(c.interface().clone())),
+            DeviceChannels::Virtual(vec) => vec.first().map(|c| ControlPort::Virtual(c.interface().clone())),
+            DeviceChannels::Broker(_) => None,
+            DeviceChannels::Replay(_) => None,
+        }
+    }
+
+    /// Maps a channel's rx ring for in-place reads.
+    pub fn map_rx(&self, channel_idx: u8) -> Result<RingMapping<RdxUsbPacket>, DeviceIOError> {
+        match self {
+            DeviceChannels::FsDevice(vec) => vec.get(channel_idx as usize).map(|c| c.map_rx()).ok_or(DeviceIOError::ChannelOutOfRange),
+            DeviceChannels::HsDevice(vec) => vec.get(channel_idx as usize).map(|c| c.map_rx()).ok_or(DeviceIOError::ChannelOutOfRange),
+            DeviceChannels::Virtual(vec) => vec.get(channel_idx as usize).map(|c| c.map_rx()).ok_or(DeviceIOError::ChannelOutOfRange),
+            DeviceChannels::Broker(vec) => vec.get(channel_idx as usize).map(|c| c.map_rx()).ok_or(DeviceIOError::ChannelOutOfRange),
+            DeviceChannels::Replay(vec) => vec.get(channel_idx as usize).map(|r| r.map()).ok_or(DeviceIOError::ChannelOutOfRange),
         }
     }
 
     pub async fn read(&mut self, channel_idx: u8) -> Result<RdxUsbPacket, RdxUsbHostError> {
-        match &mut self.channels {
+        match self {
             DeviceChannels::FsDevice(vec) => {
                 if vec.len() <= channel_idx as usize { return Err(RdxUsbHostError::NoInterface); }
                 Ok(vec[channel_idx as usize].read().await?.into())
             }
+            DeviceChannels::HsDevice(vec) => {
+                if vec.len() <= channel_idx as usize { return Err(RdxUsbHostError::NoInterface); }
+                Ok(vec[channel_idx as usize].read().await?)
+            }
+            DeviceChannels::Virtual(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(RdxUsbHostError::NoInterface); };
+                Ok(channel.read().await?)
+            }
+            DeviceChannels::Broker(vec) => {
+                let Some(channel) = vec.get_mut(channel_idx as usize) else { return Err(RdxUsbHostError::NoInterface); };
+                Ok(channel.read().await?)
+            }
+            DeviceChannels::Replay(vec) => {
+                let Some(ring) = vec.get_mut(channel_idx as usize) else { return Err(RdxUsbHostError::NoInterface); };
+                ring.pop().await.ok_or(RdxUsbHostError::DeviceDisconnected)
+            }
         }
     }
+}
+
+impl Writer {
+    /// The lane a packet goes in: `lane` if given, otherwise the one its id maps to.
+    pub fn lane_for(&self, packet: &RdxUsbPacket, lane: Option<TxLane>) -> TxLane {
+        let config = match self {
+            Writer::FsDevice(writer) => writer.lane_config(),
+            Writer::HsDevice(writer) => writer.lane_config(),
+            Writer::Replay => { return TxLane::Normal; }
+        };
+        lane.unwrap_or_else(|| config.lane_for(packet.arb_id))
+    }
 
-    pub fn try_write(&mut self, packet: &RdxUsbPacket) -> Result<(), RdxUsbPacket> {
-        match &mut self.writer {
+    pub fn try_write(&mut self, packet: &RdxUsbPacket, lane: Option<TxLane>) -> Result<(), RdxUsbPacket> {
+        let lane = self.lane_for(packet, lane);
+        match self {
             Writer::FsDevice(writer) => {
-                match writer.try_send(packet.clone().try_into()?) {
+                match writer.try_send_lane(lane, packet.clone().try_into()?) {
                     Some(s) => Err(s.into()),
                     None => Ok(())
                 }
             }
+            Writer::HsDevice(writer) => {
+                match writer.try_send_lane(lane, UsbFrame::from_packet(*packet)?) {
+                    Some(s) => Err(s),
+                    None => Ok(())
+                }
+            }
+            Writer::Replay => Err(*packet),
+        }
+    }
+
+    pub fn set_coalescing(&mut self, filters: Option<Arc<FilterSet>>) {
+        match self {
+            Writer::FsDevice(writer) => writer.set_coalescing(filters),
+            Writer::HsDevice(writer) => writer.set_coalescing(filters),
+            Writer::Replay => {}
+        }
+    }
+
+    pub fn into_fs(self) -> Option<RdxUsbFsWriter> {
+        match self {
+            Writer::FsDevice(writer) => Some(writer),
+            _ => None,
+        }
+    }
+
+    pub fn into_hs(self) -> Option<RdxUsbHsWriter> {
+        match self {
+            Writer::HsDevice(writer) => Some(writer),
+            _ => None,
+        }
+    }
+
+    /// Number of packets waiting to be sent, over all lanes.
+    pub fn occupied_len(&self) -> usize {
+        match self {
+            Writer::FsDevice(writer) => writer.occupied_len(),
+            Writer::HsDevice(writer) => writer.occupied_len(),
+            Writer::Replay => 0,
         }
     }
 
     pub async fn write(&mut self, packet: RdxUsbPacket)  -> Result<(), RdxUsbPacket> {
-        match &mut self.writer {
+        match self {
             Writer::FsDevice(writer) => {
                 match writer.send(packet.try_into()?).await {
                     Ok(_) => Ok(()),
                     Err(p) => Err(p.into())
                 }
             }
+            Writer::HsDevice(writer) => {
+                match writer.send(UsbFrame::from_packet(packet)?).await {
+                    Ok(_) => Ok(()),
+                    Err(p) => Err(p)
+                }
+            }
+            Writer::Replay => Err(packet),
+        }
+    }
+}
+
+/// The physical device a poller is currently connected to, so hotplug can report its disconnect.
+#[derive(Default)]
+pub struct Connection {
+    /// Each connection gets its own notifier, so a disconnect reported late can't end the next connection.
+    current: Mutex<Option<(DeviceId, Arc<tokio::sync::Notify>)>>,
+}
+
+impl Connection {
+    /// Records a new connection, returning the notifier that fires when hotplug reports it gone.
+    pub fn connect(&self, device_id: DeviceId) -> Arc<tokio::sync::Notify> {
+        let notify = Arc::new(tokio::sync::Notify::new());
+        if let Ok(mut current) = self.current.lock() { *current = Some((device_id, notify.clone())); }
+        notify
+    }
+
+    pub fn clear(&self) {
+        if let Ok(mut current) = self.current.lock() { current.take(); }
+    }
+
+    /// Tells the poller its device is gone, if `device_id` is the device it is connected to.
+    pub fn disconnected(&self, device_id: DeviceId) -> bool {
+        let Ok(current) = self.current.lock() else { return false; };
+        match current.as_ref() {
+            Some((id, notify)) if *id == device_id => {
+                notify.notify_one();
+                true
+            }
+            _ => false,
         }
     }
 }
@@ -112,10 +356,10 @@ pub struct Device {
     pub vid: u16,
     pub pid: u16,
     pub serial_number: Option<String>,
-    pub handle: Option<OpenDevice>,
     pub poller_handle: tokio::task::JoinHandle<()>,
     pub device_info_out: tokio::sync::watch::Sender<Option<DeviceInfo>>,
     pub shutdown: Arc<tokio::sync::Notify>,
+    pub connection: Arc<Connection>,
 }
 
 impl Device {
@@ -139,13 +383,18 @@ impl Device {
 
 pub struct EventLoop {
     pub devices: HashMap<i32, Device>,
-    pub next_handle: i32,
-    pub rt: Runtime,
+    pub rt: Handle,
+    /// The runtime, unless it is owned by its own thread in single-thread mode.
+    _runtime: Option<Runtime>,
 }
 
 impl EventLoop {
     pub fn new() -> Self {
-        let rt = Runtime::new().expect("Unable to create tokio runtime");
+        Self::with_config(&RuntimeConfig::default()).expect("Unable to create tokio runtime")
+    }
+
+    pub fn with_config(config: &RuntimeConfig) -> Result<Self, EventLoopError> {
+        let (rt, runtime) = config.start()?;
 
         // Enter the runtime so that `tokio::spawn` is available immediately.
         let _enter = rt.enter();
@@ -169,30 +418,21 @@ impl EventLoop {
             });
         }
 
-        Self {
+        Ok(Self {
             devices: HashMap::new(),
-            next_handle: 0i32,
             rt,
-        }
-    }
-
-    pub fn update_open_device(&mut self, id: i32, device: OpenDevice) {
-        self.devices.get_mut(&id).unwrap().handle.replace(device);
-
-    }
-
-    pub fn remove_open_device(&mut self, id: i32) {
-        if let Some(d) = self.devices.get_mut(&id) {
-            d.handle.take();
-        }
+            _runtime: runtime,
+        })
     }
 
-    pub fn acquire_open_device(&mut self, id: i32) -> Result<&mut OpenDevice, EventLoopError> {
-        let Some(device) = self.devices.get_mut(&id) else { return Err(EventLoopError::DeviceNotOpened); };
-        let Some(open_device) = device.handle.as_mut() else { return Err(EventLoopError::DeviceNotConnected); };
-        Ok(open_device)
+    /// Removes a device entry and frees its handle slot.
+    pub fn remove_device(&mut self, id: i32) -> Option<Device> {
+        let device = self.devices.remove(&id);
+        PERIODIC_JOBS.cancel_handle(id);
+        CONTROL_REQUESTS.cancel_handle(id);
+        HANDLES.release(id);
+        device
     }
-
 }
 
 static EVENT_LOOP: Mutex<OnceCell<EventLoop>> = Mutex::new(OnceCell::new());
@@ -222,17 +462,216 @@ pub fn try_acquire_event_loop<'a>() -> Result<EventLoopGuard<'a>, EventLoopError
     Ok(EventLoopGuard(event_loop_lock))
 }
 
+/// Starts the event loop with a custom runtime configuration.
+///
+/// This must be called before anything else starts the event loop, like opening a device.
+pub fn init_event_loop(config: &RuntimeConfig) -> Result<(), EventLoopError> {
+    let event_loop_lock = EVENT_LOOP.lock().map_err(|_e| EventLoopError::EventLoopCrashed)?;
+    if event_loop_lock.get().is_some() { return Err(EventLoopError::EventLoopAlreadyStarted); }
+    let _ = event_loop_lock.set(EventLoop::with_config(config)?);
+    Ok(())
+}
+
+
+/// Default number of bulk IN transfers kept in flight per device.
+pub const DEFAULT_IN_TRANSFERS: usize = 32;
+/// Default number of bulk OUT transfers kept in flight per device.
+pub const DEFAULT_OUT_TRANSFERS: usize = 8;
+/// Default number of packets buffered per queue.
+pub const DEFAULT_QUEUE_CAPACITY: usize = 256;
+/// Longest interval between reconnect probes.
+pub const RECONNECT_PROBE_MAX_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Per-device transport tuning.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DeviceOptions {
+    /// Capacity of each channel's rx queue, in packets.
+    pub rx_capacity: usize,
+    /// Capacity of the normal tx lane, in packets. See [`TxLaneConfig`] for the lanes.
+    pub tx_capacity: usize,
+    /// Capacity of the urgent tx lane, in packets. 0, the default, disables it.
+    /// While it is enabled, the other lanes keep at most one transfer in flight.
+    pub tx_urgent_capacity: usize,
+    /// Capacity of the bulk tx lane, in packets. 0 disables it.
+    pub tx_bulk_capacity: usize,
+    /// Packets written without a lane whose id is below this go in the urgent lane.
+    pub tx_urgent_below: u32,
+    /// Packets written without a lane whose id is at or above this go in the bulk lane.
+    pub tx_bulk_from: u32,
+    /// Number of bulk IN transfers kept in flight.
+    pub in_transfers: usize,
+    /// Number of bulk OUT transfers kept in flight.
+    pub out_transfers: usize,
+    /// What to do with packets that arrive on a full rx queue.
+    pub overflow: OverflowPolicy,
+    /// Rewrite packet timestamps onto the host monotonic clock before queueing them.
+    pub host_timestamps: bool,
+    /// While disconnected, rescan for the device after this long, backing off up to
+    /// [`RECONNECT_PROBE_MAX_INTERVAL`]. This is for platforms where hotplug events are unreliable.
+    pub reconnect_probe: Option<Duration>,
+    /// Send frames still queued when the device disconnected once it reconnects, instead of dropping them.
+    pub keep_pending_tx: bool,
+}
+
+impl Default for DeviceOptions {
+    fn default() -> Self {
+        Self {
+            rx_capacity: DEFAULT_QUEUE_CAPACITY,
+            tx_capacity: DEFAULT_QUEUE_CAPACITY,
+            tx_urgent_capacity: 0,
+            tx_bulk_capacity: DEFAULT_QUEUE_CAPACITY,
+            tx_urgent_below: 0,
+            tx_bulk_from: u32::MAX,
+            in_transfers: DEFAULT_IN_TRANSFERS,
+            out_transfers: DEFAULT_OUT_TRANSFERS,
+            overflow: OverflowPolicy::DropNewest,
+            host_timestamps: false,
+            reconnect_probe: None,
+            keep_pending_tx: false,
+        }
+    }
+}
+
+impl DeviceOptions {
+    pub fn tx_lanes(&self) -> TxLaneConfig {
+        TxLaneConfig {
+            capacity: [self.tx_urgent_capacity, self.tx_capacity, self.tx_bulk_capacity],
+            urgent_below: self.tx_urgent_below,
+            bulk_from: self.tx_bulk_from,
+        }
+    }
+}
+
+/// A freshly opened device, with the host matching its protocol version.
+enum Host {
+    Fs(RdxUsbFsHost, Vec<RdxUsbFsChannel>),
+    Hs(RdxUsbHsHost, Vec<RdxUsbHsChannel>),
+}
+
+async fn open_host(dev_info: &DeviceInfo, rx_rings: &mut RxRings) -> RdxUsbHostResult<Host> {
+    let (iface, cfg) = host::claim_interface(dev_info).await?;
+    if <RdxUsbPacket as UsbFrame>::supports_protocol(cfg.protocol_version_major) {
+        let (host, channels) = RdxUsbHsHost::from_rings(iface, &cfg, rx_rings)?;
+        Ok(Host::Hs(host, channels))
+    } else {
+        let (host, channels) = RdxUsbFsHost::from_rings(iface, &cfg, rx_rings)?;
+        Ok(Host::Fs(host, channels))
+    }
+}
+
+/// A handle's rings, kept by its poller between connections so reconnecting doesn't allocate.
+struct RingPool {
+    rx: RxRings,
+    tx_fs: Option<TxRings<RdxUsbFsPacket>>,
+    tx_hs: Option<TxRings<RdxUsbPacket>>,
+}
+
+impl RingPool {
+    fn new(options: &DeviceOptions) -> Self {
+        Self { rx: RxRings::new(options.rx_capacity), tx_fs: None, tx_hs: None }
+    }
+}
+
+/// Attaches a connected host to its handle slot and polls it until the device disconnects.
+///
+/// The tx lanes are taken from `tx_rings` if an earlier connection left them there. Once the device
+/// disconnects, the host is detached and its rings go back into `rx_rings` and `tx_rings`.
+///
+/// Returns true if the handle was shut down instead.
+#[allow(clippy::too_many_arguments)]
+async fn run_host<F: UsbFrame, T: Transport>(
+    id: i32,
+    slot: &HandleSlot,
+    mut host: RdxUsbHost<F, T>,
+    channels: Vec<RdxUsbChannel<F, T>>,
+    wrap_channels: fn(Vec<RdxUsbChannel<F, T>>) -> DeviceChannels,
+    wrap_writer: fn(RdxUsbWriter<F>) -> Writer,
+    unwrap_writer: fn(Writer) -> Option<RdxUsbWriter<F>>,
+    rx_rings: &mut RxRings,
+    tx_rings: &mut Option<TxRings<F>>,
+    options: &DeviceOptions,
+    shutdown: &tokio::sync::Notify,
+    disconnected: &tokio::sync::Notify,
+    reconnect: bool,
+) -> bool {
+    if let Ok(notify) = slot.notify(id) { host.set_notify(notify); }
+    if let Ok(filters) = slot.filters(id) { host.set_filters(filters); }
+    if let Ok(mailboxes) = slot.mailboxes(id) { host.set_mailboxes(mailboxes); }
+    if let Ok(clock) = slot.clock(id) { host.set_clock_sync(clock); }
+    if let Ok(callbacks) = slot.callbacks(id) { host.set_callbacks(callbacks); }
+    if let Ok(capture) = slot.capture(id) { host.set_capture(capture); }
+    let broker = slot.broker(id).ok();
+    if let Some(broker) = &broker { host.set_broker(broker.clone()); }
+    host.set_host_timestamps(options.host_timestamps);
+    if let Ok(stats) = slot.stats(id) {
+        if reconnect { stats.record_reconnect(); }
+        host.set_stats(stats);
+    }
+    let tx = TxRings::reuse(tx_rings.take(), options.tx_lanes(), options.keep_pending_tx);
+    let (mut write_poller, writer) = host.write_poller_from(tx);
+
+    // as in the device info, the highest channel index
+    let n_channels = (channels.len() - 1) as u8;
+    slot.attach(id, wrap_channels(channels), wrap_writer(writer));
+    if let Some(broker) = &broker { broker.set_connected(Some(n_channels)); }
+
+    // this ends when hotplug reports the disconnect, or else when transfers start failing.
+    // either way the host is dropped on return, which cancels its pending transfers
+    tokio::select! {
+        val = host.poll(options.in_transfers, options.overflow) => {
+            log::trace!(target: "rdxusb", "Read poller exited early! {:?}", val.err());
+        }
+        val = write_poller.poll(options.out_transfers) => {
+            log::trace!(target: "rdxusb", "Write poller exited early! {:?}", val.err());
+        }
+        _val = disconnected.notified() => {
+            log::trace!(target: "rdxusb", "Device disconnected");
+        }
+        // we need a notifier here because oneshot channels won't live on repeat iterations
+        _val = shutdown.notified() => { 
+            log::trace!(target: "rdxusb", "Poller Shutdown requested");
+            return true; 
+        }
+    }
+
+    if let Some(broker) = &broker { broker.set_connected(None); }
+    // keep the rings, and whatever the reader and writer hadn't gotten to, for the next connection
+    let (channels, writer) = slot.detach(id);
+    host.recycle(rx_rings);
+    if let Some(channels) = channels { rx_rings.put_consumers(channels.into_rx_queues()); }
+    *tx_rings = writer.and_then(unwrap_writer).and_then(|writer| write_poller.into_rings(writer));
+    false
+}
 
 pub async fn device_poller(
     id: i32,
     mut device_info_in: tokio::sync::watch::Receiver<Option<DeviceInfo>>,
     shutdown: Arc<tokio::sync::Notify>,
+    connection: Arc<Connection>,
     close_on_dc: bool,
-    capacity: usize,
+    options: DeviceOptions,
 ) {
     log::trace!(target: "rdxusb", "Device poller for task {id} started!");
+    let mut connected_once = false;
+    let mut probe_interval = options.reconnect_probe;
+    let mut rings = RingPool::new(&options);
     loop {
-        let dev_info = match device_info_in.changed().await {
+        let changed = match probe_interval {
+            None => device_info_in.changed().await,
+            Some(interval) => tokio::select! {
+                res = device_info_in.changed() => res,
+                _ = tokio::time::sleep(interval) => {
+                    // hotplug may have missed the device coming back, so look for it directly.
+                    // a match shows up as a change on device_info_in
+                    probe_interval = Some((interval * 2).min(RECONNECT_PROBE_MAX_INTERVAL));
+                    let _ = tokio::task::spawn_blocking(|| {
+                        try_acquire_event_loop().and_then(rescan_devices).map(drop)
+                    }).await;
+                    continue;
+                }
+            },
+        };
+        let dev_info = match changed {
             Ok(_) => {
                 match device_info_in.borrow_and_update().clone() {
                     Some(d) => d,
@@ -243,8 +682,7 @@ pub async fn device_poller(
         };
         log::trace!(target: "rdxusb", "poller: Acquired matching deviceinfo");
 
-        let device_id = dev_info.id();
-        let (mut host, channels) = match RdxUsbFsHost::open_device(dev_info, capacity).await {
+        let host = match open_host(&dev_info, &mut rings.rx).await {
             Ok(a) => {
                 log::trace!(target: "rdxusb", "poller: Successfully opened device, opening write-poller");
                 a
@@ -254,52 +692,104 @@ pub async fn device_poller(
                 continue;
             }
         };
-        let (mut write_poller, writer) = host.write_poller(capacity);
-
-
-        let open_device = OpenDevice {
-            channels: DeviceChannels::FsDevice(channels),
-            writer: Writer::FsDevice(writer),
-            device_id,
-            protocol: 0,
+        let Ok(slot) = HANDLES.get(id) else { return; };
+        let disconnected = connection.connect(dev_info.id());
+        let shutdown_requested = match host {
+            Host::Fs(host, channels) => {
+                run_host(id, slot, host, channels, DeviceChannels::FsDevice, Writer::FsDevice, Writer::into_fs, &mut rings.rx, &mut rings.tx_fs, &options, &shutdown, &disconnected, connected_once).await
+            }
+            Host::Hs(host, channels) => {
+                run_host(id, slot, host, channels, DeviceChannels::HsDevice, Writer::HsDevice, Writer::into_hs, &mut rings.rx, &mut rings.tx_hs, &options, &shutdown, &disconnected, connected_once).await
+            }
         };
-        {
-            let mut event_loop = acquire_event_loop();
-            event_loop.update_open_device(id, open_device);
+        connection.clear();
+        if shutdown_requested { return; }
+        connected_once = true;
+        probe_interval = options.reconnect_probe;
+        if close_on_dc {
+            // TODO: close bus
+            acquire_event_loop().remove_device(id);
+            return;
         }
+    }
+}
+
+/// Runs a virtual device on a handle until the handle is closed. Virtual devices never disconnect.
+async fn virtual_poller(id: i32, config: VirtualDeviceConfig, shutdown: Arc<tokio::sync::Notify>, options: DeviceOptions) {
+    let Ok(slot) = HANDLES.get(id) else { return; };
+    let mut rings = RingPool::new(&options);
+    let (host, channels) = match RdxUsbHost::<RdxUsbPacket, _>::from_rings(VirtualTransport::new(config), &config.device_info(), &mut rings.rx) {
+        Ok(a) => a,
+        Err(e) => {
+            log::trace!(target: "rdxusb", "Could not set up virtual device: {e:?}");
+            return;
+        }
+    };
+    let disconnected = tokio::sync::Notify::new();
+    run_host(id, slot, host, channels, DeviceChannels::Virtual, Writer::HsDevice, Writer::into_hs, &mut rings.rx, &mut rings.tx_hs, &options, &shutdown, &disconnected, false).await;
+}
 
-        // this will eventually error out on disconnect
-        tokio::select! {
-            val = host.poll(32, false) => {
-                log::trace!(target: "rdxusb", "Read poller exited early! {:?}", val.err());
+/// Runs a handle on a device another process published, reattaching whenever the owner goes away and comes back.
+///
+/// The owner's disconnects show up here as disconnects too.
+async fn broker_poller(id: i32, vid: u16, pid: u16, serial_number: Option<String>, shutdown: Arc<tokio::sync::Notify>, close_on_dc: bool, options: DeviceOptions) {
+    log::trace!(target: "rdxusb", "Broker poller for task {id} started!");
+    let mut connected_once = false;
+    let mut rings = RingPool::new(&options);
+    loop {
+        let transport = match BrokerTransport::attach(vid, pid, serial_number.as_deref()) {
+            Ok(Some(transport)) => transport,
+            Ok(None) => {
+                tokio::select! {
+                    _ = tokio::time::sleep(BROKER_WAKE_INTERVAL) => { continue; }
+                    _ = shutdown.notified() => { return; }
+                }
             }
-            val = write_poller.poll() => {
-                log::trace!(target: "rdxusb", "Write poller exited early! {:?}", val.err());
+            Err(e) => {
+                log::trace!(target: "rdxusb", "broker poller: Could not attach: {e}");
+                tokio::select! {
+                    _ = tokio::time::sleep(BROKER_WAKE_INTERVAL) => { continue; }
+                    _ = shutdown.notified() => { return; }
+                }
             }
-            // we need a notifier here because oneshot channels won't live on repeat iterations
-            _val = shutdown.notified() => { 
-                log::trace!(target: "rdxusb", "Poller Shutdown requested");
-                return; 
+        };
+        let info = tokio::select! {
+            info = transport.device_info() => info,
+            _ = shutdown.notified() => { return; }
+        };
+        let Some(info) = info else { continue; };
+        let (host, channels) = match RdxUsbHost::<RdxUsbPacket, _>::from_rings(transport, &info, &mut rings.rx) {
+            Ok(a) => a,
+            Err(e) => {
+                log::trace!(target: "rdxusb", "broker poller: Could not set up host: {e:?}");
+                continue;
             }
+        };
+        let Ok(slot) = HANDLES.get(id) else { return; };
+        // the transport reports the owner's disconnects as failed transfers
+        let disconnected = tokio::sync::Notify::new();
+        if run_host(id, slot, host, channels, DeviceChannels::Broker, Writer::HsDevice, Writer::into_hs, &mut rings.rx, &mut rings.tx_hs, &options, &shutdown, &disconnected, connected_once).await {
+            return;
         }
-        {
-            let mut event_loop = acquire_event_loop();
-            event_loop.remove_open_device(id);
-            if close_on_dc {
-                // TODO: close bus
-                event_loop.devices.remove(&id);
-                return;
-            }
+        connected_once = true;
+        if close_on_dc {
+            acquire_event_loop().remove_device(id);
+            return;
         }
     }
 }
 
-
 pub async fn hotplug() {
     let mut hotplug_watcher = nusb::watch_devices().expect("rdxusb: Could not start hotplug task");
+    // seed the registry only once the watcher is running, so nothing that connects in between is missed
+    if let Err(e) = DEVICE_REGISTRY.rescan() {
+        log::trace!(target: "rdxusb", "Could not seed device registry: {e:?}");
+    }
+    DEVICE_REGISTRY.set_live(true);
     while let Some(event) = hotplug_watcher.next().await {
         match event {
             nusb::hotplug::HotplugEvent::Connected(device_info) => {
+                DEVICE_REGISTRY.connected(device_info.clone());
                 let mut event_loop = acquire_event_loop();
                 'device_iter: for device in event_loop.devices.values_mut() {
                     if device.matches_device_info(&device_info) {
@@ -308,20 +798,30 @@ pub async fn hotplug() {
                     }
                 }
             }
-            nusb::hotplug::HotplugEvent::Disconnected(_device_id) => {}
+            nusb::hotplug::HotplugEvent::Disconnected(device_id) => {
+                DEVICE_REGISTRY.disconnected(device_id);
+                let event_loop = acquire_event_loop();
+                for device in event_loop.devices.values() {
+                    if device.connection.disconnected(device_id) { break; }
+                }
+            }
         }
     }
+    DEVICE_REGISTRY.set_live(false);
 }
 
+/// Hands every registered device that matches an open handle to that handle's poller.
+///
+/// This matches against the hotplug-maintained [`DEVICE_REGISTRY`] rather than enumerating the bus;
+/// use [`rescan_devices`] when hotplug events may have been missed.
 pub fn force_scan_devices(event_loop: EventLoopGuard) -> Result<EventLoopGuard, EventLoopError> {
     log::trace!(target: "rdxusb", "Force scan devices triggered");
-    let Ok(list_device_iter) = nusb::list_devices() else { return Err(EventLoopError::CannotListDevices); };
-    for device_info in list_device_iter {
+    for device_info in DEVICE_REGISTRY.snapshot()?.iter() {
         log::trace!(target: "rdxusb", "Found device: {device_info:?}");
         'device_loop: for device in event_loop.devices.values() {
-            if device.matches_device_info(&device_info) {
+            if device.matches_device_info(device_info) {
                 log::trace!(target: "rdxusb", "Device matches deviceinfo, triggering hotplug");
-                device.device_info_out.send_replace(Some(device_info));
+                device.device_info_out.send_replace(Some(DeviceInfo::clone(device_info)));
                 break 'device_loop;
             }
         }
@@ -329,9 +829,32 @@ pub fn force_scan_devices(event_loop: EventLoopGuard) -> Result<EventLoopGuard,
     Ok(event_loop)
 }
 
+/// Re-enumerates the bus into the device registry, then runs [`force_scan_devices`].
+pub fn rescan_devices(event_loop: EventLoopGuard) -> Result<EventLoopGuard, EventLoopError> {
+    DEVICE_REGISTRY.rescan()?;
+    force_scan_devices(event_loop)
+}
+
 pub fn open_device(vid: u16, pid: u16, serial_number: Option<String>, close_on_dc: bool, capacity: usize) -> Result<i32, EventLoopError> {
-    log::trace!(target: "rdxusb", "Open device {vid:04x} {pid:04x} {serial_number:?} {close_on_dc}");
+    open_device_ex(vid, pid, serial_number, close_on_dc, DeviceOptions { rx_capacity: capacity, tx_capacity: capacity, ..Default::default() })
+}
+
+/// Opens a device with explicit transport options.
+///
+/// If a matching device is already open, its existing handle is returned and `options` is ignored.
+/// A `vid` of [`VIRTUAL_VID`] opens an in-process virtual device configured for `pid`
+/// with [`configure_virtual_device`] instead. A device another process has published with
+/// [`publish_device`] under the same vid/pid/serial number is attached to through that process.
+pub fn open_device_ex(vid: u16, pid: u16, serial_number: Option<String>, close_on_dc: bool, options: DeviceOptions) -> Result<i32, EventLoopError> {
     let mut event_loop = try_acquire_event_loop()?;
+    let handle = open_locked(&mut event_loop, vid, pid, serial_number, close_on_dc, options)?;
+    force_scan_devices(event_loop)?;
+    Ok(handle)
+}
+
+/// Finds or adds the device entry for a vid/pid/serial number, without scanning for it.
+fn open_locked(event_loop: &mut EventLoop, vid: u16, pid: u16, serial_number: Option<String>, close_on_dc: bool, options: DeviceOptions) -> Result<i32, EventLoopError> {
+    log::trace!(target: "rdxusb", "Open device {vid:04x} {pid:04x} {serial_number:?} {close_on_dc} {options:?}");
 
     let maybe_existing = event_loop.devices.iter_mut().find_map(|(handle, device)| {
         if device.matches(vid, pid, serial_number.as_ref().map(|s| s.as_str())) {
@@ -340,85 +863,534 @@ pub fn open_device(vid: u16, pid: u16, serial_number: Option<String>, close_on_d
     });
     if let Some(existing_handle) = maybe_existing {
         log::trace!(target: "rdxusb", "Device already opened under handle: {existing_handle}");
-        force_scan_devices(event_loop)?;
         return Ok(existing_handle);
     }
 
     let (tx, rx) = tokio::sync::watch::channel(None);
 
     // nothing matches, let's add a device
-    let handle = event_loop.next_handle;
-    event_loop.next_handle += 1;
+    let handle = HANDLES.allocate()?;
     let shutdown = Arc::new(tokio::sync::Notify::new());
+    let connection = Arc::new(Connection::default());
 
     log::trace!(target: "rdxusb", "Spawn device poller for new handle {handle}");
-    let device_poller_task = event_loop.rt.spawn(device_poller(handle, rx, shutdown.clone(), close_on_dc, capacity));
+    let device_poller_task = if vid == VIRTUAL_VID {
+        event_loop.rt.spawn(virtual_poller(handle, VIRTUAL_DEVICES.config(pid), shutdown.clone(), options))
+    } else if BrokerClient::published(vid, pid, serial_number.as_deref()) {
+        log::trace!(target: "rdxusb", "Device is published by another process, attaching to its broker");
+        event_loop.rt.spawn(broker_poller(handle, vid, pid, serial_number.clone(), shutdown.clone(), close_on_dc, options))
+    } else {
+        event_loop.rt.spawn(device_poller(handle, rx, shutdown.clone(), connection.clone(), close_on_dc, options))
+    };
     let device_entry = Device {
         vid,
         pid,
         serial_number,
-        handle: None,
         device_info_out: tx,
         poller_handle: device_poller_task,
         shutdown,
+        connection,
     };
 
     event_loop.devices.insert(handle, device_entry);
-    force_scan_devices(event_loop)?;
     Ok(handle)
 }
 
-pub fn read_packets(handle_id: i32, channel: u8, packets: &mut [RdxUsbPacket]) -> Result<usize, EventLoopError> {
+/// One device of an [`open_devices`] call.
+#[derive(Debug, Clone)]
+pub struct OpenSpec {
+    pub vid: u16,
+    pub pid: u16,
+    pub serial_number: Option<String>,
+    pub close_on_dc: bool,
+    pub options: DeviceOptions,
+}
+
+/// Opens several devices under one event loop lock and one device scan, returning each spec's handle or error.
+///
+/// Every device gets its own poller task, so claiming the interfaces and reading their device info
+/// runs concurrently; use [`wait_connected`] to wait for them.
+pub fn open_devices(specs: &[OpenSpec]) -> Result<Vec<Result<i32, EventLoopError>>, EventLoopError> {
     let mut event_loop = try_acquire_event_loop()?;
-    let open_device = event_loop.acquire_open_device(handle_id)?;
+    let handles = specs.iter().map(|spec| {
+        open_locked(&mut event_loop, spec.vid, spec.pid, spec.serial_number.clone(), spec.close_on_dc, spec.options)
+    }).collect();
+    force_scan_devices(event_loop)?;
+    Ok(handles)
+}
 
-    let mut packets_read = 0usize;
+/// Blocks until a handle's device is connected, returning right away if it already is.
+///
+/// Fails with [`EventLoopError::DeviceNotConnected`] if the timeout expires first.
+pub fn wait_connected(handle_id: i32, timeout: Duration) -> Result<(), EventLoopError> {
+    let deadline = Instant::now().checked_add(timeout);
+    let slot = HANDLES.get(handle_id)?;
+    let notify = slot.notify(handle_id)?;
+    loop {
+        // attach notifies after marking the slot connected, so snapshot the sequence before checking
+        let seq = notify.sequence();
+        if slot.connection_generation(handle_id)? & 1 == 1 { return Ok(()); }
+        if !notify.wait_until(seq, deadline) { return Err(EventLoopError::DeviceNotConnected); }
+    }
+}
 
-    for packet in packets {
-        *packet = match open_device.try_read(channel) {
-            Ok(p) => {
-                packets_read += 1;
-                p.into()
-            }
-            Err(e) => match e {
-                DeviceIOError::ChannelOutOfRange => { return Err(EventLoopError::ChannelOutOfRange); }
-                DeviceIOError::NoData => { break; }
+/// Reads packets from a handle's rx ring.
+///
+/// This only locks the handle's own rx side, never the global event loop.
+pub fn read_packets(handle_id: i32, channel: u8, packets: &mut [RdxUsbPacket]) -> Result<usize, EventLoopError> {
+    Ok(HANDLES.get(handle_id)?.with_channels(handle_id, |channels| channels.read_into(channel, packets))??)
+}
+
+/// Reads packets from a handle's rx ring as compact records into `buf`. See [`crate::compact::CompactWriter`].
+///
+/// Returns the number of bytes written and the number of packets they hold.
+pub fn read_packets_compact(handle_id: i32, channel: u8, buf: &mut [u8]) -> Result<(usize, usize), EventLoopError> {
+    let mut writer = CompactWriter::new(buf);
+    let n = HANDLES.get(handle_id)?.with_channels(handle_id, |channels| {
+        channels.read_each(channel, usize::MAX, |idx, packet| {
+            if idx == 0 { writer.clear(); }
+            writer.push(packet)
+        })
+    })??;
+    Ok(if n == 0 { (0, 0) } else { (writer.len(), n) })
+}
+
+/// Reads up to `max` packets from a handle's rx ring into separate columns, stopping early once a present column is full.
+pub fn read_packets_columnar(handle_id: i32, channel: u8, columns: &mut Columns, max: usize) -> Result<usize, EventLoopError> {
+    let max = max.min(columns.capacity());
+    Ok(HANDLES.get(handle_id)?.with_channels(handle_id, |channels| {
+        channels.read_each(channel, max, |idx, packet| {
+            columns.write(idx, packet);
+            true
+        })
+    })??)
+}
+
+/// One entry of a [`read_packets_multi`] call.
+pub struct ReadRequest<'a> {
+    pub handle_id: i32,
+    pub channel: u8,
+    pub packets: &'a mut [RdxUsbPacket],
+    /// Number of packets read, filled in by the call.
+    pub result: Result<usize, EventLoopError>,
+}
+
+/// Serves several reads in one pass.
+///
+/// Runs of consecutive requests for the same handle share a single lock of that handle's rx side,
+/// so put requests for the same handle next to each other.
+/// Returns a mask with bit `i` set if request `i` (for the first 64 requests) read any packets.
+pub fn read_packets_multi(requests: &mut [ReadRequest]) -> u64 {
+    for run in requests.chunk_by_mut(|a, b| a.handle_id == b.handle_id) {
+        let handle_id = run[0].handle_id;
+        let res = HANDLES.get(handle_id).and_then(|slot| slot.with_channels(handle_id, |channels| {
+            for request in run.iter_mut() {
+                request.result = channels.read_into(request.channel, request.packets).map_err(EventLoopError::from);
             }
+        }));
+        if let Err(e) = res {
+            for request in run.iter_mut() { request.result = Err(e); }
         }
     }
-    Ok(packets_read)
+    requests.iter().take(64).enumerate()
+        .filter(|(_, r)| matches!(r.result, Ok(n) if n > 0))
+        .fold(0, |mask, (i, _)| mask | (1 << i))
+}
+
+/// Like [`read_packets`], but blocks until at least one packet is read or the timeout expires.
+///
+/// Returns `Ok(0)` on timeout. If the device is disconnected the whole time, this times out with
+/// [`EventLoopError::DeviceNotConnected`] instead.
+pub fn wait_packets(handle_id: i32, channel: u8, packets: &mut [RdxUsbPacket], timeout: Duration) -> Result<usize, EventLoopError> {
+    let deadline = Instant::now().checked_add(timeout);
+    let notify = HANDLES.get(handle_id)?.notify(handle_id)?;
+    loop {
+        // snapshot before reading so a push racing the read still changes the sequence
+        let seq = notify.sequence();
+        let last = match read_packets(handle_id, channel, packets) {
+            Ok(0) => Ok(0),
+            Err(EventLoopError::DeviceNotConnected) => Err(EventLoopError::DeviceNotConnected),
+            res => { return res; }
+        };
+        if packets.is_empty() || !notify.wait_until(seq, deadline) { return last; }
+    }
+}
+
+/// Gets the raw OS event handle that is signalled when packets arrive on a handle.
+pub fn event_handle(handle_id: i32) -> Result<i64, EventLoopError> {
+    HANDLES.get(handle_id)?.notify(handle_id)?.raw_event_handle().ok_or(EventLoopError::EventHandleUnavailable)
+}
+
+/// Resets a handle's OS event.
+pub fn reset_event_handle(handle_id: i32) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.notify(handle_id)?.reset_event();
+    Ok(())
+}
+
+/// Installs acceptance filters on one of a handle's channels, replacing any previous filters.
+///
+/// Filters take effect on the rx poller's next packet and are kept across reconnects.
+/// An empty filter list accepts everything again.
+pub fn set_filters(handle_id: i32, channel: u8, filters: &[RdxUsbFilter]) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.filters(handle_id)?.set(channel, filters);
+    Ok(())
+}
+
+/// Makes a handle coalesce the frames it sends whose arbitration id matches any of `filters`, replacing
+/// any previous coalescing filters.
+///
+/// While a coalesced frame is waiting to be sent, a newer frame with the same channel and id overwrites it
+/// in place instead of queueing behind it, so only the newest payload goes on the wire. A filter with a mask
+/// of 0 coalesces everything. This is kept across reconnects, and an empty filter list turns it off.
+pub fn set_tx_coalescing(handle_id: i32, filters: &[RdxUsbFilter]) -> Result<(), EventLoopError> {
+    let set = (!filters.is_empty()).then(|| Arc::new(FilterSet::new(filters)));
+    HANDLES.get(handle_id)?.set_coalescing(handle_id, set)
+}
+
+/// Sets the latest-value mailbox mode of one of a handle's channels.
+pub fn set_mailbox_mode(handle_id: i32, channel: u8, mode: MailboxMode) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.mailboxes(handle_id)?.set_mode(channel, mode);
+    Ok(())
+}
+
+/// Reads the latest packet received with an arbitration id, and how long ago it was received.
+///
+/// Returns `Ok(None)` if no packet with that id has arrived since the mailbox was enabled.
+pub fn get_latest(handle_id: i32, channel: u8, arb_id: u32) -> Result<Option<(RdxUsbPacket, Duration)>, EventLoopError> {
+    let mailbox = HANDLES.get(handle_id)?.mailboxes(handle_id)?.get(channel).ok_or(EventLoopError::MailboxDisabled)?;
+    Ok(mailbox.load(arb_id).map(|(packet, received_ns)| {
+        (packet, Duration::from_nanos(monotonic_ns().saturating_sub(received_ns)))
+    }))
+}
+
+/// Converts a device timestamp from one of a handle's packets to the host monotonic clock.
+///
+/// The estimate is reset whenever the device reconnects, so only convert timestamps from the current connection.
+pub fn device_to_host_time(handle_id: i32, device_ns: u64) -> Result<u64, EventLoopError> {
+    HANDLES.get(handle_id)?.clock(handle_id)?.device_to_host(device_ns).ok_or(EventLoopError::NoClockEstimate)
+}
+
+/// Sets or clears the rx callback of one of a handle's channels.
+///
+/// Callbacks run on the event loop right after the rx poller decodes packets, and get every packet that
+/// passes the channel's filters. Packets from transfers that complete together are delivered in one call.
+///
+/// When this returns, the previous callback isn't running and won't be called again, so anything it
+/// borrows can be freed. Closing the handle gives the same guarantee for all of its callbacks.
+pub fn set_rx_callback(handle_id: i32, channel: u8, callback: Option<RxCallback>) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.callbacks(handle_id)?.set(channel, callback);
+    Ok(())
 }
 
+/// Maps one of a handle's rx rings for in-place reads by the caller.
+///
+/// The view stays valid until the channel is unmapped or remapped, or the handle is closed. Rings are kept
+/// across reconnects, so the view keeps receiving packets after the device comes back. Its closed flag is
+/// only set once nothing will write to the ring again, like at the end of a replay.
+pub fn map_rx_channel(handle_id: i32, channel: u8) -> Result<RingView<RdxUsbPacket>, EventLoopError> {
+    HANDLES.get(handle_id)?.map_channel(handle_id, channel)
+}
+
+/// Releases a mapping made by [`map_rx_channel`].
+pub fn unmap_rx_channel(handle_id: i32, channel: u8) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.unmap_channel(handle_id, channel)
+}
+
+/// Gets a handle's connection generation. This never takes a lock, so it is cheap to poll.
+///
+/// The generation is odd while the device is connected and changes on every connect and disconnect,
+/// so a changed value means any state tied to the old connection, like the clock estimate, is stale.
+pub fn connection_generation(handle_id: i32) -> Result<u32, EventLoopError> {
+    HANDLES.get(handle_id)?.connection_generation(handle_id)
+}
+
+/// Takes a snapshot of a handle's stats.
+pub fn stats(handle_id: i32) -> Result<DeviceStatsSnapshot, EventLoopError> {
+    Ok(HANDLES.get(handle_id)?.stats(handle_id)?.snapshot())
+}
+
+/// Writes packets into a handle's tx lanes, each into the lane its id maps to.
+///
+/// This only locks the handle's own tx side, never the global event loop.
 pub fn write_packets(handle_id: i32, packets: &[RdxUsbPacket]) -> Result<usize, EventLoopError> {
+    write_packets_lane(handle_id, None, packets)
+}
+
+/// Like [`write_packets`], but puts every packet in `lane` if given.
+pub fn write_packets_lane(handle_id: i32, lane: Option<TxLane>, packets: &[RdxUsbPacket]) -> Result<usize, EventLoopError> {
+    HANDLES.get(handle_id)?.with_writer(handle_id, |writer, stats| write_run(writer, stats, lane, packets))
+}
+
+/// Queues packets until the first one that doesn't fit, and records the outcome. Returns how many were queued.
+pub(crate) fn write_run(writer: &mut Writer, stats: &DeviceStats, lane: Option<TxLane>, packets: &[RdxUsbPacket]) -> usize {
+    let written = packets.iter().take_while(|packet| writer.try_write(packet, lane).is_ok()).count();
+    stats.record_tx(written, packets.len() - written, writer.occupied_len());
+    for packet in &packets[written..] {
+        stats.record_tx_lane_rejected(writer.lane_for(packet, lane));
+    }
+    written
+}
+
+/// Sets what virtual devices opened on `pid` from now on generate. Already open virtual devices keep their config.
+pub fn configure_virtual_device(pid: u16, config: VirtualDeviceConfig) -> Result<(), EventLoopError> {
+    VIRTUAL_DEVICES.configure(pid, config)
+}
+
+/// Starts capturing every frame a handle sends and receives to a file, replacing any running capture.
+///
+/// The capture keeps running across reconnects until [`stop_capture`] or until the handle is closed.
+pub fn start_capture(handle_id: i32, path: &Path) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.capture(handle_id)?.start(path).map_err(|e| {
+        log::trace!(target: "rdxusb", "Could not start capture to {path:?}: {e}");
+        EventLoopError::CaptureIo
+    })
+}
+
+/// Stops a handle's capture and finishes writing the file.
+pub fn stop_capture(handle_id: i32) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.capture(handle_id)?.stop().map_err(|e| {
+        log::trace!(target: "rdxusb", "Could not finish capture: {e}");
+        EventLoopError::CaptureIo
+    })
+}
+
+/// Publishes a handle's device to other processes, which then share it through this one.
+///
+/// Opening the same vid/pid/serial number in another process attaches to this handle: it gets every frame
+/// this handle receives, and its writes go out through this handle's tx lanes. Each client process gets
+/// rings of `ring_capacity` packets. Publishing spans reconnects and lasts until [`unpublish_device`]
+/// or until the handle is closed. Publishing an already published handle does nothing.
+pub fn publish_device(handle_id: i32, ring_capacity: usize) -> Result<(), EventLoopError> {
+    let broker = HANDLES.get(handle_id)?.broker(handle_id)?;
+    if broker.is_published() { return Ok(()); }
+    let (vid, pid, serial_number) = {
+        let event_loop = try_acquire_event_loop()?;
+        let device = event_loop.devices.get(&handle_id).ok_or(EventLoopError::DeviceNotOpened)?;
+        (device.vid, device.pid, device.serial_number.clone())
+    };
+    broker.publish_with(|| {
+        let server = BrokerServer::create(vid, pid, serial_number.as_deref(), ring_capacity).map_err(|e| {
+            log::trace!(target: "rdxusb", "Could not publish device: {e}");
+            EventLoopError::BrokerUnavailable
+        })?;
+        let server = Arc::new(server);
+        std::thread::Builder::new().name("rdxusb-broker".into()).spawn({
+            let server = server.clone();
+            move || broker_pump(handle_id, &server)
+        }).map_err(|_| EventLoopError::BrokerUnavailable)?;
+        Ok(server)
+    })?;
+    // closing the handle unpublishes its broker, but only a publish that got in first
+    if HANDLES.get(handle_id).is_err() {
+        broker.unpublish();
+        return Err(EventLoopError::DeviceNotOpened);
+    }
+    Ok(())
+}
+
+/// Stops publishing a handle's device. Attached processes see it disconnect.
+pub fn unpublish_device(handle_id: i32) -> Result<(), EventLoopError> {
+    HANDLES.get(handle_id)?.broker(handle_id)?.unpublish();
+    Ok(())
+}
+
+/// Moves what broker clients write into the owning handle's tx lanes, until the device is unpublished.
+///
+/// Frames written while the handle's device is disconnected are dropped, as a write would fail then.
+fn broker_pump(handle_id: i32, server: &BrokerServer) {
+    let mut last_reap = Instant::now();
+    while !server.is_closed() {
+        let backlog = server.drain_tx(|packets| write_packets(handle_id, packets).unwrap_or(packets.len()));
+        // a backlog means the tx lanes are full, so give the write poller a moment to drain them
+        server.wait_tx(if backlog { BROKER_TX_RETRY } else { BROKER_WAKE_INTERVAL });
+        if last_reap.elapsed() >= BROKER_WAKE_INTERVAL {
+            server.reap();
+            last_reap = Instant::now();
+        }
+    }
+}
+
+/// Number of channels a replay handle has. Records on higher channels are counted as invalid.
+pub const REPLAY_CHANNELS: usize = MAX_STATS_CHANNELS;
+/// Number of records the replay reader thread hands over at once.
+const REPLAY_BATCH: usize = 256;
+
+/// Opens a handle that plays back the received frames of a capture file, as if they came from a device.
+///
+/// Frames are read back through [`read_packets`] and the other rx paths, on the channel they were captured on.
+/// `speed` scales the original timing: 1.0 is real time, 10.0 ten times as fast,
+/// and 0.0 as fast as the reader keeps up. Replay never drops frames; it waits for room in the rx rings,
+/// so read every channel the capture uses. Writes to a replay handle are rejected.
+/// When the capture ends the handle shows as disconnected in [`connection_generation`],
+/// but frames still in the rings stay readable until the handle is closed.
+pub fn open_replay(path: &Path, speed: f64, rx_capacity: usize) -> Result<i32, EventLoopError> {
+    if !(speed >= 0.0 && speed.is_finite()) { return Err(EventLoopError::InvalidArgument); }
+    let reader = CaptureReader::open(path).map_err(|e| {
+        log::trace!(target: "rdxusb", "Could not open capture {path:?}: {e}");
+        EventLoopError::CaptureIo
+    })?;
     let mut event_loop = try_acquire_event_loop()?;
-    let open_device = event_loop.acquire_open_device(handle_id)?;
-    let mut packets_written = 0usize;
 
-    for packet in packets {
-        match open_device.try_write(packet) {
-            Ok(_) => {
-                packets_written += 1;
+    let handle = HANDLES.allocate()?;
+    let slot = HANDLES.get(handle)?;
+    let (producers, consumers): (Vec<_>, Vec<_>) = (0..REPLAY_CHANNELS).map(|_| packet_ring(rx_capacity.max(1))).unzip();
+    if let Ok(stats) = slot.stats(handle) { stats.n_channels.store(REPLAY_CHANNELS as u32, std::sync::atomic::Ordering::Relaxed); }
+    slot.attach(handle, DeviceChannels::Replay(consumers), Writer::Replay);
+
+    let (tx, _rx) = tokio::sync::watch::channel(None);
+    let shutdown = Arc::new(tokio::sync::Notify::new());
+    let poller_handle = event_loop.rt.spawn(replay_poller(handle, reader, producers, speed, shutdown.clone()));
+    event_loop.devices.insert(handle, Device {
+        // no real device has vid 0, so hotplug and open_device never match a replay handle
+        vid: 0,
+        pid: 0,
+        serial_number: Some(path.display().to_string()),
+        poller_handle,
+        device_info_out: tx,
+        shutdown,
+        connection: Arc::new(Connection::default()),
+    });
+    Ok(handle)
+}
+
+async fn replay_poller(id: i32, mut reader: CaptureReader, mut rx_queue: Vec<RingProducer<RdxUsbPacket>>, speed: f64, shutdown: Arc<tokio::sync::Notify>) {
+    let Ok(slot) = HANDLES.get(id) else { return; };
+    let (Ok(notify), Ok(stats)) = (slot.notify(id), slot.stats(id)) else { return; };
+
+    // file reads happen on a blocking thread, in batches
+    let (batch_tx, mut batch_rx) = tokio::sync::mpsc::channel::<Vec<CaptureRecord>>(4);
+    tokio::task::spawn_blocking(move || loop {
+        let mut batch = Vec::with_capacity(REPLAY_BATCH);
+        while batch.len() < REPLAY_BATCH {
+            match reader.next_record() {
+                Ok(Some(record)) if record.direction == Direction::Rx => batch.push(record),
+                Ok(Some(_)) => {}
+                Ok(None) => break,
+                Err(e) => {
+                    log::trace!(target: "rdxusb", "Replay read error: {e}");
+                    break;
+                }
             }
-            Err(_) => { break; }
         }
+        let done = batch.len() < REPLAY_BATCH;
+        if batch_tx.blocking_send(batch).is_err() || done { return; }
+    });
+
+    let replay = async {
+        let start = tokio::time::Instant::now();
+        let mut first_ns = None;
+        while let Some(batch) = batch_rx.recv().await {
+            for record in batch {
+                let first_ns = *first_ns.get_or_insert(record.host_ns);
+                if speed > 0.0 {
+                    let offset = record.host_ns.saturating_sub(first_ns) as f64 / speed;
+                    tokio::time::sleep_until(start + Duration::from_nanos(offset as u64)).await;
+                }
+                let packet = record.packet;
+                let Some(queue) = rx_queue.get_mut(packet.channel as usize) else {
+                    stats.record_invalid_channel();
+                    continue;
+                };
+                if queue.push(packet).await.is_err() { return; }
+                stats.channel(packet.channel).record_rx(packet.dlc, queue.occupied_len());
+                notify.notify_if_armed();
+            }
+        }
+    };
+    tokio::select! {
+        _ = replay => { log::trace!(target: "rdxusb", "Replay for handle {id} finished"); }
+        _ = shutdown.notified() => {}
     }
-    
+    // closing the rings ends async reads; the buffered tail stays readable
+    drop(rx_queue);
+    slot.end_of_stream(id);
+}
+
+/// Starts sending a packet on a handle every `period`, with the first one sent `phase` from now.
+///
+/// The job runs on the event loop until it is cancelled or the handle is closed. Frames that come due
+/// while the device is disconnected or its tx queue is full are dropped rather than sent late, so each
+/// period produces at most one frame. Returns a non-negative job id.
+pub fn schedule_periodic(handle_id: i32, packet: RdxUsbPacket, period: Duration, phase: Duration) -> Result<i32, EventLoopError> {
+    let event_loop = try_acquire_event_loop()?;
+    PERIODIC_JOBS.schedule(&event_loop.rt, handle_id, packet, period, phase)
+}
 
-    Ok(packets_written)
+/// Replaces the data of a periodic job's packet. The next frame the job sends carries the new data.
+pub fn update_periodic(job_id: i32, data: &[u8]) -> Result<(), EventLoopError> {
+    PERIODIC_JOBS.update(job_id, data)
+}
+
+/// Stops a periodic job.
+pub fn cancel_periodic(job_id: i32) -> Result<(), EventLoopError> {
+    PERIODIC_JOBS.cancel(job_id)
+}
+
+/// Starts a vendor control request on a handle's connected device. OUT requests send `data`.
+///
+/// The transfer runs on the event loop; collect its result with [`poll_control`] or [`wait_control`].
+/// Requests are independent of each other and of the bulk endpoints, so many can be in flight at once.
+/// Returns a non-negative request id.
+pub fn submit_control(handle_id: i32, setup: ControlSetup, data: &[u8]) -> Result<i32, EventLoopError> {
+    let rt = try_acquire_event_loop()?.rt.clone();
+    CONTROL_REQUESTS.submit(&rt, handle_id, setup, data)
+}
+
+/// Collects a finished control request without blocking. See [`crate::control::ControlRequests::poll`].
+pub fn poll_control(request_id: i32, data: &mut [u8]) -> Result<usize, EventLoopError> {
+    CONTROL_REQUESTS.poll(request_id, data)
+}
+
+/// Collects a control request, blocking until it finishes or the timeout expires.
+pub fn wait_control(request_id: i32, timeout: Duration, data: &mut [u8]) -> Result<usize, EventLoopError> {
+    CONTROL_REQUESTS.wait(request_id, Instant::now().checked_add(timeout), data)
+}
+
+/// Abandons a control request, cancelling its transfer if it hasn't finished.
+pub fn cancel_control(request_id: i32) -> Result<(), EventLoopError> {
+    CONTROL_REQUESTS.cancel(request_id)
+}
+
+/// One entry of a [`write_packets_multi`] call.
+pub struct WriteRequest<'a> {
+    pub handle_id: i32,
+    pub packets: &'a [RdxUsbPacket],
+    /// Number of packets written, filled in by the call.
+    pub result: Result<usize, EventLoopError>,
+}
+
+/// Serves several writes in one pass.
+///
+/// Like [`read_packets_multi`], runs of consecutive requests for the same handle share a single lock.
+pub fn write_packets_multi(requests: &mut [WriteRequest]) {
+    for run in requests.chunk_by_mut(|a, b| a.handle_id == b.handle_id) {
+        let handle_id = run[0].handle_id;
+        let res = HANDLES.get(handle_id).and_then(|slot| slot.with_writer(handle_id, |writer, stats| {
+            for request in run.iter_mut() {
+                request.result = Ok(write_run(writer, stats, None, request.packets));
+            }
+        }));
+        if let Err(e) = res {
+            for request in run.iter_mut() { request.result = Err(e); }
+        }
+    }
 }
 
 pub fn close_device(handle_id: i32) -> Result<(), EventLoopError> {
     let mut event_loop = try_acquire_event_loop()?;
     let Some(device) = event_loop.devices.get_mut(&handle_id) else { return Ok(()); };
     device.shutdown.notify_one();
-    event_loop.devices.remove(&handle_id);
+    event_loop.remove_device(handle_id);
     Ok(())
 }
 
 pub fn close_all_devices() -> Result<(), EventLoopError> {
     let mut event_loop = try_acquire_event_loop()?;
-    event_loop.devices.retain(|_handle, device| {
+    event_loop.devices.retain(|handle, device| {
         device.shutdown.notify_one();
+        PERIODIC_JOBS.cancel_handle(*handle);
+        CONTROL_REQUESTS.cancel_handle(*handle);
+        HANDLES.release(*handle);
         false
     });
     Ok(())
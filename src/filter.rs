@@ -0,0 +1,138 @@
+//! Acceptance filters applied by the rx poller before packets are queued.
+
+use std::{collections::HashSet, hash::{BuildHasherDefault, Hasher}, sync::Arc};
+
+use crate::channel_table::{ChannelTable, ChannelTableCache};
+
+/// An id/mask acceptance filter.
+///
+/// A packet is accepted if `(arb_id & mask) == (id & mask)`. Both fields cover the full arbitration id,
+/// so the [`crate::MESSAGE_ARB_ID_EXT`], [`crate::MESSAGE_ARB_ID_RTR`] and [`crate::MESSAGE_ARB_ID_DEVICE`]
+/// flag bits can be matched the same way as id bits.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct RdxUsbFilter {
+    pub id: u32,
+    pub mask: u32,
+}
+
+/// Multiplicative hasher for masked arbitration ids. SipHash is overkill for a single u32 on the rx path.
+#[derive(Default)]
+struct IdHasher(u64);
+
+impl Hasher for IdHasher {
+    fn finish(&self) -> u64 {
+        self.0
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        for b in bytes {
+            self.0 = (self.0.rotate_left(8) ^ *b as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        }
+    }
+
+    fn write_u32(&mut self, i: u32) {
+        self.0 = (i as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    }
+}
+
+/// A compiled set of filters.
+///
+/// Filters are grouped by mask, and each group is a hash set of masked ids, so checking a packet costs
+/// one hash lookup per distinct mask rather than one comparison per filter.
+#[derive(Debug, Default)]
+pub struct FilterSet {
+    groups: Vec<(u32, HashSet<u32, BuildHasherDefault<IdHasher>>)>,
+}
+
+impl FilterSet {
+    pub fn new(filters: &[RdxUsbFilter]) -> Self {
+        let mut groups: Vec<(u32, HashSet<u32, BuildHasherDefault<IdHasher>>)> = Vec::new();
+        for filter in filters {
+            let ids = match groups.iter_mut().position(|(mask, _)| *mask == filter.mask) {
+                Some(idx) => &mut groups[idx].1,
+                None => {
+                    groups.push((filter.mask, HashSet::default()));
+                    &mut groups.last_mut().unwrap().1
+                }
+            };
+            ids.insert(filter.id & filter.mask);
+        }
+        Self { groups }
+    }
+
+    #[inline]
+    pub fn accepts(&self, arb_id: u32) -> bool {
+        self.groups.iter().any(|(mask, ids)| ids.contains(&(arb_id & mask)))
+    }
+}
+
+/// Per-channel filters for a device, shared between the handle and its rx poller.
+pub type RxFilters = ChannelTable<FilterSet>;
+/// The rx poller's cached view of an [`RxFilters`].
+pub type FilterCache = ChannelTableCache<FilterSet>;
+
+impl ChannelTable<FilterSet> {
+    /// Installs filters for a channel. An empty slice removes filtering from the channel.
+    pub fn set(&self, channel: u8, filters: &[RdxUsbFilter]) {
+        let set = (!filters.is_empty()).then(|| Arc::new(FilterSet::new(filters)));
+        self.update(channel, |entry| *entry = set);
+    }
+}
+
+impl ChannelTableCache<FilterSet> {
+    /// Checks a packet against the current filters for its channel.
+    #[inline]
+    pub fn accepts(&mut self, filters: &RxFilters, channel: u8, arb_id: u32) -> bool {
+        self.get(filters, channel).map_or(true, |set| set.accepts(arb_id))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::MESSAGE_ARB_ID_EXT;
+
+    const STD_MASK: u32 = MESSAGE_ARB_ID_EXT | 0x7ff;
+    const EXT_MASK: u32 = MESSAGE_ARB_ID_EXT | 0x1fff_ffff;
+
+    #[test]
+    fn filters_with_the_same_mask_share_a_group() {
+        let set = FilterSet::new(&[
+            RdxUsbFilter { id: 0x100, mask: STD_MASK },
+            RdxUsbFilter { id: 0x200, mask: STD_MASK },
+            RdxUsbFilter { id: 0x300, mask: 0x700 },
+        ]);
+        assert_eq!(set.groups.len(), 2);
+        for accepted in [0x100, 0x200, 0x300, 0x3ff] { assert!(set.accepts(accepted), "{accepted:#x}"); }
+        for rejected in [0x101, 0x400, 0x0] { assert!(!set.accepts(rejected), "{rejected:#x}"); }
+    }
+
+    #[test]
+    fn ext_flag_keeps_standard_and_extended_ids_apart() {
+        let set = FilterSet::new(&[
+            RdxUsbFilter { id: 0x123, mask: STD_MASK },
+            RdxUsbFilter { id: MESSAGE_ARB_ID_EXT | 0x123, mask: EXT_MASK },
+        ]);
+        assert!(set.accepts(0x123));
+        assert!(set.accepts(MESSAGE_ARB_ID_EXT | 0x123));
+        // the extended id only matches in full, and the standard filter doesn't take extended frames
+        assert!(!set.accepts(MESSAGE_ARB_ID_EXT | 0x1000_0123));
+        assert!(!set.accepts(MESSAGE_ARB_ID_EXT | 0x124));
+    }
+
+    #[test]
+    fn empty_set_accepts_nothing_but_an_empty_channel_accepts_everything() {
+        assert!(!FilterSet::new(&[]).accepts(0x123));
+
+        let filters = RxFilters::new();
+        let mut cache = FilterCache::default();
+        assert!(cache.accepts(&filters, 0, 0x123));
+        filters.set(0, &[RdxUsbFilter { id: 0x10, mask: 0x7ff }]);
+        assert!(!cache.accepts(&filters, 0, 0x123));
+        assert!(cache.accepts(&filters, 0, 0x10));
+        assert!(cache.accepts(&filters, 1, 0x123), "other channels are unfiltered");
+        filters.set(0, &[]);
+        assert!(cache.accepts(&filters, 0, 0x123));
+    }
+}
@@ -0,0 +1,393 @@
+use std::sync::{atomic::{AtomicU32, Ordering}, Arc, Mutex, MutexGuard};
+
+use rdxusb_protocol::RdxUsbPacket;
+
+use crate::{broker::BrokerSlot, callback::RxCallbacks, capture::CaptureSlot, clock::ClockSync, control::ControlPort, event_loop::{DeviceChannels, EventLoopError, Writer}, filter::{FilterSet, RxFilters}, mailbox::RxMailboxes, notify::RxNotify, ring::{RingMapping, RingView}, stats::DeviceStats};
+
+/// Maximum number of simultaneously open device handles.
+pub const MAX_HANDLES: usize = 64;
+/// Number of low handle bits used for the slot index.
+const SLOT_BITS: u32 = MAX_HANDLES.trailing_zeros();
+const SLOT_MASK: i32 = (MAX_HANDLES - 1) as i32;
+/// Generation bits that fit in the remaining non-negative range of an i32 handle.
+const GENERATION_MASK: u32 = (1 << (31 - SLOT_BITS)) - 1;
+
+/// Rx-side state of a handle. This lives as long as the handle does, across reconnects.
+pub struct RxState {
+    /// The connected device's rx rings, if any.
+    pub channels: Option<DeviceChannels>,
+    /// Wakes blocked readers and the handle's OS event.
+    pub notify: Arc<RxNotify>,
+    pub stats: Arc<DeviceStats>,
+    /// Acceptance filters; these are kept across reconnects too.
+    pub filters: Arc<RxFilters>,
+    /// Latest-value mailboxes, also kept across reconnects.
+    pub mailboxes: Arc<RxMailboxes>,
+    /// Device-to-host clock estimate of the connected device.
+    pub clock: Arc<ClockSync>,
+    /// Rx rings mapped by the caller, indexed by channel. These outlive disconnects until unmapped.
+    pub mappings: Vec<Option<RingMapping<RdxUsbPacket>>>,
+    /// Push-style rx callbacks, kept across reconnects.
+    pub callbacks: Arc<RxCallbacks>,
+    /// Traffic capture, kept across reconnects so a capture spans the whole session.
+    pub capture: Arc<CaptureSlot>,
+    /// Whether the handle's device is published to other processes. Publishing spans reconnects, like capture.
+    pub broker: Arc<BrokerSlot>,
+}
+
+/// Tx-side state of a handle. This also lives as long as the handle does.
+pub struct TxState {
+    /// The connected device's tx queue, if any.
+    pub writer: Option<Writer>,
+    pub stats: Arc<DeviceStats>,
+    /// Which frames the writer coalesces, applied again to every reconnect's writer.
+    pub coalesce: Option<Arc<FilterSet>>,
+}
+
+/// A single handle slot.
+///
+/// The generation counter is odd while the slot is in use and even while it is free.
+/// Handles encode the generation they were allocated under, so a stale handle from a closed
+/// device never aliases a newer device that reuses the same slot.
+///
+/// The rx and tx sides are behind separate locks, so readers and writers of one handle don't
+/// contend with each other, and nothing here ever touches the global event loop lock.
+pub struct HandleSlot {
+    generation: AtomicU32,
+    /// Bumped on every attach and detach, so it is odd exactly while a device is attached.
+    connection: AtomicU32,
+    rx: Mutex<Option<RxState>>,
+    tx: Mutex<Option<TxState>>,
+}
+
+impl HandleSlot {
+    const fn new() -> Self {
+        Self {
+            generation: AtomicU32::new(0),
+            connection: AtomicU32::new(0),
+            rx: Mutex::new(None),
+            tx: Mutex::new(None),
+        }
+    }
+
+    fn matches(&self, handle_id: i32) -> bool {
+        let generation = self.generation.load(Ordering::Acquire);
+        generation & 1 == 1 && (generation & GENERATION_MASK) == (handle_id >> SLOT_BITS) as u32
+    }
+
+    fn lock<T>(lock: &Mutex<T>) -> Result<MutexGuard<'_, T>, EventLoopError> {
+        lock.lock().map_err(|_e| EventLoopError::EventLoopCrashed)
+    }
+
+    /// Runs `f` against the connected device's rx channels.
+    ///
+    /// This arms the handle's notifier first, so any push that `f` misses still wakes waiters.
+    pub fn with_channels<R>(&self, handle_id: i32, f: impl FnOnce(&mut DeviceChannels) -> R) -> Result<R, EventLoopError> {
+        let mut rx = Self::lock(&self.rx)?;
+        // recheck under the lock so a concurrent close/reopen can't hand us another device's rings
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(rx) = rx.as_mut() else { return Err(EventLoopError::DeviceNotOpened); };
+        rx.notify.arm();
+        match rx.channels.as_mut() {
+            Some(c) => Ok(f(c)),
+            None => Err(EventLoopError::DeviceNotConnected),
+        }
+    }
+
+    /// Returns the handle's rx notifier.
+    pub fn notify(&self, handle_id: i32) -> Result<Arc<RxNotify>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.notify.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's stats block.
+    pub fn stats(&self, handle_id: i32) -> Result<Arc<DeviceStats>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.stats.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's acceptance filters.
+    pub fn filters(&self, handle_id: i32) -> Result<Arc<RxFilters>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.filters.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's mailboxes.
+    pub fn mailboxes(&self, handle_id: i32) -> Result<Arc<RxMailboxes>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.mailboxes.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's clock estimate.
+    pub fn clock(&self, handle_id: i32) -> Result<Arc<ClockSync>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.clock.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's rx callbacks.
+    pub fn callbacks(&self, handle_id: i32) -> Result<Arc<RxCallbacks>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.callbacks.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's capture.
+    pub fn capture(&self, handle_id: i32) -> Result<Arc<CaptureSlot>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.capture.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's broker slot.
+    pub fn broker(&self, handle_id: i32) -> Result<Arc<BrokerSlot>, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        rx.as_ref().map(|rx| rx.broker.clone()).ok_or(EventLoopError::DeviceNotOpened)
+    }
+
+    /// Returns the handle's connection generation without taking any lock.
+    ///
+    /// This is odd while a device is attached and changes on every connect and disconnect.
+    pub fn connection_generation(&self, handle_id: i32) -> Result<u32, EventLoopError> {
+        let connection = self.connection.load(Ordering::Acquire);
+        // recheck after the load so a slot reused in the meantime isn't reported for this handle
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        Ok(connection)
+    }
+
+    /// Maps a connected channel's rx ring, keeping it alive until it is unmapped or the handle is released.
+    pub fn map_channel(&self, handle_id: i32, channel: u8) -> Result<RingView<RdxUsbPacket>, EventLoopError> {
+        let mut rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(rx) = rx.as_mut() else { return Err(EventLoopError::DeviceNotOpened); };
+        let Some(channels) = rx.channels.as_ref() else { return Err(EventLoopError::DeviceNotConnected); };
+        let mapping = channels.map_rx(channel)?;
+        let view = mapping.view();
+        let idx = channel as usize;
+        if rx.mappings.len() <= idx { rx.mappings.resize_with(idx + 1, || None); }
+        rx.mappings[idx] = Some(mapping);
+        Ok(view)
+    }
+
+    /// Drops a mapping made by [`map_channel`](Self::map_channel).
+    pub fn unmap_channel(&self, handle_id: i32, channel: u8) -> Result<(), EventLoopError> {
+        let mut rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(rx) = rx.as_mut() else { return Err(EventLoopError::DeviceNotOpened); };
+        if let Some(mapping) = rx.mappings.get_mut(channel as usize) { mapping.take(); }
+        Ok(())
+    }
+
+    /// Returns the interface control requests to the connected device go to.
+    pub fn control_port(&self, handle_id: i32) -> Result<ControlPort, EventLoopError> {
+        let rx = Self::lock(&self.rx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(rx) = rx.as_ref() else { return Err(EventLoopError::DeviceNotOpened); };
+        rx.channels.as_ref().and_then(|c| c.control_port()).ok_or(EventLoopError::DeviceNotConnected)
+    }
+
+    /// Runs `f` against the connected device's tx writer.
+    pub fn with_writer<R>(&self, handle_id: i32, f: impl FnOnce(&mut Writer, &DeviceStats) -> R) -> Result<R, EventLoopError> {
+        let mut tx = Self::lock(&self.tx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(tx) = tx.as_mut() else { return Err(EventLoopError::DeviceNotOpened); };
+        match tx.writer.as_mut() {
+            Some(w) => Ok(f(w, &tx.stats)),
+            None => Err(EventLoopError::DeviceNotConnected),
+        }
+    }
+
+    /// Sets which frames the handle's writer coalesces, now and after reconnects.
+    pub fn set_coalescing(&self, handle_id: i32, filters: Option<Arc<FilterSet>>) -> Result<(), EventLoopError> {
+        let mut tx = Self::lock(&self.tx)?;
+        if !self.matches(handle_id) { return Err(EventLoopError::DeviceNotOpened); }
+        let Some(tx) = tx.as_mut() else { return Err(EventLoopError::DeviceNotOpened); };
+        if let Some(writer) = tx.writer.as_mut() { writer.set_coalescing(filters.clone()); }
+        tx.coalesce = filters;
+        Ok(())
+    }
+
+    /// Attaches a freshly connected device to the slot.
+    ///
+    /// This is a no-op if the handle has since been closed.
+    pub fn attach(&self, handle_id: i32, channels: DeviceChannels, mut writer: Writer) {
+        let (Ok(mut rx), Ok(mut tx)) = (self.rx.lock(), self.tx.lock()) else { return; };
+        if !self.matches(handle_id) { return; }
+        let (Some(rx), Some(tx)) = (rx.as_mut(), tx.as_mut()) else { return; };
+        rx.channels.replace(channels);
+        writer.set_coalescing(tx.coalesce.clone());
+        tx.writer.replace(writer);
+        self.set_connected(true);
+        // let blocked readers notice the handle is usable now
+        rx.notify.notify();
+    }
+
+    /// Detaches a disconnected device from the slot, keeping the handle itself open.
+    ///
+    /// Returns the detached channels and writer, so their rings can be reused on the next connection.
+    pub fn detach(&self, handle_id: i32) -> (Option<DeviceChannels>, Option<Writer>) {
+        let (Ok(mut rx), Ok(mut tx)) = (self.rx.lock(), self.tx.lock()) else { return (None, None); };
+        if !self.matches(handle_id) { return (None, None); }
+        let channels = rx.as_mut().and_then(|rx| rx.channels.take());
+        let writer = tx.as_mut().and_then(|tx| tx.writer.take());
+        self.set_connected(false);
+        // let blocked readers fail out with DeviceNotConnected rather than wait for the reconnect
+        if let Some(rx) = rx.as_ref() { rx.notify.notify(); }
+        (channels, writer)
+    }
+
+    /// Marks the slot disconnected but leaves its rings attached, so frames already buffered stay readable.
+    pub fn end_of_stream(&self, handle_id: i32) {
+        let Ok(rx) = self.rx.lock() else { return; };
+        if !self.matches(handle_id) { return; }
+        self.set_connected(false);
+        if let Some(rx) = rx.as_ref() { rx.notify.notify(); }
+    }
+
+    fn set_connected(&self, connected: bool) {
+        if (self.connection.load(Ordering::Relaxed) & 1 == 1) != connected {
+            self.connection.fetch_add(1, Ordering::Release);
+        }
+    }
+
+    fn init(&self) {
+        let stats = Arc::new(DeviceStats::new());
+        if let Ok(mut rx) = self.rx.lock() {
+            rx.replace(RxState {
+                channels: None,
+                notify: Arc::new(RxNotify::new()),
+                stats: stats.clone(),
+                filters: Arc::new(RxFilters::new()),
+                mailboxes: Arc::new(RxMailboxes::new()),
+                clock: Arc::new(ClockSync::new()),
+                mappings: Vec::new(),
+                callbacks: Arc::new(RxCallbacks::new()),
+                capture: Arc::new(CaptureSlot::new()),
+                broker: Arc::new(BrokerSlot::new()),
+            });
+        }
+        if let Ok(mut tx) = self.tx.lock() {
+            tx.replace(TxState { writer: None, stats, coalesce: None });
+        }
+    }
+
+    fn clear(&self) {
+        let rx = self.rx.lock().ok().and_then(|mut rx| rx.take());
+        if let Some(rx) = rx {
+            // wake anyone still blocked on the old handle so they can fail out
+            rx.broker.unpublish();
+            rx.notify.notify();
+            // outside the lock, since a callback we wait out here may be calling into this handle
+            rx.callbacks.clear();
+        }
+        if let Ok(mut tx) = self.tx.lock() { tx.take(); }
+        self.set_connected(false);
+    }
+}
+
+/// Fixed-size table of device handles.
+///
+/// Allocation and release happen under the event loop lock, but lookups are lock-free,
+/// which keeps [`crate::event_loop::read_packets`] and [`crate::event_loop::write_packets`]
+/// independent of hotplug, device scans, and other handles.
+pub struct HandleTable {
+    slots: [HandleSlot; MAX_HANDLES],
+}
+
+impl HandleTable {
+    const fn new() -> Self {
+        Self { slots: [const { HandleSlot::new() }; MAX_HANDLES] }
+    }
+
+    /// Allocates a free slot, returning its new handle id.
+    pub fn allocate(&self) -> Result<i32, EventLoopError> {
+        for (idx, slot) in self.slots.iter().enumerate() {
+            let generation = slot.generation.load(Ordering::Acquire);
+            if generation & 1 == 1 { continue; }
+            if slot.generation.compare_exchange(generation, generation.wrapping_add(1), Ordering::AcqRel, Ordering::Acquire).is_ok() {
+                slot.init();
+                let generation = generation.wrapping_add(1) & GENERATION_MASK;
+                return Ok(((generation as i32) << SLOT_BITS) | idx as i32);
+            }
+        }
+        Err(EventLoopError::TooManyDevices)
+    }
+
+    /// Releases a handle, dropping any attached rings.
+    pub fn release(&self, handle_id: i32) {
+        let Some(slot) = self.slot(handle_id) else { return; };
+        let generation = slot.generation.load(Ordering::Acquire);
+        if !slot.matches(handle_id) { return; }
+        if slot.generation.compare_exchange(generation, generation.wrapping_add(1), Ordering::AcqRel, Ordering::Acquire).is_ok() {
+            slot.clear();
+        }
+    }
+
+    /// Looks up the slot for a live handle.
+    pub fn get(&self, handle_id: i32) -> Result<&HandleSlot, EventLoopError> {
+        match self.slot(handle_id) {
+            Some(slot) if slot.matches(handle_id) => Ok(slot),
+            _ => Err(EventLoopError::DeviceNotOpened),
+        }
+    }
+
+    fn slot(&self, handle_id: i32) -> Option<&HandleSlot> {
+        if handle_id < 0 { return None; }
+        Some(&self.slots[(handle_id & SLOT_MASK) as usize])
+    }
+}
+
+pub static HANDLES: HandleTable = HandleTable::new();
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn stale_handle_is_rejected_after_reopen() {
+        let table = HandleTable::new();
+        let old = table.allocate().unwrap();
+        table.release(old);
+        assert_eq!(table.get(old).err(), Some(EventLoopError::DeviceNotOpened));
+
+        let new = table.allocate().unwrap();
+        assert_eq!(new & SLOT_MASK, old & SLOT_MASK, "the freed slot is reused");
+        assert_ne!(new, old);
+        assert!(table.get(new).is_ok());
+        assert_eq!(table.get(old).err(), Some(EventLoopError::DeviceNotOpened));
+        // releasing the stale handle leaves the new one open
+        table.release(old);
+        assert!(table.get(new).is_ok());
+    }
+
+    #[test]
+    fn generation_wraps_around_to_valid_handles() {
+        let table = HandleTable::new();
+        for start in [GENERATION_MASK - 1, u32::MAX - 1] {
+            table.slots[0].generation.store(start, Ordering::Relaxed);
+            let last = table.allocate().unwrap();
+            table.release(last);
+            let wrapped = table.allocate().unwrap();
+            assert!(last >= 0 && wrapped >= 0);
+            assert_eq!((last >> SLOT_BITS) as u32, GENERATION_MASK);
+            assert_eq!(wrapped >> SLOT_BITS, 1);
+            assert!(table.get(wrapped).is_ok());
+            assert_eq!(table.get(last).err(), Some(EventLoopError::DeviceNotOpened));
+            table.release(wrapped);
+        }
+    }
+
+    #[test]
+    fn allocating_past_max_handles_fails() {
+        let table = HandleTable::new();
+        let handles: Vec<_> = (0..MAX_HANDLES).map(|_| table.allocate().unwrap()).collect();
+        assert_eq!(table.allocate(), Err(EventLoopError::TooManyDevices));
+        table.release(handles[7]);
+        assert_eq!(table.allocate().map(|h| h & SLOT_MASK), Ok(7));
+    }
+}
@@ -1,19 +1,211 @@
 #![allow(dead_code)]
 
-use std::fmt::Display;
+use std::{collections::VecDeque, fmt::Display, marker::PhantomData, pin::pin, sync::{atomic::Ordering, Arc, OnceLock}};
 
-use bytemuck::AnyBitPattern;
-use futures_util::StreamExt;
-use nusb::{transfer::{ControlIn, ControlOut, ControlType, Recipient, RequestBuffer}, DeviceInfo};
-use rdxusb_protocol::{RdxUsbCtrl, RdxUsbDeviceInfo, RdxUsbFsPacket, ENDPOINT_OUT};
-use ringbuf::{storage::Heap, traits::Consumer};
-use async_ringbuf::{traits::{AsyncProducer, AsyncConsumer, Producer, Split}, AsyncHeapRb, AsyncRb};
+use bytemuck::{AnyBitPattern, Pod, Zeroable};
+use futures_util::{future::{select, Either}, FutureExt};
+use nusb::{transfer::{ControlIn, ControlOut, ControlType, Recipient}, DeviceInfo};
+use rdxusb_protocol::{RdxUsbCtrl, RdxUsbDeviceInfo, RdxUsbFsPacket, RdxUsbPacket, ENDPOINT_OUT, HS_PACKETS_PER_TRANSFER, PROTOCOL_VERSION_MAJOR_HS};
+use ringbuf::{storage::Heap, traits::{Consumer, Observer}};
+use async_ringbuf::{traits::{AsyncConsumer, AsyncObserver, AsyncProducer, Producer, Split}, AsyncHeapRb, AsyncRb};
+
+use crate::{broker::{BrokerCache, BrokerSlot}, callback::{CallbackBatcher, RxCallbacks}, capture::{CaptureCache, CaptureSlot, Direction}, clock::{monotonic_ns, ClockEstimator, ClockSync}, coalesce::{self, Coalescer}, filter::{FilterCache, FilterSet, RxFilters}, mailbox::{MailboxCache, RxMailboxes}, notify::RxNotify, ring::{packet_ring, RingConsumer, RingMapping, RingProducer}, stats::DeviceStats, trace::{self, SubmitTimes, TxStamped}, transport::{BulkInQueue, BulkOutQueue, Transport}};
+
+/// A frame format carried over the bulk endpoints.
+///
+/// Full-speed devices exchange [`RdxUsbFsPacket`]s one per transfer, and high-speed devices
+/// exchange [`RdxUsbPacket`]s packed several per transfer. Everything else about the two is the same.
+pub trait UsbFrame: Pod + Send + Sync {
+    /// Size of one frame on the wire.
+    const SIZE: usize = core::mem::size_of::<Self>();
+    /// Maximum number of frames packed back to back into one bulk transfer.
+    const FRAMES_PER_TRANSFER: usize;
+    /// Whether devices reporting this major protocol version use this frame format.
+    fn supports_protocol(protocol_version_major: u16) -> bool;
+    fn channel(&self) -> u8;
+    fn arb_id(&self) -> u32;
+    fn dlc(&self) -> u8;
+    fn timestamp_ns(&self) -> u64;
+    fn set_channel(&mut self, channel: u8);
+    /// Writes the frame into a generic packet.
+    fn widen_into(&self, dst: &mut RdxUsbPacket);
+    /// Narrows a generic packet into this frame format, failing if it doesn't fit.
+    fn from_packet(packet: RdxUsbPacket) -> Result<Self, RdxUsbPacket>;
+}
+
+impl UsbFrame for RdxUsbFsPacket {
+    const FRAMES_PER_TRANSFER: usize = 1;
+
+    fn supports_protocol(protocol_version_major: u16) -> bool {
+        protocol_version_major < PROTOCOL_VERSION_MAJOR_HS
+    }
+
+    fn channel(&self) -> u8 { self.channel }
+    fn arb_id(&self) -> u32 { self.arb_id }
+    fn dlc(&self) -> u8 { self.dlc }
+    fn timestamp_ns(&self) -> u64 { self.timestamp_ns }
+    fn set_channel(&mut self, channel: u8) { self.channel = channel; }
+
+    fn widen_into(&self, dst: &mut RdxUsbPacket) {
+        rdxusb_protocol::widen_fs_packets(core::slice::from_ref(self), core::slice::from_mut(dst));
+    }
+
+    fn from_packet(packet: RdxUsbPacket) -> Result<Self, RdxUsbPacket> {
+        packet.try_into()
+    }
+}
+
+impl UsbFrame for RdxUsbPacket {
+    const FRAMES_PER_TRANSFER: usize = HS_PACKETS_PER_TRANSFER;
+
+    fn supports_protocol(protocol_version_major: u16) -> bool {
+        protocol_version_major == PROTOCOL_VERSION_MAJOR_HS
+    }
+
+    fn channel(&self) -> u8 { self.channel }
+    fn arb_id(&self) -> u32 { self.arb_id }
+    fn dlc(&self) -> u8 { self.dlc }
+    fn timestamp_ns(&self) -> u64 { self.timestamp_ns }
+    fn set_channel(&mut self, channel: u8) { self.channel = channel; }
+
+    fn widen_into(&self, dst: &mut RdxUsbPacket) {
+        *dst = *self;
+    }
+
+    fn from_packet(packet: RdxUsbPacket) -> Result<Self, RdxUsbPacket> {
+        if packet.dlc as usize > packet.data.len() { return Err(packet); }
+        Ok(packet)
+    }
+}
+
+/// Widens a frame into a new generic packet.
+#[inline]
+fn widened<F: UsbFrame>(frame: &F) -> RdxUsbPacket {
+    let mut packet = RdxUsbPacket::zeroed();
+    frame.widen_into(&mut packet);
+    packet
+}
 
 /// USB full-speed spec host.
-pub struct RdxUsbFsHost {
-    iface: nusb::Interface,
+pub type RdxUsbFsHost = RdxUsbHost<RdxUsbFsPacket>;
+/// USB high-speed spec host, which packs multiple full-size packets into each bulk transfer.
+pub type RdxUsbHsHost = RdxUsbHost<RdxUsbPacket>;
+
+/// Host side of an RdxUsb device, generic over the device's [`UsbFrame`] format and its [`Transport`].
+pub struct RdxUsbHost<F: UsbFrame, T: Transport = nusb::Interface> {
+    iface: T,
     n_channels: u8,
-    rx_queue: Vec<<AsyncRb<Heap<RdxUsbFsPacket>> as async_ringbuf::traits::Split>::Prod>
+    rx_queue: Vec<RingProducer<RdxUsbPacket>>,
+    notify: Option<Arc<RxNotify>>,
+    stats: Arc<DeviceStats>,
+    filters: Option<Arc<RxFilters>>,
+    filter_cache: FilterCache,
+    mailboxes: Option<Arc<RxMailboxes>>,
+    mailbox_cache: MailboxCache,
+    clock: ClockEstimator,
+    clock_sync: Option<Arc<ClockSync>>,
+    host_timestamps: bool,
+    callbacks: Option<Arc<RxCallbacks>>,
+    batcher: CallbackBatcher,
+    capture: Option<Arc<CaptureSlot>>,
+    capture_cache: CaptureCache,
+    broker: Option<Arc<BrokerSlot>>,
+    broker_cache: BrokerCache,
+    _frame: PhantomData<F>,
+}
+
+/// What the rx poller does with a packet whose channel queue is full.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[repr(u32)]
+pub enum OverflowPolicy {
+    /// Discard the incoming packet.
+    #[default]
+    DropNewest = 0,
+    /// Evict the oldest queued packet to make room.
+    DropOldest = 1,
+    /// Stop reading from the device until the consumer makes room.
+    Backpressure = 2,
+}
+
+impl TryFrom<u32> for OverflowPolicy {
+    type Error = u32;
+
+    fn try_from(value: u32) -> Result<Self, Self::Error> {
+        match value {
+            0 => Ok(Self::DropNewest),
+            1 => Ok(Self::DropOldest),
+            2 => Ok(Self::Backpressure),
+            v => Err(v),
+        }
+    }
+}
+
+/// Number of tx priority lanes.
+pub const TX_LANES: usize = 3;
+/// Transfers in a row that may leave out waiting bulk frames. The next one takes from the bulk lane
+/// before the normal lane, so bulk traffic still drains while the normal lane is never empty.
+pub const BULK_MAX_SKIPPED: usize = 8;
+
+/// Which tx lane a frame is queued in. The write poller always drains lower-numbered lanes first.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+pub enum TxLane {
+    /// Control frames such as setpoints. Frames here never wait behind more than one transfer of the other lanes.
+    Urgent = 0,
+    /// Where frames go by default.
+    Normal = 1,
+    /// Configuration and other bulk traffic, sent after the other lanes. A sustained load on the normal lane
+    /// holds it back for at most [`BULK_MAX_SKIPPED`] transfers at a time.
+    Bulk = 2,
+}
+
+impl TryFrom<u32> for TxLane {
+    type Error = u32;
+
+    fn try_from(value: u32) -> Result<Self, Self::Error> {
+        match value {
+            0 => Ok(Self::Urgent),
+            1 => Ok(Self::Normal),
+            2 => Ok(Self::Bulk),
+            v => Err(v),
+        }
+    }
+}
+
+/// Capacities of the tx lanes, and how frames written without an explicit lane are assigned one.
+///
+/// Frames are assigned by CAN id without the flag bits. Lower ids win arbitration on the bus,
+/// so this mirrors the priority the bus itself would give them.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TxLaneConfig {
+    /// Capacity of each lane in packets, indexed by [`TxLane`]. A lane with capacity 0 rejects every frame,
+    /// except for the normal lane, which always holds at least one.
+    ///
+    /// While the urgent lane has capacity, the other lanes keep at most one transfer in flight,
+    /// which bounds how long an urgent frame waits but costs them pipelining.
+    pub capacity: [usize; TX_LANES],
+    /// Ids below this go in the urgent lane.
+    pub urgent_below: u32,
+    /// Ids at or above this go in the bulk lane.
+    pub bulk_from: u32,
+}
+
+impl TxLaneConfig {
+    /// A single FIFO of `n_packets`: every frame goes in the normal lane.
+    pub const fn fifo(n_packets: usize) -> Self {
+        Self { capacity: [0, n_packets, 0], urgent_below: 0, bulk_from: u32::MAX }
+    }
+
+    pub fn lane_for(&self, arb_id: u32) -> TxLane {
+        let id = arb_id & 0x1fff_ffff;
+        if id < self.urgent_below {
+            TxLane::Urgent
+        } else if id >= self.bulk_from {
+            TxLane::Bulk
+        } else {
+            TxLane::Normal
+        }
+    }
 }
 
 #[derive(Debug)]
@@ -75,68 +267,119 @@ impl core::error::Error for RdxUsbHostError {}
 
 pub type RdxUsbHostResult<T> = Result<T, RdxUsbHostError>;
 
-impl RdxUsbFsHost {
+/// Opens a device and claims its RdxUsb interface, returning the interface and the device's reported config.
+///
+/// The config's protocol version says which host to construct with [`RdxUsbHost::from_interface`].
+pub async fn claim_interface(dev_info: &DeviceInfo) -> RdxUsbHostResult<(nusb::Interface, RdxUsbDeviceInfo)> {
+
+    let Some(iface) = dev_info.interfaces().find(|iface| {
+        iface.class() == 0xff && iface.subclass() == 0x0 && iface.protocol() == 0x0
+    }) else { return Err(RdxUsbHostError::NoInterface); };
+
+    let iface_idx = iface.interface_number();
+
+    let mut handle: RdxUsbHostResult<nusb::Device> = Err(RdxUsbHostError::UsbFault);
+    for _ in 0..3 {
+        handle = match dev_info.open() {
+            Ok(o) => { Ok(o) }
+            Err(e) => {
+                // windows needs a sleep retry
+                #[cfg(windows)]
+                std::thread::sleep(std::time::Duration::from_millis(10));
+                Err(e.into())
+            }
+        };
+        if handle.is_ok() { break; }
+    }
+    let handle = handle?;
+
+    handle.detach_kernel_driver(iface_idx).ok();
+    // TODO: properly introspect for our device
+    // we probably don't need to right now
+    //let cfg = handle.active_configuration().unwrap();
+    //for iface in cfg.interfaces() {
+    //    eprintln!("iface number: {}", iface.interface_number());
+    //    for alt_stg in iface.alt_settings() {
+    //        eprintln!("\talt_stg idx: {}", alt_stg.alternate_setting());
+    //        for endpoint in alt_stg.endpoints() {
+    //            eprintln!("\tep {}, {:?} ({})", endpoint.address(), endpoint.direction(), endpoint.max_packet_size());
+    //        }
+    //    }
+    //}
+
+
+    let iface = handle.claim_interface(iface_idx)?;
+    let cfg = get_device_info(&iface).await?;
+    Ok((iface, cfg))
+}
+
+async fn get_device_info<T: Transport>(iface: &T) -> RdxUsbHostResult<RdxUsbDeviceInfo> {
+    let res = iface.control_in(ControlIn { 
+        control_type: ControlType::Vendor,
+        recipient: Recipient::Interface,
+        request: RdxUsbCtrl::DeviceInfo as u8,
+        value: 1,
+        index: 0,
+        length: core::mem::size_of::<RdxUsbDeviceInfo>() as u16,
+    }).await.into_result()?;
+    Ok(bytemuck::try_from_bytes::<RdxUsbDeviceInfo>(&res.as_slice())?.clone())
+}
+
+impl<F: UsbFrame> RdxUsbHost<F> {
     /// Opens the device with the [`DeviceInfo`] and specified rx queue buffer size.
     /// Returns a usb device handle
-    pub async fn open_device(dev_info: DeviceInfo, rx_q_size: usize) -> RdxUsbHostResult<(Self, Vec<RdxUsbFsChannel>)> {
-
-        let Some(iface) = dev_info.interfaces().find(|iface| {
-            iface.class() == 0xff && iface.subclass() == 0x0 && iface.protocol() == 0x0
-        }) else { return Err(RdxUsbHostError::NoInterface); };
+    ///
+    /// Fails with [`RdxUsbHostError::UnsupportedProtocol`] if the device uses the other frame format.
+    pub async fn open_device(dev_info: DeviceInfo, rx_q_size: usize) -> RdxUsbHostResult<(Self, Vec<RdxUsbChannel<F>>)> {
+        let (iface, cfg) = claim_interface(&dev_info).await?;
+        Self::from_interface(iface, &cfg, rx_q_size)
+    }
+}
 
-        let iface_idx = iface.interface_number();
+impl<F: UsbFrame, T: Transport> RdxUsbHost<F, T> {
+    /// Sets up the host for an interface returned by [`claim_interface`], or any other [`Transport`].
+    pub fn from_interface(iface: T, cfg: &RdxUsbDeviceInfo, rx_q_size: usize) -> RdxUsbHostResult<(Self, Vec<RdxUsbChannel<F, T>>)> {
+        Self::from_rings(iface, cfg, &mut RxRings::new(rx_q_size))
+    }
 
-        let mut handle: RdxUsbHostResult<nusb::Device> = Err(RdxUsbHostError::UsbFault);
-        for _ in 0..3 {
-            handle = match dev_info.open() {
-                Ok(o) => { Ok(o) }
-                Err(e) => {
-                    // windows needs a sleep retry
-                    #[cfg(windows)]
-                    std::thread::sleep(std::time::Duration::from_millis(10));
-                    Err(e.into())
-                }
-            };
-            if handle.is_ok() { break; }
-        }
-        let handle = handle?;
-
-        handle.detach_kernel_driver(iface_idx).ok();
-        // TODO: properly introspect for our device
-        // we probably don't need to right now
-        //let cfg = handle.active_configuration().unwrap();
-        //for iface in cfg.interfaces() {
-        //    eprintln!("iface number: {}", iface.interface_number());
-        //    for alt_stg in iface.alt_settings() {
-        //        eprintln!("\talt_stg idx: {}", alt_stg.alternate_setting());
-        //        for endpoint in alt_stg.endpoints() {
-        //            eprintln!("\tep {}, {:?} ({})", endpoint.address(), endpoint.direction(), endpoint.max_packet_size());
-        //        }
-        //    }
-        //}
-
-
-        let iface = handle.claim_interface(iface_idx)?;
-        let cfg = Self::get_device_info(&iface).await?;
+    /// Like [`from_interface`](Self::from_interface), but takes the channels' rx rings from `rings`,
+    /// only allocating rings for channels it doesn't have yet.
+    pub fn from_rings(iface: T, cfg: &RdxUsbDeviceInfo, rings: &mut RxRings) -> RdxUsbHostResult<(Self, Vec<RdxUsbChannel<F, T>>)> {
+        if !F::supports_protocol(cfg.protocol_version_major) { return Err(RdxUsbHostError::UnsupportedProtocol); }
         let icount = cfg.n_channels;
 
-        // TODO: split into RdxUsbFsHost or RdxUsbHsHost here.
-
-        let mut dev = RdxUsbFsHost {
+        let mut dev = RdxUsbHost {
             iface: iface.clone(),
             n_channels: icount,
-            rx_queue: Vec::with_capacity(icount as usize),
+            rx_queue: Vec::with_capacity(icount as usize + 1),
+            notify: None,
+            stats: Arc::new(DeviceStats::new()),
+            filters: None,
+            filter_cache: FilterCache::default(),
+            mailboxes: None,
+            mailbox_cache: MailboxCache::default(),
+            clock: ClockEstimator::new(),
+            clock_sync: None,
+            host_timestamps: false,
+            callbacks: None,
+            batcher: CallbackBatcher::default(),
+            capture: None,
+            capture_cache: CaptureCache::default(),
+            broker: None,
+            broker_cache: BrokerCache::default(),
+            _frame: PhantomData,
         };
 
-        let mut v = Vec::with_capacity(icount as usize);
+        // n_channels is the highest channel index, so a single-channel device reports 0
+        let mut v = Vec::with_capacity(icount as usize + 1);
         for i in 0..=icount {
-            //let (tx, rx) = tokio::sync::mpsc::channel(rx_q_size);
-            let (prod, cons) = AsyncHeapRb::new(rx_q_size).split();
+            let (prod, cons) = rings.take(i as usize);
 
-            v.push(RdxUsbFsChannel {
+            v.push(RdxUsbChannel {
                 iface: iface.clone(),
                 channel: i,
                 rx_queue: cons,
+                _frame: PhantomData,
             });
             dev.rx_queue.push(prod);
         }
@@ -144,107 +387,609 @@ impl RdxUsbFsHost {
         Ok((dev, v))
     }
 
+    /// Gives the host's ends of the rx rings back to `rings`, for the next host on the same handle.
+    /// The channels' ends go back with [`RxRings::put_consumers`].
+    pub fn recycle(self, rings: &mut RxRings) {
+        rings.put_producers(self.rx_queue);
+    }
+
     /// This drives the event loop.
     /// 
     /// **n_transfers** determines the maximum number of transfers to be flighted at a time.
-    pub async fn poll(&mut self, n_transfers: usize, await_on_full: bool) -> RdxUsbHostResult<()> {
+    /// **overflow** determines what happens to packets that arrive on a full channel queue.
+    ///
+    /// Each transfer may carry up to [`UsbFrame::FRAMES_PER_TRANSFER`] frames, which are dispatched in order.
+    pub async fn poll(&mut self, n_transfers: usize, overflow: OverflowPolicy) -> RdxUsbHostResult<()> {
         let mut read_queue = self.iface.bulk_in_queue(rdxusb_protocol::ENDPOINT_IN);
+        let transfer_size = F::SIZE * F::FRAMES_PER_TRANSFER;
 
         while read_queue.pending() < n_transfers {
-            read_queue.submit(RequestBuffer::new(RdxUsbFsPacket::SIZE))
+            read_queue.submit(Vec::new(), transfer_size)
         }
         loop {
-            let buf = read_queue.next_complete().await.into_result()?;
-            //println!("Received message: len={} {buf:?}", buf.len());
-            if let Ok(pkt) = bytemuck::try_from_bytes::<RdxUsbFsPacket>(buf.as_slice()) {
-                if (pkt.channel as usize) < self.rx_queue.len() {
-                    if await_on_full {
-                        self.rx_queue[pkt.channel as usize].push(pkt.clone()).await.ok();
-                    } else {
-                        self.rx_queue[pkt.channel as usize].try_push(pkt.clone()).ok();
+            let mut completion = read_queue.next_complete().await;
+            loop {
+                let buf = match completion.into_result() {
+                    Ok(buf) => buf,
+                    Err(e) => {
+                        self.flush_batch();
+                        self.stats.record_transfer_error(&e);
+                        return Err(e.into());
+                    }
+                };
+                // take this as close to completion as possible, since it feeds the clock estimate
+                let received_ns = monotonic_ns();
+                //println!("Received message: len={} {buf:?}", buf.len());
+                let whole_frames = buf.len() / F::SIZE * F::SIZE;
+                if whole_frames != buf.len() { self.stats.record_decode_error(); }
+                match bytemuck::try_cast_slice::<u8, F>(&buf[..whole_frames]) {
+                    Ok(frames) => {
+                        for pkt in frames {
+                            self.dispatch(pkt, received_ns, overflow).await;
+                        }
                     }
+                    Err(_) => self.stats.record_decode_error(),
                 }
-            } 
 
-            read_queue.submit(RequestBuffer::reuse(buf, RdxUsbFsPacket::SIZE))
+                read_queue.submit(buf, transfer_size);
+                // pick up transfers that already completed too, so rx callbacks get them in the same batch
+                match read_queue.next_complete().now_or_never() {
+                    Some(c) => { completion = c; }
+                    None => { break; }
+                }
+            }
+            self.flush_batch();
         }
         //println!("Packet id: {:#08x} ts: {}", header.arbitration_id(), u32::from_le_bytes(buf[20..24].try_into().unwrap()));
     }
 
-    async fn get_device_info(iface: &nusb::Interface) -> RdxUsbHostResult<RdxUsbDeviceInfo> {
-        let res = iface.control_in(ControlIn { 
-            control_type: ControlType::Vendor,
-            recipient: Recipient::Interface,
-            request: RdxUsbCtrl::DeviceInfo as u8,
-            value: 1,
-            index: 0,
-            length: core::mem::size_of::<RdxUsbDeviceInfo>() as u16,
-        }).await.into_result()?;
-        Ok(bytemuck::try_from_bytes::<RdxUsbDeviceInfo>(&res.as_slice())?.clone())
+    /// Hands the frames of a transfer batch to rx callbacks and broker clients.
+    fn flush_batch(&mut self) {
+        if let Some(callbacks) = &self.callbacks { self.batcher.flush(callbacks); }
+        if let Some(server) = self.broker_cache.server() { server.flush(); }
+    }
+
+    /// Routes a received packet through the channel's filters and mailbox into its rx queue.
+    ///
+    /// **received_ns** is when the transfer completed on the host monotonic clock.
+    async fn dispatch(&mut self, pkt: &F, received_ns: u64, overflow: OverflowPolicy) {
+        if let Some(tap) = self.capture.as_ref().and_then(|c| self.capture_cache.get(c)) {
+            tap.record(Direction::Rx, received_ns, &widened(pkt));
+        }
+        // broker clients run their own filters and clock estimate, so they get every frame as the device sent it
+        if let Some(server) = self.broker.as_ref().and_then(|b| self.broker_cache.get(b)) {
+            server.publish(&widened(pkt));
+        }
+        if self.clock.observe(pkt.timestamp_ns(), received_ns) {
+            if let Some(sync) = &self.clock_sync { sync.publish(self.clock.estimate()); }
+        }
+        let timestamp_ns = match self.clock.estimate() {
+            Some(estimate) if self.host_timestamps => estimate.device_to_host(pkt.timestamp_ns()),
+            _ => pkt.timestamp_ns(),
+        };
+
+        let Some(rx_queue) = self.rx_queue.get_mut(pkt.channel() as usize) else {
+            self.stats.record_invalid_channel();
+            return;
+        };
+        let stats = self.stats.channel(pkt.channel());
+        if let Some(filters) = &self.filters {
+            if !self.filter_cache.accepts(filters, pkt.channel(), pkt.arb_id()) {
+                stats.rx_filtered.fetch_add(1, Ordering::Relaxed);
+                return;
+            }
+        }
+        if let Some(callbacks) = &self.callbacks {
+            self.batcher.push(callbacks, pkt.channel(), || RdxUsbPacket { timestamp_ns, ..widened(pkt) });
+        }
+        if let Some(mailbox) = self.mailboxes.as_ref().and_then(|m| self.mailbox_cache.get(m, pkt.channel())) {
+            let stored = mailbox.store(&RdxUsbPacket { timestamp_ns, ..widened(pkt) }, received_ns);
+            if !mailbox.queued() {
+                // with nowhere else to go, a packet whose id didn't fit in the mailbox is lost
+                if stored {
+                    stats.record_rx(pkt.dlc(), rx_queue.occupied_len());
+                } else {
+                    stats.rx_dropped_full.fetch_add(1, Ordering::Relaxed);
+                }
+                return;
+            }
+        }
+
+        rx_queue.set_trace_origin(received_ns);
+        let widen = |slot: &mut RdxUsbPacket| {
+            pkt.widen_into(slot);
+            slot.timestamp_ns = timestamp_ns;
+        };
+        let pushed = match overflow {
+            OverflowPolicy::DropNewest => rx_queue.try_push_with(widen),
+            OverflowPolicy::DropOldest => {
+                if rx_queue.push_overwrite_with(widen) { stats.rx_evicted.fetch_add(1, Ordering::Relaxed); }
+                true
+            }
+            OverflowPolicy::Backpressure => {
+                rx_queue.push(RdxUsbPacket { timestamp_ns, ..widened(pkt) }).await.is_ok()
+            }
+        };
+        if pushed {
+            stats.record_rx(pkt.dlc(), rx_queue.occupied_len());
+            if let Some(notify) = &self.notify { notify.notify_if_armed(); }
+        } else {
+            stats.rx_dropped_full.fetch_add(1, Ordering::Relaxed);
+        }
     }
 
     pub async fn get_device_config(&self) -> RdxUsbHostResult<RdxUsbDeviceInfo> {
-        Self::get_device_info(&self.iface).await
+        get_device_info(&self.iface).await
     }
 
-    pub fn write_poller(&self, n_packets: usize) -> (RdxUsbFsWritePoller, RdxUsbFsWriter) {
-        RdxUsbFsWritePoller::new(self.iface.clone(), n_packets)
+    /// Sets a notifier that gets signalled when packets are pushed into the rx queues.
+    pub fn set_notify(&mut self, notify: Arc<RxNotify>) {
+        self.notify = Some(notify);
+    }
+
+    /// Sets the acceptance filters checked before packets are queued.
+    /// Packets rejected by a filter never reach the rx queues.
+    pub fn set_filters(&mut self, filters: Arc<RxFilters>) {
+        self.filters = Some(filters);
+    }
+
+    /// Sets the latest-value mailboxes updated by the rx poller.
+    pub fn set_mailboxes(&mut self, mailboxes: Arc<RxMailboxes>) {
+        self.mailboxes = Some(mailboxes);
+    }
+
+    /// Sets where the device's clock estimate gets published. This clears any previously published estimate,
+    /// since a newly opened device's clock has nothing to do with the last one's.
+    pub fn set_clock_sync(&mut self, clock_sync: Arc<ClockSync>) {
+        clock_sync.publish(self.clock.estimate());
+        self.clock_sync = Some(clock_sync);
+    }
+
+    /// If set, queued packets carry host monotonic timestamps converted with the current clock estimate
+    /// instead of raw device timestamps.
+    pub fn set_host_timestamps(&mut self, host_timestamps: bool) {
+        self.host_timestamps = host_timestamps;
+    }
+
+    /// Sets the callbacks that receive batches of packets as the rx poller decodes them.
+    ///
+    /// Callbacks see every packet that passes the channel's filters, whether or not it is queued.
+    /// They run on the poller's task, so they must not block.
+    pub fn set_callbacks(&mut self, callbacks: Arc<RxCallbacks>) {
+        self.callbacks = Some(callbacks);
+    }
+
+    /// Sets the capture that records every frame received, and every frame sent by the
+    /// [`write_poller`](Self::write_poller), so call this before creating that.
+    pub fn set_capture(&mut self, capture: Arc<CaptureSlot>) {
+        self.capture = Some(capture);
+    }
+
+    /// Sets the broker slot that received frames are published to other processes through.
+    pub fn set_broker(&mut self, broker: Arc<BrokerSlot>) {
+        self.broker = Some(broker);
+    }
+
+    /// Shares a stats block with the host, e.g. one that outlives reconnects.
+    pub fn set_stats(&mut self, stats: Arc<DeviceStats>) {
+        stats.n_channels.store(self.rx_queue.len() as u32, Ordering::Relaxed);
+        self.stats = stats;
+    }
+
+    pub fn stats(&self) -> &Arc<DeviceStats> {
+        &self.stats
+    }
+
+    /// Creates the write side of the device. It shares the host's stats block, 
+    /// so call this after [`set_stats`](Self::set_stats).
+    pub fn write_poller(&self, lanes: TxLaneConfig) -> (RdxUsbWritePoller<F, T>, RdxUsbWriter<F>) {
+        self.write_poller_from(TxRings::new(lanes))
+    }
+
+    /// Like [`write_poller`](Self::write_poller), but reuses tx lanes kept from an earlier connection,
+    /// along with any frames still queued in them.
+    pub fn write_poller_from(&self, rings: TxRings<F>) -> (RdxUsbWritePoller<F, T>, RdxUsbWriter<F>) {
+        let (mut poller, mut writer) = RdxUsbWritePoller::from_rings(self.iface.clone(), rings);
+        poller.stats = self.stats.clone();
+        writer.stats = self.stats.clone();
+        poller.capture = self.capture.clone();
+        (poller, writer)
     }
 
 }
 
-pub struct RdxUsbFsWriter(<AsyncRb<Heap<RdxUsbFsPacket>> as async_ringbuf::traits::Split>::Prod);
+/// Rx rings kept between connections, so a host reconnecting on the same handle reuses them
+/// instead of allocating new ones, and packets that weren't read before a disconnect can still be read after.
+pub struct RxRings {
+    capacity: usize,
+    /// Both ends of each channel's ring, indexed by channel. A ring is only reused once both ends are back.
+    rings: Vec<(Option<RingProducer<RdxUsbPacket>>, Option<RingConsumer<RdxUsbPacket>>)>,
+}
 
-impl RdxUsbFsWriter {
-    pub fn try_send(&mut self, packet: RdxUsbFsPacket) -> Option<RdxUsbFsPacket> {
-        self.0.try_push(packet).err()
+impl RxRings {
+    /// An empty pool of rings holding `capacity` packets each.
+    pub fn new(capacity: usize) -> Self {
+        Self { capacity, rings: Vec::new() }
     }
-    pub async fn send(&mut self, packet: RdxUsbFsPacket) -> Result<(), RdxUsbFsPacket> {
-        self.0.push(packet).await
+
+    /// Takes a channel's ring, allocating one if it isn't pooled.
+    fn take(&mut self, channel: usize) -> (RingProducer<RdxUsbPacket>, RingConsumer<RdxUsbPacket>) {
+        match self.rings.get_mut(channel).map(|(prod, cons)| (prod.take(), cons.take())) {
+            Some((Some(prod), Some(cons))) if prod.feeds(&cons) => (prod, cons),
+            _ => packet_ring(self.capacity),
+        }
+    }
+
+    fn put(&mut self, channel: usize, f: impl FnOnce(&mut (Option<RingProducer<RdxUsbPacket>>, Option<RingConsumer<RdxUsbPacket>>))) {
+        if self.rings.len() <= channel { self.rings.resize_with(channel + 1, || (None, None)); }
+        f(&mut self.rings[channel]);
+    }
+
+    /// Returns the host's ends of the rings, in channel order.
+    pub fn put_producers(&mut self, producers: impl IntoIterator<Item = RingProducer<RdxUsbPacket>>) {
+        for (channel, prod) in producers.into_iter().enumerate() {
+            self.put(channel, |ring| ring.0 = Some(prod));
+        }
+    }
+
+    /// Returns the channels' ends of the rings, in channel order.
+    pub fn put_consumers(&mut self, consumers: impl IntoIterator<Item = RingConsumer<RdxUsbPacket>>) {
+        for (channel, cons) in consumers.into_iter().enumerate() {
+            self.put(channel, |ring| ring.1 = Some(cons));
+        }
     }
 }
 
-pub struct RdxUsbFsWritePoller {
-    iface: nusb::Interface,
-    tx_queue: <AsyncRb<Heap<RdxUsbFsPacket>> as async_ringbuf::traits::Split>::Cons,
+/// A writer's tx lanes together with the write poller's ends of them, kept between connections like [`RxRings`].
+pub struct TxRings<F: UsbFrame> {
+    writer: RdxUsbWriter<F>,
+    lanes: [Option<TxConsumer<F>>; TX_LANES],
 }
 
-impl RdxUsbFsWritePoller {
-    pub fn new(iface: nusb::Interface, n_packets: usize) -> (Self, RdxUsbFsWriter) {
-        let (prod, cons) = AsyncHeapRb::new(n_packets).split();
+impl<F: UsbFrame> TxRings<F> {
+    pub fn new(config: TxLaneConfig) -> Self {
+        let mut producers = [None, None, None];
+        let mut consumers = [None, None, None];
+        for (lane, &capacity) in config.capacity.iter().enumerate() {
+            let capacity = if lane == TxLane::Normal as usize { capacity.max(1) } else { capacity };
+            if capacity == 0 { continue; }
+            let (prod, cons) = AsyncHeapRb::new(capacity).split();
+            producers[lane] = Some(prod);
+            consumers[lane] = Some(cons);
+        }
+        let writer = RdxUsbWriter {
+            lanes: producers,
+            config,
+            coalesce: None,
+            coalescer: Arc::new(OnceLock::new()),
+            stats: Arc::new(DeviceStats::new()),
+        };
+        Self { writer, lanes: consumers }
+    }
 
-        (Self { iface, tx_queue: cons, }, RdxUsbFsWriter(prod))
+    /// Number of frames waiting to be sent, over all lanes.
+    pub fn occupied_len(&self) -> usize {
+        self.writer.occupied_len()
     }
 
-    pub async fn poll(&mut self) -> Result<(), RdxUsbHostError> {
-        let mut buffer= Vec::with_capacity(64);
-        while let Some(msg) = self.tx_queue.next().await {
-            buffer.clear();
-            buffer.extend_from_slice(bytemuck::bytes_of(&msg));
-            buffer = self.iface.bulk_out(ENDPOINT_OUT, buffer).await.into_result()?.reuse();
+    /// Takes the lanes `kept` from an earlier connection, dropping the frames still queued in them unless
+    /// `keep_pending`, or makes new lanes if there are none.
+    pub fn reuse(kept: Option<Self>, config: TxLaneConfig, keep_pending: bool) -> Self {
+        match kept {
+            Some(mut rings) => {
+                if !keep_pending { rings.clear(); }
+                rings
+            }
+            None => Self::new(config),
+        }
+    }
+
+    /// Drops every frame waiting to be sent.
+    pub fn clear(&mut self) {
+        for lane in self.lanes.iter_mut().flatten() {
+            while let Some(entry) = lane.try_pop() {
+                if entry.slot == NO_SLOT { continue; }
+                if let Some(coalescer) = self.writer.coalescer.get() { coalescer.take(entry.slot); }
+            }
+        }
+    }
+}
+
+pub type RdxUsbFsWriter = RdxUsbWriter<RdxUsbFsPacket>;
+pub type RdxUsbHsWriter = RdxUsbWriter<RdxUsbPacket>;
+
+/// [`TxEntry::slot`] of an entry that carries its own frame.
+const NO_SLOT: u32 = u32::MAX;
+
+/// What the tx lanes carry: a frame, or a token standing in for the newest frame of a coalescing slot.
+struct TxEntry<F> {
+    stamped: TxStamped<F>,
+    slot: u32,
+}
+
+type TxRing<F> = AsyncRb<Heap<TxEntry<F>>>;
+type TxProducer<F> = <TxRing<F> as Split>::Prod;
+type TxConsumer<F> = <TxRing<F> as Split>::Cons;
+
+pub struct RdxUsbWriter<F: UsbFrame> {
+    lanes: [Option<TxProducer<F>>; TX_LANES],
+    config: TxLaneConfig,
+    /// Frames whose arbitration id matches these are coalesced.
+    coalesce: Option<Arc<FilterSet>>,
+    /// Created on the first coalesced frame, so writers that never coalesce don't pay for the table.
+    coalescer: Arc<OnceLock<Coalescer<F>>>,
+    stats: Arc<DeviceStats>,
+}
+
+impl<F: UsbFrame> RdxUsbWriter<F> {
+    /// Number of packets waiting to be sent, over all lanes.
+    pub fn occupied_len(&self) -> usize {
+        self.lanes.iter().flatten().map(|lane| lane.occupied_len()).sum()
+    }
+
+    pub fn lane_config(&self) -> &TxLaneConfig {
+        &self.config
+    }
+
+    /// Sets which frames are coalesced: while a frame is waiting to be sent, a newer frame with the same
+    /// channel and [`RdxUsbPacket::id`] replaces its payload instead of being queued. `None` turns this off.
+    pub fn set_coalescing(&mut self, filters: Option<Arc<FilterSet>>) {
+        self.coalesce = filters;
+    }
+
+    fn coalesces(&self, packet: &F) -> bool {
+        self.coalesce.as_ref().is_some_and(|filters| filters.accepts(packet.arb_id()))
+    }
+
+    /// Queues a packet in the lane its id maps to.
+    pub fn try_send(&mut self, packet: F) -> Option<F> {
+        self.try_send_lane(self.config.lane_for(packet.arb_id()), packet)
+    }
+
+    pub fn try_send_lane(&mut self, lane: TxLane, packet: F) -> Option<F> {
+        let mut slot = NO_SLOT;
+        if self.coalesces(&packet) && self.lanes[lane as usize].is_some() {
+            let coalescer = self.coalescer.get_or_init(Coalescer::new);
+            // a full table falls back to queueing the frame itself
+            if let Some((idx, needs_token)) = coalescer.store(coalesce::key(packet.channel(), packet.arb_id()), &packet) {
+                if !needs_token {
+                    self.stats.record_tx_coalesced();
+                    return None;
+                }
+                slot = idx;
+            }
+        }
+        let Some(queue) = &mut self.lanes[lane as usize] else { return Some(packet); };
+        match queue.try_push(TxEntry { stamped: trace::tx_pushed(packet), slot }) {
+            Ok(()) => None,
+            Err(entry) => {
+                if let Some(coalescer) = self.coalescer.get().filter(|_| slot != NO_SLOT) { coalescer.unqueue(slot); }
+                Some(entry.stamped.frame)
+            }
+        }
+    }
+
+    /// Queues a packet in the lane its id maps to, waiting for room. Coalesced packets never wait.
+    pub async fn send(&mut self, packet: F) -> Result<(), F> {
+        let lane = self.config.lane_for(packet.arb_id());
+        if self.coalesces(&packet) {
+            return self.try_send_lane(lane, packet).map_or(Ok(()), Err);
+        }
+        let Some(queue) = &mut self.lanes[lane as usize] else { return Err(packet); };
+        queue.push(TxEntry { stamped: trace::tx_pushed(packet), slot: NO_SLOT }).await.map_err(|e| e.stamped.frame)
+    }
+}
+
+pub type RdxUsbFsWritePoller = RdxUsbWritePoller<RdxUsbFsPacket>;
+pub type RdxUsbHsWritePoller = RdxUsbWritePoller<RdxUsbPacket>;
+
+pub struct RdxUsbWritePoller<F: UsbFrame, T: Transport = nusb::Interface> {
+    iface: T,
+    tx_lanes: [Option<TxConsumer<F>>; TX_LANES],
+    coalescer: Arc<OnceLock<Coalescer<F>>>,
+    stats: Arc<DeviceStats>,
+    capture: Option<Arc<CaptureSlot>>,
+    capture_cache: CaptureCache,
+    /// Transfers in a row that left out waiting bulk frames.
+    bulk_skipped: usize,
+}
+
+impl<F: UsbFrame, T: Transport> RdxUsbWritePoller<F, T> {
+    pub fn new(iface: T, lanes: TxLaneConfig) -> (Self, RdxUsbWriter<F>) {
+        Self::from_rings(iface, TxRings::new(lanes))
+    }
+
+    /// Creates a poller sending what is queued in `rings` to `iface`.
+    pub fn from_rings(iface: T, rings: TxRings<F>) -> (Self, RdxUsbWriter<F>) {
+        let TxRings { writer, lanes } = rings;
+        let poller = Self {
+            iface,
+            tx_lanes: lanes,
+            coalescer: writer.coalescer.clone(),
+            stats: writer.stats.clone(),
+            capture: None,
+            capture_cache: CaptureCache::default(),
+            bulk_skipped: 0,
+        };
+        (poller, writer)
+    }
+
+    /// Takes the poller apart again for [`from_rings`](Self::from_rings). Frames still queued stay queued.
+    ///
+    /// Returns `None` if `writer` isn't the writer created with this poller.
+    pub fn into_rings(self, writer: RdxUsbWriter<F>) -> Option<TxRings<F>> {
+        // a writer and its poller are made together and share the coalescer
+        if !Arc::ptr_eq(&self.coalescer, &writer.coalescer) { return None; }
+        Some(TxRings { writer, lanes: self.tx_lanes })
+    }
+
+    /// Number of lanes, from the top, that may go into the next transfer.
+    fn sendable_lanes(&self, lower_in_flight: usize) -> usize {
+        if self.tx_lanes[TxLane::Urgent as usize].is_some() && lower_in_flight > 0 { 1 } else { TX_LANES }
+    }
+
+    /// Packs queued frames from the top `n_lanes` lanes into `buffer`, up to [`UsbFrame::FRAMES_PER_TRANSFER`],
+    /// most urgent lane first unless the bulk lane is owed a turn. See [`BULK_MAX_SKIPPED`].
+    ///
+    /// Returns the number of frames packed, and whether any of them came from below the urgent lane.
+    fn fill_transfer(&mut self, n_lanes: usize, submit_ns: u64, buffer: &mut Vec<u8>) -> (usize, bool) {
+        const URGENT: usize = TxLane::Urgent as usize;
+        const NORMAL: usize = TxLane::Normal as usize;
+        const BULK: usize = TxLane::Bulk as usize;
+        let tap = self.capture.as_ref().and_then(|c| self.capture_cache.get(c));
+        let sent_ns = if tap.is_some() { monotonic_ns() } else { 0 };
+        let order = if self.bulk_skipped >= BULK_MAX_SKIPPED { [URGENT, BULK, NORMAL] } else { [URGENT, NORMAL, BULK] };
+        let mut n_frames = 0;
+        let mut lower = false;
+        let mut took_bulk = false;
+        for lane in order.into_iter().filter(|&lane| lane < n_lanes) {
+            let Some(queue) = &mut self.tx_lanes[lane] else { continue; };
+            while n_frames < F::FRAMES_PER_TRANSFER {
+                let Some(entry) = queue.try_pop() else { break; };
+                let msg = match entry.slot {
+                    NO_SLOT => entry.stamped.frame,
+                    // the token of a frame that already went out with an earlier token
+                    slot => match self.coalescer.get().and_then(|c| c.take(slot)) {
+                        Some(frame) => frame,
+                        None => { continue; }
+                    },
+                };
+                trace::tx_submitted(&entry.stamped, submit_ns);
+                buffer.extend_from_slice(bytemuck::bytes_of(&msg));
+                if let Some(tap) = tap {
+                    tap.record(Direction::Tx, sent_ns, &widened(&msg));
+                }
+                n_frames += 1;
+                lower |= lane != URGENT;
+                took_bulk |= lane == BULK;
+            }
+        }
+        // a transfer kept to the urgent lane doesn't count either way
+        if n_lanes > BULK {
+            let bulk_waiting = self.tx_lanes[BULK].as_ref().is_some_and(|lane| !lane.is_empty());
+            self.bulk_skipped = if bulk_waiting && !took_bulk { self.bulk_skipped + 1 } else { 0 };
+        }
+        (n_frames, lower)
+    }
+
+    fn lanes_empty(&self, n_lanes: usize) -> bool {
+        self.tx_lanes[..n_lanes].iter().flatten().all(|lane| lane.is_empty())
+    }
+
+    fn is_closed(&self) -> bool {
+        // the lanes are all dropped together with the writer
+        self.tx_lanes.iter().flatten().any(|lane| lane.is_closed())
+    }
+
+    /// Waits until any of the top `n_lanes` lanes has a frame.
+    async fn wait_occupied(&mut self, n_lanes: usize) {
+        let mut idx = 0;
+        let [urgent, normal, bulk] = self.tx_lanes.each_mut().map(|lane| {
+            let lane = lane.as_mut().filter(|_| idx < n_lanes);
+            idx += 1;
+            async move {
+                match lane {
+                    Some(lane) => { lane.wait_occupied(1).await; }
+                    None => std::future::pending::<()>().await,
+                }
+            }
+        });
+        select(pin!(urgent), select(pin!(normal), pin!(bulk))).await;
+    }
+
+    /// This drives the write side of the event loop.
+    ///
+    /// **n_transfers** determines the maximum number of OUT transfers to be flighted at a time.
+    /// Transfer buffers are reused, so this doesn't allocate once the pipeline is warmed up.
+    /// Queued frames are packed up to [`UsbFrame::FRAMES_PER_TRANSFER`] per transfer, taking from the
+    /// most urgent lane first (see [`BULK_MAX_SKIPPED`] for the exception), but a transfer is never held back
+    /// waiting for more frames.
+    ///
+    /// Returns `Ok(())` once the matching [`RdxUsbWriter`] is dropped and the queue is drained.
+    pub async fn poll(&mut self, n_transfers: usize) -> Result<(), RdxUsbHostError> {
+        let n_transfers = n_transfers.max(1);
+        let mut write_queue = self.iface.bulk_out_queue(ENDPOINT_OUT);
+        let transfer_size = F::SIZE * F::FRAMES_PER_TRANSFER;
+        let mut free_buffers: Vec<Vec<u8>> = (0..n_transfers).map(|_| Vec::with_capacity(transfer_size)).collect();
+        let mut submit_times = SubmitTimes::default();
+        // per pending transfer, whether it carries frames from below the urgent lane
+        let mut in_flight: VecDeque<bool> = VecDeque::with_capacity(n_transfers);
+        let mut lower_in_flight = 0usize;
+
+        loop {
+            while write_queue.pending() < n_transfers {
+                let n_lanes = self.sendable_lanes(lower_in_flight);
+                if self.lanes_empty(n_lanes) { break; }
+                let mut buffer = free_buffers.pop().unwrap_or_else(|| Vec::with_capacity(transfer_size));
+                buffer.clear();
+                let submit_ns = trace::now();
+                let (n_frames, lower) = self.fill_transfer(n_lanes, submit_ns, &mut buffer);
+                if n_frames == 0 {
+                    free_buffers.push(buffer);
+                    continue;
+                }
+                write_queue.submit(buffer);
+                submit_times.submitted(submit_ns);
+                in_flight.push_back(lower);
+                lower_in_flight += lower as usize;
+            }
+
+            if write_queue.pending() == 0 {
+                if self.is_closed() && self.lanes_empty(TX_LANES) { return Ok(()); }
+                self.wait_occupied(TX_LANES).await;
+                continue;
+            }
+
+            // every lane that could go into a transfer right now is empty, unless the pipeline is full
+            let completion = if write_queue.pending() >= n_transfers || self.is_closed() {
+                write_queue.next_complete().await
+            } else {
+                // room in the pipeline: wake on whichever comes first, a completion or a new packet
+                let n_lanes = self.sendable_lanes(lower_in_flight);
+                let complete = pin!(write_queue.next_complete());
+                let occupied = pin!(self.wait_occupied(n_lanes));
+                match select(complete, occupied).await {
+                    Either::Left((completion, _)) => completion,
+                    Either::Right(_) => { continue; }
+                }
+            };
+            match completion.into_result() {
+                Ok(buf) => {
+                    submit_times.completed();
+                    if in_flight.pop_front() == Some(true) { lower_in_flight -= 1; }
+                    free_buffers.push(buf);
+                }
+                Err(e) => {
+                    self.stats.record_transfer_error(&e);
+                    return Err(e.into());
+                }
+            }
         }
-        Ok(())
     }
 }
 
 
-pub struct RdxUsbFsChannel {
-    iface: nusb::Interface,
+pub type RdxUsbFsChannel = RdxUsbChannel<RdxUsbFsPacket>;
+pub type RdxUsbHsChannel = RdxUsbChannel<RdxUsbPacket>;
+
+pub struct RdxUsbChannel<F: UsbFrame, T: Transport = nusb::Interface> {
+    iface: T,
     channel: u8,
-    rx_queue: <AsyncRb<Heap<RdxUsbFsPacket>> as async_ringbuf::traits::Split>::Cons,
+    rx_queue: RingConsumer<RdxUsbPacket>,
+    _frame: PhantomData<F>,
 }
 
-impl RdxUsbFsChannel {
-    pub async fn control_in_struct<T: AnyBitPattern>(&self, req: RdxUsbCtrl) -> RdxUsbHostResult<T> {
+impl<F: UsbFrame, T: Transport> RdxUsbChannel<F, T> {
+    pub async fn control_in_struct<S: AnyBitPattern>(&self, req: RdxUsbCtrl) -> RdxUsbHostResult<S> {
         let res = self.iface.control_in(ControlIn {
             control_type: ControlType::Vendor,
             recipient: Recipient::Interface,
             request: req as u8,
             value: self.channel as u16,
             index: 0,
-            length: core::mem::size_of::<T>() as u16,
+            length: core::mem::size_of::<S>() as u16,
         }).await.into_result()?;
-        Ok(bytemuck::try_from_bytes::<T>(&res.as_slice())?.clone())
+        Ok(bytemuck::try_from_bytes::<S>(&res.as_slice())?.clone())
     }
 
     pub async fn control_out_struct(&self, req: RdxUsbCtrl, data: &[u8]) -> RdxUsbHostResult<()> {
@@ -259,29 +1004,206 @@ impl RdxUsbFsChannel {
         Ok(())
     }
 
-    pub fn interface(&self) -> &nusb::Interface {
+    pub fn interface(&self) -> &T {
         &self.iface
     }
 
-    pub async fn read(&mut self) -> RdxUsbHostResult<RdxUsbFsPacket> {
+    /// Takes the channel's end of its rx ring, to hand back to [`RxRings::put_consumers`].
+    pub fn into_rx_queue(self) -> RingConsumer<RdxUsbPacket> {
+        self.rx_queue
+    }
+
+    pub async fn read(&mut self) -> RdxUsbHostResult<RdxUsbPacket> {
         match self.rx_queue.pop().await {
             Some(v) => Ok(v),
             None => Err(RdxUsbHostError::DeviceDisconnected)
         }
     }
 
-    pub fn try_read(&mut self) -> Option<RdxUsbFsPacket> {
+    pub fn try_read(&mut self) -> Option<RdxUsbPacket> {
         self.rx_queue.try_pop()
     }
 
-    pub async fn write(&mut self, mut pkt: RdxUsbFsPacket) -> RdxUsbHostResult<()> {
-        pkt.channel = self.channel;
+    /// Drains as many queued packets as fit into `packets`.
+    ///
+    /// Packets are widened when they are queued, so this is a plain bulk copy.
+    /// Returns the number of packets read.
+    pub fn read_into(&mut self, packets: &mut [RdxUsbPacket]) -> usize {
+        self.rx_queue.pop_slice(packets)
+    }
+
+    /// Pops queued packets in place with `f`, for reads that copy out less than whole packets.
+    /// See [`RingConsumer::pop_each`].
+    pub fn read_each(&mut self, max: usize, f: impl FnMut(usize, &RdxUsbPacket) -> bool) -> usize {
+        self.rx_queue.pop_each(max, f)
+    }
+
+    /// Maps the channel's rx ring for in-place reads. See [`RingConsumer::map`].
+    pub fn map_rx(&self) -> RingMapping<RdxUsbPacket> {
+        self.rx_queue.map()
+    }
+
+    pub async fn write(&mut self, mut pkt: F) -> RdxUsbHostResult<()> {
+        pkt.set_channel(self.channel);
         let v = Vec::from(bytemuck::bytes_of(&pkt));
         self.iface.bulk_out(rdxusb_protocol::ENDPOINT_OUT, v).await.into_result()?;
         Ok(())
     }
 
     pub async fn write_buf(&mut self, vbuf: Vec<u8>) -> RdxUsbHostResult<Vec<u8>> {
-        Ok(self.iface.bulk_out(rdxusb_protocol::ENDPOINT_OUT, vbuf).await.into_result()?.reuse())
+        Ok(self.iface.bulk_out(rdxusb_protocol::ENDPOINT_OUT, vbuf).await.into_result()?)
+    }
+}
+
+#[cfg(all(test, feature = "event-loop"))]
+mod tests {
+    use super::*;
+    use crate::{mailbox::{MailboxMode, MAILBOX_SLOTS}, test_util::packet, virtual_device::{VirtualDeviceConfig, VirtualTransport}};
+
+    type VirtualHost = RdxUsbHost<RdxUsbPacket, VirtualTransport>;
+    type VirtualChannel = RdxUsbChannel<RdxUsbPacket, VirtualTransport>;
+
+    fn connect(rings: &mut RxRings) -> (VirtualHost, Vec<VirtualChannel>) {
+        let config = VirtualDeviceConfig { n_channels: 2, rate: 0, ..Default::default() };
+        VirtualHost::from_rings(VirtualTransport::new(config), &config.device_info(), rings).unwrap()
+    }
+
+    /// Hands a disconnected host's rings back to the pool, as the device poller does.
+    fn disconnect(host: VirtualHost, channels: Vec<VirtualChannel>, rings: &mut RxRings) {
+        host.recycle(rings);
+        rings.put_consumers(channels.into_iter().map(RdxUsbChannel::into_rx_queue));
+    }
+
+    #[test]
+    fn rx_rings_are_reused_across_reconnects() {
+        let mut rings = RxRings::new(16);
+        let (mut host, channels) = connect(&mut rings);
+        let slots = channels[1].rx_queue.map().view().slots;
+        assert!(host.rx_queue[1].try_push_with(|slot| *slot = packet(0x10, 1, 8)));
+        disconnect(host, channels, &mut rings);
+
+        let (host, mut channels) = connect(&mut rings);
+        assert_eq!(channels[1].rx_queue.map().view().slots, slots);
+        assert!(host.rx_queue[1].feeds(&channels[1].rx_queue));
+        // what wasn't read before the disconnect is still there
+        assert_eq!(channels[1].try_read().map(|p| p.arb_id), Some(0x10));
+    }
+
+    #[test]
+    fn rx_ring_is_replaced_if_an_end_is_missing() {
+        let mut rings = RxRings::new(16);
+        let (host, channels) = connect(&mut rings);
+        let slots = channels[0].rx_queue.map().view().slots;
+        host.recycle(&mut rings);
+        drop(channels);
+
+        let (host, channels) = connect(&mut rings);
+        assert_ne!(channels[0].rx_queue.map().view().slots, slots);
+        assert!(host.rx_queue[0].feeds(&channels[0].rx_queue));
+    }
+
+    #[test]
+    fn keep_pending_tx_decides_whether_queued_frames_survive() {
+        for keep_pending in [false, true] {
+            let mut rings = RxRings::new(16);
+            let (host, channels) = connect(&mut rings);
+            let (poller, mut writer) = host.write_poller(TxLaneConfig::fifo(8));
+            assert!(writer.try_send(packet(0x20, 1, 8)).is_none());
+            assert!(writer.try_send(packet(0x21, 2, 8)).is_none());
+            let kept = poller.into_rings(writer);
+            assert!(kept.is_some());
+            disconnect(host, channels, &mut rings);
+
+            let (host, _channels) = connect(&mut rings);
+            let tx = TxRings::reuse(kept, TxLaneConfig::fifo(8), keep_pending);
+            let (_poller, writer) = host.write_poller_from(tx);
+            assert_eq!(writer.occupied_len(), if keep_pending { 2 } else { 0 });
+        }
+    }
+
+    fn lane_config() -> TxLaneConfig {
+        TxLaneConfig { capacity: [64; TX_LANES], urgent_below: 0x10, bulk_from: 0x700 }
+    }
+
+    /// Fills one transfer from the top `n_lanes` lanes, returning the ids it carries.
+    fn next_transfer(poller: &mut RdxUsbWritePoller<RdxUsbPacket, VirtualTransport>, n_lanes: usize) -> Vec<u32> {
+        let mut buffer = Vec::new();
+        poller.fill_transfer(n_lanes, 0, &mut buffer);
+        bytemuck::cast_slice::<u8, RdxUsbPacket>(&buffer).iter().map(|p| p.arb_id).collect()
+    }
+
+    #[test]
+    fn lanes_drain_urgent_then_normal_then_bulk() {
+        let (host, _channels) = connect(&mut RxRings::new(16));
+        let (mut poller, mut writer) = host.write_poller(lane_config());
+        for id in [0x700, 0x100, 0x1, 0x701, 0x101, 0x2] { assert!(writer.try_send(packet(id, 0, 8)).is_none()); }
+
+        let mut sent = Vec::new();
+        loop {
+            let ids = next_transfer(&mut poller, TX_LANES);
+            if ids.is_empty() { break; }
+            sent.extend(ids);
+        }
+        assert_eq!(sent, [0x1, 0x2, 0x100, 0x101, 0x700, 0x701]);
+    }
+
+    #[test]
+    fn lower_lanes_wait_for_their_transfer_only_with_an_urgent_lane() {
+        let (host, _channels) = connect(&mut RxRings::new(16));
+        let (mut poller, mut writer) = host.write_poller(lane_config());
+        assert_eq!((poller.sendable_lanes(0), poller.sendable_lanes(1)), (TX_LANES, 1));
+        assert!(writer.try_send(packet(0x100, 0, 8)).is_none());
+        assert!(writer.try_send(packet(0x1, 0, 8)).is_none());
+        assert_eq!(next_transfer(&mut poller, 1), [0x1]);
+        assert!(next_transfer(&mut poller, 1).is_empty());
+
+        let (fifo, _writer) = host.write_poller(TxLaneConfig::fifo(8));
+        assert_eq!(fifo.sendable_lanes(1), TX_LANES);
+    }
+
+    #[test]
+    fn bulk_drains_under_sustained_normal_load() {
+        let (host, _channels) = connect(&mut RxRings::new(16));
+        let (mut poller, mut writer) = host.write_poller(lane_config());
+        for i in 0..4 { assert!(writer.try_send(packet(0x700 + i, 0, 8)).is_none()); }
+
+        let mut bulk_sent = Vec::new();
+        for transfer in 0..=BULK_MAX_SKIPPED {
+            // keep the normal lane full
+            while writer.try_send(packet(0x100, 0, 8)).is_none() {}
+            let ids = next_transfer(&mut poller, TX_LANES);
+            if transfer < BULK_MAX_SKIPPED { assert!(ids.iter().all(|&id| id == 0x100)); }
+            bulk_sent.extend(ids.into_iter().filter(|&id| id >= 0x700));
+        }
+        assert_eq!(bulk_sent, [0x700, 0x701, 0x702, 0x703]);
+        // with the bulk lane empty again, the normal lane has every transfer to itself
+        while writer.try_send(packet(0x100, 0, 8)).is_none() {}
+        assert!(next_transfer(&mut poller, TX_LANES).iter().all(|&id| id == 0x100));
+    }
+
+    #[test]
+    fn single_channel_device_reads_channel_0() {
+        let config = VirtualDeviceConfig { n_channels: 1, rate: 0, ..Default::default() };
+        assert_eq!(config.device_info().n_channels, 0);
+        let (mut host, mut channels) = VirtualHost::from_rings(VirtualTransport::new(config), &config.device_info(), &mut RxRings::new(16)).unwrap();
+        assert_eq!(channels.len(), 1);
+
+        host.dispatch(&packet(0x30, 1, 8), 0, OverflowPolicy::DropNewest).now_or_never().unwrap();
+        assert_eq!(channels[0].try_read().map(|p| p.arb_id), Some(0x30));
+        assert_eq!(host.stats().snapshot().rx_dropped_invalid_channel, 0);
+    }
+
+    #[test]
+    fn mailbox_only_packets_that_dont_fit_count_as_dropped() {
+        let (mut host, _channels) = connect(&mut RxRings::new(16));
+        let mailboxes = Arc::new(RxMailboxes::new());
+        mailboxes.set_mode(0, MailboxMode::Only);
+        host.set_mailboxes(mailboxes);
+        for id in 0..=MAILBOX_SLOTS as u32 {
+            host.dispatch(&packet(id, 1, 8), 0, OverflowPolicy::DropNewest).now_or_never().unwrap();
+        }
+        let stats = host.stats().channel(0).snapshot();
+        assert_eq!((stats.rx_packets, stats.rx_dropped_full), (MAILBOX_SLOTS as u64, 1));
+        assert!(host.rx_queue[0].is_empty());
     }
 }
@@ -1,10 +1,61 @@
 pub mod host;
+/// Host monotonic timestamps and device clock correlation.
+pub mod clock;
+/// Batched push-style rx callbacks.
+pub mod callback;
+/// Streaming traffic capture files and capture readers for replay.
+pub mod capture;
+/// Sharing a published device with other processes through shared memory.
+pub mod broker;
+/// Per-channel settings tables shared with the rx poller.
+pub mod channel_table;
+/// Compact and columnar encodings of received packets.
+pub mod compact;
+/// Latest-wins coalescing of pending tx frames.
+pub mod coalesce;
+/// Arbitration id acceptance filters.
+pub mod filter;
+/// Latest-value packet mailboxes keyed by arbitration id.
+pub mod mailbox;
+/// Rx wakeups for blocking reads and OS-level event handles.
+pub mod notify;
+/// Packet ring buffers used for rx queues.
+pub mod ring;
+/// Per-device transport counters.
+pub mod stats;
+/// Per-stage hot path latency histograms and trace export, behind the `latency-trace` feature.
+pub mod trace;
+/// The USB transport abstraction hosts run over.
+pub mod transport;
 /// Integrated tokio-driven event loop that handles hotplug and polling logic automatically.
 /// This is the backend used for the C API.
 #[cfg(feature = "event-loop")]
 pub mod event_loop;
+/// Asynchronous vendor control transfers run on the event loop.
+#[cfg(feature = "event-loop")]
+pub mod control;
+/// Lock-free handle table backing the event loop's read/write fast path.
+#[cfg(feature = "event-loop")]
+pub mod handle_table;
+/// Periodic transmit jobs scheduled on the event loop.
+#[cfg(feature = "event-loop")]
+pub mod periodic;
+/// Hotplug-maintained registry of attached USB devices.
+#[cfg(feature = "event-loop")]
+pub mod registry;
+/// Event loop runtime threading and scheduling configuration.
+#[cfg(feature = "event-loop")]
+pub mod runtime;
+/// In-process virtual devices for testing without hardware.
+#[cfg(feature = "event-loop")]
+pub mod virtual_device;
+/// Bridging device channels to Linux SocketCAN interfaces.
+#[cfg(all(target_os = "linux", feature = "event-loop"))]
+pub mod socketcan;
 /// An abstracted C API used for everything else.
 #[cfg(feature = "c-api")]
 pub mod c_api;
 
-pub use rdxusb_protocol::{RdxUsbPacket, MESSAGE_ARB_ID_DEVICE, MESSAGE_ARB_ID_EXT, MESSAGE_ARB_ID_RTR};
\ No newline at end of file
+pub use rdxusb_protocol::{RdxUsbPacket, MESSAGE_ARB_ID_DEVICE, MESSAGE_ARB_ID_EXT, MESSAGE_ARB_ID_RTR};
+#[cfg(test)]
+mod test_util;
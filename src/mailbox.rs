@@ -0,0 +1,224 @@
+//! Latest-value mailboxes: the newest packet per arbitration id, readable without draining a queue.
+
+use std::sync::{atomic::{self, AtomicU32, AtomicU64, AtomicU8, Ordering}, Arc};
+
+use rdxusb_protocol::RdxUsbPacket;
+
+use crate::channel_table::{ChannelTable, ChannelTableCache};
+
+/// Number of distinct arbitration ids a channel's mailbox can hold.
+pub const MAILBOX_SLOTS: usize = 1024;
+const SLOT_MASK: usize = MAILBOX_SLOTS - 1;
+/// Marks an unused slot. Keys are [`RdxUsbPacket::id`]s, which never have the top bits set.
+const EMPTY_KEY: u32 = u32::MAX;
+const WORDS: usize = core::mem::size_of::<RdxUsbPacket>() / 8;
+const _: () = assert!(core::mem::size_of::<RdxUsbPacket>() % 8 == 0);
+
+/// What the rx poller does with packets on a channel that has a mailbox.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[repr(u32)]
+pub enum MailboxMode {
+    /// No mailbox; packets only go to the rx queue.
+    #[default]
+    Disabled = 0,
+    /// Packets update the mailbox and are also queued.
+    Queued = 1,
+    /// Packets only update the mailbox and are never queued.
+    Only = 2,
+}
+
+impl TryFrom<u32> for MailboxMode {
+    type Error = u32;
+
+    fn try_from(value: u32) -> Result<Self, Self::Error> {
+        match value {
+            0 => Ok(Self::Disabled),
+            1 => Ok(Self::Queued),
+            2 => Ok(Self::Only),
+            v => Err(v),
+        }
+    }
+}
+
+#[inline]
+fn slot_index(key: u32) -> usize {
+    (key.wrapping_mul(0x9e37_79b9) >> (32 - MAILBOX_SLOTS.trailing_zeros())) as usize
+}
+
+/// One arbitration id's latest packet, guarded by a seqlock.
+///
+/// The sequence number is odd while the poller is writing. Readers retry until they see the same
+/// even sequence number before and after copying, so they never block the writer.
+/// The payload is stored as atomic words so torn reads are merely discarded rather than undefined.
+struct Slot {
+    key: AtomicU32,
+    seq: AtomicU32,
+    received_ns: AtomicU64,
+    words: [AtomicU64; WORDS],
+}
+
+impl Slot {
+    fn new() -> Self {
+        Self {
+            key: AtomicU32::new(EMPTY_KEY),
+            seq: AtomicU32::new(0),
+            received_ns: AtomicU64::new(0),
+            words: [const { AtomicU64::new(0) }; WORDS],
+        }
+    }
+
+    fn write(&self, packet: &RdxUsbPacket, received_ns: u64) {
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        atomic::fence(Ordering::Release);
+        let words: [u64; WORDS] = bytemuck::cast(*packet);
+        for (dst, src) in self.words.iter().zip(words) {
+            dst.store(src, Ordering::Relaxed);
+        }
+        self.received_ns.store(received_ns, Ordering::Relaxed);
+        self.seq.store(seq.wrapping_add(2), Ordering::Release);
+    }
+
+    fn read(&self) -> (RdxUsbPacket, u64) {
+        loop {
+            let before = self.seq.load(Ordering::Acquire);
+            if before & 1 == 1 {
+                core::hint::spin_loop();
+                continue;
+            }
+            let words: [u64; WORDS] = core::array::from_fn(|i| self.words[i].load(Ordering::Relaxed));
+            let received_ns = self.received_ns.load(Ordering::Relaxed);
+            atomic::fence(Ordering::Acquire);
+            if self.seq.load(Ordering::Relaxed) == before {
+                return (bytemuck::cast(words), received_ns);
+            }
+        }
+    }
+}
+
+/// A fixed-size, open-addressed table of the latest packet per arbitration id on one channel.
+///
+/// There is a single writer (the channel's rx poller), so inserting a new key needs no compare-exchange:
+/// the slot is filled in first and the key published last. Once the table is full, packets with new ids
+/// are not stored.
+pub struct Mailbox {
+    mode: AtomicU8,
+    slots: Box<[Slot]>,
+}
+
+impl Mailbox {
+    pub fn new(mode: MailboxMode) -> Self {
+        Self {
+            mode: AtomicU8::new(mode as u8),
+            slots: (0..MAILBOX_SLOTS).map(|_| Slot::new()).collect(),
+        }
+    }
+
+    /// Whether packets should also be queued.
+    #[inline]
+    pub fn queued(&self) -> bool {
+        self.mode.load(Ordering::Relaxed) == MailboxMode::Queued as u8
+    }
+
+    /// Stores a packet as the latest for its id. Only the rx poller may call this.
+    ///
+    /// Returns false if the table is full.
+    pub fn store(&self, packet: &RdxUsbPacket, received_ns: u64) -> bool {
+        let key = packet.id();
+        let start = slot_index(key);
+        for i in 0..MAILBOX_SLOTS {
+            let slot = &self.slots[(start + i) & SLOT_MASK];
+            match slot.key.load(Ordering::Relaxed) {
+                k if k == key => {
+                    slot.write(packet, received_ns);
+                    return true;
+                }
+                EMPTY_KEY => {
+                    slot.write(packet, received_ns);
+                    slot.key.store(key, Ordering::Release);
+                    return true;
+                }
+                _ => {}
+            }
+        }
+        false
+    }
+
+    /// Reads the latest packet for an arbitration id, along with the time it was received
+    /// on the [`crate::clock::monotonic_ns`] clock. The id's flag bits are ignored.
+    pub fn load(&self, arb_id: u32) -> Option<(RdxUsbPacket, u64)> {
+        let key = arb_id & 0x1fff_ffff;
+        let start = slot_index(key);
+        for i in 0..MAILBOX_SLOTS {
+            let slot = &self.slots[(start + i) & SLOT_MASK];
+            match slot.key.load(Ordering::Acquire) {
+                k if k == key => { return Some(slot.read()); }
+                EMPTY_KEY => { return None; }
+                _ => {}
+            }
+        }
+        None
+    }
+}
+
+/// Per-channel mailboxes for a device, shared between the handle and its rx poller.
+pub type RxMailboxes = ChannelTable<Mailbox>;
+/// The rx poller's cached view of an [`RxMailboxes`].
+pub type MailboxCache = ChannelTableCache<Mailbox>;
+
+impl ChannelTable<Mailbox> {
+    /// Sets a channel's mailbox mode. Switching between enabled modes keeps the stored packets.
+    pub fn set_mode(&self, channel: u8, mode: MailboxMode) {
+        self.update(channel, |entry| match (entry.as_ref(), mode) {
+            (_, MailboxMode::Disabled) => { *entry = None; }
+            (Some(mailbox), mode) => { mailbox.mode.store(mode as u8, Ordering::Relaxed); }
+            (None, mode) => { *entry = Some(Arc::new(Mailbox::new(mode))); }
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::{is_whole, packet};
+
+    #[test]
+    fn keeps_latest_per_id() {
+        let mailbox = Mailbox::new(MailboxMode::Only);
+        assert!(!mailbox.queued());
+        assert!(mailbox.load(0x123).is_none());
+        assert!(mailbox.store(&packet(0x123, 1, 8), 10));
+        assert!(mailbox.store(&packet(0x456, 2, 8), 20));
+        assert!(mailbox.store(&packet(0x123, 3, 8), 30));
+        let (latest, received_ns) = mailbox.load(0x123).unwrap();
+        assert_eq!((latest.data[0], received_ns), (3, 30));
+        assert_eq!(mailbox.load(0x456).unwrap().1, 20);
+    }
+
+    #[test]
+    fn stops_storing_new_ids_when_full() {
+        let mailbox = Mailbox::new(MailboxMode::Queued);
+        for id in 0..MAILBOX_SLOTS as u32 { assert!(mailbox.store(&packet(id, 0, 8), 0)); }
+        assert!(!mailbox.store(&packet(MAILBOX_SLOTS as u32, 0, 8), 0));
+        assert!(mailbox.store(&packet(7, 1, 8), 1));
+        assert_eq!(mailbox.load(7).unwrap().1, 1);
+    }
+
+    #[test]
+    fn reads_are_never_torn() {
+        let mailbox = Arc::new(Mailbox::new(MailboxMode::Only));
+        mailbox.store(&packet(0x42, 0, 64), 0);
+        let writer = {
+            let mailbox = mailbox.clone();
+            std::thread::spawn(move || {
+                for i in 0..100_000u32 { mailbox.store(&packet(0x42, i, 64), i as u64); }
+            })
+        };
+        while !writer.is_finished() {
+            let (latest, received_ns) = mailbox.load(0x42).unwrap();
+            assert!(is_whole(&latest));
+            assert_eq!(received_ns, { latest.timestamp_ns });
+        }
+        writer.join().unwrap();
+    }
+}
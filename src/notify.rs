@@ -0,0 +1,219 @@
+use std::{sync::{atomic::{self, AtomicBool, Ordering}, Condvar, Mutex}, time::Instant};
+
+/// Wakes readers blocked on a device's rx rings.
+///
+/// Readers [`arm`](Self::arm) the notifier before checking their rings, and the host poller calls
+/// [`notify_if_armed`](Self::notify_if_armed) after every push. This keeps the producer side to a fence
+/// and an atomic load in the common case where nobody is waiting; the condvar and OS event are only
+/// touched on the first push after a reader armed it.
+///
+/// The OS event (eventfd on Linux, a pipe on other unixes, a manual-reset event on Windows)
+/// lets callers wait on rdxusb from their own epoll/WaitForMultipleObjects loop.
+pub struct RxNotify {
+    armed: AtomicBool,
+    seq: Mutex<u64>,
+    cond: Condvar,
+    event: Option<sys::OsEvent>,
+}
+
+impl RxNotify {
+    pub fn new() -> Self {
+        let event = match sys::OsEvent::new() {
+            Ok(e) => Some(e),
+            Err(e) => {
+                log::trace!(target: "rdxusb", "Could not create OS event for rx notify: {e}");
+                None
+            }
+        };
+        Self { armed: AtomicBool::new(true), seq: Mutex::new(0), cond: Condvar::new(), event }
+    }
+
+    /// Requests a wakeup on the next push. Must be called before the reader checks its rings.
+    pub fn arm(&self) {
+        self.armed.store(true, Ordering::Relaxed);
+        atomic::fence(Ordering::SeqCst);
+    }
+
+    /// Called by the producer after pushing into a ring.
+    pub fn notify_if_armed(&self) {
+        atomic::fence(Ordering::SeqCst);
+        if self.armed.load(Ordering::Relaxed) && self.armed.swap(false, Ordering::AcqRel) {
+            self.notify();
+        }
+    }
+
+    /// Unconditionally wakes every waiter, e.g. on connect.
+    pub fn notify(&self) {
+        if let Ok(mut seq) = self.seq.lock() {
+            *seq = seq.wrapping_add(1);
+        }
+        self.cond.notify_all();
+        if let Some(event) = &self.event { event.set(); }
+    }
+
+    /// The current wakeup sequence number, to pass to [`wait_until`](Self::wait_until).
+    pub fn sequence(&self) -> u64 {
+        self.seq.lock().map_or(0, |s| *s)
+    }
+
+    /// Blocks until a notification after `seq` arrives or the deadline passes.
+    ///
+    /// Returns false on timeout. A `None` deadline waits forever.
+    pub fn wait_until(&self, seq: u64, deadline: Option<Instant>) -> bool {
+        let Ok(mut cur) = self.seq.lock() else { return false; };
+        while *cur == seq {
+            cur = match deadline {
+                Some(deadline) => {
+                    let Some(remaining) = deadline.checked_duration_since(Instant::now()) else { return false; };
+                    match self.cond.wait_timeout(cur, remaining) {
+                        Ok((c, _)) => c,
+                        Err(_) => { return false; }
+                    }
+                }
+                None => match self.cond.wait(cur) {
+                    Ok(c) => c,
+                    Err(_) => { return false; }
+                }
+            };
+        }
+        true
+    }
+
+    /// The raw OS event handle: a file descriptor on unix, a `HANDLE` on Windows.
+    pub fn raw_event_handle(&self) -> Option<i64> {
+        self.event.as_ref().map(|e| e.raw())
+    }
+
+    /// Resets the OS event so it can be signalled again, and arms the notifier.
+    ///
+    /// Arming here means callers that consume mapped rings directly, without going through a read call,
+    /// still get woken by the next push after the reset.
+    pub fn reset_event(&self) {
+        if let Some(event) = &self.event { event.reset(); }
+        self.arm();
+    }
+}
+
+impl Default for RxNotify {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod sys {
+    use std::io;
+
+    pub struct OsEvent(libc::c_int);
+
+    impl OsEvent {
+        pub fn new() -> io::Result<Self> {
+            let fd = unsafe { libc::eventfd(0, libc::EFD_NONBLOCK | libc::EFD_CLOEXEC) };
+            if fd < 0 { return Err(io::Error::last_os_error()); }
+            Ok(Self(fd))
+        }
+
+        pub fn set(&self) {
+            let v = 1u64;
+            unsafe { libc::write(self.0, (&v as *const u64).cast(), 8); }
+        }
+
+        pub fn reset(&self) {
+            let mut v = 0u64;
+            unsafe { libc::read(self.0, (&mut v as *mut u64).cast(), 8); }
+        }
+
+        pub fn raw(&self) -> i64 {
+            self.0 as i64
+        }
+    }
+
+    impl Drop for OsEvent {
+        fn drop(&mut self) {
+            unsafe { libc::close(self.0); }
+        }
+    }
+}
+
+#[cfg(all(unix, not(target_os = "linux")))]
+mod sys {
+    use std::io;
+
+    /// Self-pipe; the read end is handed out.
+    pub struct OsEvent { rd: libc::c_int, wr: libc::c_int }
+
+    impl OsEvent {
+        pub fn new() -> io::Result<Self> {
+            let mut fds = [0 as libc::c_int; 2];
+            if unsafe { libc::pipe(fds.as_mut_ptr()) } < 0 { return Err(io::Error::last_os_error()); }
+            for fd in fds {
+                unsafe {
+                    libc::fcntl(fd, libc::F_SETFL, libc::fcntl(fd, libc::F_GETFL) | libc::O_NONBLOCK);
+                    libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC);
+                }
+            }
+            Ok(Self { rd: fds[0], wr: fds[1] })
+        }
+
+        pub fn set(&self) {
+            let v = 1u8;
+            unsafe { libc::write(self.wr, (&v as *const u8).cast(), 1); }
+        }
+
+        pub fn reset(&self) {
+            let mut buf = [0u8; 64];
+            while unsafe { libc::read(self.rd, buf.as_mut_ptr().cast(), buf.len()) } > 0 {}
+        }
+
+        pub fn raw(&self) -> i64 {
+            self.rd as i64
+        }
+    }
+
+    impl Drop for OsEvent {
+        fn drop(&mut self) {
+            unsafe {
+                libc::close(self.rd);
+                libc::close(self.wr);
+            }
+        }
+    }
+}
+
+#[cfg(windows)]
+mod sys {
+    use std::io;
+    use windows_sys::Win32::{Foundation::{CloseHandle, HANDLE}, System::Threading::{CreateEventW, ResetEvent, SetEvent}};
+
+    pub struct OsEvent(HANDLE);
+    // event handles may be signalled from any thread
+    unsafe impl Send for OsEvent {}
+    unsafe impl Sync for OsEvent {}
+
+    impl OsEvent {
+        pub fn new() -> io::Result<Self> {
+            // manual-reset, initially unsignalled
+            let handle = unsafe { CreateEventW(core::ptr::null(), 1, 0, core::ptr::null()) };
+            if handle.is_null() { return Err(io::Error::last_os_error()); }
+            Ok(Self(handle))
+        }
+
+        pub fn set(&self) {
+            unsafe { SetEvent(self.0); }
+        }
+
+        pub fn reset(&self) {
+            unsafe { ResetEvent(self.0); }
+        }
+
+        pub fn raw(&self) -> i64 {
+            self.0 as isize as i64
+        }
+    }
+
+    impl Drop for OsEvent {
+        fn drop(&mut self) {
+            unsafe { CloseHandle(self.0); }
+        }
+    }
+}
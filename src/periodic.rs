@@ -0,0 +1,105 @@
+//! Host-side periodic transmit jobs, run on the event loop.
+
+use std::{collections::HashMap, sync::{atomic::{AtomicI32, Ordering}, Arc, Mutex, MutexGuard}, time::Duration};
+
+use rdxusb_protocol::RdxUsbPacket;
+use tokio::{runtime::Handle, task::JoinHandle, time::{Instant, MissedTickBehavior}};
+
+use crate::{event_loop::{self, EventLoopError}, handle_table::HANDLES};
+
+/// A periodic transmit job.
+struct PeriodicJob {
+    handle_id: i32,
+    /// The frame sent every period. The job copies it out under the lock, so updates are never torn.
+    payload: Arc<Mutex<RdxUsbPacket>>,
+    task: JoinHandle<()>,
+}
+
+/// Periodic transmit jobs, keyed by job id.
+///
+/// Each job is its own task on the event loop runtime and writes straight into its handle's tx queue,
+/// so frames keep going out no matter what the thread that scheduled them is doing.
+pub struct PeriodicJobs {
+    next_id: AtomicI32,
+    jobs: Mutex<Option<HashMap<i32, PeriodicJob>>>,
+}
+
+impl PeriodicJobs {
+    const fn new() -> Self {
+        Self { next_id: AtomicI32::new(0), jobs: Mutex::new(None) }
+    }
+
+    fn lock(&self) -> Result<MutexGuard<'_, Option<HashMap<i32, PeriodicJob>>>, EventLoopError> {
+        self.jobs.lock().map_err(|_e| EventLoopError::EventLoopCrashed)
+    }
+
+    /// Starts sending `packet` on a handle every `period`, beginning `phase` from now.
+    ///
+    /// Returns a non-negative job id.
+    pub fn schedule(&self, rt: &Handle, handle_id: i32, packet: RdxUsbPacket, period: Duration, phase: Duration) -> Result<i32, EventLoopError> {
+        if period.is_zero() || packet.dlc as usize > packet.data.len() { return Err(EventLoopError::InvalidArgument); }
+        HANDLES.get(handle_id)?;
+
+        let mut jobs = self.lock()?;
+        let jobs = jobs.get_or_insert_with(HashMap::new);
+        let job_id = loop {
+            let id = self.next_id.fetch_add(1, Ordering::Relaxed) & i32::MAX;
+            if !jobs.contains_key(&id) { break id; }
+        };
+        let payload = Arc::new(Mutex::new(packet));
+        let task = rt.spawn(run_job(handle_id, payload.clone(), Instant::now() + phase, period));
+        jobs.insert(job_id, PeriodicJob { handle_id, payload, task });
+        Ok(job_id)
+    }
+
+    /// Replaces a job's payload, starting with its next frame.
+    pub fn update(&self, job_id: i32, data: &[u8]) -> Result<(), EventLoopError> {
+        let payload = {
+            let jobs = self.lock()?;
+            let job = jobs.as_ref().and_then(|jobs| jobs.get(&job_id)).ok_or(EventLoopError::PeriodicJobNotFound)?;
+            job.payload.clone()
+        };
+        let mut packet = payload.lock().map_err(|_e| EventLoopError::EventLoopCrashed)?;
+        if data.len() > packet.data.len() { return Err(EventLoopError::InvalidArgument); }
+        packet.data = [0u8; 64];
+        packet.data[..data.len()].copy_from_slice(data);
+        packet.dlc = data.len() as u8;
+        Ok(())
+    }
+
+    /// Stops a job.
+    pub fn cancel(&self, job_id: i32) -> Result<(), EventLoopError> {
+        let job = self.lock()?.as_mut().and_then(|jobs| jobs.remove(&job_id)).ok_or(EventLoopError::PeriodicJobNotFound)?;
+        job.task.abort();
+        Ok(())
+    }
+
+    /// Stops every job of a handle. This is called when the handle is closed.
+    pub fn cancel_handle(&self, handle_id: i32) {
+        let Ok(mut jobs) = self.jobs.lock() else { return; };
+        let Some(jobs) = jobs.as_mut() else { return; };
+        jobs.retain(|_, job| {
+            if job.handle_id != handle_id { return true; }
+            job.task.abort();
+            false
+        });
+    }
+}
+
+pub static PERIODIC_JOBS: PeriodicJobs = PeriodicJobs::new();
+
+async fn run_job(handle_id: i32, payload: Arc<Mutex<RdxUsbPacket>>, start: Instant, period: Duration) {
+    // ticks are scheduled against absolute deadlines, so jitter doesn't accumulate, and a late tick
+    // (e.g. while the queue was stalled) is skipped rather than sent as a burst
+    let mut interval = tokio::time::interval_at(start, period);
+    interval.set_missed_tick_behavior(MissedTickBehavior::Skip);
+    loop {
+        interval.tick().await;
+        let Ok(packet) = payload.lock().map(|p| *p) else { return; };
+        let res = HANDLES.get(handle_id).and_then(|slot| slot.with_writer(handle_id, |writer, stats| {
+            event_loop::write_run(writer, stats, None, core::slice::from_ref(&packet));
+        }));
+        // frames due while the device is disconnected are dropped, but a closed handle ends the job
+        if let Err(EventLoopError::DeviceNotOpened) = res { return; }
+    }
+}
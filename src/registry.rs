@@ -0,0 +1,74 @@
+//! Registry of attached USB devices, kept current by the event loop's hotplug task.
+
+use std::sync::{atomic::{AtomicBool, Ordering}, Arc, Mutex, MutexGuard};
+
+use nusb::{DeviceId, DeviceInfo};
+
+use crate::event_loop::EventLoopError;
+
+/// An immutable snapshot of the attached devices.
+pub type DeviceSnapshot = Arc<Vec<Arc<DeviceInfo>>>;
+
+/// The attached USB devices.
+///
+/// The device list is copy-on-write: hotplug events build a new list, and readers just clone the current
+/// one, so taking a snapshot never enumerates the bus. Without a live hotplug watcher (e.g. before the
+/// event loop has started) every snapshot rescans instead.
+pub struct DeviceRegistry {
+    /// Whether a hotplug watcher is keeping the registry current.
+    live: AtomicBool,
+    devices: Mutex<Option<DeviceSnapshot>>,
+}
+
+impl DeviceRegistry {
+    const fn new() -> Self {
+        Self { live: AtomicBool::new(false), devices: Mutex::new(None) }
+    }
+
+    fn lock(&self) -> Result<MutexGuard<'_, Option<DeviceSnapshot>>, EventLoopError> {
+        self.devices.lock().map_err(|_e| EventLoopError::EventLoopCrashed)
+    }
+
+    /// Replaces the registry with a fresh enumeration of the bus.
+    pub fn rescan(&self) -> Result<DeviceSnapshot, EventLoopError> {
+        let Ok(device_iter) = nusb::list_devices() else { return Err(EventLoopError::CannotListDevices); };
+        let snapshot: DeviceSnapshot = Arc::new(device_iter.map(Arc::new).collect());
+        self.lock()?.replace(snapshot.clone());
+        Ok(snapshot)
+    }
+
+    /// Marks whether a hotplug watcher is keeping the registry current.
+    pub fn set_live(&self, live: bool) {
+        self.live.store(live, Ordering::Release);
+    }
+
+    /// Adds or replaces a device after a hotplug connect.
+    pub fn connected(&self, device_info: DeviceInfo) {
+        self.modify(|devices| {
+            devices.retain(|d| d.id() != device_info.id());
+            devices.push(Arc::new(device_info));
+        });
+    }
+
+    /// Removes a device after a hotplug disconnect.
+    pub fn disconnected(&self, device_id: DeviceId) {
+        self.modify(|devices| devices.retain(|d| d.id() != device_id));
+    }
+
+    fn modify(&self, f: impl FnOnce(&mut Vec<Arc<DeviceInfo>>)) {
+        let Ok(mut devices) = self.devices.lock() else { return; };
+        let mut next = devices.as_deref().cloned().unwrap_or_default();
+        f(&mut next);
+        devices.replace(Arc::new(next));
+    }
+
+    /// Gets the attached devices.
+    pub fn snapshot(&self) -> Result<DeviceSnapshot, EventLoopError> {
+        if self.live.load(Ordering::Acquire) {
+            if let Some(snapshot) = self.lock()?.as_ref() { return Ok(snapshot.clone()); }
+        }
+        self.rescan()
+    }
+}
+
+pub static DEVICE_REGISTRY: DeviceRegistry = DeviceRegistry::new();
@@ -0,0 +1,505 @@
+//! Bounded single-producer/single-consumer packet ring used for device rx queues.
+//!
+//! Unlike [`async_ringbuf`], the producer may evict the oldest entry when the ring is full,
+//! which is what [`crate::host::OverflowPolicy::DropOldest`] needs.
+//! An eviction lets the producer overwrite a slot while the consumer is still copying it, so slots are
+//! stored as atomic words, as in [`crate::mailbox`]: the consumer commits reads with a compare-exchange on
+//! the tail index, and discards what it copied and retries if the producer evicted entries out from under it.
+//!
+//! The slot array is cache-line aligned and the ring's indices can be handed out as a [`RingView`],
+//! so that C callers can consume packets in place with the same protocol.
+
+use std::{alloc::Layout, future::poll_fn, marker::PhantomData, ptr::NonNull, sync::{atomic::{self, AtomicBool, AtomicU64, AtomicUsize, Ordering}, Arc}, task::Poll};
+
+use bytemuck::{Pod, Zeroable};
+use futures_util::task::AtomicWaker;
+
+#[cfg(feature = "latency-trace")]
+use crate::trace::{self, RxStamp};
+
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+const CACHE_LINE: usize = 64;
+
+/// Zero-initialized, cache-line aligned slot storage.
+///
+/// Each slot is `size_of::<T>() / 8` consecutive atomic words, laid out exactly like a `[T]`.
+struct Slots<T> {
+    ptr: NonNull<AtomicU64>,
+    /// Length in words.
+    len: usize,
+    _marker: PhantomData<T>,
+}
+
+impl<T: Pod> Slots<T> {
+    const WORDS: usize = core::mem::size_of::<T>() / 8;
+
+    fn new(capacity: usize) -> Self {
+        const { assert!(core::mem::size_of::<T>() % 8 == 0 && core::mem::size_of::<T>() > 0, "ring entries must be whole words") };
+        let len = capacity.checked_mul(Self::WORDS).expect("ring capacity overflow");
+        let layout = Self::layout(len);
+        // SAFETY: the layout is non-zero-sized, and all-zeroes is a valid AtomicU64
+        let ptr = unsafe { std::alloc::alloc_zeroed(layout) };
+        let Some(ptr) = NonNull::new(ptr.cast()) else { std::alloc::handle_alloc_error(layout) };
+        Self { ptr, len, _marker: PhantomData }
+    }
+
+    /// The words of the slot at masked index `idx`.
+    fn words(&self, idx: usize) -> &[AtomicU64] {
+        // SAFETY: masked indices are always in bounds, and the words are initialized
+        unsafe { core::slice::from_raw_parts(self.ptr.as_ptr().add(idx * Self::WORDS), Self::WORDS) }
+    }
+
+    fn write(&self, idx: usize, item: &T) {
+        for (dst, src) in self.words(idx).iter().zip(bytemuck::bytes_of(item).chunks_exact(8)) {
+            dst.store(u64::from_ne_bytes(src.try_into().unwrap()), Ordering::Relaxed);
+        }
+    }
+
+    /// Copies a slot out. The copy may be torn if the producer evicted the slot; see [`RingConsumer::pop_slice`].
+    fn read(&self, idx: usize, out: &mut T) {
+        for (src, dst) in self.words(idx).iter().zip(bytemuck::bytes_of_mut(out).chunks_exact_mut(8)) {
+            dst.copy_from_slice(&src.load(Ordering::Relaxed).to_ne_bytes());
+        }
+    }
+}
+
+impl<T> Slots<T> {
+    fn layout(len: usize) -> Layout {
+        Layout::array::<AtomicU64>(len)
+            .and_then(|l| l.align_to(CACHE_LINE))
+            .expect("ring capacity overflow")
+    }
+
+    fn as_ptr(&self) -> *mut T {
+        self.ptr.as_ptr().cast()
+    }
+}
+
+impl<T> Drop for Slots<T> {
+    fn drop(&mut self) {
+        unsafe { std::alloc::dealloc(self.ptr.as_ptr().cast(), Self::layout(self.len)); }
+    }
+}
+
+struct Shared<T> {
+    /// Next index to write. Only stored by the producer.
+    head: CachePadded<AtomicUsize>,
+    /// Next index to read. Advanced by the consumer, and by the producer when evicting.
+    tail: CachePadded<AtomicUsize>,
+    closed: AtomicBool,
+    mask: usize,
+    slots: Slots<T>,
+    data_waker: AtomicWaker,
+    space_waker: AtomicWaker,
+    /// Completion and push times of each slot's entry. These are atomics because a consumer reads them
+    /// after committing, when the producer may already be reusing the slot; that only skews a trace sample.
+    #[cfg(feature = "latency-trace")]
+    stamps: Box<[[AtomicU64; 2]]>,
+}
+
+unsafe impl<T: Send> Send for Shared<T> {}
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+impl<T: Pod> Shared<T> {
+    fn capacity(&self) -> usize {
+        self.mask + 1
+    }
+
+    fn occupied_len(&self) -> usize {
+        let tail = self.tail.0.load(Ordering::Acquire);
+        self.head.0.load(Ordering::Acquire).wrapping_sub(tail)
+    }
+
+    fn read(&self, idx: usize, out: &mut T) {
+        self.slots.read(idx & self.mask, out);
+    }
+
+    #[cfg(feature = "latency-trace")]
+    fn stamp(&self, idx: usize) -> &[AtomicU64; 2] {
+        &self.stamps[idx & self.mask]
+    }
+
+    /// Records trace stages for the `n` entries just popped from `tail`.
+    #[cfg(feature = "latency-trace")]
+    fn trace_popped(&self, tail: usize, n: usize) {
+        for i in 0..n {
+            let [complete_ns, push_ns] = self.stamp(tail.wrapping_add(i)).each_ref().map(|s| s.load(Ordering::Relaxed));
+            trace::rx_popped(RxStamp { complete_ns, push_ns });
+        }
+    }
+
+    fn close(&self) {
+        self.closed.store(true, Ordering::Release);
+        self.data_waker.wake();
+        self.space_waker.wake();
+    }
+}
+
+/// Creates a new ring. The capacity is rounded up to the next power of two.
+pub fn packet_ring<T: Pod + Send>(capacity: usize) -> (RingProducer<T>, RingConsumer<T>) {
+    let capacity = capacity.max(1).next_power_of_two();
+    let shared = Arc::new(Shared {
+        head: CachePadded(AtomicUsize::new(0)),
+        tail: CachePadded(AtomicUsize::new(0)),
+        closed: AtomicBool::new(false),
+        mask: capacity - 1,
+        slots: Slots::new(capacity),
+        data_waker: AtomicWaker::new(),
+        space_waker: AtomicWaker::new(),
+        #[cfg(feature = "latency-trace")]
+        stamps: (0..capacity).map(|_| [AtomicU64::new(0), AtomicU64::new(0)]).collect(),
+    });
+    (RingProducer { shared: shared.clone(), #[cfg(feature = "latency-trace")] complete_ns: 0 }, RingConsumer(shared))
+}
+
+pub struct RingProducer<T: Pod> {
+    shared: Arc<Shared<T>>,
+    /// Completion time stamped onto pushed entries. See [`set_trace_origin`](Self::set_trace_origin).
+    #[cfg(feature = "latency-trace")]
+    complete_ns: u64,
+}
+
+impl<T: Pod> RingProducer<T> {
+    /// Writes a new entry with `f`, which starts from all zeroes, if there is room. Returns false on a full ring.
+    pub fn try_push_with(&mut self, f: impl FnOnce(&mut T)) -> bool {
+        let head = self.shared.head.0.load(Ordering::Relaxed);
+        let tail = self.shared.tail.0.load(Ordering::Acquire);
+        if head.wrapping_sub(tail) > self.shared.mask { return false; }
+        self.commit(head, f);
+        true
+    }
+
+    /// Writes a new entry with `f`, which starts from all zeroes, evicting the oldest entry if the ring is full.
+    ///
+    /// Returns true if an entry was evicted.
+    pub fn push_overwrite_with(&mut self, f: impl FnOnce(&mut T)) -> bool {
+        let head = self.shared.head.0.load(Ordering::Relaxed);
+        let mut tail = self.shared.tail.0.load(Ordering::Acquire);
+        let mut evicted = false;
+        while head.wrapping_sub(tail) > self.shared.mask {
+            match self.shared.tail.0.compare_exchange_weak(tail, tail.wrapping_add(1), Ordering::AcqRel, Ordering::Acquire) {
+                Ok(_) => { evicted = true; break; }
+                Err(t) => { tail = t; }
+            }
+        }
+        // a consumer that copies any of what we write next also sees the eviction when it commits, and retries
+        if evicted { atomic::fence(Ordering::Release); }
+        self.commit(head, f);
+        evicted
+    }
+
+    /// Pushes an entry, waiting for room if the ring is full.
+    ///
+    /// Returns the entry back if the consumer was dropped.
+    pub async fn push(&mut self, item: T) -> Result<(), T> {
+        poll_fn(|cx| {
+            if self.shared.closed.load(Ordering::Acquire) { return Poll::Ready(Err(item)); }
+            if self.try_push_with(|slot| *slot = item) { return Poll::Ready(Ok(())); }
+            self.shared.space_waker.register(cx.waker());
+            // recheck after registering so a pop in between isn't missed
+            if self.try_push_with(|slot| *slot = item) { return Poll::Ready(Ok(())); }
+            Poll::Pending
+        }).await
+    }
+
+    /// Sets the bulk IN completion time of the entries pushed from now on, for latency tracing.
+    ///
+    /// This does nothing without the `latency-trace` feature.
+    #[inline(always)]
+    pub fn set_trace_origin(&mut self, _complete_ns: u64) {
+        #[cfg(feature = "latency-trace")]
+        { self.complete_ns = _complete_ns; }
+    }
+
+    fn commit(&mut self, head: usize, f: impl FnOnce(&mut T)) {
+        let mut item = T::zeroed();
+        f(&mut item);
+        // `head` is outside of [tail, head) so the consumer won't commit a read of it
+        self.shared.slots.write(head & self.shared.mask, &item);
+        #[cfg(feature = "latency-trace")]
+        {
+            let stamp = match self.complete_ns {
+                0 => RxStamp::default(),
+                complete_ns => trace::rx_pushed(complete_ns),
+            };
+            let slot = self.shared.stamp(head);
+            slot[0].store(stamp.complete_ns, Ordering::Relaxed);
+            slot[1].store(stamp.push_ns, Ordering::Relaxed);
+        }
+        self.shared.head.0.store(head.wrapping_add(1), Ordering::Release);
+        self.shared.data_waker.wake();
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.shared.capacity()
+    }
+
+    pub fn occupied_len(&self) -> usize {
+        self.shared.occupied_len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.occupied_len() == 0
+    }
+
+    pub fn is_closed(&self) -> bool {
+        self.shared.closed.load(Ordering::Acquire)
+    }
+
+    /// Whether `consumer` is the other end of this producer's ring.
+    pub fn feeds(&self, consumer: &RingConsumer<T>) -> bool {
+        Arc::ptr_eq(&self.shared, &consumer.0)
+    }
+}
+
+impl<T: Pod> Drop for RingProducer<T> {
+    fn drop(&mut self) {
+        self.shared.close();
+    }
+}
+
+pub struct RingConsumer<T: Pod>(Arc<Shared<T>>);
+
+impl<T: Pod> RingConsumer<T> {
+    /// Pops as many entries as fit into `out`, returning the number popped.
+    pub fn pop_slice(&mut self, out: &mut [T]) -> usize {
+        loop {
+            let tail = self.0.tail.0.load(Ordering::Acquire);
+            let head = self.0.head.0.load(Ordering::Acquire);
+            let n = head.wrapping_sub(tail).min(self.0.capacity()).min(out.len());
+            if n == 0 { return 0; }
+
+            // [tail, tail + n) was published by the producer's release store of head
+            for (i, item) in out[..n].iter_mut().enumerate() {
+                self.0.read(tail.wrapping_add(i), item);
+            }
+
+            // if the producer evicted in the meantime, what we copied may be torn; go again.
+            // The fence pairs with the producer's, so a copy of anything written after an eviction fails the commit.
+            atomic::fence(Ordering::Acquire);
+            if self.0.tail.0.compare_exchange(tail, tail.wrapping_add(n), Ordering::AcqRel, Ordering::Acquire).is_ok() {
+                self.0.space_waker.wake();
+                #[cfg(feature = "latency-trace")]
+                self.0.trace_popped(tail, n);
+                return n;
+            }
+        }
+    }
+
+    /// Pops up to `max` entries, handing each to `f` with its index in the pop, until `f` returns false.
+    /// Returns the number popped, which doesn't include the entry `f` refused.
+    ///
+    /// This is for consumers that copy out only part of each entry. If the producer evicts entries while
+    /// `f` runs, the pop starts over with the new oldest entry at index 0, so `f` has to treat index 0 as a
+    /// fresh start, and anything it wrote is only valid if this returns more than 0.
+    pub fn pop_each(&mut self, max: usize, mut f: impl FnMut(usize, &T) -> bool) -> usize {
+        loop {
+            let tail = self.0.tail.0.load(Ordering::Acquire);
+            let head = self.0.head.0.load(Ordering::Acquire);
+            let available = head.wrapping_sub(tail).min(self.0.capacity()).min(max);
+            let mut n = 0;
+            let mut item = T::zeroed();
+            while n < available {
+                self.0.read(tail.wrapping_add(n), &mut item);
+                if !f(n, &item) { break; }
+                n += 1;
+            }
+            if n == 0 { return 0; }
+
+            // as in pop_slice, a failed commit means what f saw may be torn
+            atomic::fence(Ordering::Acquire);
+            if self.0.tail.0.compare_exchange(tail, tail.wrapping_add(n), Ordering::AcqRel, Ordering::Acquire).is_ok() {
+                self.0.space_waker.wake();
+                #[cfg(feature = "latency-trace")]
+                self.0.trace_popped(tail, n);
+                return n;
+            }
+        }
+    }
+
+    pub fn try_pop(&mut self) -> Option<T> {
+        loop {
+            let tail = self.0.tail.0.load(Ordering::Acquire);
+            if self.0.head.0.load(Ordering::Acquire) == tail { return None; }
+            let mut item = T::zeroed();
+            self.0.read(tail, &mut item);
+            atomic::fence(Ordering::Acquire);
+            if self.0.tail.0.compare_exchange(tail, tail.wrapping_add(1), Ordering::AcqRel, Ordering::Acquire).is_ok() {
+                self.0.space_waker.wake();
+                #[cfg(feature = "latency-trace")]
+                self.0.trace_popped(tail, 1);
+                return Some(item);
+            }
+        }
+    }
+
+    /// Waits for an entry. Returns None once the ring is empty and the producer was dropped.
+    pub async fn pop(&mut self) -> Option<T> {
+        poll_fn(|cx| {
+            if let Some(v) = self.try_pop() { return Poll::Ready(Some(v)); }
+            if self.0.closed.load(Ordering::Acquire) { return Poll::Ready(self.try_pop()); }
+            self.0.data_waker.register(cx.waker());
+            match self.try_pop() {
+                Some(v) => Poll::Ready(Some(v)),
+                None => Poll::Pending,
+            }
+        }).await
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.0.capacity()
+    }
+
+    pub fn occupied_len(&self) -> usize {
+        self.0.occupied_len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.occupied_len() == 0
+    }
+
+    pub fn is_closed(&self) -> bool {
+        self.0.closed.load(Ordering::Acquire)
+    }
+
+    /// Maps the ring for in-place consumption by another party, e.g. C code.
+    ///
+    /// The mapping keeps the ring's memory alive, but does not keep it open; once the producer
+    /// is dropped the ring's closed flag is set. Whoever uses the view becomes the ring's consumer,
+    /// so this consumer should not be read from while the view is in use.
+    pub fn map(&self) -> RingMapping<T> {
+        RingMapping(self.0.clone())
+    }
+}
+
+/// Keeps a mapped ring alive. See [`RingConsumer::map`].
+pub struct RingMapping<T: Pod>(Arc<Shared<T>>);
+
+impl<T: Pod> RingMapping<T> {
+    pub fn view(&self) -> RingView<T> {
+        RingView {
+            slots: self.0.slots.as_ptr(),
+            capacity: self.0.capacity(),
+            head: &self.0.head.0,
+            tail: &self.0.tail.0,
+            closed: &self.0.closed,
+        }
+    }
+}
+
+/// Raw pointers into a mapped ring, valid for as long as its [`RingMapping`] lives.
+///
+/// Entries `[tail, head)` (indices taken modulo `capacity`) are readable. A consumer reads `head` with acquire
+/// ordering, copies or inspects the entries, then commits by compare-exchanging `tail` forward with acq-rel
+/// ordering. If the compare-exchange fails, the producer evicted entries in the meantime, and the entries read
+/// may have been overwritten, so the consumer has to start over from the new tail.
+#[derive(Debug, Clone, Copy)]
+pub struct RingView<T> {
+    pub slots: *mut T,
+    /// Always a power of two.
+    pub capacity: usize,
+    pub head: *const AtomicUsize,
+    pub tail: *const AtomicUsize,
+    pub closed: *const AtomicBool,
+}
+
+impl<T: Pod> Drop for RingConsumer<T> {
+    fn drop(&mut self) {
+        self.0.close();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use futures_util::FutureExt;
+    use crate::test_util::{is_whole, packet};
+
+    #[test]
+    fn push_and_pop_across_wraparound() {
+        let (mut tx, mut rx) = packet_ring::<u64>(3);
+        assert_eq!(tx.capacity(), 4);
+        for i in 0..3 { assert!(tx.try_push_with(|slot| *slot = i)); }
+        assert_eq!((rx.try_pop(), rx.try_pop()), (Some(0), Some(1)));
+        for i in 3..6 { assert!(tx.try_push_with(|slot| *slot = i)); }
+        assert!(!tx.try_push_with(|slot| *slot = 6));
+
+        // the entries straddle the end of the slot array
+        let mut out = [0u64; 8];
+        assert_eq!(rx.pop_slice(&mut out), 4);
+        assert_eq!(out[..4], [2, 3, 4, 5]);
+        assert!(rx.is_empty());
+    }
+
+    #[test]
+    fn eviction_mid_pop_restarts_the_pop() {
+        let (mut tx, mut rx) = packet_ring::<u64>(4);
+        for i in 0..4 { tx.try_push_with(|slot| *slot = i); }
+
+        let mut seen = Vec::new();
+        let mut indices = Vec::new();
+        let n = rx.pop_each(4, |idx, &item| {
+            if idx == 0 { seen.clear(); }
+            indices.push(idx);
+            seen.push(item);
+            // evict the entry this pop started from, so its commit has to fail
+            if indices.len() == 2 { assert!(tx.push_overwrite_with(|slot| *slot = 4)); }
+            true
+        });
+        assert_eq!(n, 4);
+        assert_eq!(indices, [0, 1, 2, 3, 0, 1, 2, 3]);
+        assert_eq!(seen, [1, 2, 3, 4]);
+        assert!(rx.is_empty());
+    }
+
+    #[test]
+    fn pop_each_stops_where_refused() {
+        let (mut tx, mut rx) = packet_ring::<u64>(4);
+        for i in 0..4 { tx.try_push_with(|slot| *slot = i); }
+        assert_eq!(rx.pop_each(4, |_, &item| item < 2), 2);
+        assert_eq!(rx.try_pop(), Some(2));
+        assert_eq!(rx.occupied_len(), 1);
+    }
+
+    #[test]
+    fn dropping_the_producer_closes_the_ring() {
+        let (mut tx, mut rx) = packet_ring::<u64>(4);
+        tx.try_push_with(|slot| *slot = 1);
+        assert!(rx.pop().now_or_never().is_some());
+        assert!(rx.pop().now_or_never().is_none(), "an open, empty ring waits");
+
+        tx.try_push_with(|slot| *slot = 2);
+        drop(tx);
+        assert!(rx.is_closed());
+        // buffered entries are still delivered before the end of the stream
+        assert_eq!(rx.pop().now_or_never(), Some(Some(2)));
+        assert_eq!(rx.pop().now_or_never(), Some(None));
+    }
+
+    /// Overwrites a small ring from one thread while another pops from it. Run it under Miri or TSan to check
+    /// the eviction path for data races; the assertions catch torn or reordered packets.
+    #[test]
+    fn overwrites_never_tear_pops() {
+        let pushes = if cfg!(miri) { 2_000 } else { 200_000 };
+        let (mut tx, mut rx) = packet_ring(4);
+        let producer = std::thread::spawn(move || {
+            for seq in 1..=pushes { tx.push_overwrite_with(|slot| *slot = packet(0x42, seq, 64)); }
+        });
+        let mut last = 0;
+        let mut out = [packet(0, 0, 0); 4];
+        loop {
+            let n = rx.pop_slice(&mut out);
+            for p in &out[..n] {
+                let seq = p.timestamp_ns;
+                assert!(is_whole(p));
+                assert!(seq > last, "popped {seq} after {last}");
+                last = seq;
+            }
+            if n == 0 && rx.is_closed() && rx.is_empty() { break; }
+        }
+        producer.join().unwrap();
+        assert_eq!(last, pushes as u64);
+    }
+}
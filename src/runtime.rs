@@ -0,0 +1,116 @@
+//! Event loop runtime configuration: worker threads, CPU affinity and scheduling priority.
+
+use tokio::runtime::{Builder, Handle, Runtime};
+
+use crate::event_loop::EventLoopError;
+
+/// Highest SCHED_FIFO priority accepted by [`RuntimeConfig::rt_priority`].
+pub const MAX_RT_PRIORITY: u32 = 99;
+
+/// How the event loop's tokio runtime is set up. This has to be chosen before the event loop starts.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct RuntimeConfig {
+    /// Number of worker threads. 0 means one per core.
+    pub worker_threads: usize,
+    /// Runs every device poller on one dedicated thread instead of a worker pool.
+    /// `worker_threads` is ignored in this mode.
+    pub single_thread: bool,
+    /// Name given to the event loop's threads.
+    pub thread_name: String,
+    /// CPUs the event loop's threads may run on, one bit per CPU. 0 leaves affinity alone.
+    pub cpu_affinity: u64,
+    /// Real-time priority for the event loop's threads: SCHED_FIFO on unix, time-critical on Windows.
+    /// 0 leaves the scheduling policy alone.
+    pub rt_priority: u32,
+}
+
+impl Default for RuntimeConfig {
+    fn default() -> Self {
+        Self {
+            worker_threads: 0,
+            single_thread: false,
+            thread_name: "rdxusb".to_string(),
+            cpu_affinity: 0,
+            rt_priority: 0,
+        }
+    }
+}
+
+impl RuntimeConfig {
+    /// Builds and starts the runtime.
+    ///
+    /// A multi-threaded runtime is returned to be owned by the caller. In single-thread mode the runtime is
+    /// owned by the thread driving it, so only its handle is returned.
+    pub fn start(&self) -> Result<(Handle, Option<Runtime>), EventLoopError> {
+        if self.rt_priority > MAX_RT_PRIORITY { return Err(EventLoopError::InvalidArgument); }
+        let (cpu_affinity, rt_priority) = (self.cpu_affinity, self.rt_priority);
+
+        let mut builder = if self.single_thread { Builder::new_current_thread() } else { Builder::new_multi_thread() };
+        if !self.single_thread && self.worker_threads > 0 { builder.worker_threads(self.worker_threads); }
+        builder.enable_all()
+            .thread_name(self.thread_name.clone())
+            .on_thread_start(move || tune_current_thread(cpu_affinity, rt_priority));
+        let rt = builder.build().map_err(|_e| EventLoopError::EventLoopCrashed)?;
+        let handle = rt.handle().clone();
+        if !self.single_thread { return Ok((handle, Some(rt))); }
+
+        // a current-thread runtime only runs its IO and timer drivers inside Runtime::block_on,
+        // so it needs a thread of its own
+        std::thread::Builder::new().name(self.thread_name.clone()).spawn(move || {
+            tune_current_thread(cpu_affinity, rt_priority);
+            rt.block_on(std::future::pending::<()>());
+        }).map_err(|_e| EventLoopError::EventLoopCrashed)?;
+        Ok((handle, None))
+    }
+}
+
+fn tune_current_thread(cpu_affinity: u64, rt_priority: u32) {
+    if cpu_affinity != 0 && !set_affinity(cpu_affinity) {
+        log::warn!(target: "rdxusb", "Could not set event loop thread affinity to {cpu_affinity:#x}");
+    }
+    if rt_priority != 0 && !set_rt_priority(rt_priority) {
+        log::warn!(target: "rdxusb", "Could not set event loop thread priority to {rt_priority}");
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn set_affinity(cpu_affinity: u64) -> bool {
+    unsafe {
+        let mut set: libc::cpu_set_t = core::mem::zeroed();
+        for cpu in (0..64).filter(|cpu| cpu_affinity & (1 << cpu) != 0) {
+            libc::CPU_SET(cpu, &mut set);
+        }
+        libc::sched_setaffinity(0, core::mem::size_of::<libc::cpu_set_t>(), &set) == 0
+    }
+}
+
+#[cfg(windows)]
+fn set_affinity(cpu_affinity: u64) -> bool {
+    use windows_sys::Win32::System::Threading::{GetCurrentThread, SetThreadAffinityMask};
+    unsafe { SetThreadAffinityMask(GetCurrentThread(), cpu_affinity as usize) != 0 }
+}
+
+#[cfg(not(any(target_os = "linux", windows)))]
+fn set_affinity(_cpu_affinity: u64) -> bool {
+    false
+}
+
+#[cfg(unix)]
+fn set_rt_priority(rt_priority: u32) -> bool {
+    unsafe {
+        let mut param: libc::sched_param = core::mem::zeroed();
+        param.sched_priority = rt_priority as i32;
+        libc::pthread_setschedparam(libc::pthread_self(), libc::SCHED_FIFO, &param) == 0
+    }
+}
+
+#[cfg(windows)]
+fn set_rt_priority(_rt_priority: u32) -> bool {
+    use windows_sys::Win32::System::Threading::{GetCurrentThread, SetThreadPriority, THREAD_PRIORITY_TIME_CRITICAL};
+    unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0 }
+}
+
+#[cfg(not(any(unix, windows)))]
+fn set_rt_priority(_rt_priority: u32) -> bool {
+    false
+}
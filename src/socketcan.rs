@@ -0,0 +1,404 @@
+//! Bridging a device channel to a Linux SocketCAN interface, so tools that speak SocketCAN see its bus.
+//!
+//! Received frames go to the interface from the channel's rx callback, so they leave on the rx poller
+//! right after decoding, one `sendmmsg` per callback batch. Frames from the interface are read in
+//! `recvmmsg` batches by a gateway thread and written into the handle's tx lanes for its write poller.
+//! Frames with more than 8 data bytes use CAN-FD.
+
+use std::{ffi::CString, fmt::Display, io, os::fd::{AsRawFd, FromRawFd, OwnedFd}, sync::{atomic::{AtomicBool, AtomicU64, Ordering}, Arc}, thread::JoinHandle, time::Duration};
+
+use bytemuck::{Pod, Zeroable};
+use rdxusb_protocol::{RdxUsbPacket, MESSAGE_ARB_ID_EXT, MESSAGE_ARB_ID_RTR};
+
+use crate::{callback::RxCallback, event_loop::{self, EventLoopError}};
+
+/// Most frames moved per `sendmmsg`/`recvmmsg` call.
+pub const GATEWAY_BATCH: usize = 64;
+/// How often the gateway thread checks whether it was stopped while the bus is idle.
+const GATEWAY_WAKE_INTERVAL: Duration = Duration::from_millis(100);
+/// How often frames from the bus are retried while the tx lanes are full.
+const GATEWAY_TX_RETRY: Duration = Duration::from_millis(1);
+
+// from linux/can.h and linux/can/raw.h
+const CAN_RAW: libc::c_int = 1;
+const SOL_CAN_RAW: libc::c_int = 101;
+const CAN_RAW_FD_FRAMES: libc::c_int = 5;
+const CAN_EFF_FLAG: u32 = 0x8000_0000;
+const CAN_RTR_FLAG: u32 = 0x4000_0000;
+const CAN_ERR_FLAG: u32 = 0x2000_0000;
+const CAN_SFF_MASK: u32 = 0x0000_07ff;
+const CAN_EFF_MASK: u32 = 0x1fff_ffff;
+const CAN_MAX_DLEN: usize = 8;
+const CANFD_MAX_DLEN: usize = 64;
+/// Size of a classic `struct can_frame`.
+pub const CAN_MTU: usize = 16;
+/// Size of a `struct canfd_frame`.
+pub const CANFD_MTU: usize = core::mem::size_of::<CanFdFrame>();
+
+/// A `struct canfd_frame`. Its first [`CAN_MTU`] bytes are laid out like a classic `struct can_frame`,
+/// so one buffer holds either kind.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Pod, Zeroable)]
+#[repr(C)]
+pub struct CanFdFrame {
+    /// Identifier with the kernel's `CAN_*_FLAG` bits.
+    pub can_id: u32,
+    /// Data length in bytes.
+    pub len: u8,
+    pub flags: u8,
+    res0: u8,
+    res1: u8,
+    pub data: [u8; CANFD_MAX_DLEN],
+}
+
+#[repr(C)]
+struct SockaddrCan {
+    can_family: libc::sa_family_t,
+    can_ifindex: libc::c_int,
+    /// Protocol-specific addressing, unused by raw sockets.
+    can_addr: [u64; 2],
+}
+
+/// Rounds a length up to one a CAN-FD frame can have.
+fn fd_len(len: usize) -> usize {
+    match len {
+        0..=8 => len,
+        9..=12 => 12,
+        13..=16 => 16,
+        17..=20 => 20,
+        21..=24 => 24,
+        25..=32 => 32,
+        33..=48 => 48,
+        _ => 64,
+    }
+}
+
+/// Fills `frame` with a packet, returning how many bytes of it to send: [`CAN_MTU`] for a classic frame,
+/// or [`CANFD_MTU`] when the packet carries more than 8 data bytes.
+/// CAN-FD has no remote frames, so RTR packets always go out as classic frames, with their length capped at 8.
+///
+/// Returns None for packets flagged with [`rdxusb_protocol::MESSAGE_ARB_ID_DEVICE`], which are the device's own
+/// and were never on the bus.
+pub fn packet_to_frame(packet: &RdxUsbPacket, frame: &mut CanFdFrame) -> Option<usize> {
+    if packet.device() { return None; }
+    let mut can_id = if packet.extended() { (packet.id() & CAN_EFF_MASK) | CAN_EFF_FLAG } else { packet.id() & CAN_SFF_MASK };
+    if packet.rtr() { can_id |= CAN_RTR_FLAG; }
+    let max_len = if packet.rtr() { CAN_MAX_DLEN } else { CANFD_MAX_DLEN };
+    let len = (packet.dlc as usize).min(max_len);
+    *frame = CanFdFrame::zeroed();
+    frame.can_id = can_id;
+    frame.data[..len].copy_from_slice(&packet.data[..len]);
+    if len > CAN_MAX_DLEN {
+        frame.len = fd_len(len) as u8;
+        Some(CANFD_MTU)
+    } else {
+        frame.len = len as u8;
+        Some(CAN_MTU)
+    }
+}
+
+/// Converts a frame read from a socket into a packet on `channel`. `mtu` is how many bytes the read returned.
+///
+/// Returns None for error frames and reads that are neither frame size.
+pub fn frame_to_packet(frame: &CanFdFrame, mtu: usize, channel: u8) -> Option<RdxUsbPacket> {
+    let max_len = match mtu {
+        CAN_MTU => CAN_MAX_DLEN,
+        CANFD_MTU => CANFD_MAX_DLEN,
+        _ => { return None; }
+    };
+    if frame.can_id & CAN_ERR_FLAG != 0 { return None; }
+    let mut arb_id = if frame.can_id & CAN_EFF_FLAG != 0 {
+        (frame.can_id & CAN_EFF_MASK) | MESSAGE_ARB_ID_EXT
+    } else {
+        frame.can_id & CAN_SFF_MASK
+    };
+    if frame.can_id & CAN_RTR_FLAG != 0 { arb_id |= MESSAGE_ARB_ID_RTR; }
+    let len = (frame.len as usize).min(max_len);
+    let mut packet = RdxUsbPacket::zeroed();
+    packet.arb_id = arb_id;
+    packet.dlc = len as u8;
+    packet.channel = channel;
+    packet.data[..len].copy_from_slice(&frame.data[..len]);
+    Some(packet)
+}
+
+/// A raw CAN socket bound to one interface.
+struct CanSocket {
+    fd: OwnedFd,
+    /// Whether the socket takes CAN-FD frames. Older kernels only do classic frames.
+    fd_frames: bool,
+}
+
+impl CanSocket {
+    fn open(interface: &str) -> io::Result<Self> {
+        let name = CString::new(interface).map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "interface name has a nul byte"))?;
+        let ifindex = unsafe { libc::if_nametoindex(name.as_ptr()) };
+        if ifindex == 0 { return Err(io::Error::last_os_error()); }
+
+        let raw = unsafe { libc::socket(libc::PF_CAN, libc::SOCK_RAW | libc::SOCK_CLOEXEC, CAN_RAW) };
+        if raw < 0 { return Err(io::Error::last_os_error()); }
+        // SAFETY: socket just returned this fd, and nothing else owns it
+        let fd = unsafe { OwnedFd::from_raw_fd(raw) };
+
+        let enable: libc::c_int = 1;
+        let fd_frames = unsafe {
+            libc::setsockopt(raw, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, (&enable as *const libc::c_int).cast(), core::mem::size_of::<libc::c_int>() as libc::socklen_t)
+        } == 0;
+        let timeout = libc::timeval { tv_sec: 0, tv_usec: GATEWAY_WAKE_INTERVAL.as_micros() as libc::suseconds_t };
+        if unsafe {
+            libc::setsockopt(raw, libc::SOL_SOCKET, libc::SO_RCVTIMEO, (&timeout as *const libc::timeval).cast(), core::mem::size_of::<libc::timeval>() as libc::socklen_t)
+        } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        let addr = SockaddrCan { can_family: libc::AF_CAN as libc::sa_family_t, can_ifindex: ifindex as libc::c_int, can_addr: [0; 2] };
+        if unsafe { libc::bind(raw, (&addr as *const SockaddrCan).cast(), core::mem::size_of::<SockaddrCan>() as libc::socklen_t) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { fd, fd_frames })
+    }
+
+    /// Sends frames without blocking, each `mtus[i]` bytes long. Returns how many were sent;
+    /// the rest didn't fit in the interface's queue.
+    fn send_batch(&self, frames: &mut [CanFdFrame], mtus: &[usize]) -> usize {
+        let n = frames.len().min(GATEWAY_BATCH);
+        if n == 0 { return 0; }
+        let mut iovecs: [libc::iovec; GATEWAY_BATCH] = unsafe { core::mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; GATEWAY_BATCH] = unsafe { core::mem::zeroed() };
+        for i in 0..n {
+            iovecs[i] = libc::iovec { iov_base: (&mut frames[i] as *mut CanFdFrame).cast(), iov_len: mtus[i] };
+            msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        let sent = unsafe { libc::sendmmsg(self.fd.as_raw_fd(), msgs.as_mut_ptr(), n as _, libc::MSG_DONTWAIT as _) };
+        sent.max(0) as usize
+    }
+
+    /// Waits for frames, then reads as many as are ready without waiting again.
+    /// `mtus[i]` gets how many bytes of `frames[i]` were read.
+    fn recv_batch(&self, frames: &mut [CanFdFrame; GATEWAY_BATCH], mtus: &mut [usize; GATEWAY_BATCH]) -> io::Result<usize> {
+        let mut iovecs: [libc::iovec; GATEWAY_BATCH] = unsafe { core::mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; GATEWAY_BATCH] = unsafe { core::mem::zeroed() };
+        for i in 0..GATEWAY_BATCH {
+            iovecs[i] = libc::iovec { iov_base: (&mut frames[i] as *mut CanFdFrame).cast(), iov_len: CANFD_MTU };
+            msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        let n = unsafe {
+            libc::recvmmsg(self.fd.as_raw_fd(), msgs.as_mut_ptr(), GATEWAY_BATCH as _, libc::MSG_WAITFORONE as _, core::ptr::null_mut())
+        };
+        if n < 0 { return Err(io::Error::last_os_error()); }
+        let n = n as usize;
+        for (mtu, msg) in mtus.iter_mut().zip(&msgs[..n]) { *mtu = msg.msg_len as usize; }
+        Ok(n)
+    }
+}
+
+/// Frame counts of a gateway.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct GatewayStats {
+    /// Frames sent to the interface.
+    pub to_bus: u64,
+    /// Frames the interface had no room for, or CAN-FD frames it doesn't take.
+    pub to_bus_dropped: u64,
+    /// Frames from the interface written into the handle's tx lanes.
+    pub from_bus: u64,
+    /// Frames from the interface dropped because the device was disconnected.
+    pub from_bus_dropped: u64,
+}
+
+struct GatewayShared {
+    socket: CanSocket,
+    stop: AtomicBool,
+    to_bus: AtomicU64,
+    to_bus_dropped: AtomicU64,
+    from_bus: AtomicU64,
+    from_bus_dropped: AtomicU64,
+}
+
+impl GatewayShared {
+    /// Rx callback body: sends a batch of received packets to the interface.
+    fn forward_to_bus(&self, packets: &[RdxUsbPacket]) {
+        let mut frames = [CanFdFrame::zeroed(); GATEWAY_BATCH];
+        let mut mtus = [0usize; GATEWAY_BATCH];
+        let mut n = 0;
+        let mut dropped = 0;
+        for packet in packets.iter().take(GATEWAY_BATCH) {
+            match packet_to_frame(packet, &mut frames[n]) {
+                Some(CANFD_MTU) if !self.socket.fd_frames => { dropped += 1; }
+                Some(mtu) => {
+                    mtus[n] = mtu;
+                    n += 1;
+                }
+                None => {}
+            }
+        }
+        let sent = self.socket.send_batch(&mut frames[..n], &mtus[..n]);
+        self.to_bus.fetch_add(sent as u64, Ordering::Relaxed);
+        self.to_bus_dropped.fetch_add((dropped + n - sent) as u64, Ordering::Relaxed);
+    }
+
+    /// Gateway thread body: moves frames from the interface into the handle's tx lanes until stopped.
+    fn forward_from_bus(&self, handle_id: i32, channel: u8) {
+        let mut frames = [CanFdFrame::zeroed(); GATEWAY_BATCH];
+        let mut mtus = [0usize; GATEWAY_BATCH];
+        let mut packets = Vec::with_capacity(GATEWAY_BATCH);
+        while !self.stop.load(Ordering::Acquire) {
+            let n = match self.socket.recv_batch(&mut frames, &mut mtus) {
+                Ok(n) => n,
+                Err(e) if matches!(e.kind(), io::ErrorKind::WouldBlock | io::ErrorKind::TimedOut | io::ErrorKind::Interrupted) => { continue; }
+                Err(e) => {
+                    log::trace!(target: "rdxusb", "SocketCAN gateway stopped reading: {e}");
+                    return;
+                }
+            };
+            packets.clear();
+            packets.extend(frames[..n].iter().zip(&mtus[..n]).filter_map(|(frame, mtu)| frame_to_packet(frame, *mtu, channel)));
+            self.write_all(handle_id, &packets);
+        }
+    }
+
+    /// Writes packets into the tx lanes, waiting out full lanes. Packets are dropped if the device is disconnected.
+    fn write_all(&self, handle_id: i32, packets: &[RdxUsbPacket]) {
+        let mut written = 0;
+        while written < packets.len() && !self.stop.load(Ordering::Acquire) {
+            match event_loop::write_packets(handle_id, &packets[written..]) {
+                Ok(n) => { written += n; }
+                Err(_) => { break; }
+            }
+            if written < packets.len() { std::thread::sleep(GATEWAY_TX_RETRY); }
+        }
+        self.from_bus.fetch_add(written as u64, Ordering::Relaxed);
+        self.from_bus_dropped.fetch_add((packets.len() - written) as u64, Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug)]
+pub enum GatewayError {
+    /// The interface could not be opened.
+    Io(io::Error),
+    /// The handle or channel could not be bridged.
+    EventLoop(EventLoopError),
+}
+
+impl Display for GatewayError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            GatewayError::Io(e) => write!(f, "could not open CAN interface: {e}"),
+            GatewayError::EventLoop(e) => write!(f, "could not bridge handle: {e:?}"),
+        }
+    }
+}
+
+impl std::error::Error for GatewayError {}
+
+impl From<io::Error> for GatewayError {
+    fn from(value: io::Error) -> Self {
+        Self::Io(value)
+    }
+}
+
+impl From<EventLoopError> for GatewayError {
+    fn from(value: EventLoopError) -> Self {
+        Self::EventLoop(value)
+    }
+}
+
+/// A running bridge between one channel of a handle and a SocketCAN interface, such as `can0` or `vcan0`.
+///
+/// The gateway takes over the channel's rx callback. Received frames still land in the channel's rx queue
+/// as well, so open the handle with [`crate::host::OverflowPolicy::DropOldest`] if nothing else reads it.
+/// Dropping the gateway stops it.
+pub struct SocketCanGateway {
+    handle_id: i32,
+    channel: u8,
+    shared: Arc<GatewayShared>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl SocketCanGateway {
+    pub fn start(handle_id: i32, channel: u8, interface: &str) -> Result<Self, GatewayError> {
+        let shared = Arc::new(GatewayShared {
+            socket: CanSocket::open(interface)?,
+            stop: AtomicBool::new(false),
+            to_bus: AtomicU64::new(0),
+            to_bus_dropped: AtomicU64::new(0),
+            from_bus: AtomicU64::new(0),
+            from_bus_dropped: AtomicU64::new(0),
+        });
+        let callback = {
+            let shared = shared.clone();
+            RxCallback::new(Box::new(move |_channel: u8, packets: &[RdxUsbPacket]| shared.forward_to_bus(packets)), GATEWAY_BATCH)
+        };
+        event_loop::set_rx_callback(handle_id, channel, Some(callback))?;
+        let thread = std::thread::Builder::new().name(format!("rdxusb-socketcan-{interface}")).spawn({
+            let shared = shared.clone();
+            move || shared.forward_from_bus(handle_id, channel)
+        });
+        let thread = match thread {
+            Ok(thread) => thread,
+            Err(e) => {
+                let _ = event_loop::set_rx_callback(handle_id, channel, None);
+                return Err(e.into());
+            }
+        };
+        Ok(Self { handle_id, channel, shared, thread: Some(thread) })
+    }
+
+    pub fn stats(&self) -> GatewayStats {
+        GatewayStats {
+            to_bus: self.shared.to_bus.load(Ordering::Relaxed),
+            to_bus_dropped: self.shared.to_bus_dropped.load(Ordering::Relaxed),
+            from_bus: self.shared.from_bus.load(Ordering::Relaxed),
+            from_bus_dropped: self.shared.from_bus_dropped.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl Drop for SocketCanGateway {
+    fn drop(&mut self) {
+        let _ = event_loop::set_rx_callback(self.handle_id, self.channel, None);
+        self.shared.stop.store(true, Ordering::Release);
+        // the thread notices within a receive timeout
+        if let Some(thread) = self.thread.take() { let _ = thread.join(); }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use rdxusb_protocol::MESSAGE_ARB_ID_DEVICE;
+
+    use super::*;
+    use crate::test_util::packet;
+
+    /// What of a packet survives the bus: no timestamp or flags.
+    fn on_bus(packet: RdxUsbPacket) -> RdxUsbPacket {
+        RdxUsbPacket { timestamp_ns: 0, flags: 0, ..packet }
+    }
+
+    #[test]
+    fn frames_map_ids_and_lengths() {
+        let mut frame = CanFdFrame::zeroed();
+
+        assert_eq!(packet_to_frame(&packet(0x123, 7, 8), &mut frame), Some(CAN_MTU));
+        assert_eq!((frame.can_id, frame.len), (0x123, 8));
+        assert_eq!(frame_to_packet(&frame, CAN_MTU, 0), Some(on_bus(packet(0x123, 7, 8))));
+
+        let ext = packet(0x1abc_def0 | MESSAGE_ARB_ID_EXT | MESSAGE_ARB_ID_RTR, 0, 0);
+        assert_eq!(packet_to_frame(&ext, &mut frame), Some(CAN_MTU));
+        assert_eq!(frame.can_id, 0x1abc_def0 | CAN_EFF_FLAG | CAN_RTR_FLAG);
+        assert_eq!(frame_to_packet(&frame, CAN_MTU, 0), Some(ext));
+
+        // more than 8 bytes goes out as CAN-FD, padded to the next valid length
+        assert_eq!(packet_to_frame(&packet(0x42, 7, 10), &mut frame), Some(CANFD_MTU));
+        assert_eq!(frame.len, 12);
+        assert_eq!({ frame_to_packet(&frame, CANFD_MTU, 0).unwrap().dlc }, 12);
+
+        // except for remote frames, which CAN-FD doesn't have
+        assert_eq!(packet_to_frame(&packet(0x42 | MESSAGE_ARB_ID_RTR, 0, 12), &mut frame), Some(CAN_MTU));
+        assert_eq!((frame.can_id, frame.len), (0x42 | CAN_RTR_FLAG, 8));
+
+        assert_eq!(packet_to_frame(&packet(0x42 | MESSAGE_ARB_ID_DEVICE, 1, 1), &mut frame), None);
+        frame.can_id = CAN_ERR_FLAG;
+        assert_eq!(frame_to_packet(&frame, CAN_MTU, 2), None);
+    }
+}
@@ -0,0 +1,240 @@
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use nusb::transfer::TransferError;
+
+use crate::host::{TxLane, TX_LANES};
+
+/// Number of channels that get their own counters. Packets on higher channels still count towards the totals.
+pub const MAX_STATS_CHANNELS: usize = 8;
+
+fn bump(counter: &AtomicU64, n: u64) {
+    counter.fetch_add(n, Ordering::Relaxed);
+}
+
+fn get(counter: &AtomicU64) -> u64 {
+    counter.load(Ordering::Relaxed)
+}
+
+/// Per-channel rx counters.
+#[derive(Debug, Default)]
+pub struct ChannelStats {
+    pub rx_packets: AtomicU64,
+    pub rx_bytes: AtomicU64,
+    /// Packets dropped because the queue was full (drop newest/backpressure policies),
+    /// or in [`crate::mailbox::MailboxMode::Only`] because the mailbox was.
+    pub rx_dropped_full: AtomicU64,
+    /// Queued packets evicted to make room (drop oldest policy).
+    pub rx_evicted: AtomicU64,
+    /// Highest rx queue occupancy seen.
+    pub rx_high_water: AtomicU64,
+    /// Packets rejected by the channel's acceptance filters.
+    pub rx_filtered: AtomicU64,
+}
+
+impl ChannelStats {
+    const fn new() -> Self {
+        Self {
+            rx_packets: AtomicU64::new(0),
+            rx_bytes: AtomicU64::new(0),
+            rx_dropped_full: AtomicU64::new(0),
+            rx_evicted: AtomicU64::new(0),
+            rx_high_water: AtomicU64::new(0),
+            rx_filtered: AtomicU64::new(0),
+        }
+    }
+
+    /// Records a packet that made it into the rx queue.
+    pub fn record_rx(&self, bytes: u8, occupied: usize) {
+        bump(&self.rx_packets, 1);
+        bump(&self.rx_bytes, bytes as u64);
+        let occupied = occupied as u64;
+        if occupied > get(&self.rx_high_water) {
+            self.rx_high_water.fetch_max(occupied, Ordering::Relaxed);
+        }
+    }
+
+    pub fn snapshot(&self) -> ChannelStatsSnapshot {
+        ChannelStatsSnapshot {
+            rx_packets: get(&self.rx_packets),
+            rx_bytes: get(&self.rx_bytes),
+            rx_dropped_full: get(&self.rx_dropped_full),
+            rx_evicted: get(&self.rx_evicted),
+            rx_high_water: get(&self.rx_high_water),
+            rx_filtered: get(&self.rx_filtered),
+        }
+    }
+}
+
+/// Counters for a device handle. These persist across reconnects.
+///
+/// Everything is updated with relaxed atomics, so a snapshot is not guaranteed to be
+/// consistent across counters, only monotonic per counter.
+#[derive(Debug)]
+pub struct DeviceStats {
+    pub channels: [ChannelStats; MAX_STATS_CHANNELS],
+    /// Rx counters for channels past [`MAX_STATS_CHANNELS`].
+    pub overflow_channels: ChannelStats,
+    pub n_channels: AtomicU32,
+    /// Transfers that could not be decoded as a packet.
+    pub rx_dropped_decode_error: AtomicU64,
+    /// Packets addressed to a channel the device doesn't have.
+    pub rx_dropped_invalid_channel: AtomicU64,
+    pub tx_accepted: AtomicU64,
+    /// Packets not queued by write calls, because the tx queue was full or the packet was too large.
+    pub tx_rejected: AtomicU64,
+    /// Highest tx queue occupancy seen, over all lanes.
+    pub tx_high_water: AtomicU64,
+    /// The part of `tx_rejected` that was bound for each lane, indexed by [`TxLane`].
+    pub tx_lane_rejected: [AtomicU64; TX_LANES],
+    /// Accepted packets that replaced a pending packet with the same id instead of being queued.
+    pub tx_coalesced: AtomicU64,
+    /// USB transfer errors, indexed by [`TransferErrorKind`].
+    pub usb_errors: [AtomicU64; TransferErrorKind::COUNT],
+    pub reconnects: AtomicU64,
+}
+
+/// Index into [`DeviceStats::usb_errors`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(usize)]
+pub enum TransferErrorKind {
+    Cancelled = 0,
+    Stall = 1,
+    Disconnected = 2,
+    Fault = 3,
+    Unknown = 4,
+}
+
+impl TransferErrorKind {
+    pub const COUNT: usize = 5;
+}
+
+impl From<&TransferError> for TransferErrorKind {
+    fn from(value: &TransferError) -> Self {
+        match value {
+            TransferError::Cancelled => Self::Cancelled,
+            TransferError::Stall => Self::Stall,
+            TransferError::Disconnected => Self::Disconnected,
+            TransferError::Fault => Self::Fault,
+            TransferError::Unknown => Self::Unknown,
+        }
+    }
+}
+
+impl DeviceStats {
+    pub const fn new() -> Self {
+        Self {
+            channels: [const { ChannelStats::new() }; MAX_STATS_CHANNELS],
+            overflow_channels: ChannelStats::new(),
+            n_channels: AtomicU32::new(0),
+            rx_dropped_decode_error: AtomicU64::new(0),
+            rx_dropped_invalid_channel: AtomicU64::new(0),
+            tx_accepted: AtomicU64::new(0),
+            tx_rejected: AtomicU64::new(0),
+            tx_high_water: AtomicU64::new(0),
+            tx_lane_rejected: [const { AtomicU64::new(0) }; TX_LANES],
+            tx_coalesced: AtomicU64::new(0),
+            usb_errors: [const { AtomicU64::new(0) }; TransferErrorKind::COUNT],
+            reconnects: AtomicU64::new(0),
+        }
+    }
+
+    pub fn channel(&self, channel: u8) -> &ChannelStats {
+        self.channels.get(channel as usize).unwrap_or(&self.overflow_channels)
+    }
+
+    pub fn record_transfer_error(&self, error: &TransferError) {
+        bump(&self.usb_errors[TransferErrorKind::from(error) as usize], 1);
+    }
+
+    pub fn record_decode_error(&self) {
+        bump(&self.rx_dropped_decode_error, 1);
+    }
+
+    pub fn record_invalid_channel(&self) {
+        bump(&self.rx_dropped_invalid_channel, 1);
+    }
+
+    pub fn record_reconnect(&self) {
+        bump(&self.reconnects, 1);
+    }
+
+    /// Records the outcome of a write call.
+    pub fn record_tx(&self, accepted: usize, rejected: usize, occupied: usize) {
+        if accepted > 0 { bump(&self.tx_accepted, accepted as u64); }
+        if rejected > 0 { bump(&self.tx_rejected, rejected as u64); }
+        let occupied = occupied as u64;
+        if occupied > get(&self.tx_high_water) {
+            self.tx_high_water.fetch_max(occupied, Ordering::Relaxed);
+        }
+    }
+
+    pub fn record_tx_lane_rejected(&self, lane: TxLane) {
+        bump(&self.tx_lane_rejected[lane as usize], 1);
+    }
+
+    pub fn record_tx_coalesced(&self) {
+        bump(&self.tx_coalesced, 1);
+    }
+
+    pub fn snapshot(&self) -> DeviceStatsSnapshot {
+        let mut totals = self.overflow_channels.snapshot();
+        let channels = core::array::from_fn(|i| {
+            let c = self.channels[i].snapshot();
+            totals.rx_packets += c.rx_packets;
+            totals.rx_bytes += c.rx_bytes;
+            totals.rx_dropped_full += c.rx_dropped_full;
+            totals.rx_evicted += c.rx_evicted;
+            totals.rx_filtered += c.rx_filtered;
+            totals.rx_high_water = totals.rx_high_water.max(c.rx_high_water);
+            c
+        });
+        DeviceStatsSnapshot {
+            n_channels: self.n_channels.load(Ordering::Relaxed),
+            totals,
+            channels,
+            rx_dropped_decode_error: get(&self.rx_dropped_decode_error),
+            rx_dropped_invalid_channel: get(&self.rx_dropped_invalid_channel),
+            tx_accepted: get(&self.tx_accepted),
+            tx_rejected: get(&self.tx_rejected),
+            tx_high_water: get(&self.tx_high_water),
+            tx_lane_rejected: core::array::from_fn(|i| get(&self.tx_lane_rejected[i])),
+            tx_coalesced: get(&self.tx_coalesced),
+            usb_errors: core::array::from_fn(|i| get(&self.usb_errors[i])),
+            reconnects: get(&self.reconnects),
+        }
+    }
+}
+
+impl Default for DeviceStats {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ChannelStatsSnapshot {
+    pub rx_packets: u64,
+    pub rx_bytes: u64,
+    pub rx_dropped_full: u64,
+    pub rx_evicted: u64,
+    pub rx_high_water: u64,
+    pub rx_filtered: u64,
+}
+
+/// A point-in-time copy of [`DeviceStats`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DeviceStatsSnapshot {
+    pub n_channels: u32,
+    /// Rx counters summed over all channels. The high-water mark is the max over channels.
+    pub totals: ChannelStatsSnapshot,
+    pub channels: [ChannelStatsSnapshot; MAX_STATS_CHANNELS],
+    pub rx_dropped_decode_error: u64,
+    pub rx_dropped_invalid_channel: u64,
+    pub tx_accepted: u64,
+    pub tx_rejected: u64,
+    pub tx_high_water: u64,
+    pub tx_lane_rejected: [u64; TX_LANES],
+    pub tx_coalesced: u64,
+    pub usb_errors: [u64; TransferErrorKind::COUNT],
+    pub reconnects: u64,
+}
@@ -0,0 +1,17 @@
+//! Packet fixtures shared by the unit tests and the benches.
+
+use rdxusb_protocol::RdxUsbPacket;
+
+/// A `dlc`-byte packet whose timestamp, flags and data bytes all derive from `seq`,
+/// so a copy torn between two writes shows up in [`is_whole`].
+pub fn packet(arb_id: u32, seq: u32, dlc: u8) -> RdxUsbPacket {
+    let mut data = [0u8; 64];
+    data[..dlc as usize].fill(seq as u8);
+    RdxUsbPacket { timestamp_ns: seq as u64, arb_id, dlc, channel: 0, flags: seq as u16, data }
+}
+
+/// Whether a packet made by [`packet`] was read back whole.
+pub fn is_whole(packet: &RdxUsbPacket) -> bool {
+    let seq = packet.timestamp_ns;
+    packet.flags == seq as u16 && packet.data[..packet.dlc as usize].iter().all(|&b| b == seq as u8)
+}
@@ -0,0 +1,365 @@
+//! Per-stage latency tracing of the rx and tx hot paths.
+//!
+//! Frames are timestamped at each stage they pass through:
+//!
+//! * rx: bulk IN completion, rx ring push, rx ring pop, and return from the read call
+//! * tx: write call entry, tx queue push, bulk OUT submit, and bulk OUT completion
+//!
+//! and the time between stages goes into one lock-free [`Histogram`] per [`Stage`].
+//! Every [`set_sample_interval`]th frame is also kept as a set of spans that
+//! [`export_chrome_trace`] writes out for `chrome://tracing` or Perfetto.
+//!
+//! All of this is behind the `latency-trace` feature. Without it the hooks are empty inline functions
+//! and the stamps are zero-sized, so the hot path compiles to what it was before.
+
+#[cfg(feature = "latency-trace")]
+use std::{cell::Cell, collections::VecDeque, io::{self, Write}, path::Path, sync::{atomic::{AtomicU32, AtomicU64, Ordering}, Mutex}};
+
+/// A span of the hot path that gets its own histogram.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+pub enum Stage {
+    /// Bulk IN completion to rx ring push.
+    RxCompleteToPush = 0,
+    /// Rx ring push to rx ring pop.
+    RxPushToPop = 1,
+    /// Rx ring pop to the read call returning.
+    RxPopToReturn = 2,
+    /// Bulk IN completion to rx ring pop.
+    RxCompleteToPop = 3,
+    /// Write call entry to tx queue push.
+    TxEntryToPush = 4,
+    /// Tx queue push to bulk OUT submit.
+    TxPushToSubmit = 5,
+    /// Bulk OUT submit to bulk OUT completion.
+    TxSubmitToComplete = 6,
+}
+
+impl Stage {
+    pub const COUNT: usize = 7;
+    pub const ALL: [Stage; Self::COUNT] = [
+        Stage::RxCompleteToPush, Stage::RxPushToPop, Stage::RxPopToReturn, Stage::RxCompleteToPop,
+        Stage::TxEntryToPush, Stage::TxPushToSubmit, Stage::TxSubmitToComplete,
+    ];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::RxCompleteToPush => "rx_complete_to_push",
+            Stage::RxPushToPop => "rx_push_to_pop",
+            Stage::RxPopToReturn => "rx_pop_to_return",
+            Stage::RxCompleteToPop => "rx_complete_to_pop",
+            Stage::TxEntryToPush => "tx_entry_to_push",
+            Stage::TxPushToSubmit => "tx_push_to_submit",
+            Stage::TxSubmitToComplete => "tx_submit_to_complete",
+        }
+    }
+}
+
+impl TryFrom<u32> for Stage {
+    type Error = ();
+
+    fn try_from(value: u32) -> Result<Self, Self::Error> {
+        Stage::ALL.get(value as usize).copied().ok_or(())
+    }
+}
+
+/// When a queued rx frame was received and pushed, kept next to its ring slot.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RxStamp {
+    #[cfg(feature = "latency-trace")]
+    pub complete_ns: u64,
+    #[cfg(feature = "latency-trace")]
+    pub push_ns: u64,
+}
+
+/// A queued tx frame, with when it was queued.
+#[derive(Debug, Clone, Copy)]
+#[cfg_attr(not(feature = "latency-trace"), repr(transparent))]
+pub struct TxStamped<F> {
+    pub frame: F,
+    #[cfg(feature = "latency-trace")]
+    pub push_ns: u64,
+}
+
+#[cfg(feature = "latency-trace")]
+pub use imp::*;
+
+#[cfg(not(feature = "latency-trace"))]
+mod noop {
+    use super::{RxStamp, TxStamped};
+
+    #[inline(always)]
+    pub fn rx_pushed(_complete_ns: u64) -> RxStamp { RxStamp {} }
+    #[inline(always)]
+    pub fn rx_popped(_stamp: RxStamp) {}
+    #[inline(always)]
+    pub fn rx_returned() {}
+    #[inline(always)]
+    pub fn tx_entry() {}
+    #[inline(always)]
+    pub fn tx_pushed<F>(frame: F) -> TxStamped<F> { TxStamped { frame } }
+    #[inline(always)]
+    pub fn tx_returned() {}
+    #[inline(always)]
+    pub fn tx_submitted<F>(_stamped: &TxStamped<F>, _submit_ns: u64) {}
+    #[inline(always)]
+    pub fn now() -> u64 { 0 }
+
+    /// Submit times of in-flight bulk OUT transfers. Empty without the `latency-trace` feature.
+    #[derive(Debug, Default)]
+    pub struct SubmitTimes;
+
+    impl SubmitTimes {
+        #[inline(always)]
+        pub fn submitted(&mut self, _submit_ns: u64) {}
+        #[inline(always)]
+        pub fn completed(&mut self) {}
+    }
+}
+
+#[cfg(not(feature = "latency-trace"))]
+pub use noop::*;
+
+#[cfg(feature = "latency-trace")]
+mod imp {
+    use super::*;
+    use crate::clock::monotonic_ns;
+
+    /// Sub-buckets per power of two. 4 keeps every bucket within 25% of its values.
+    const SUB_BITS: u32 = 2;
+    const SUB_BUCKETS: u64 = 1 << SUB_BITS;
+    pub const N_BUCKETS: usize = 64 << SUB_BITS;
+    /// Most sampled spans kept for export. Older ones are dropped first.
+    pub const MAX_SPANS: usize = 1 << 16;
+
+    fn bucket(ns: u64) -> usize {
+        if ns < SUB_BUCKETS { return ns as usize; }
+        let msb = 63 - ns.leading_zeros();
+        ((((msb - SUB_BITS + 1) as u64) << SUB_BITS) | ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1))) as usize
+    }
+
+    /// Smallest value that lands in bucket `idx`.
+    fn bucket_floor(idx: usize) -> u64 {
+        let idx = idx as u64;
+        if idx < SUB_BUCKETS { return idx; }
+        let (exp, sub) = (idx >> SUB_BITS, idx & (SUB_BUCKETS - 1));
+        (SUB_BUCKETS | sub) << (exp - 1)
+    }
+
+    /// Log-linear latency histogram, updated with relaxed atomic adds.
+    pub struct Histogram {
+        buckets: [AtomicU64; N_BUCKETS],
+        count: AtomicU64,
+        sum_ns: AtomicU64,
+        max_ns: AtomicU64,
+    }
+
+    impl Histogram {
+        const fn new() -> Self {
+            Self {
+                buckets: [const { AtomicU64::new(0) }; N_BUCKETS],
+                count: AtomicU64::new(0),
+                sum_ns: AtomicU64::new(0),
+                max_ns: AtomicU64::new(0),
+            }
+        }
+
+        pub fn record(&self, ns: u64) {
+            self.buckets[bucket(ns)].fetch_add(1, Ordering::Relaxed);
+            self.count.fetch_add(1, Ordering::Relaxed);
+            self.sum_ns.fetch_add(ns, Ordering::Relaxed);
+            self.max_ns.fetch_max(ns, Ordering::Relaxed);
+        }
+
+        pub fn snapshot(&self) -> HistogramSnapshot {
+            HistogramSnapshot {
+                buckets: self.buckets.iter().map(|b| b.load(Ordering::Relaxed)).collect(),
+                count: self.count.load(Ordering::Relaxed),
+                sum_ns: self.sum_ns.load(Ordering::Relaxed),
+                max_ns: self.max_ns.load(Ordering::Relaxed),
+            }
+        }
+
+        fn reset(&self) {
+            for b in &self.buckets { b.store(0, Ordering::Relaxed); }
+            self.count.store(0, Ordering::Relaxed);
+            self.sum_ns.store(0, Ordering::Relaxed);
+            self.max_ns.store(0, Ordering::Relaxed);
+        }
+    }
+
+    /// A copy of a [`Histogram`]. Counters are read one by one, so they may be off by in-flight records.
+    #[derive(Debug, Clone)]
+    pub struct HistogramSnapshot {
+        pub buckets: Box<[u64]>,
+        pub count: u64,
+        pub sum_ns: u64,
+        pub max_ns: u64,
+    }
+
+    impl HistogramSnapshot {
+        /// Estimates the `p`th quantile (0.0 to 1.0) as the floor of the bucket it falls in.
+        pub fn percentile(&self, p: f64) -> u64 {
+            let total: u64 = self.buckets.iter().sum();
+            if total == 0 { return 0; }
+            let rank = ((total as f64 * p).ceil() as u64).clamp(1, total);
+            let mut seen = 0;
+            for (idx, n) in self.buckets.iter().enumerate() {
+                seen += n;
+                if seen >= rank { return bucket_floor(idx).min(self.max_ns); }
+            }
+            self.max_ns
+        }
+    }
+
+    static HISTOGRAMS: [Histogram; Stage::COUNT] = [const { Histogram::new() }; Stage::COUNT];
+
+    pub fn record(stage: Stage, ns: u64) {
+        HISTOGRAMS[stage as usize].record(ns);
+    }
+
+    pub fn histogram(stage: Stage) -> HistogramSnapshot {
+        HISTOGRAMS[stage as usize].snapshot()
+    }
+
+    /// Clears every histogram and the sampled spans.
+    pub fn reset() {
+        for h in &HISTOGRAMS { h.reset(); }
+        if let Ok(mut spans) = SPANS.lock() { spans.clear(); }
+    }
+
+    /// A sampled stage of one frame.
+    #[derive(Debug, Clone, Copy)]
+    struct Span {
+        stage: Stage,
+        start_ns: u64,
+        end_ns: u64,
+    }
+
+    static SAMPLE_INTERVAL: AtomicU32 = AtomicU32::new(0);
+    static SAMPLE_COUNTER: AtomicU64 = AtomicU64::new(0);
+    static SPANS: Mutex<VecDeque<Span>> = Mutex::new(VecDeque::new());
+
+    /// Keeps every `interval`th frame for [`export_chrome_trace`]. 0 turns sampling off, which is the default.
+    pub fn set_sample_interval(interval: u32) {
+        SAMPLE_INTERVAL.store(interval, Ordering::Relaxed);
+    }
+
+    fn sampled() -> bool {
+        match SAMPLE_INTERVAL.load(Ordering::Relaxed) {
+            0 => false,
+            interval => SAMPLE_COUNTER.fetch_add(1, Ordering::Relaxed) % interval as u64 == 0,
+        }
+    }
+
+    fn keep(spans: &[Span]) {
+        let Ok(mut kept) = SPANS.lock() else { return; };
+        for span in spans {
+            if kept.len() >= MAX_SPANS { kept.pop_front(); }
+            kept.push_back(*span);
+        }
+    }
+
+    /// Writes the sampled spans to `path` in the Chrome trace event format, and clears them.
+    ///
+    /// Rx stages show up on one track and tx stages on another, on the host monotonic clock.
+    pub fn export_chrome_trace(path: &Path) -> io::Result<()> {
+        let spans: Vec<Span> = SPANS.lock().map(|mut s| s.drain(..).collect()).unwrap_or_default();
+        let mut out = io::BufWriter::new(std::fs::File::create(path)?);
+        out.write_all(b"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n")?;
+        out.write_all(b"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"rx\"}},\n")?;
+        out.write_all(b"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"tx\"}}")?;
+        for span in spans {
+            let tid = if (span.stage as u32) < Stage::TxEntryToPush as u32 { 1 } else { 2 };
+            // trace timestamps are in fractional microseconds
+            write!(out, ",\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{tid},\"ts\":{:.3},\"dur\":{:.3}}}",
+                span.stage.name(), span.start_ns as f64 / 1000.0, span.end_ns.saturating_sub(span.start_ns) as f64 / 1000.0)?;
+        }
+        out.write_all(b"\n]}\n")?;
+        out.flush()
+    }
+
+    thread_local! {
+        /// When this thread last popped rx frames inside the current read call, or 0.
+        static POP_NS: Cell<u64> = const { Cell::new(0) };
+        /// When this thread entered the current write call, or 0.
+        static ENTRY_NS: Cell<u64> = const { Cell::new(0) };
+    }
+
+    /// Stamps an rx frame being pushed into its ring.
+    pub fn rx_pushed(complete_ns: u64) -> RxStamp {
+        let push_ns = monotonic_ns();
+        record(Stage::RxCompleteToPush, push_ns.saturating_sub(complete_ns));
+        RxStamp { complete_ns, push_ns }
+    }
+
+    /// Records the stages of an rx frame that was just popped.
+    pub fn rx_popped(stamp: RxStamp) {
+        // frames pushed without a completion time (e.g. replayed ones) have nothing to measure
+        if stamp.complete_ns == 0 { return; }
+        let pop_ns = monotonic_ns();
+        record(Stage::RxPushToPop, pop_ns.saturating_sub(stamp.push_ns));
+        record(Stage::RxCompleteToPop, pop_ns.saturating_sub(stamp.complete_ns));
+        POP_NS.with(|p| p.set(pop_ns));
+        if sampled() {
+            keep(&[
+                Span { stage: Stage::RxCompleteToPush, start_ns: stamp.complete_ns, end_ns: stamp.push_ns },
+                Span { stage: Stage::RxPushToPop, start_ns: stamp.push_ns, end_ns: pop_ns },
+            ]);
+        }
+    }
+
+    /// Called as a read call returns, after any [`rx_popped`].
+    pub fn rx_returned() {
+        let pop_ns = POP_NS.with(|p| p.replace(0));
+        if pop_ns != 0 { record(Stage::RxPopToReturn, monotonic_ns().saturating_sub(pop_ns)); }
+    }
+
+    /// Called as a write call starts.
+    pub fn tx_entry() {
+        ENTRY_NS.with(|e| e.set(monotonic_ns()));
+    }
+
+    /// Stamps a tx frame being pushed into the tx queue.
+    pub fn tx_pushed<F>(frame: F) -> TxStamped<F> {
+        let push_ns = monotonic_ns();
+        let entry_ns = ENTRY_NS.with(|e| e.get());
+        // writes from inside rdxusb, like periodic jobs, have no entry time
+        if entry_ns != 0 { record(Stage::TxEntryToPush, push_ns.saturating_sub(entry_ns)); }
+        TxStamped { frame, push_ns }
+    }
+
+    /// Called as a write call returns.
+    pub fn tx_returned() {
+        ENTRY_NS.with(|e| e.set(0));
+    }
+
+    /// Records a tx frame being packed into a bulk OUT transfer submitted at `submit_ns`.
+    pub fn tx_submitted<F>(stamped: &TxStamped<F>, submit_ns: u64) {
+        record(Stage::TxPushToSubmit, submit_ns.saturating_sub(stamped.push_ns));
+        if sampled() {
+            keep(&[Span { stage: Stage::TxPushToSubmit, start_ns: stamped.push_ns, end_ns: submit_ns }]);
+        }
+    }
+
+    /// The clock stages are timed on.
+    pub fn now() -> u64 {
+        monotonic_ns()
+    }
+
+    /// Submit times of in-flight bulk OUT transfers, oldest first. Transfers complete in submission order.
+    #[derive(Debug, Default)]
+    pub struct SubmitTimes(VecDeque<u64>);
+
+    impl SubmitTimes {
+        pub fn submitted(&mut self, submit_ns: u64) {
+            self.0.push_back(submit_ns);
+        }
+
+        /// Records the oldest in-flight transfer completing.
+        pub fn completed(&mut self) {
+            let Some(submit_ns) = self.0.pop_front() else { return; };
+            record(Stage::TxSubmitToComplete, monotonic_ns().saturating_sub(submit_ns));
+        }
+    }
+}
@@ -0,0 +1,94 @@
+//! The USB operations a host needs from its device, so hosts can run over something other than [`nusb`].
+
+use std::future::Future;
+
+use futures_util::FutureExt;
+use nusb::transfer::{Completion, ControlIn, ControlOut, Queue, RequestBuffer};
+
+/// A queue of bulk IN transfers, shaped like [`nusb::transfer::Queue`].
+pub trait BulkInQueue: Send {
+    /// Submits a transfer reading up to `len` bytes. `buf` is an old buffer to reuse.
+    fn submit(&mut self, buf: Vec<u8>, len: usize);
+    /// Number of transfers submitted but not yet returned by [`next_complete`](Self::next_complete).
+    fn pending(&self) -> usize;
+    /// Waits for the oldest pending transfer to complete.
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_;
+}
+
+/// A queue of bulk OUT transfers, shaped like [`nusb::transfer::Queue`].
+pub trait BulkOutQueue: Send {
+    /// Submits a transfer sending all of `buf`.
+    fn submit(&mut self, buf: Vec<u8>);
+    /// Number of transfers submitted but not yet returned by [`next_complete`](Self::next_complete).
+    fn pending(&self) -> usize;
+    /// Waits for the oldest pending transfer to complete, handing back its emptied buffer.
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_;
+}
+
+/// A claimed RdxUsb interface.
+///
+/// Hosts are generic over this, so the transport is picked at compile time and costs nothing on real devices.
+pub trait Transport: Clone + Send + Sync + 'static {
+    type BulkIn: BulkInQueue;
+    type BulkOut: BulkOutQueue;
+
+    fn bulk_in_queue(&self, endpoint: u8) -> Self::BulkIn;
+    fn bulk_out_queue(&self, endpoint: u8) -> Self::BulkOut;
+    /// Sends one bulk OUT transfer, handing back its emptied buffer.
+    fn bulk_out(&self, endpoint: u8, buf: Vec<u8>) -> impl Future<Output = Completion<Vec<u8>>> + Send;
+    fn control_in(&self, data: ControlIn) -> impl Future<Output = Completion<Vec<u8>>> + Send;
+    fn control_out(&self, data: ControlOut<'_>) -> impl Future<Output = Completion<()>> + Send;
+}
+
+impl BulkInQueue for Queue<RequestBuffer> {
+    fn submit(&mut self, buf: Vec<u8>, len: usize) {
+        Queue::submit(self, RequestBuffer::reuse(buf, len));
+    }
+
+    fn pending(&self) -> usize {
+        Queue::pending(self)
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        Queue::next_complete(self)
+    }
+}
+
+impl BulkOutQueue for Queue<Vec<u8>> {
+    fn submit(&mut self, buf: Vec<u8>) {
+        Queue::submit(self, buf);
+    }
+
+    fn pending(&self) -> usize {
+        Queue::pending(self)
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        Queue::next_complete(self).map(|c| Completion { data: c.data.reuse(), status: c.status })
+    }
+}
+
+impl Transport for nusb::Interface {
+    type BulkIn = Queue<RequestBuffer>;
+    type BulkOut = Queue<Vec<u8>>;
+
+    fn bulk_in_queue(&self, endpoint: u8) -> Self::BulkIn {
+        nusb::Interface::bulk_in_queue(self, endpoint)
+    }
+
+    fn bulk_out_queue(&self, endpoint: u8) -> Self::BulkOut {
+        nusb::Interface::bulk_out_queue(self, endpoint)
+    }
+
+    fn bulk_out(&self, endpoint: u8, buf: Vec<u8>) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        nusb::Interface::bulk_out(self, endpoint, buf).map(|c| Completion { data: c.data.reuse(), status: c.status })
+    }
+
+    fn control_in(&self, data: ControlIn) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        nusb::Interface::control_in(self, data)
+    }
+
+    fn control_out(&self, data: ControlOut<'_>) -> impl Future<Output = Completion<()>> + Send {
+        nusb::Interface::control_out(self, data).map(|c| Completion { data: (), status: c.status })
+    }
+}
@@ -0,0 +1,506 @@
+//! In-process virtual RdxUsb devices, for load testing and CI without hardware.
+//!
+//! Opening [`VIRTUAL_VID`] with any pid gives a handle backed by a [`VirtualTransport`] instead of USB.
+//! It speaks the high-speed protocol, generates frames as set by [`VirtualDeviceConfig`],
+//! and echoes written frames back on the channel they were written to.
+
+use std::{collections::{HashMap, VecDeque}, future::Future, sync::{Arc, Mutex}, time::Duration};
+
+use bytemuck::Zeroable;
+use nusb::transfer::{Completion, ControlIn, ControlOut, TransferError};
+use rdxusb_protocol::{RdxUsbCtrl, RdxUsbDeviceInfo, RdxUsbPacket, PROTOCOL_VERSION_MAJOR_HS};
+use tokio::{sync::Notify, time::Instant};
+
+use crate::{clock::monotonic_ns, event_loop::EventLoopError, transport::{BulkInQueue, BulkOutQueue, Transport}};
+
+/// Vendor id reserved for virtual devices. 0xffff is never assigned to a real vendor.
+pub const VIRTUAL_VID: u16 = 0xffff;
+/// Most written frames a virtual device holds before echoing them. Frames written past this are dropped.
+pub const ECHO_CAPACITY: usize = 4096;
+
+/// What a virtual device sends.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct VirtualDeviceConfig {
+    /// Number of channels the device has. Its device info reports the highest channel index, like real devices do.
+    pub n_channels: u8,
+    /// Generated frames per second, spread over the channels. 0 only echoes.
+    pub rate: u32,
+    /// Generated frames are sent in bursts of this many back to back, at `rate / burst` bursts per second.
+    pub burst: u32,
+    /// Generated arbitration ids are drawn uniformly from `id_base..id_base + id_count`.
+    pub id_base: u32,
+    pub id_count: u32,
+    /// Data length of generated frames. The first 8 bytes carry a sequence number, to spot lost frames.
+    pub dlc: u8,
+    /// Whether written frames are sent back.
+    pub echo: bool,
+}
+
+impl Default for VirtualDeviceConfig {
+    fn default() -> Self {
+        Self { n_channels: 1, rate: 1000, burst: 1, id_base: 0, id_count: 1, dlc: 8, echo: true }
+    }
+}
+
+impl VirtualDeviceConfig {
+    fn validate(&self) -> Result<(), EventLoopError> {
+        if self.n_channels == 0 || self.burst == 0 || self.id_count == 0 || self.dlc as usize > 64 {
+            return Err(EventLoopError::InvalidArgument);
+        }
+        Ok(())
+    }
+
+    /// The device info the virtual device reports.
+    pub fn device_info(&self) -> RdxUsbDeviceInfo {
+        RdxUsbDeviceInfo {
+            sku: 0,
+            interface_idx: 0,
+            n_channels: self.n_channels - 1,
+            protocol_version_major: PROTOCOL_VERSION_MAJOR_HS,
+            protocol_version_minor: 0,
+            reserved: [0; 24],
+        }
+    }
+}
+
+/// Configs of virtual devices, keyed by pid.
+pub struct VirtualDevices {
+    configs: Mutex<Option<HashMap<u16, VirtualDeviceConfig>>>,
+}
+
+impl VirtualDevices {
+    const fn new() -> Self {
+        Self { configs: Mutex::new(None) }
+    }
+
+    /// Sets the config used by virtual devices opened on `pid` from now on.
+    pub fn configure(&self, pid: u16, config: VirtualDeviceConfig) -> Result<(), EventLoopError> {
+        config.validate()?;
+        let mut configs = self.configs.lock().map_err(|_e| EventLoopError::EventLoopCrashed)?;
+        configs.get_or_insert_with(HashMap::new).insert(pid, config);
+        Ok(())
+    }
+
+    /// Gets the config for `pid`, or the default config if it was never configured.
+    pub fn config(&self, pid: u16) -> VirtualDeviceConfig {
+        let Ok(configs) = self.configs.lock() else { return VirtualDeviceConfig::default(); };
+        configs.as_ref().and_then(|c| c.get(&pid)).copied().unwrap_or_default()
+    }
+}
+
+pub static VIRTUAL_DEVICES: VirtualDevices = VirtualDevices::new();
+
+struct Shared {
+    config: VirtualDeviceConfig,
+    echo: Mutex<VecDeque<RdxUsbPacket>>,
+    echo_ready: Notify,
+}
+
+impl Shared {
+    fn echo(&self, buf: &[u8]) {
+        if !self.config.echo { return; }
+        let Ok(frames) = bytemuck::try_cast_slice::<u8, RdxUsbPacket>(buf) else { return; };
+        let Ok(mut echo) = self.echo.lock() else { return; };
+        let timestamp_ns = monotonic_ns();
+        for frame in frames.iter().take(ECHO_CAPACITY.saturating_sub(echo.len())) {
+            echo.push_back(RdxUsbPacket { timestamp_ns, ..*frame });
+        }
+        drop(echo);
+        self.echo_ready.notify_one();
+    }
+}
+
+/// A virtual device's side of the bus.
+#[derive(Clone)]
+pub struct VirtualTransport(Arc<Shared>);
+
+impl VirtualTransport {
+    pub fn new(config: VirtualDeviceConfig) -> Self {
+        Self(Arc::new(Shared { config, echo: Mutex::new(VecDeque::new()), echo_ready: Notify::new() }))
+    }
+}
+
+impl Transport for VirtualTransport {
+    type BulkIn = VirtualBulkIn;
+    type BulkOut = VirtualBulkOut;
+
+    fn bulk_in_queue(&self, _endpoint: u8) -> Self::BulkIn {
+        VirtualBulkIn { shared: self.0.clone(), generator: Generator::new(self.0.config), buffers: VecDeque::new() }
+    }
+
+    fn bulk_out_queue(&self, _endpoint: u8) -> Self::BulkOut {
+        VirtualBulkOut { shared: self.0.clone(), done: VecDeque::new() }
+    }
+
+    fn bulk_out(&self, _endpoint: u8, mut buf: Vec<u8>) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        self.0.echo(&buf);
+        buf.clear();
+        std::future::ready(Completion { data: buf, status: Ok(()) })
+    }
+
+    fn control_in(&self, data: ControlIn) -> impl Future<Output = Completion<Vec<u8>>> + Send {
+        let completion = if data.request == RdxUsbCtrl::DeviceInfo as u8 {
+            let mut info = self.0.config.device_info().encode().to_vec();
+            info.truncate(data.length as usize);
+            Completion { data: info, status: Ok(()) }
+        } else {
+            Completion { data: Vec::new(), status: Err(TransferError::Stall) }
+        };
+        std::future::ready(completion)
+    }
+
+    fn control_out(&self, _data: ControlOut<'_>) -> impl Future<Output = Completion<()>> + Send {
+        std::future::ready(Completion { data: (), status: Ok(()) })
+    }
+}
+
+/// Produces the configured frame stream against absolute deadlines.
+///
+/// A host that falls behind gets the backlog as fast as it takes it, so the average rate holds
+/// and a saturated host shows up as full rx queues rather than as a slower stream.
+struct Generator {
+    config: VirtualDeviceConfig,
+    interval: Duration,
+    next_burst: Instant,
+    left_in_burst: u32,
+    seq: u64,
+    rng: u64,
+}
+
+impl Generator {
+    fn new(config: VirtualDeviceConfig) -> Self {
+        let interval = match config.rate {
+            0 => Duration::MAX,
+            rate => Duration::from_secs_f64(config.burst as f64 / rate as f64),
+        };
+        Self { config, interval, next_burst: Instant::now(), left_in_burst: 0, seq: 0, rng: 0x9e37_79b9_7f4a_7c15 }
+    }
+
+    /// When the next burst is due, if frames are generated at all.
+    fn next_due(&self) -> Option<Instant> {
+        (self.config.rate != 0).then_some(self.next_burst)
+    }
+
+    fn next_random(&mut self) -> u64 {
+        // xorshift64
+        self.rng ^= self.rng << 13;
+        self.rng ^= self.rng >> 7;
+        self.rng ^= self.rng << 17;
+        self.rng
+    }
+
+    /// Takes the next frame if it is due by `now`.
+    fn next(&mut self, now: Instant) -> Option<RdxUsbPacket> {
+        if self.config.rate == 0 { return None; }
+        if self.left_in_burst == 0 {
+            if now < self.next_burst { return None; }
+            self.left_in_burst = self.config.burst;
+            self.next_burst += self.interval;
+        }
+        self.left_in_burst -= 1;
+
+        let random = self.next_random();
+        let mut packet = RdxUsbPacket::zeroed();
+        packet.timestamp_ns = monotonic_ns();
+        packet.arb_id = self.config.id_base.wrapping_add((random % self.config.id_count as u64) as u32);
+        packet.channel = ((random >> 32) % self.config.n_channels as u64) as u8;
+        packet.dlc = self.config.dlc;
+        packet.data[..8].copy_from_slice(&self.seq.to_le_bytes());
+        self.seq += 1;
+        Some(packet)
+    }
+}
+
+/// Bulk IN queue of a virtual device. Transfers complete as soon as there are echoed or generated frames for them.
+pub struct VirtualBulkIn {
+    shared: Arc<Shared>,
+    generator: Generator,
+    buffers: VecDeque<(Vec<u8>, usize)>,
+}
+
+impl VirtualBulkIn {
+    /// Fills the oldest transfer with whatever is ready, completing it if that is anything.
+    fn try_complete(&mut self) -> Option<Completion<Vec<u8>>> {
+        let (buf, len) = self.buffers.front_mut()?;
+        let max_frames = *len / RdxUsbPacket::SIZE;
+        buf.clear();
+        let mut n_frames = 0;
+        if let Ok(mut echo) = self.shared.echo.lock() {
+            while n_frames < max_frames {
+                let Some(frame) = echo.pop_front() else { break; };
+                buf.extend_from_slice(bytemuck::bytes_of(&frame));
+                n_frames += 1;
+            }
+        }
+        let now = Instant::now();
+        while n_frames < max_frames {
+            let Some(frame) = self.generator.next(now) else { break; };
+            buf.extend_from_slice(bytemuck::bytes_of(&frame));
+            n_frames += 1;
+        }
+        if n_frames == 0 { return None; }
+        self.buffers.pop_front().map(|(data, _)| Completion { data, status: Ok(()) })
+    }
+}
+
+impl BulkInQueue for VirtualBulkIn {
+    fn submit(&mut self, buf: Vec<u8>, len: usize) {
+        self.buffers.push_back((buf, len));
+    }
+
+    fn pending(&self) -> usize {
+        self.buffers.len()
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        // nothing is taken off the queue until it completes, so dropping this future loses nothing
+        async move {
+            loop {
+                if let Some(completion) = self.try_complete() { return completion; }
+                if self.buffers.is_empty() { std::future::pending::<()>().await; }
+                match self.generator.next_due() {
+                    Some(due) => tokio::select! {
+                        _ = self.shared.echo_ready.notified() => {}
+                        _ = tokio::time::sleep_until(due) => {}
+                    },
+                    None => self.shared.echo_ready.notified().await,
+                }
+            }
+        }
+    }
+}
+
+/// Bulk OUT queue of a virtual device. Transfers complete immediately.
+pub struct VirtualBulkOut {
+    shared: Arc<Shared>,
+    done: VecDeque<Vec<u8>>,
+}
+
+impl BulkOutQueue for VirtualBulkOut {
+    fn submit(&mut self, mut buf: Vec<u8>) {
+        self.shared.echo(&buf);
+        buf.clear();
+        self.done.push_back(buf);
+    }
+
+    fn pending(&self) -> usize {
+        self.done.len()
+    }
+
+    fn next_complete(&mut self) -> impl Future<Output = Completion<Vec<u8>>> + Send + '_ {
+        async move {
+            match self.done.pop_front() {
+                Some(data) => Completion { data, status: Ok(()) },
+                None => std::future::pending().await,
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{control::{ControlDirection, ControlSetup}, event_loop::{cancel_control, cancel_periodic, close_device, configure_virtual_device, open_device, open_devices, poll_control, read_packets, read_packets_multi, schedule_periodic, stats, submit_control, update_periodic, wait_connected, wait_control, wait_packets, write_packets, write_packets_multi, OpenSpec, ReadRequest, WriteRequest}, test_util::packet};
+
+    /// Opens a virtual device that echoes what it is sent and generates nothing, once it is connected.
+    fn open_echo(pid: u16, n_channels: u8) -> i32 {
+        configure_virtual_device(pid, VirtualDeviceConfig { n_channels, rate: 0, ..Default::default() }).unwrap();
+        let handle = open_device(VIRTUAL_VID, pid, None, false, 256).unwrap();
+        wait_connected(handle, Duration::from_secs(5)).unwrap();
+        handle
+    }
+
+    /// Waits until a handle has received `n` packets on `channel` in total.
+    fn wait_received(handle: i32, channel: usize, n: u64) {
+        let deadline = std::time::Instant::now() + Duration::from_secs(5);
+        while stats(handle).unwrap().channels[channel].rx_packets < n {
+            assert!(std::time::Instant::now() < deadline, "only got {} of {n} packets", stats(handle).unwrap().channels[channel].rx_packets);
+            std::thread::sleep(Duration::from_millis(1));
+        }
+    }
+
+    #[test]
+    fn event_loop_round_trip() {
+        let pid = 0x7e57;
+        configure_virtual_device(pid, VirtualDeviceConfig { n_channels: 2, rate: 0, ..Default::default() }).unwrap();
+        let handle = open_device(VIRTUAL_VID, pid, None, false, 256).unwrap();
+
+        let sent: Vec<RdxUsbPacket> = (0..5u8).map(|i| RdxUsbPacket {
+            timestamp_ns: 0, arb_id: 0x200 + i as u32, dlc: 8, channel: 1, flags: 0, data: [i; 64],
+        }).collect();
+        // the device connects on the event loop; writes are refused until it has
+        let deadline = std::time::Instant::now() + Duration::from_secs(5);
+        while write_packets(handle, &sent).map_or(true, |n| n == 0) {
+            assert!(std::time::Instant::now() < deadline, "virtual device never connected");
+            std::thread::sleep(Duration::from_millis(10));
+        }
+
+        let mut received = Vec::new();
+        let mut buf = [RdxUsbPacket::zeroed(); 16];
+        while received.len() < sent.len() && std::time::Instant::now() < deadline {
+            let n = wait_packets(handle, 1, &mut buf, Duration::from_millis(100)).unwrap();
+            received.extend_from_slice(&buf[..n]);
+        }
+        let ids: Vec<u32> = received.iter().map(|p| p.arb_id).collect();
+        assert_eq!(ids, [0x200, 0x201, 0x202, 0x203, 0x204]);
+        assert!(received.iter().zip(&sent).all(|(r, s)| r.data[..8] == s.data[..8] && r.channel == 1));
+        assert_eq!(read_packets(handle, 0, &mut buf).unwrap(), 0);
+
+        let stats = stats(handle).unwrap();
+        assert_eq!((stats.tx_accepted, stats.channels[1].rx_packets), (5, 5));
+
+        close_device(handle).unwrap();
+        assert!(read_packets(handle, 1, &mut buf).is_err());
+    }
+
+    #[test]
+    fn open_devices_then_wait_connected() {
+        let specs: Vec<OpenSpec> = [0x7e59, 0x7e5a].into_iter().map(|pid| {
+            configure_virtual_device(pid, VirtualDeviceConfig { rate: 0, ..Default::default() }).unwrap();
+            OpenSpec { vid: VIRTUAL_VID, pid, serial_number: None, close_on_dc: false, options: Default::default() }
+        }).collect();
+        let handles: Vec<i32> = open_devices(&specs).unwrap().into_iter().map(Result::unwrap).collect();
+        assert_ne!(handles[0], handles[1]);
+        // opening the same devices again finds the existing handles
+        assert_eq!(open_devices(&specs).unwrap(), handles.iter().copied().map(Ok).collect::<Vec<_>>());
+
+        for &handle in &handles {
+            wait_connected(handle, Duration::from_secs(5)).unwrap();
+            assert_eq!(write_packets(handle, &[RdxUsbPacket::zeroed()]), Ok(1));
+            close_device(handle).unwrap();
+            assert_eq!(wait_connected(handle, Duration::ZERO), Err(EventLoopError::DeviceNotOpened));
+        }
+    }
+
+    #[test]
+    fn control_requests_run_concurrently() {
+        let pid = 0x7e58;
+        configure_virtual_device(pid, VirtualDeviceConfig { n_channels: 3, rate: 0, ..Default::default() }).unwrap();
+        let handle = open_device(VIRTUAL_VID, pid, None, false, 256).unwrap();
+        let device_info = ControlSetup {
+            direction: ControlDirection::In,
+            request: RdxUsbCtrl::DeviceInfo as u8,
+            value: 0,
+            index: 0,
+            length: RdxUsbDeviceInfo::SIZE as u16,
+        };
+        let deadline = std::time::Instant::now() + Duration::from_secs(5);
+        while submit_control(handle, device_info, &[]).map(cancel_control).is_err() {
+            assert!(std::time::Instant::now() < deadline, "virtual device never connected");
+            std::thread::sleep(Duration::from_millis(10));
+        }
+
+        // everything is submitted before anything is collected
+        let requests: Vec<i32> = (0..16).map(|_| submit_control(handle, device_info, &[]).unwrap()).collect();
+        let stalled = submit_control(handle, ControlSetup { request: 0x7f, ..device_info }, &[]).unwrap();
+        for request in requests {
+            let mut buf = [0u8; RdxUsbDeviceInfo::SIZE];
+            assert_eq!(wait_control(request, Duration::from_secs(5), &mut buf), Ok(buf.len()));
+            assert_eq!(RdxUsbDeviceInfo::from_buf(buf).n_channels, 2);
+            // collecting frees the id
+            assert_eq!(poll_control(request, &mut buf), Err(EventLoopError::ControlRequestNotFound));
+        }
+        assert_eq!(wait_control(stalled, Duration::from_secs(5), &mut []), Err(EventLoopError::ControlTransferFailed));
+
+        close_device(handle).unwrap();
+        assert_eq!(submit_control(handle, device_info, &[]), Err(EventLoopError::DeviceNotOpened));
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn rx_notify_wakes_blocked_readers_and_the_event_handle() {
+        use crate::event_loop::{event_handle, reset_event_handle};
+        let handle = open_echo(0x7e5b, 1);
+        let event_set = |timeout_ms| {
+            let mut fd = libc::pollfd { fd: event_handle(handle).unwrap() as libc::c_int, events: libc::POLLIN, revents: 0 };
+            unsafe { libc::poll(&mut fd, 1, timeout_ms) == 1 }
+        };
+
+        let reader = std::thread::spawn(move || {
+            let mut buf = [RdxUsbPacket::zeroed(); 4];
+            wait_packets(handle, 0, &mut buf, Duration::from_secs(5)).map(|n| buf[..n].iter().map(|p| p.arb_id).collect::<Vec<_>>())
+        });
+        reset_event_handle(handle).unwrap();
+        assert!(!event_set(0));
+        // give the reader time to block, so the push below is what wakes it
+        std::thread::sleep(Duration::from_millis(50));
+        assert_eq!(write_packets(handle, &[packet(0x301, 1, 8)]), Ok(1));
+        assert_eq!(reader.join().unwrap(), Ok(vec![0x301]));
+        // the reset armed the notifier, so the same push signalled the OS event
+        assert!(event_set(1000));
+
+        // once reset, the event stays clear until the next push after a reader arms it again
+        reset_event_handle(handle).unwrap();
+        assert!(!event_set(50));
+        assert_eq!(write_packets(handle, &[packet(0x302, 2, 8)]), Ok(1));
+        assert!(event_set(1000));
+        close_device(handle).unwrap();
+    }
+
+    #[test]
+    fn multi_calls_report_per_request_results() {
+        let (a, b) = (open_echo(0x7e5c, 1), open_echo(0x7e5d, 2));
+        let a_packets = [packet(0x10, 1, 8), packet(0x11, 2, 8)];
+        let b_packets = [RdxUsbPacket { channel: 1, ..packet(0x20, 3, 8) }];
+        let mut writes = [
+            WriteRequest { handle_id: a, packets: &a_packets[..1], result: Ok(0) },
+            WriteRequest { handle_id: a, packets: &a_packets[1..], result: Ok(0) },
+            WriteRequest { handle_id: b, packets: &b_packets, result: Ok(0) },
+            WriteRequest { handle_id: i32::MAX, packets: &b_packets, result: Ok(0) },
+        ];
+        write_packets_multi(&mut writes);
+        let results: Vec<_> = writes.iter().map(|w| w.result).collect();
+        assert_eq!(results, [Ok(1), Ok(1), Ok(1), Err(EventLoopError::DeviceNotOpened)]);
+        wait_received(a, 0, 2);
+        wait_received(b, 1, 1);
+
+        let mut bufs = [[RdxUsbPacket::zeroed(); 4]; 5];
+        let [a0, b0, b1, b9, stale] = &mut bufs;
+        let mut reads = [
+            ReadRequest { handle_id: a, channel: 0, packets: a0, result: Ok(0) },
+            ReadRequest { handle_id: b, channel: 0, packets: b0, result: Ok(0) },
+            ReadRequest { handle_id: b, channel: 1, packets: b1, result: Ok(0) },
+            ReadRequest { handle_id: b, channel: 9, packets: b9, result: Ok(0) },
+            ReadRequest { handle_id: i32::MAX, channel: 0, packets: stale, result: Ok(0) },
+        ];
+        // only requests that read something are in the ready mask
+        assert_eq!(read_packets_multi(&mut reads), 0b00101);
+        let results: Vec<_> = reads.iter().map(|r| r.result).collect();
+        assert_eq!(results, [Ok(2), Ok(0), Ok(1), Err(EventLoopError::ChannelOutOfRange), Err(EventLoopError::DeviceNotOpened)]);
+        assert_eq!(bufs[0][..2].iter().map(|p| p.arb_id).collect::<Vec<_>>(), [0x10, 0x11]);
+        assert_eq!({ bufs[2][0].arb_id }, 0x20);
+
+        close_device(a).unwrap();
+        close_device(b).unwrap();
+    }
+
+    #[test]
+    fn periodic_jobs_send_until_cancelled_and_pick_up_updates() {
+        let handle = open_echo(0x7e5e, 1);
+        let job = schedule_periodic(handle, packet(0x40, 1, 8), Duration::from_millis(5), Duration::ZERO).unwrap();
+        wait_received(handle, 0, 2);
+
+        update_periodic(job, &[9; 4]).unwrap();
+        let mut buf = [RdxUsbPacket::zeroed(); 64];
+        let deadline = std::time::Instant::now() + Duration::from_secs(5);
+        'updated: loop {
+            assert!(std::time::Instant::now() < deadline, "no frame carried the update");
+            let n = wait_packets(handle, 0, &mut buf, Duration::from_millis(100)).unwrap();
+            for p in &buf[..n] {
+                assert_eq!({ p.arb_id }, 0x40);
+                if p.dlc == 4 && p.data[..4] == [9; 4] { break 'updated; }
+            }
+        }
+
+        cancel_periodic(job).unwrap();
+        assert_eq!(cancel_periodic(job), Err(EventLoopError::PeriodicJobNotFound));
+        assert_eq!(update_periodic(job, &[1]), Err(EventLoopError::PeriodicJobNotFound));
+        // let a frame already on its way arrive, then nothing more comes
+        std::thread::sleep(Duration::from_millis(50));
+        while read_packets(handle, 0, &mut buf).unwrap() > 0 {}
+        let received = stats(handle).unwrap().channels[0].rx_packets;
+        std::thread::sleep(Duration::from_millis(50));
+        assert_eq!(stats(handle).unwrap().channels[0].rx_packets, received);
+        close_device(handle).unwrap();
+    }
+}